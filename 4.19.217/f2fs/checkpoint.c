@@ -1477,9 +1477,13 @@ int f2fs_write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 
 	trace_f2fs_write_checkpoint(sbi->sb, cpc->reason, "start block_ops");
 
+	/* let GC finish the remap batches it holds pages of */
+	down_write(&sbi->remap_rwsem);
 	err = block_operations(sbi);
-	if (err)
+	if (err) {
+		up_write(&sbi->remap_rwsem);
 		goto out;
+	}
 
 	trace_f2fs_write_checkpoint(sbi->sb, cpc->reason, "finish block_ops");
 
@@ -1489,6 +1493,7 @@ int f2fs_write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	if (cpc->reason & CP_DISCARD) {
 		if (!f2fs_exist_trim_candidates(sbi, cpc)) {
 			unblock_operations(sbi);
+			up_write(&sbi->remap_rwsem);
 			goto out;
 		}
 
@@ -1498,6 +1503,7 @@ int f2fs_write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 			f2fs_flush_sit_entries(sbi, cpc);
 			f2fs_clear_prefree_segments(sbi, cpc);
 			unblock_operations(sbi);
+			up_write(&sbi->remap_rwsem);
 			goto out;
 		}
 	}
@@ -1522,6 +1528,7 @@ int f2fs_write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 		f2fs_clear_prefree_segments(sbi, cpc);
 
 	unblock_operations(sbi);
+	up_write(&sbi->remap_rwsem);
 	stat_inc_cp_count(sbi->stat_info);
 
 	if (cpc->reason & CP_RECOVERY)
@@ -1550,8 +1557,8 @@ void f2fs_init_ino_entry_info(struct f2fs_sb_info *sbi)
 	}
 
 	sbi->max_orphans = (sbi->blocks_per_seg - F2FS_CP_PACKS -
-			NR_CURSEG_TYPE - __cp_payload(sbi)) *
-				F2FS_ORPHANS_PER_BLOCK;
+			NR_CURSEG_TYPE - __cp_payload(sbi) -
+			REMAP_LOG_BLOCKS) * F2FS_ORPHANS_PER_BLOCK;
 }
 
 int __init f2fs_create_checkpoint_caches(void)
@@ -1777,6 +1777,9 @@ bool f2fs_should_update_outplace(struct inode *inode, struct f2fs_io_info *fio)
 		return true;
 	if (f2fs_is_atomic_file(inode))
 		return true;
+	/* the device may be moving the old block away under us */
+	if (atomic_read(&F2FS_I(inode)->i_remap_pending))
+		return true;
 	if (fio) {
 		if (is_cold_data(fio->page))
 			return true;
@@ -1898,98 +1901,7 @@ out:
 		f2fs_unlock_op(fio->sbi);
 	return err;
 }
-int f2fs_do_remap_data_page(struct f2fs_io_info *fio)
-{
-	struct page *page = fio->page;
-	struct inode *inode = page->mapping->host;
-	struct dnode_of_data dn;
-	struct extent_info ei = {0,0,0};
-	struct node_info ni;
-	bool ipu_force = false;
-	int err = 0;
-
-	set_new_dnode(&dn, inode, NULL, NULL, 0);
-	if (need_inplace_update(fio) &&
-			f2fs_lookup_extent_cache(inode, page->index, &ei)) {
-		printk("inplace update 1.\n");
-		fio->old_blkaddr = ei.blk + page->index - ei.fofs;
-
-		if (!f2fs_is_valid_blkaddr(fio->sbi, fio->old_blkaddr,
-							DATA_GENERIC))
-			return -EFSCORRUPTED;
-
-		ipu_force = true;
-		fio->need_lock = LOCK_DONE;
-		goto got_it;
-	}
-
-	/* Deadlock due to between page->lock and f2fs_lock_op */
-	if (fio->need_lock == LOCK_REQ && !f2fs_trylock_op(fio->sbi))
-		return -EAGAIN;
-
-	err = f2fs_get_dnode_of_data(&dn, page->index, LOOKUP_NODE);
-	if (err)
-		goto out;
-
-	fio->old_blkaddr = dn.data_blkaddr;
-
-	/* This page is already truncated */
-	if (fio->old_blkaddr == NULL_ADDR) {
-		ClearPageUptodate(page);
-		clear_cold_data(page);
-		goto out_writepage;
-	}
-got_it:
-	if (__is_valid_data_blkaddr(fio->old_blkaddr) &&
-		!f2fs_is_valid_blkaddr(fio->sbi, fio->old_blkaddr,
-							DATA_GENERIC)) {
-		err = -EFSCORRUPTED;
-		goto out_writepage;
-	}
-	/*
-	 * If current allocation needs SSR,
-	 * it had better in-place writes for updated data.
-	 */
-	if (ipu_force || (is_valid_data_blkaddr(fio->sbi, fio->old_blkaddr) &&
-					need_inplace_update(fio))) {
-		printk("erro:inplace update 2.\n");
-		return 0;
-	}
 
-	if (fio->need_lock == LOCK_RETRY) {
-		if (!f2fs_trylock_op(fio->sbi)) {
-			err = -EAGAIN;
-			goto out_writepage;
-		}
-		fio->need_lock = LOCK_REQ;
-	}
-
-	err = f2fs_get_node_info(fio->sbi, dn.nid, &ni);
-	if (err)
-		goto out_writepage;
-
-	fio->version = ni.version;
-
-	err = encrypt_one_page(fio); // not encrypted file.
-	if (err)
-		goto out_writepage;
-
-	//set_page_writeback(page);
-	ClearPageError(page);
-
-	/* LFS mode write path */
-	f2fs_outplace_remap_data(&dn, fio);
-	trace_f2fs_do_write_data_page(page, OPU);
-	set_inode_flag(inode, FI_APPEND_WRITE);
-	if (page->index == 0)
-		set_inode_flag(inode, FI_FIRST_BLOCK_WRITTEN);
-out_writepage:
-	f2fs_put_dnode(&dn);
-out:
-	if (fio->need_lock == LOCK_REQ)
-		f2fs_unlock_op(fio->sbi);
-	return err;
-}
 static int __write_data_page(struct page *page, bool *submitted,
 				struct writeback_control *wbc,
 				enum iostat_type io_type)
@@ -349,6 +349,12 @@ static int stat_show(struct seq_file *s, void *v)
 				si->bg_data_blks);
 		seq_printf(s, "  - node blocks : %d (%d)\n", si->node_blks,
 				si->bg_node_blks);
+		seq_printf(s, "Moved data blocks: host %d, remap %d, "
+				"device copy %d, fallback %d\n",
+				si->gc_move[GC_MOVE_HOST],
+				si->gc_move[GC_MOVE_REMAP],
+				si->gc_move[GC_MOVE_DCOPY],
+				si->gc_move[GC_MOVE_FALLBACK]);
 		seq_printf(s, "Skipped : atomic write %llu (%llu)\n",
 				si->skipped_atomic_files[BG_GC] +
 				si->skipped_atomic_files[FG_GC],
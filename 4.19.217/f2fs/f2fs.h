@@ -188,6 +188,9 @@ enum {
 #define DEF_CP_INTERVAL			60	/* 60 secs */
 #define DEF_IDLE_INTERVAL		5	/* 5 secs */
 
+/* blocks at the tail of each checkpoint pack kept for the remap intent log */
+#define REMAP_LOG_BLOCKS		64
+
 struct cp_control {
 	int reason;
 	__u64 trim_start;
@@ -644,6 +647,15 @@ enum {
 	MAX_GC_FAILURE
 };
 
+/* how GC relocated a valid data block */
+enum {
+	GC_MOVE_HOST,		/* read and rewritten by the host */
+	GC_MOVE_REMAP,		/* remapped by the device */
+	GC_MOVE_DCOPY,		/* copied inside the device */
+	GC_MOVE_FALLBACK,	/* device failed, copied by the host instead */
+	NR_GC_MOVE
+};
+
 struct f2fs_inode_info {
 	struct inode vfs_inode;		/* serve a vfs inode */
 	unsigned long i_flags;		/* keep an inode flags for ioctl */
@@ -682,6 +694,7 @@ struct f2fs_inode_info {
 
 	/* avoid racing between foreground op and gc */
 	struct rw_semaphore i_gc_rwsem[2];
+	atomic_t i_remap_pending;	/* blocks queued for device remap */
 	struct rw_semaphore i_mmap_sem;
 	struct rw_semaphore i_xattr_sem; /* avoid racing between reading and changing EAs */
 
@@ -1103,6 +1116,7 @@ enum {
 	GC_IDLE_CB,
 	GC_IDLE_GREEDY,
 	GC_URGENT,
+	GC_IDLE_REMAP,
 };
 
 enum {
@@ -1243,6 +1257,9 @@ struct f2fs_sb_info {
 	struct f2fs_gc_kthread	*gc_thread;	/* GC thread */
 	unsigned int cur_victim_sec;		/* current victim section num */
 	unsigned int gc_mode;			/* current GC state */
+	unsigned long *gc_blk_state;		/* victim block states */
+	unsigned int gc_remap_budget;		/* BG remaps granted by gc thread */
+	struct page **gc_sum_pages;		/* SSA pages of victim section */
 	/* for skip statistic */
 	unsigned long long skipped_atomic_files[2];	/* FG_GC and BG_GC */
 	unsigned long long skipped_gc_rwsem;		/* FG_GC only */
@@ -1293,6 +1310,22 @@ struct f2fs_sb_info {
 	struct f2fs_dev_info *devs;		/* for device list */
 	unsigned int dirty_device;		/* for checkpoint data flush */
 	spinlock_t dev_lock;			/* protect dirty_device */
+
+	/* for GC remap on NVMe */
+	struct block_device *remap_bdev;	/* NULL if remap is disabled */
+	unsigned int remap_nsid;		/* namespace of remap_bdev */
+	unsigned int remap_lba_shift;		/* log2 of LBAs per block */
+	sector_t remap_start_lba;		/* partition offset in LBAs */
+	unsigned long remap_caps;		/* REMAP_OP_* not rejected yet */
+	unsigned int copy_max_ranges;		/* source ranges per NVMe Copy */
+	unsigned int copy_max_range_blks;	/* blocks per source range */
+	unsigned int copy_max_blks;		/* blocks per NVMe Copy */
+	struct remap_ctx *remap_ctx;		/* batches of running GC */
+	struct mutex remap_log_lock;		/* protects remap_log_* */
+	void *remap_log;			/* copy of the remap intent log */
+	unsigned int remap_log_pos;		/* entries used in it */
+	unsigned long long remap_log_ver;	/* checkpoint the log refers to */
+	struct rw_semaphore remap_rwsem;	/* remap batches vs. checkpoint */
 	struct mutex umount_mutex;
 	unsigned int shrinker_run_no;
 
@@ -2970,8 +3003,6 @@ void f2fs_do_write_meta_page(struct f2fs_sb_info *sbi, struct page *page,
 void f2fs_do_write_node_page(unsigned int nid, struct f2fs_io_info *fio);
 void f2fs_outplace_write_data(struct dnode_of_data *dn,
 			struct f2fs_io_info *fio);
-void f2fs_outplace_remap_data(struct dnode_of_data *dn,
-struct f2fs_io_info *fio);
 int f2fs_inplace_write_data(struct f2fs_io_info *fio);
 void f2fs_do_replace_block(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
 			block_t old_blkaddr, block_t new_blkaddr,
@@ -3070,7 +3101,6 @@ struct page *f2fs_get_cached_data_page(struct inode *inode, pgoff_t index,bool f
 struct page *f2fs_get_new_data_page(struct inode *inode,
 			struct page *ipage, pgoff_t index, bool new_i_size);
 int f2fs_do_write_data_page(struct f2fs_io_info *fio);
-int f2fs_do_remap_data_page(struct f2fs_io_info *fio);
 int f2fs_map_blocks(struct inode *inode, struct f2fs_map_blocks *map,
 			int create, int flag);
 int f2fs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
@@ -3095,7 +3125,29 @@ void f2fs_stop_gc_thread(struct f2fs_sb_info *sbi);
 block_t f2fs_start_bidx_of_node(unsigned int node_ofs, struct inode *inode);
 int f2fs_gc(struct f2fs_sb_info *sbi, bool sync, bool background,
 			unsigned int segno);
-void f2fs_build_gc_manager(struct f2fs_sb_info *sbi);
+void f2fs_gc_move_fallback(struct inode *inode, pgoff_t index,
+			block_t old_blkaddr);
+int f2fs_build_gc_manager(struct f2fs_sb_info *sbi);
+void f2fs_destroy_gc_manager(struct f2fs_sb_info *sbi);
+
+/*
+ * remap.c
+ */
+struct remap_ctx;
+struct remap_batch;
+void f2fs_remap_init_dev(struct f2fs_sb_info *sbi);
+void f2fs_remap_destroy_dev(struct f2fs_sb_info *sbi);
+bool f2fs_remap_replay(struct f2fs_sb_info *sbi);
+int f2fs_remap_recover(struct f2fs_sb_info *sbi);
+int f2fs_remap_init_ctx(struct f2fs_sb_info *sbi, struct remap_ctx *rc);
+void f2fs_remap_destroy_ctx(struct f2fs_sb_info *sbi, struct remap_ctx *rc);
+bool f2fs_remap_add(struct remap_batch *rb, struct page *page,
+			struct dnode_of_data *dn, block_t new_blkaddr);
+struct remap_batch *f2fs_remap_get_batch(struct f2fs_sb_info *sbi,
+			struct remap_ctx *rc, unsigned int segno);
+void f2fs_remap_submit(struct f2fs_sb_info *sbi, struct remap_batch *rb);
+void f2fs_remap_wait(struct f2fs_sb_info *sbi, struct remap_ctx *rc);
+bool f2fs_remap_sec_busy(struct f2fs_sb_info *sbi, unsigned int secno);
 
 /*
  * recovery.c
@@ -3139,6 +3191,7 @@ struct f2fs_stat_info {
 	int bg_node_segs, bg_data_segs;
 	int tot_blks, data_blks, node_blks;
 	int bg_data_blks, bg_node_blks;
+	int gc_move[NR_GC_MOVE];
 	unsigned long long skipped_atomic_files[2];
 	int curseg[NR_CURSEG_TYPE];
 	int cursec[NR_CURSEG_TYPE];
@@ -3255,6 +3308,9 @@ static inline struct f2fs_stat_info *F2FS_STAT(struct f2fs_sb_info *sbi)
 		si->bg_node_blks += ((gc_type) == BG_GC) ? (blks) : 0;	\
 	} while (0)
 
+#define stat_inc_gc_move(sbi, type)					\
+	((F2FS_STAT(sbi))->gc_move[(type)]++)
+
 int f2fs_build_stats(struct f2fs_sb_info *sbi);
 void f2fs_destroy_stats(struct f2fs_sb_info *sbi);
 int __init f2fs_create_root_stats(void);
@@ -3289,6 +3345,7 @@ void f2fs_destroy_root_stats(void);
 #define stat_inc_tot_blk_count(si, blks)		do { } while (0)
 #define stat_inc_data_blk_count(sbi, blks, gc_type)	do { } while (0)
 #define stat_inc_node_blk_count(sbi, blks, gc_type)	do { } while (0)
+#define stat_inc_gc_move(sbi, type)			do { } while (0)
 
 static inline int f2fs_build_stats(struct f2fs_sb_info *sbi) { return 0; }
 static inline void f2fs_destroy_stats(struct f2fs_sb_info *sbi) { }
@@ -3491,6 +3548,8 @@ static inline bool f2fs_force_buffered_io(struct inode *inode, int rw)
 {
 	return (f2fs_post_read_required(inode) ||
 			(rw == WRITE && test_opt(F2FS_I_SB(inode), LFS)) ||
+			(rw == WRITE &&
+				atomic_read(&F2FS_I(inode)->i_remap_pending)) ||
 			f2fs_is_multi_device(F2FS_I_SB(inode)));
 }
 
@@ -21,8 +21,34 @@
 #include "node.h"
 #include "segment.h"
 #include "gc.h"
+#include "remap.h"
+#include "gctrace.h"
 #include <trace/events/f2fs.h>
 
+/*
+ * Blocks BG_GC may hand to the device on this wakeup.  A remap costs the
+ * device a mapping update instead of a block write, but it still competes
+ * with user I/O, so spend only what the idle window and the writeback in
+ * flight leave room for.
+ */
+static unsigned int bg_remap_budget(struct f2fs_sb_info *sbi,
+					struct f2fs_gc_kthread *gc_th)
+{
+	unsigned int budget = gc_th->max_remap_blocks;
+	unsigned int inflight;
+
+	if (!sbi->remap_caps)
+		return 0;
+
+	/* urgent GC runs even if the device is busy */
+	if (!is_idle(sbi))
+		budget >>= 2;
+
+	inflight = get_pages(sbi, F2FS_WB_CP_DATA) +
+				get_pages(sbi, F2FS_WB_DATA);
+	return inflight < budget ? budget - inflight : 0;
+}
+
 static int gc_thread_func(void *data)
 {
 	struct f2fs_sb_info *sbi = data;
@@ -96,10 +122,15 @@ static int gc_thread_func(void *data)
 do_gc:
 		stat_inc_bggc_count(sbi);
 
+		/* gc_mutex is held, so only this f2fs_gc() sees the budget */
+		sbi->gc_remap_budget = bg_remap_budget(sbi, gc_th);
+
 		/* if return value is not zero, no victim was selected */
 		if (f2fs_gc(sbi, test_opt(sbi, FORCE_FG_GC), true, NULL_SEGNO))
 			wait_ms = gc_th->no_gc_sleep_time;
 
+		sbi->gc_remap_budget = 0;
+
 		trace_f2fs_background_gc(sbi->sb, wait_ms,
 				prefree_segments(sbi), free_segments(sbi));
 
@@ -129,6 +160,8 @@ int f2fs_start_gc_thread(struct f2fs_sb_info *sbi)
 	gc_th->max_sleep_time = DEF_GC_THREAD_MAX_SLEEP_TIME;
 	gc_th->no_gc_sleep_time = DEF_GC_THREAD_NOGC_SLEEP_TIME;
 
+	gc_th->max_remap_blocks = DEF_GC_THREAD_REMAP_BLOCKS;
+
 	gc_th->gc_wake= 0;
 
 	sbi->gc_thread = gc_th;
@@ -166,6 +199,10 @@ static int select_gc_type(struct f2fs_sb_info *sbi, int gc_type)
 	case GC_URGENT:
 		gc_mode = GC_GREEDY;
 		break;
+	case GC_IDLE_REMAP:
+		/* without a remap device every block has to be copied */
+		gc_mode = sbi->remap_bdev ? GC_REMAP : GC_GREEDY;
+		break;
 	}
 	return gc_mode;
 }
@@ -209,7 +246,7 @@ static unsigned int get_max_cost(struct f2fs_sb_info *sbi,
 		return sbi->blocks_per_seg;
 	if (p->gc_mode == GC_GREEDY)
 		return 2 * sbi->blocks_per_seg * p->ofs_unit;
-	else if (p->gc_mode == GC_CB)
+	else if (p->gc_mode == GC_CB || p->gc_mode == GC_REMAP)
 		return UINT_MAX;
 	else /* No other gc_mode */
 		return 0;
@@ -228,6 +265,8 @@ static unsigned int check_bg_victims(struct f2fs_sb_info *sbi)
 	for_each_set_bit(secno, dirty_i->victim_secmap, MAIN_SECS(sbi)) {
 		if (sec_usage_check(sbi, secno))
 			continue;
+		if (f2fs_remap_sec_busy(sbi, secno))
+			continue;
 		clear_bit(secno, dirty_i->victim_secmap);
 		return GET_SEG_FROM_SEC(sbi, secno);
 	}
@@ -266,6 +305,173 @@ static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 	return UINT_MAX - ((100 * (100 - u) * age) / (100 + u));
 }
 
+struct remap_sample {
+	unsigned int ofs_in_node;	/* in: block offset in the dnode */
+	unsigned int nofs;		/* in: offset of the dnode */
+	bool found;			/* out: owner is cached */
+	bool copy;			/* out: block must be copied by host */
+};
+
+static int remap_sample_match(struct inode *inode, unsigned long ino,
+								void *data)
+{
+	struct remap_sample *rs = data;
+	struct address_space *mapping = inode->i_mapping;
+	pgoff_t index;
+
+	if (inode->i_ino != ino)
+		return 0;
+
+	spin_lock(&inode->i_lock);
+	if (inode->i_state & (I_NEW | I_FREEING | I_WILL_FREE)) {
+		spin_unlock(&inode->i_lock);
+		return -1;
+	}
+	rs->found = true;
+
+	if (f2fs_post_read_required(inode)) {
+		rs->copy = true;
+	} else {
+		index = f2fs_start_bidx_of_node(rs->nofs, inode) +
+							rs->ofs_in_node;
+		rcu_read_lock();
+		rs->copy = radix_tree_tag_get(&mapping->i_pages, index,
+						PAGECACHE_TAG_DIRTY) ||
+				radix_tree_tag_get(&mapping->i_pages, index,
+						PAGECACHE_TAG_WRITEBACK);
+		rcu_read_unlock();
+	}
+	spin_unlock(&inode->i_lock);
+	return -1;
+}
+
+/*
+ * Sample up to GC_REMAP_SAMPLES valid blocks of a data segment and cache
+ * the share of them that is dirty or under writeback in the page cache, so
+ * that remap_data_page() would fall back to copying them through the host.
+ * Only cached summary, node and inode objects are looked at, since victim
+ * selection must not issue I/O; a block whose owner is not cached can not
+ * have a dirty page and counts as remappable.
+ *
+ * This runs without sentry_lock, so the valid map is read racily; the
+ * result is only an estimate for get_remap_cost() anyway.
+ */
+static void sample_remap_segment(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	struct seg_entry *se = get_seg_entry(sbi, segno);
+	unsigned int step = max_t(unsigned int, 1,
+				sbi->blocks_per_seg / GC_REMAP_SAMPLES);
+	struct f2fs_summary_block *sum;
+	struct page *sum_page;
+	unsigned int off, sampled = 0, copied = 0;
+
+	if (READ_ONCE(se->remap_fresh) || !IS_DATASEG(se->type) ||
+						!se->valid_blocks)
+		return;
+
+	sum_page = find_get_page(META_MAPPING(sbi), GET_SUM_BLOCK(sbi, segno));
+	if (!sum_page)
+		return;
+	if (!PageUptodate(sum_page))
+		goto out;
+	sum = page_address(sum_page);
+
+	for (off = 0; off < sbi->blocks_per_seg; off += step) {
+		struct f2fs_summary *entry = &sum->entries[off];
+		struct remap_sample rs = { 0 };
+		struct page *node_page;
+		nid_t ino;
+
+		if (!f2fs_test_bit(off, se->cur_valid_map))
+			continue;
+		sampled++;
+
+		node_page = find_get_page(NODE_MAPPING(sbi),
+						le32_to_cpu(entry->nid));
+		if (!node_page)
+			continue;
+		if (!PageUptodate(node_page)) {
+			f2fs_put_page(node_page, 0);
+			continue;
+		}
+		ino = ino_of_node(node_page);
+		rs.nofs = ofs_of_node(node_page);
+		rs.ofs_in_node = le16_to_cpu(entry->ofs_in_node);
+		f2fs_put_page(node_page, 0);
+
+		find_inode_nowait(sbi->sb, ino, remap_sample_match, &rs);
+		if (rs.found && rs.copy)
+			copied++;
+	}
+
+	/* nothing was learnt, try again on the next search */
+	if (sampled) {
+		WRITE_ONCE(se->remap_copy, copied * 255 / sampled);
+		WRITE_ONCE(se->remap_fresh, true);
+	}
+out:
+	f2fs_put_page(sum_page, 0);
+}
+
+/*
+ * get_remap_cost() runs under seglist_lock and sentry_lock, so it only
+ * reads the cached estimates.  Before a GC_REMAP search, resample the
+ * segments of the next max_victim_search dirty sections it will look at
+ * whose blocks were invalidated since their last sample.
+ */
+static void refresh_remap_estimates(struct f2fs_sb_info *sbi)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int segno = SIT_I(sbi)->last_victim[GC_REMAP];
+	unsigned int nsearched = 0, i;
+
+	while (nsearched++ < sbi->max_victim_search) {
+		segno = find_next_bit(dirty_i->dirty_segmap[DIRTY],
+						MAIN_SEGS(sbi), segno);
+		if (segno >= MAIN_SEGS(sbi))
+			break;
+		segno -= segno % sbi->segs_per_sec;
+		for (i = 0; i < sbi->segs_per_sec; i++)
+			sample_remap_segment(sbi, segno + i);
+		segno += sbi->segs_per_sec;
+	}
+}
+
+static unsigned int get_remap_cost(struct f2fs_sb_info *sbi,
+						unsigned int segno)
+{
+	unsigned int secno = GET_SEC_FROM_SEG(sbi, segno);
+	unsigned int start = GET_SEG_FROM_SEC(sbi, secno);
+	unsigned int usable = BLKS_PER_SEC(sbi);
+	unsigned int vblocks = 0, copied = 0;
+	unsigned long long cost;
+	unsigned int i;
+
+	for (i = 0; i < sbi->segs_per_sec; i++) {
+		unsigned int valid = get_valid_blocks(sbi, start + i, false);
+		struct seg_entry *se = get_seg_entry(sbi, start + i);
+
+		if (!valid)
+			continue;
+		vblocks += valid;
+
+		/* node blocks are always moved through the page cache */
+		if (!IS_DATASEG(se->type)) {
+			copied += valid;
+			continue;
+		}
+
+		copied += valid * READ_ONCE(se->remap_copy) / 255;
+	}
+
+	if (vblocks >= usable)
+		return UINT_MAX - 1;
+
+	cost = (u64)(vblocks - copied) + (u64)copied * GC_REMAP_COPY_WEIGHT;
+	cost = div_u64(cost * 100, usable - vblocks);
+	return min_t(unsigned long long, cost, UINT_MAX - 1);
+}
+
 static inline unsigned int get_gc_cost(struct f2fs_sb_info *sbi,
 			unsigned int segno, struct victim_sel_policy *p)
 {
@@ -275,6 +481,8 @@ static inline unsigned int get_gc_cost(struct f2fs_sb_info *sbi,
 	/* alloc_mode == LFS */
 	if (p->gc_mode == GC_GREEDY)
 		return get_valid_blocks(sbi, segno, true);
+	else if (p->gc_mode == GC_REMAP)
+		return get_remap_cost(sbi, segno);
 	else
 		return get_cb_cost(sbi, segno);
 }
@@ -364,6 +572,8 @@ static int get_victim_by_default(struct f2fs_sb_info *sbi,
 
 		if (sec_usage_check(sbi, secno))
 			goto next;
+		if (p.alloc_mode == LFS && f2fs_remap_sec_busy(sbi, secno))
+			goto next;
 		if (gc_type == BG_GC && test_bit(secno, dirty_i->victim_secmap))
 			goto next;
 
@@ -484,6 +694,7 @@ next_step:
 		nid_t nid = le32_to_cpu(entry->nid);
 		struct page *node_page;
 		struct node_info ni;
+		u64 start;
 
 		/* stop BG_GC if there is not enough free sections. */
 		if (gc_type == BG_GC && has_not_enough_free_secs(sbi, 0, 0))
@@ -504,6 +715,7 @@ next_step:
 		}
 
 		/* phase == 2 */
+		start = f2fs_gc_trace_clock();
 		node_page = f2fs_get_node_page(sbi, nid);
 		if (IS_ERR(node_page))
 			continue;
@@ -525,6 +737,8 @@ next_step:
 		}
 
 		f2fs_move_node_page(node_page, gc_type);
+		f2fs_trace_gc(sbi, ni.ino, nid, start_addr + off, NULL_ADDR,
+						GC_TRACE_NODE, start);
 		stat_inc_node_blk_count(sbi, 1, gc_type);
 	}
 
@@ -689,6 +903,7 @@ static void move_data_block(struct inode *inode, block_t bidx,
 	block_t newaddr;
 	int err;
 	bool lfs_mode = test_opt(fio.sbi, LFS);
+	u64 start = f2fs_gc_trace_clock();
 
 	/* do not read out */
 	page = f2fs_grab_cache_page(inode->i_mapping, bidx, false);
@@ -809,6 +1024,9 @@ write_page:
 	set_inode_flag(inode, FI_APPEND_WRITE);
 	if (page->index == 0)
 		set_inode_flag(inode, FI_FIRST_BLOCK_WRITTEN);
+	stat_inc_gc_move(fio.sbi, GC_MOVE_HOST);
+	f2fs_trace_gc(fio.sbi, inode->i_ino, bidx, fio.old_blkaddr, newaddr,
+					GC_TRACE_ENCRYPTED, start);
 put_page_out:
 	f2fs_put_page(fio.encrypted_page, 1);
 recover_block:
@@ -826,6 +1044,8 @@ out:
 static void move_data_page(struct inode *inode, block_t bidx, int gc_type,
 							unsigned int segno, int off)
 {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	u64 start = f2fs_gc_trace_clock();
 	struct page *page;
 
 	page = f2fs_get_lock_data_page(inode, bidx, true);
@@ -847,10 +1067,17 @@ static void move_data_page(struct inode *inode, block_t bidx, int gc_type,
 	}
 
 	if (gc_type == BG_GC) {
+		int path = PageDirty(page) ? GC_TRACE_MOVE_DIRTY :
+						GC_TRACE_MOVE_CLEAN;
+
 		if (PageWriteback(page))
 			goto out;
 		set_page_dirty(page);
 		set_cold_data(page);
+		stat_inc_gc_move(sbi, GC_MOVE_HOST);
+		f2fs_trace_gc(sbi, inode->i_ino, bidx,
+				START_BLOCK(sbi, segno) + off, NULL_ADDR,
+				path, start);
 	} else {
 		struct f2fs_io_info fio = {
 			.sbi = F2FS_I_SB(inode),
@@ -887,27 +1114,54 @@ retry:
 			}
 			if (is_dirty)
 				set_page_dirty(page);
+		} else {
+			stat_inc_gc_move(sbi, GC_MOVE_HOST);
+			f2fs_trace_gc(sbi, inode->i_ino, bidx,
+				fio.old_blkaddr, fio.new_blkaddr,
+				is_dirty ? GC_TRACE_MOVE_DIRTY :
+				GC_TRACE_MOVE_CLEAN, start);
 		}
 	}
 out:
 	f2fs_put_page(page, 1);
 }
-static void remap_data_page(struct inode *inode, block_t bidx, int gc_type,
-							unsigned int segno, int off)
+/*
+ * Reserve a new cold data block for @bidx and queue the old -> new move in
+ * @rb, so that the device relocates the data instead of the host copying it.
+ * A queued page is left locked for the batch to release once it is applied.
+ * Returns false if the block has to be copied by move_data_page() instead,
+ * e.g. because the page cache holds newer data than the device.
+ */
+static bool remap_data_page(struct inode *inode, block_t bidx, int gc_type,
+			unsigned int segno, int off, struct remap_batch *rb)
 {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	struct dnode_of_data dn;
+	struct f2fs_summary sum;
+	struct node_info ni;
 	struct page *page;
+	block_t newaddr;
+	bool queued = false;
 
-	page = f2fs_get_cached_data_page(inode,bidx, true);
-//	page = f2fs_get_lock_data_page(inode, bidx, true);
-	if (IS_ERR(page))
-		return;
+	if (rb->nr_entries >= rb->max_entries)
+		return false;
 
-	if (!check_valid_map(F2FS_I_SB(inode), segno, off))
+	page = f2fs_grab_cache_page(inode->i_mapping, bidx, false);
+	if (!page)
+		return false;
+
+	if (PageDirty(page) || PageWriteback(page))
+		goto out;
+
+	/* the block is handled, even if it turns out not to need moving */
+	queued = true;
+
+	if (!check_valid_map(sbi, segno, off))
 		goto out;
 
 	if (f2fs_is_atomic_file(inode)) {
 		F2FS_I(inode)->i_gc_failures[GC_FAILURE_ATOMIC]++;
-		F2FS_I_SB(inode)->skipped_atomic_files[gc_type]++;
+		sbi->skipped_atomic_files[gc_type]++;
 		goto out;
 	}
 	if (f2fs_is_pinned_file(inode)) {
@@ -916,52 +1170,137 @@ static void remap_data_page(struct inode *inode, block_t bidx, int gc_type,
 		goto out;
 	}
 
-	if (gc_type == BG_GC) {
-		if (PageWriteback(page))
-			goto out;
-		set_page_dirty(page);
-		set_cold_data(page);
-	} else {
-		struct f2fs_io_info fio = {
-			.sbi = F2FS_I_SB(inode),
-			.ino = inode->i_ino,
-			.type = DATA,
-			.temp = COLD,
-			.op = REQ_OP_WRITE,
-			.op_flags = REQ_SYNC,
-			.old_blkaddr = NULL_ADDR,
-			.page = page,
-			.encrypted_page = NULL,
-			.need_lock = LOCK_REQ,
-			.io_type = FS_GC_DATA_IO,
-		};
-		bool is_dirty = PageDirty(page);
-		int err;
-
-retry:
-//		set_page_dirty(page);
-//		f2fs_wait_on_page_writeback(page, DATA, true);
-//		if (clear_page_dirty_for_io(page)) { // 清除旧页的脏页标志
-//			inode_dec_dirty_pages(inode);
-//			f2fs_remove_dirty_inode(inode);
-//		}
+	f2fs_lock_op(sbi);
+	set_new_dnode(&dn, inode, NULL, NULL, 0);
+	if (f2fs_get_dnode_of_data(&dn, bidx, LOOKUP_NODE)) {
+		queued = false;
+		goto unlock_out;
+	}
 
-		set_cold_data(page);
+	if (dn.data_blkaddr != START_BLOCK(sbi, segno) + off)
+		goto put_out;
 
-		err = f2fs_do_remap_data_page(&fio);
-		if (err) {
-			clear_cold_data(page);
-			if (err == -ENOMEM) {
-				congestion_wait(BLK_RW_ASYNC, HZ/50);
-				goto retry;
-			}
-			if (is_dirty)
-				set_page_dirty(page);
-		}
+	if (f2fs_get_node_info(sbi, dn.nid, &ni)) {
+		queued = false;
+		goto put_out;
 	}
+
+	set_summary(&sum, dn.nid, dn.ofs_in_node, ni.version);
+
+	/* keep the old block valid until the device confirms the remap */
+	f2fs_allocate_data_block(sbi, NULL, NULL_ADDR, &newaddr,
+					&sum, CURSEG_COLD_DATA, NULL, false);
+
+	atomic_inc(&F2FS_I(inode)->i_remap_pending);
+	f2fs_remap_add(rb, page, &dn, newaddr);
+	page = NULL;
+put_out:
+	f2fs_put_dnode(&dn);
+unlock_out:
+	f2fs_unlock_op(sbi);
 out:
 	f2fs_put_page(page, 1);
+	return queued;
 }
+
+/*
+ * Snapshot the valid map of a victim, so that readahead phases don't take
+ * sentry_lock for every block.  Valid blocks start as uncached.  The map of
+ * segno starts at block @base, one segment per slot of the section.
+ */
+static void init_gc_blk_state(struct f2fs_sb_info *sbi, struct gc_ctx *gc,
+				unsigned int segno, unsigned int base)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct seg_entry *se;
+	unsigned int off;
+
+	memset(gc->blk_state + base / GC_BLK_PER_LONG, 0,
+						GC_BLK_STATE_SIZE(sbi));
+
+	down_read(&sit_i->sentry_lock);
+	se = get_seg_entry(sbi, segno);
+	for (off = 0; off < sbi->blocks_per_seg; off++)
+		if (f2fs_test_bit(off, se->cur_valid_map))
+			set_gc_blk_state(gc, base + off, GC_BLK_UNCACHED);
+	up_read(&sit_i->sentry_lock);
+}
+
+/* page cache state of a valid data block, without reading it */
+static int classify_data_block(struct inode *inode, pgoff_t index)
+{
+	struct page *page;
+	int state = GC_BLK_UNCACHED;
+
+	page = find_get_page(inode->i_mapping, index);
+	if (!page)
+		return state;
+
+	if (PageDirty(page) || PageWriteback(page))
+		state = GC_BLK_DIRTY;
+	else if (PageUptodate(page))
+		state = GC_BLK_CLEAN;
+	f2fs_put_page(page, 0);
+	return state;
+}
+
+/*
+ * Pick how a valid data block of a FG victim gets relocated.  The device can
+ * only move what it holds already, so blocks with newer data in the page
+ * cache are copied by the host.  So are blocks of encrypted files, whose
+ * ciphertext may be cached in META_MAPPING, of atomic files, whose pages
+ * are staged in memory, and of pinned files, which must keep their address.
+ * Otherwise the command the device still accepts for @rb is used.
+ */
+static int gc_data_mover(struct inode *inode, int blk_state,
+						struct remap_batch *rb)
+{
+	if (!rb || blk_state == GC_BLK_DIRTY)
+		return GC_MOVE_HOST;
+	if (f2fs_post_read_required(inode) || f2fs_is_atomic_file(inode) ||
+						f2fs_is_pinned_file(inode))
+		return GC_MOVE_HOST;
+	return rb->op == REMAP_OP_COPY ? GC_MOVE_DCOPY : GC_MOVE_REMAP;
+}
+
+/*
+ * Copy a block which the device failed to relocate.  Called once its batch
+ * was applied, with no lock of @inode held; @inode is pinned by the
+ * gc_inode_list of the running f2fs_gc().
+ */
+void f2fs_gc_move_fallback(struct inode *inode, pgoff_t index,
+						block_t old_blkaddr)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	bool locked = false;
+
+	if (S_ISREG(inode->i_mode)) {
+		if (!down_write_trylock(&fi->i_gc_rwsem[READ])) {
+			sbi->skipped_gc_rwsem++;
+			return;
+		}
+		if (!down_write_trylock(&fi->i_gc_rwsem[WRITE])) {
+			sbi->skipped_gc_rwsem++;
+			up_write(&fi->i_gc_rwsem[READ]);
+			return;
+		}
+		locked = true;
+
+		/* wait for all inflight aio data */
+		inode_dio_wait(inode);
+	}
+
+	stat_inc_gc_move(sbi, GC_MOVE_FALLBACK);
+	move_data_page(inode, index, FG_GC, GET_SEGNO(sbi, old_blkaddr),
+				GET_BLKOFF_FROM_SEG0(sbi, old_blkaddr));
+
+	if (locked) {
+		up_write(&fi->i_gc_rwsem[WRITE]);
+		up_write(&fi->i_gc_rwsem[READ]);
+	}
+}
+
 /*
  * This function tries to get parent node of victim data block, and identifies
  * data block validity. If the block is valid, copy that with cold status and
@@ -970,15 +1309,23 @@ out:
  * the victim data block is ignored.
  */
 static void gc_data_segment(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
-		struct gc_inode_list *gc_list, unsigned int segno, int gc_type)
+		struct gc_inode_list *gc_list, unsigned int segno, int gc_type,
+		struct gc_ctx *gc)
 {
 	struct super_block *sb = sbi->sb;
 	struct f2fs_summary *entry;
+	struct remap_batch *rb = NULL;
+	unsigned int planned = 0;
 	block_t start_addr;
 	int off;
 	int phase = 0;
 
 	start_addr = START_BLOCK(sbi, segno);
+	init_gc_blk_state(sbi, gc, segno, 0);
+
+	/* clean blocks are remapped as far as the idle budget goes */
+	if (gc->rc && gc->remap_budget)
+		rb = f2fs_remap_get_batch(sbi, gc->rc, segno);
 
 next_step:
 	entry = sum;
@@ -989,13 +1336,17 @@ next_step:
 		struct node_info dni; /* dnode info for the data */
 		unsigned int ofs_in_node, nofs;
 		block_t start_bidx;
+		bool skip_read;
 		nid_t nid = le32_to_cpu(entry->nid);
 
 		/* stop BG_GC if there is not enough free sections. */
 		if (gc_type == BG_GC && has_not_enough_free_secs(sbi, 0, 0))
-			return;
+			goto out;
 
-		if (check_valid_map(sbi, segno, off) == 0)
+		if (gc_blk_state(gc, off) == GC_BLK_INVALID)
+			continue;
+		/* readahead may use the snapshot, moving must not */
+		if (phase > 2 && check_valid_map(sbi, segno, off) == 0)
 			continue;
 
 		if (phase == 0) {
@@ -1047,6 +1398,25 @@ next_step:
 				continue;
 			}
 
+			/* cached blocks need no read */
+			set_gc_blk_state(gc, off,
+					classify_data_block(inode, start_bidx));
+			skip_read = gc_blk_state(gc, off) != GC_BLK_UNCACHED;
+
+			/* nor do those the device will move */
+			if (!skip_read && planned < gc->remap_budget &&
+				gc_data_mover(inode, GC_BLK_UNCACHED, rb) !=
+							GC_MOVE_HOST) {
+				planned++;
+				skip_read = true;
+			}
+
+			if (skip_read) {
+				up_write(&F2FS_I(inode)->i_gc_rwsem[WRITE]);
+				add_gc_inode(gc_list, inode);
+				continue;
+			}
+
 			data_page = f2fs_get_read_data_page(inode,
 						start_bidx, REQ_RAHEAD, true);
 			up_write(&F2FS_I(inode)->i_gc_rwsem[WRITE]);
@@ -1066,6 +1436,12 @@ next_step:
 			struct f2fs_inode_info *fi = F2FS_I(inode);
 			bool locked = false;
 
+			/* switch batches before taking any inode lock */
+			if (rb && rb->nr_entries >= rb->max_entries) {
+				f2fs_remap_submit(sbi, rb);
+				rb = f2fs_remap_get_batch(sbi, gc->rc, segno);
+			}
+
 			if (S_ISREG(inode->i_mode)) {
 				if (!down_write_trylock(&fi->i_gc_rwsem[READ])) {
 					sbi->skipped_gc_rwsem++;
@@ -1085,7 +1461,14 @@ next_step:
 
 			start_bidx = f2fs_start_bidx_of_node(nofs, inode)
 								+ ofs_in_node;
-			if (f2fs_post_read_required(inode)) // encrypted.
+			/* dirty pages are left to writeback as before */
+			if (gc->remap_budget &&
+				gc_data_mover(inode, gc_blk_state(gc, off),
+						rb) != GC_MOVE_HOST &&
+				remap_data_page(inode, start_bidx, gc_type,
+							segno, off, rb))
+				gc->remap_budget--;
+			else if (f2fs_post_read_required(inode)) // encrypted.
 				move_data_block(inode, start_bidx, gc_type,
 								segno, off);
 			else
@@ -1103,38 +1486,62 @@ next_step:
 
 	if (++phase < 5)
 		goto next_step;
+out:
+	if (rb)
+		f2fs_remap_submit(sbi, rb);
 }
-static void gc_data_segment_FG(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
-		struct gc_inode_list *gc_list, unsigned int segno, int gc_type)
+
+/*
+ * Same as gc_data_segment(), but valid blocks are handed to the device for
+ * remapping where possible, and the whole victim section is cleaned in one
+ * pass: every phase walks all segments picked by do_garbage_collect() before
+ * the next phase starts, so node and inode readahead of the section is in
+ * flight at once.  Remap requests are collected in batches which may cross
+ * segment boundaries; a full batch is submitted and applied once the device
+ * completes it, while GC goes on.
+ * Blocks found dirty in the page cache are copied without trying a remap.
+ */
+static void gc_data_section(struct f2fs_sb_info *sbi,
+		struct gc_inode_list *gc_list, unsigned int start_segno,
+		int gc_type, struct gc_ctx *gc)
 {
 	struct super_block *sb = sbi->sb;
-	struct f2fs_summary *entry;
-	block_t start_addr;
-	int off;
+	struct remap_batch *rb = NULL;
+	unsigned int blk;
 	int phase = 0;
-	int * array;
-	array = kzalloc(sizeof(int)*512,GFP_KERNEL);
-	
-	start_addr = START_BLOCK(sbi, segno);
-	printk("gc data:%x\n",start_addr);
-next_step:
-	entry = sum;
 
-	for (off = 0; off < sbi->blocks_per_seg; off++, entry++) {
+	if (gc->rc)
+		rb = f2fs_remap_get_batch(sbi, gc->rc, start_segno);
+next_step:
+	for (blk = 0; blk < BLKS_PER_SEC(sbi); blk++) {
+		unsigned int i = blk >> sbi->log_blocks_per_seg;
+		unsigned int segno = start_segno + i;
+		int off = blk & (sbi->blocks_per_seg - 1);
+		struct f2fs_summary_block *sum;
+		struct f2fs_summary *entry;
 		struct page *data_page;
 		struct inode *inode;
 		struct node_info dni; /* dnode info for the data */
 		unsigned int ofs_in_node, nofs;
 		block_t start_bidx;
-		nid_t nid = le32_to_cpu(entry->nid);
+		nid_t nid;
 
-		/* stop BG_GC if there is not enough free sections. */
-		if (gc_type == BG_GC && has_not_enough_free_secs(sbi, 0, 0))
-			return;
+		/* segment was left out by do_garbage_collect() */
+		if (!gc->sum_pages[i]) {
+			blk += sbi->blocks_per_seg - 1;
+			continue;
+		}
 
-		if (check_valid_map(sbi, segno, off) == 0)
+		if (gc_blk_state(gc, blk) == GC_BLK_INVALID)
+			continue;
+		/* readahead may use the snapshot, moving must not */
+		if (phase > 2 && check_valid_map(sbi, segno, off) == 0)
 			continue;
 
+		sum = page_address(gc->sum_pages[i]);
+		entry = &sum->entries[off];
+		nid = le32_to_cpu(entry->nid);
+
 		if (phase == 0) {
 			f2fs_ra_meta_pages(sbi, NAT_BLOCK_OFFSET(nid), 1,
 							META_NAT, true); // read ahead nat page.
@@ -1147,7 +1554,8 @@ next_step:
 		}
 
 		/* Get an inode by ino with checking validity */
-		if (!is_alive(sbi, entry, &dni, start_addr + off, &nofs))
+		if (!is_alive(sbi, entry, &dni, START_BLOCK(sbi, segno) + off,
+								&nofs))
 			continue;
 
 		if (phase == 2) {
@@ -1172,11 +1580,10 @@ next_step:
 			start_bidx = f2fs_start_bidx_of_node(nofs, inode) +
 								ofs_in_node;
 
-			if (f2fs_post_read_required(inode)) { // judge wheather the file is encrypted.
-				printk("FG_GC:Sad...encrypted.\n");
-				int err = ra_data_block(inode, start_bidx); // for encrypted.
+			if (f2fs_post_read_required(inode)) {
+				int err = ra_data_block(inode, start_bidx);
 
-				up_write(&F2FS_I(inode)->i_gc_rwsem[WRITE]); // 释放写锁
+				up_write(&F2FS_I(inode)->i_gc_rwsem[WRITE]);
 				if (err) {
 					iput(inode);
 					continue;
@@ -1185,20 +1592,26 @@ next_step:
 				continue;
 			}
 
-			//data_page = f2fs_get_read_data_page(inode,start_bidx, REQ_RAHEAD, true);
-			data_page = f2fs_get_cached_data_page(inode,start_bidx, true);
+			/* cached blocks and those the device moves need no read */
+			set_gc_blk_state(gc, blk,
+					classify_data_block(inode, start_bidx));
+			if (gc_blk_state(gc, blk) != GC_BLK_UNCACHED ||
+				gc_data_mover(inode, GC_BLK_UNCACHED, rb) !=
+							GC_MOVE_HOST) {
+				up_write(&F2FS_I(inode)->i_gc_rwsem[WRITE]);
+				add_gc_inode(gc_list, inode);
+				continue;
+			}
+
+			data_page = f2fs_get_read_data_page(inode,
+						start_bidx, REQ_RAHEAD, true);
 			up_write(&F2FS_I(inode)->i_gc_rwsem[WRITE]);
 			if (IS_ERR(data_page)) {
 				iput(inode);
 				continue;
 			}
-			if (PageUptodate(data_page) || PageDirty(data_page)) {
-				array[off] = 1;
-			} 
 
-			printk("put_page:\n");
-			f2fs_put_page(data_page, 0); // when need to put page.
-			printk("end\n");
+			f2fs_put_page(data_page, 0);
 			add_gc_inode(gc_list, inode);
 			continue;
 		}
@@ -1209,6 +1622,13 @@ next_step:
 			struct f2fs_inode_info *fi = F2FS_I(inode);
 			bool locked = false;
 
+			/* switch batches before taking any inode lock */
+			if (rb && rb->nr_entries >= rb->max_entries) {
+				f2fs_remap_submit(sbi, rb);
+				rb = f2fs_remap_get_batch(sbi, gc->rc,
+								start_segno);
+			}
+
 			if (S_ISREG(inode->i_mode)) { // judge wheather a normal file.
 				if (!down_write_trylock(&fi->i_gc_rwsem[READ])) {
 					sbi->skipped_gc_rwsem++;
@@ -1228,14 +1648,21 @@ next_step:
 
 			start_bidx = f2fs_start_bidx_of_node(nofs, inode)
 								+ ofs_in_node;
-			if (f2fs_post_read_required(inode))
-				move_data_block(inode, start_bidx, gc_type,
-								segno, off);
-			else{
-				if(array[off]) // if set bit: in the page cache.
-					move_data_page(inode, start_bidx, gc_type,segno, off);
+			switch (gc_data_mover(inode, gc_blk_state(gc, blk), rb)) {
+			case GC_MOVE_REMAP:
+			case GC_MOVE_DCOPY:
+				if (remap_data_page(inode, start_bidx, gc_type,
+							segno, off, rb))
+					break;
+				/* fall through */
+			default:
+				if (f2fs_post_read_required(inode))
+					move_data_block(inode, start_bidx,
+							gc_type, segno, off);
 				else
-					remap_data_page(inode, start_bidx, gc_type,segno, off);
+					move_data_page(inode, start_bidx,
+							gc_type, segno, off);
+				break;
 			}
 
 			if (locked) {
@@ -1249,13 +1676,20 @@ next_step:
 
 	if (++phase < 5)
 		goto next_step;
+
+	if (rb)
+		f2fs_remap_submit(sbi, rb);
 }
+
 static int __get_victim(struct f2fs_sb_info *sbi, unsigned int *victim,
 			int gc_type)
 {
 	struct sit_info *sit_i = SIT_I(sbi);
 	int ret;
 
+	if (select_gc_type(sbi, gc_type) == GC_REMAP)
+		refresh_remap_estimates(sbi);
+
 	down_write(&sit_i->sentry_lock);
 	ret = DIRTY_I(sbi)->v_ops->get_victim(sbi, victim, gc_type,
 					      NO_CHECK_TYPE, LFS);
@@ -1265,13 +1699,15 @@ static int __get_victim(struct f2fs_sb_info *sbi, unsigned int *victim,
 
 static int do_garbage_collect(struct f2fs_sb_info *sbi,
 				unsigned int start_segno,
-				struct gc_inode_list *gc_list, int gc_type)
+				struct gc_inode_list *gc_list, int gc_type,
+				struct gc_ctx *gc)
 {
 	struct page *sum_page;
 	struct f2fs_summary_block *sum;
 	struct blk_plug plug;
 	unsigned int segno = start_segno;
 	unsigned int end_segno = start_segno + sbi->segs_per_sec;
+	unsigned int i, nr_planned = 0;
 	int seg_freed = 0;
 	unsigned char type = IS_DATASEG(get_seg_entry(sbi, segno)->type) ?
 						SUM_TYPE_DATA : SUM_TYPE_NODE;
@@ -1317,15 +1753,20 @@ static int do_garbage_collect(struct f2fs_sb_info *sbi,
 		 *   - down_read(sentry_lock)     - change_curseg()
 		 *                                  - lock_page(sum_page)
 		 */
-		if (type == SUM_TYPE_NODE)
+		if (type == SUM_TYPE_NODE) {
 			gc_node_segment(sbi, sum->entries, segno, gc_type);
-		else{
-			if(gc_type==BG_GC)
-				gc_data_segment(sbi, sum->entries, gc_list, segno,gc_type);
-			else	
-				gc_data_segment_FG(sbi, sum->entries, gc_list, segno,gc_type);
+		} else if (gc_type == BG_GC) {
+			gc_data_segment(sbi, sum->entries, gc_list,
+							segno, gc_type, gc);
+		} else {
+			/* keep the summary referenced for gc_data_section() */
+			i = segno - start_segno;
+			init_gc_blk_state(sbi, gc, segno,
+					i << sbi->log_blocks_per_seg);
+			gc->sum_pages[i] = sum_page;
+			nr_planned++;
+			continue;
 		}
-			
 
 		stat_inc_seg_count(sbi, type, gc_type);
 
@@ -1337,6 +1778,27 @@ next:
 		f2fs_put_page(sum_page, 0);
 	}
 
+	if (nr_planned) {
+		/* freed segments of this section are counted below */
+		if (gc->rc)
+			gc->rc->cur_secno = GET_SEC_FROM_SEG(sbi, start_segno);
+
+		gc_data_section(sbi, gc_list, start_segno, gc_type, gc);
+
+		for (i = 0; i < sbi->segs_per_sec; i++) {
+			if (!gc->sum_pages[i])
+				continue;
+			stat_inc_seg_count(sbi, type, gc_type);
+			if (get_valid_blocks(sbi, start_segno + i, false) == 0)
+				seg_freed++;
+			f2fs_put_page(gc->sum_pages[i], 0);
+			gc->sum_pages[i] = NULL;
+		}
+
+		if (gc->rc)
+			gc->rc->cur_secno = NULL_SECNO;
+	}
+
 	if (gc_type == FG_GC)
 		f2fs_submit_merged_write(sbi,
 				(type == SUM_TYPE_NODE) ? NODE : DATA);
@@ -1360,6 +1822,13 @@ int f2fs_gc(struct f2fs_sb_info *sbi, bool sync,
 		.ilist = LIST_HEAD_INIT(gc_list.ilist),
 		.iroot = RADIX_TREE_INIT(gc_list.iroot, GFP_NOFS),
 	};
+	struct remap_ctx remap_ctx;
+	struct gc_ctx gc = {
+		.blk_state = sbi->gc_blk_state,
+		.sum_pages = sbi->gc_sum_pages,
+		.rc = &remap_ctx,
+		.remap_budget = sbi->gc_remap_budget,
+	};
 	unsigned long long last_skipped = sbi->skipped_atomic_files[FG_GC];
 	unsigned long long first_skipped;
 	unsigned int skipped_round = 0, round = 0;
@@ -1376,6 +1845,10 @@ int f2fs_gc(struct f2fs_sb_info *sbi, bool sync,
 	cpc.reason = __get_cp_reason(sbi);
 	sbi->skipped_gc_rwsem = 0;
 	first_skipped = last_skipped;
+
+	/* without batch buffers, fall back to copying every block */
+	if (f2fs_remap_init_ctx(sbi, gc.rc))
+		gc.rc = NULL;
 gc_more:
 	if (unlikely(!(sbi->sb->s_flags & SB_ACTIVE))) {
 		ret = -EINVAL;
@@ -1393,6 +1866,9 @@ gc_more:
 		 * secure free segments which doesn't need fggc any more.
 		 */
 		if (prefree_segments(sbi)) {
+			/* the checkpoint waits for the batches this GC holds */
+			if (gc.rc)
+				f2fs_remap_wait(sbi, gc.rc);
 			ret = f2fs_write_checkpoint(sbi, &cpc);
 			if (ret)
 				goto stop;
@@ -1411,7 +1887,7 @@ gc_more:
 		goto stop;
 	}
 
-	seg_freed = do_garbage_collect(sbi, segno, &gc_list, gc_type);
+	seg_freed = do_garbage_collect(sbi, segno, &gc_list, gc_type, &gc);
 	if (gc_type == FG_GC && seg_freed == sbi->segs_per_sec)
 		sec_freed++;
 	total_freed += seg_freed;
@@ -1430,7 +1906,8 @@ gc_more:
 	if (sync)
 		goto stop;
 
-	if (has_not_enough_free_secs(sbi, sec_freed, 0)) {
+	if (has_not_enough_free_secs(sbi, sec_freed +
+					(gc.rc ? gc.rc->sec_freed : 0), 0)) {
 		if (skipped_round <= MAX_SKIP_GC_COUNT ||
 					skipped_round * 2 < round) {
 			segno = NULL_SEGNO;
@@ -1444,10 +1921,20 @@ gc_more:
 			segno = NULL_SEGNO;
 			goto gc_more;
 		}
-		if (gc_type == FG_GC)
+		if (gc_type == FG_GC) {
+			/* don't checkpoint blocks the device is still moving */
+			if (gc.rc)
+				f2fs_remap_wait(sbi, gc.rc);
 			ret = f2fs_write_checkpoint(sbi, &cpc);
+		}
 	}
 stop:
+	if (gc.rc) {
+		f2fs_remap_destroy_ctx(sbi, gc.rc);
+		sec_freed += gc.rc->sec_freed;
+		total_freed += gc.rc->seg_freed;
+	}
+
 	SIT_I(sbi)->last_victim[ALLOC_NEXT] = 0;
 	SIT_I(sbi)->last_victim[FLUSH_DEVICE] = init_segno;
 
@@ -1469,7 +1956,7 @@ stop:
 	return ret;
 }
 
-void f2fs_build_gc_manager(struct f2fs_sb_info *sbi)
+int f2fs_build_gc_manager(struct f2fs_sb_info *sbi)
 {
 	DIRTY_I(sbi)->v_ops = &default_v_ops;
 
@@ -1479,4 +1966,27 @@ void f2fs_build_gc_manager(struct f2fs_sb_info *sbi)
 	if (f2fs_is_multi_device(sbi) && sbi->segs_per_sec == 1)
 		SIT_I(sbi)->last_victim[ALLOC_NEXT] =
 				GET_SEGNO(sbi, FDEV(0).end_blk) + 1;
+
+	/* serialized by gc_mutex, so one section map serves every f2fs_gc() */
+	sbi->gc_blk_state = f2fs_kvzalloc(sbi,
+			GC_BLK_STATE_SIZE(sbi) * sbi->segs_per_sec, GFP_KERNEL);
+	if (!sbi->gc_blk_state)
+		return -ENOMEM;
+
+	sbi->gc_sum_pages = f2fs_kzalloc(sbi,
+			sbi->segs_per_sec * sizeof(struct page *), GFP_KERNEL);
+	if (!sbi->gc_sum_pages) {
+		kvfree(sbi->gc_blk_state);
+		sbi->gc_blk_state = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void f2fs_destroy_gc_manager(struct f2fs_sb_info *sbi)
+{
+	kfree(sbi->gc_sum_pages);
+	sbi->gc_sum_pages = NULL;
+	kvfree(sbi->gc_blk_state);
+	sbi->gc_blk_state = NULL;
 }
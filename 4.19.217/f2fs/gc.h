@@ -17,6 +17,7 @@
 #define DEF_GC_THREAD_MIN_SLEEP_TIME	30000	/* milliseconds */
 #define DEF_GC_THREAD_MAX_SLEEP_TIME	60000
 #define DEF_GC_THREAD_NOGC_SLEEP_TIME	300000	/* wait 5 min */
+#define DEF_GC_THREAD_REMAP_BLOCKS	1024	/* BG remaps per wakeup */
 #define LIMIT_INVALID_BLOCK	40 /* percentage over total user space */
 #define LIMIT_FREE_BLOCK	40 /* percentage over invalid + free space */
 
@@ -25,6 +26,10 @@
 /* Search max. number of dirty segments to select a victim segment */
 #define DEF_MAX_VICTIM_SEARCH 4096 /* covers 8GB */
 
+/* for GC_REMAP victim selection */
+#define GC_REMAP_SAMPLES	32	/* valid blocks sampled per segment */
+#define GC_REMAP_COPY_WEIGHT	16	/* cost of a host copy over a remap */
+
 struct f2fs_gc_kthread {
 	struct task_struct *f2fs_gc_task;
 	wait_queue_head_t gc_wait_queue_head;
@@ -37,6 +42,9 @@ struct f2fs_gc_kthread {
 
 	/* for changing gc mode */
 	unsigned int gc_wake;
+
+	/* for remapping in BG_GC, 0 disables it */
+	unsigned int max_remap_blocks;
 };
 
 struct gc_inode_list {
@@ -44,9 +52,49 @@ struct gc_inode_list {
 	struct radix_tree_root iroot;
 };
 
+/* state of a block in the victim section */
+enum {
+	GC_BLK_INVALID,		/* not valid when the segment was scanned */
+	GC_BLK_UNCACHED,	/* valid, no uptodate page cached */
+	GC_BLK_CLEAN,		/* valid, clean uptodate page cached */
+	GC_BLK_DIRTY,		/* valid, page dirty or under writeback */
+};
+
+#define GC_BLK_STATE_BITS	2
+#define GC_BLK_STATE_MASK	((1UL << GC_BLK_STATE_BITS) - 1)
+#define GC_BLK_PER_LONG		(BITS_PER_LONG / GC_BLK_STATE_BITS)
+#define GC_BLK_STATE_SIZE(sbi)						\
+	(DIV_ROUND_UP((sbi)->blocks_per_seg, GC_BLK_PER_LONG) *		\
+						sizeof(unsigned long))
+
+/* state shared by all victims of one f2fs_gc() call */
+struct gc_ctx {
+	unsigned long *blk_state;	/* GC_BLK_STATE_BITS per block */
+	struct page **sum_pages;	/* planned SSA pages of FG data victim */
+	struct remap_ctx *rc;		/* NULL if blocks are only copied */
+	unsigned int remap_budget;	/* blocks BG_GC may still remap */
+};
+
 /*
  * inline functions
  */
+static inline int gc_blk_state(struct gc_ctx *gc, unsigned int off)
+{
+	return (gc->blk_state[off / GC_BLK_PER_LONG] >>
+		((off % GC_BLK_PER_LONG) * GC_BLK_STATE_BITS)) &
+							GC_BLK_STATE_MASK;
+}
+
+static inline void set_gc_blk_state(struct gc_ctx *gc, unsigned int off,
+								int state)
+{
+	unsigned long *word = &gc->blk_state[off / GC_BLK_PER_LONG];
+	unsigned int shift = (off % GC_BLK_PER_LONG) * GC_BLK_STATE_BITS;
+
+	*word = (*word & ~(GC_BLK_STATE_MASK << shift)) |
+					((unsigned long)state << shift);
+}
+
 static inline block_t free_user_blocks(struct f2fs_sb_info *sbi)
 {
 	if (free_segments(sbi) < overprovision_segments(sbi))
@@ -0,0 +1,65 @@
+/*
+ * fs/f2fs/gctrace.h
+ *
+ * Tracer of the blocks garbage collection relocates
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __F2FS_GCTRACE_H__
+#define __F2FS_GCTRACE_H__
+
+/* how a valid block left its victim segment */
+enum {
+	GC_TRACE_REMAP,		/* remapped by the device */
+	GC_TRACE_MOVE_DIRTY,	/* copied, page was dirty already */
+	GC_TRACE_MOVE_CLEAN,	/* copied, page was clean or uncached */
+	GC_TRACE_ENCRYPTED,	/* copied through META_MAPPING */
+	GC_TRACE_NODE,		/* node block copied */
+	GC_TRACE_DEVICE_COPY,	/* copied by the device */
+};
+
+/*
+ * One relocation, as read from <debugfs>/f2fs_gc_trace.
+ * new_blkaddr is NULL_ADDR if the block gets its address at writeback.
+ */
+struct f2fs_gc_trace_rec {
+	__u64 time;		/* local_clock() at completion, in ns */
+	__u32 dev;		/* new_encode_dev() of the volume */
+	__u32 segno;		/* victim segment */
+	__u32 ino;		/* owner inode */
+	__u32 bidx;		/* page index in owner, nid for node blocks */
+	__u32 old_blkaddr;
+	__u32 new_blkaddr;
+	__u32 latency;		/* ns spent on the relocation */
+	__u16 offset;		/* block offset in segno */
+	__u8 path;		/* GC_TRACE_* */
+	__u8 rsvd;
+} __packed;
+
+#ifdef CONFIG_F2FS_GC_TRACE
+#include <linux/sched/clock.h>
+
+static inline u64 f2fs_gc_trace_clock(void)
+{
+	return local_clock();
+}
+
+extern void f2fs_trace_gc(struct f2fs_sb_info *sbi, nid_t ino, pgoff_t bidx,
+		block_t old_blkaddr, block_t new_blkaddr, int path, u64 start);
+extern void f2fs_build_gc_trace(void);
+extern void f2fs_destroy_gc_trace(void);
+#else
+static inline u64 f2fs_gc_trace_clock(void)
+{
+	return 0;
+}
+
+static inline void f2fs_trace_gc(struct f2fs_sb_info *sbi, nid_t ino,
+		pgoff_t bidx, block_t old_blkaddr, block_t new_blkaddr,
+		int path, u64 start) {}
+#define f2fs_build_gc_trace()
+#define f2fs_destroy_gc_trace()
+#endif
+#endif /* __F2FS_GCTRACE_H__ */
@@ -749,6 +749,8 @@ skip:
 			struct cp_control cpc = {
 				.reason = CP_RECOVERY,
 			};
+			/* the checkpoint overwrites the remap log */
+			f2fs_remap_replay(sbi);
 			err = f2fs_write_checkpoint(sbi, &cpc);
 		}
 	}
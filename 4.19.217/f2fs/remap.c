@@ -0,0 +1,976 @@
+/*
+ * fs/f2fs/remap.c
+ *
+ * Device assisted relocation of data blocks for garbage collection
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/fs.h>
+#include <linux/f2fs_fs.h>
+#include <linux/blkdev.h>
+#include <linux/nvme.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+
+#include "f2fs.h"
+#include "segment.h"
+#include "node.h"
+#include "remap.h"
+#include "gctrace.h"
+
+typedef void (nvme_kernel_end_io_t)(void *private, int status, u32 result);
+extern int nvme_kernel_iocmd_async(struct block_device *bdev,
+			struct nvme_passthru_cmd *cmd,
+			void *buffer, unsigned int bufflen,
+			nvme_kernel_end_io_t *end_io, void *private);
+extern int nvme_kernel_copy_limits(struct block_device *bdev,
+			u32 *max_ranges, u32 *max_range_lbas, u32 *max_lbas);
+
+/*
+ * NVMe Copy is only used if the controller reports it in its identify data,
+ * and within the limits of the namespace, kept in blocks.  A device which
+ * can't copy one block with a single range is not worth it.
+ */
+static bool __remap_init_copy(struct f2fs_sb_info *sbi)
+{
+	u32 ranges, range_lbas, lbas;
+
+	if (nvme_kernel_copy_limits(sbi->remap_bdev, &ranges,
+						&range_lbas, &lbas))
+		return false;
+
+	/* unset limits are only bound by the 16 bit length of a range */
+	if (!range_lbas || range_lbas > 65536)
+		range_lbas = 65536;
+	if (!lbas)
+		lbas = UINT_MAX;
+
+	sbi->copy_max_ranges = min_t(u32, ranges, COPY_RANGES_PER_CMD);
+	sbi->copy_max_range_blks = range_lbas >> sbi->remap_lba_shift;
+	sbi->copy_max_blks = lbas >> sbi->remap_lba_shift;
+	return sbi->copy_max_ranges && sbi->copy_max_range_blks &&
+						sbi->copy_max_blks;
+}
+
+/*
+ * Look up the NVMe namespace behind the mounted block device once, so that
+ * GC can talk to it directly for the lifetime of the superblock.  Remap is
+ * left disabled if the volume does not sit on a single NVMe namespace.
+ */
+void f2fs_remap_init_dev(struct f2fs_sb_info *sbi)
+{
+	struct block_device *bdev = sbi->sb->s_bdev;
+	unsigned int lba_bits;
+	int nsid;
+
+	if (f2fs_is_multi_device(sbi))
+		return;
+
+	nsid = ioctl_by_bdev(bdev, NVME_IOCTL_ID, 0);
+	if (nsid <= 0)
+		return;
+
+	lba_bits = ilog2(bdev_logical_block_size(bdev));
+	if (lba_bits > F2FS_BLKSIZE_BITS)
+		return;
+
+	sbi->remap_log = vzalloc(REMAP_LOG_BLOCKS << F2FS_BLKSIZE_BITS);
+	if (!sbi->remap_log)
+		return;
+	mutex_init(&sbi->remap_log_lock);
+	sbi->remap_log_pos = 0;
+	sbi->remap_log_ver = cur_cp_version(F2FS_CKPT(sbi));
+
+	sbi->remap_bdev = bdgrab(bdev);
+	sbi->remap_nsid = nsid;
+	sbi->remap_lba_shift = F2FS_BLKSIZE_BITS - lba_bits;
+	sbi->remap_start_lba = get_start_sect(bdev) >> (lba_bits - 9);
+
+	/* the vendor remap is assumed to work until the device rejects it */
+	sbi->remap_caps = BIT(REMAP_OP_REMAP);
+	if (__remap_init_copy(sbi))
+		sbi->remap_caps |= BIT(REMAP_OP_COPY);
+
+	f2fs_msg(sbi->sb, KERN_INFO, "GC remap enabled on nsid %d, copy %s",
+		nsid, test_bit(REMAP_OP_COPY, &sbi->remap_caps) ?
+		"supported" : "unsupported");
+}
+
+void f2fs_remap_destroy_dev(struct f2fs_sb_info *sbi)
+{
+	if (!sbi->remap_bdev)
+		return;
+	bdput(sbi->remap_bdev);
+	sbi->remap_bdev = NULL;
+	sbi->remap_caps = 0;
+	vfree(sbi->remap_log);
+	sbi->remap_log = NULL;
+}
+
+/* device relocation to use for new batches, -1 if there is none left */
+static int __remap_pick_op(struct f2fs_sb_info *sbi)
+{
+	if (test_bit(REMAP_OP_REMAP, &sbi->remap_caps))
+		return REMAP_OP_REMAP;
+	if (test_bit(REMAP_OP_COPY, &sbi->remap_caps))
+		return REMAP_OP_COPY;
+	return -1;
+}
+
+static void __destroy_batch(struct remap_batch *rb)
+{
+	kvfree(rb->entries);
+	kfree(rb->ranges);
+	kfree(rb->cmds);
+	rb->entries = NULL;
+	rb->ranges = NULL;
+	rb->cmds = NULL;
+}
+
+static int __init_batch(struct f2fs_sb_info *sbi, struct remap_ctx *rc,
+					struct remap_batch *rb)
+{
+	unsigned int max_cmds;
+
+	rb->rc = rc;
+	rb->segno = NULL_SEGNO;
+	rb->state = REMAP_BATCH_FREE;
+	rb->op = REMAP_OP_REMAP;
+	rb->nr_entries = 0;
+	rb->max_entries = sbi->blocks_per_seg;
+	atomic_set(&rb->nr_inflight, 0);
+
+	/* a copy command needs a contiguous destination, which may be 1 block */
+	max_cmds = rb->max_entries;
+
+	rb->entries = f2fs_kvmalloc(sbi, rb->max_entries *
+				sizeof(struct remap_entry), GFP_NOFS);
+	/* range lists are DMA'ed by the device, keep them out of vmalloc */
+	rb->ranges = f2fs_kmalloc(sbi, rb->max_entries *
+				max(sizeof(struct nvme_remap_range),
+				sizeof(struct nvme_copy_range)), GFP_NOFS);
+	rb->cmds = f2fs_kmalloc(sbi, max_cmds *
+				sizeof(struct remap_cmd), GFP_NOFS);
+	if (!rb->entries || !rb->ranges || !rb->cmds) {
+		__destroy_batch(rb);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+int f2fs_remap_init_ctx(struct f2fs_sb_info *sbi, struct remap_ctx *rc)
+{
+	int i;
+
+	if (!sbi->remap_bdev || !sbi->remap_caps)
+		return -EOPNOTSUPP;
+
+	init_waitqueue_head(&rc->wait);
+	rc->seg_freed = 0;
+	rc->sec_freed = 0;
+	rc->cur_secno = NULL_SECNO;
+
+	for (i = 0; i < REMAP_MAX_BATCHES; i++) {
+		if (__init_batch(sbi, rc, &rc->batches[i])) {
+			while (--i >= 0)
+				__destroy_batch(&rc->batches[i]);
+			return -ENOMEM;
+		}
+	}
+
+	sbi->remap_ctx = rc;
+	return 0;
+}
+
+void f2fs_remap_destroy_ctx(struct f2fs_sb_info *sbi, struct remap_ctx *rc)
+{
+	int i;
+
+	f2fs_remap_wait(sbi, rc);
+	sbi->remap_ctx = NULL;
+
+	for (i = 0; i < REMAP_MAX_BATCHES; i++)
+		__destroy_batch(&rc->batches[i]);
+}
+
+/*
+ * Record that the block @dn points at, which backs the locked @page, should
+ * be moved to @new_blkaddr by the device.  @new_blkaddr has already been
+ * reserved in the cold data log, but neither the dnode nor the SIT entry of
+ * the old block is touched until the device has confirmed the move.  The
+ * page stays locked until then: the device may complete long before the
+ * batch is applied, and a reader of an uncached page must wait for the dnode
+ * to point at the new address rather than read the old one, which the
+ * device has remapped away.
+ */
+bool f2fs_remap_add(struct remap_batch *rb, struct page *page,
+			struct dnode_of_data *dn, block_t new_blkaddr)
+{
+	struct remap_entry *re;
+
+	if (rb->nr_entries >= rb->max_entries)
+		return false;
+
+	re = &rb->entries[rb->nr_entries++];
+	re->inode = page->mapping->host;
+	re->index = page->index;
+	re->page = page;
+	re->old_blkaddr = dn->data_blkaddr;
+	re->new_blkaddr = new_blkaddr;
+	re->nid = dn->nid;
+	re->ofs_in_node = dn->ofs_in_node;
+	re->err = 0;
+	return true;
+}
+
+static int remap_entry_cmp(const void *a, const void *b)
+{
+	const struct remap_entry *ra = a, *rb = b;
+
+	if (ra->old_blkaddr < rb->old_blkaddr)
+		return -1;
+	return ra->old_blkaddr > rb->old_blkaddr;
+}
+
+/* called from the completion path of the device, may be in irq context */
+static void f2fs_remap_end_io(void *private, int status, u32 result)
+{
+	struct remap_cmd *cmd = private;
+	struct remap_batch *rb = cmd->rb;
+	unsigned int i;
+
+	if (status)
+		for (i = cmd->first; i < cmd->last; i++)
+			rb->entries[i].err = status;
+
+	if (atomic_dec_and_test(&rb->nr_inflight))
+		wake_up(&rb->rc->wait);
+}
+
+static void __submit_remap_cmd(struct f2fs_sb_info *sbi,
+				struct remap_batch *rb, struct remap_cmd *cmd,
+				struct nvme_remap_range *ranges,
+				unsigned int nr_ranges)
+{
+	struct nvme_passthru_cmd c;
+	void *buffer = NULL;
+	unsigned int bufflen = 0;
+	int err;
+
+	memset(&c, 0, sizeof(c));
+	c.nsid = sbi->remap_nsid;
+
+	/* a single run fits in the command itself, no payload to DMA */
+	if (nr_ranges == 1) {
+		u64 src = le64_to_cpu(ranges[0].src_lba);
+		u64 dst = le64_to_cpu(ranges[0].dst_lba);
+
+		c.opcode = NVME_CMD_REMAP;
+		c.cdw10 = lower_32_bits(src);
+		c.cdw11 = upper_32_bits(src);
+		c.cdw12 = lower_32_bits(dst);
+		c.cdw13 = upper_32_bits(dst);
+		c.cdw14 = le32_to_cpu(ranges[0].len);
+	} else {
+		c.opcode = NVME_CMD_REMAP_LIST;
+		c.cdw10 = nr_ranges - 1;
+		buffer = ranges;
+		bufflen = nr_ranges * sizeof(struct nvme_remap_range);
+	}
+
+	atomic_inc(&rb->nr_inflight);
+	err = nvme_kernel_iocmd_async(sbi->remap_bdev, &c, buffer, bufflen,
+						f2fs_remap_end_io, cmd);
+	if (err)
+		f2fs_remap_end_io(cmd, err, 0);
+}
+
+/*
+ * Merge sorted entries into runs which are contiguous on both the source and
+ * the destination side, and send them with as few commands as possible.
+ * The commands complete asynchronously; each one records its status in the
+ * entries it covers.
+ */
+static void __issue_remap_batch(struct f2fs_sb_info *sbi,
+				struct remap_batch *rb)
+{
+	struct remap_cmd *cmd = rb->cmds;
+	unsigned int first = 0, start = 0;
+	unsigned int cmd_range = 0, nr_ranges = 0;
+	unsigned int i;
+
+	/* hold a reference so that the batch can't complete while issuing */
+	atomic_set(&rb->nr_inflight, 1);
+
+	for (i = 1; i <= rb->nr_entries; i++) {
+		struct remap_entry *prev = &rb->entries[i - 1];
+		struct nvme_remap_range *range;
+
+		if (i < rb->nr_entries &&
+			rb->entries[i].old_blkaddr == prev->old_blkaddr + 1 &&
+			rb->entries[i].new_blkaddr == prev->new_blkaddr + 1)
+			continue;
+
+		/* close the run [start, i) */
+		range = &rb->ranges[nr_ranges++];
+		range->src_lba = cpu_to_le64(remap_lba(sbi,
+					rb->entries[start].old_blkaddr));
+		range->dst_lba = cpu_to_le64(remap_lba(sbi,
+					rb->entries[start].new_blkaddr));
+		range->len = cpu_to_le32((i - start) << sbi->remap_lba_shift);
+		range->rsvd = 0;
+		start = i;
+
+		if (nr_ranges - cmd_range < REMAP_RANGES_PER_CMD &&
+						i < rb->nr_entries)
+			continue;
+
+		cmd->rb = rb;
+		cmd->first = first;
+		cmd->last = i;
+		__submit_remap_cmd(sbi, rb, cmd, &rb->ranges[cmd_range],
+						nr_ranges - cmd_range);
+		cmd++;
+		first = i;
+		cmd_range = nr_ranges;
+	}
+
+	if (atomic_dec_and_test(&rb->nr_inflight))
+		wake_up(&rb->rc->wait);
+}
+
+static void __submit_copy_cmd(struct f2fs_sb_info *sbi,
+				struct remap_batch *rb, struct remap_cmd *cmd,
+				block_t dst_blkaddr,
+				struct nvme_copy_range *ranges,
+				unsigned int nr_ranges)
+{
+	struct nvme_passthru_cmd c;
+	u64 sdlba = remap_lba(sbi, dst_blkaddr);
+	int err;
+
+	memset(&c, 0, sizeof(c));
+	c.opcode = NVME_CMD_COPY;
+	c.nsid = sbi->remap_nsid;
+	c.cdw10 = lower_32_bits(sdlba);
+	c.cdw11 = upper_32_bits(sdlba);
+	c.cdw12 = nr_ranges - 1;	/* descriptor format 0 */
+
+	atomic_inc(&rb->nr_inflight);
+	err = nvme_kernel_iocmd_async(sbi->remap_bdev, &c, ranges,
+				nr_ranges * sizeof(struct nvme_copy_range),
+				f2fs_remap_end_io, cmd);
+	if (err)
+		f2fs_remap_end_io(cmd, err, 0);
+}
+
+/*
+ * Same as __issue_remap_batch() for devices which copy instead of remap.
+ * A copy command writes one contiguous destination, so a command is closed
+ * whenever the new addresses of the sorted entries have a gap; within it,
+ * each contiguous source run becomes one range.  Ranges and commands are
+ * also closed where they would exceed the limits of the device.
+ */
+static void __issue_copy_batch(struct f2fs_sb_info *sbi,
+				struct remap_batch *rb)
+{
+	struct remap_cmd *cmd = rb->cmds;
+	unsigned int first = 0, start = 0;
+	unsigned int cmd_range = 0, nr_ranges = 0;
+	unsigned int i;
+
+	/* hold a reference so that the batch can't complete while issuing */
+	atomic_set(&rb->nr_inflight, 1);
+
+	for (i = 1; i <= rb->nr_entries; i++) {
+		struct remap_entry *prev = &rb->entries[i - 1];
+		struct nvme_copy_range *range;
+		bool dst_contig = i < rb->nr_entries &&
+			rb->entries[i].new_blkaddr == prev->new_blkaddr + 1;
+
+		if (dst_contig &&
+			rb->entries[i].old_blkaddr == prev->old_blkaddr + 1 &&
+			i - start < sbi->copy_max_range_blks &&
+			i - first < sbi->copy_max_blks)
+			continue;
+
+		/* close the source range [start, i) */
+		range = &rb->copy_ranges[nr_ranges++];
+		memset(range, 0, sizeof(*range));
+		range->slba = cpu_to_le64(remap_lba(sbi,
+					rb->entries[start].old_blkaddr));
+		range->nlb = cpu_to_le16(((i - start) <<
+					sbi->remap_lba_shift) - 1);
+		start = i;
+
+		if (dst_contig &&
+				nr_ranges - cmd_range < sbi->copy_max_ranges &&
+				i - first < sbi->copy_max_blks)
+			continue;
+
+		cmd->rb = rb;
+		cmd->first = first;
+		cmd->last = i;
+		__submit_copy_cmd(sbi, rb, cmd,
+				rb->entries[first].new_blkaddr,
+				&rb->copy_ranges[cmd_range],
+				nr_ranges - cmd_range);
+		cmd++;
+		first = i;
+		cmd_range = nr_ranges;
+	}
+
+	if (atomic_dec_and_test(&rb->nr_inflight))
+		wake_up(&rb->rc->wait);
+}
+
+/* the log goes to the tail of the pack checkpoint @ver + 1 is written to */
+static block_t __remap_log_addr(struct f2fs_sb_info *sbi,
+						unsigned long long ver)
+{
+	block_t start_addr = le32_to_cpu(F2FS_RAW_SUPER(sbi)->cp_blkaddr);
+
+	if (!((ver + 1) & 1))
+		start_addr += sbi->blocks_per_seg;
+	return start_addr + sbi->blocks_per_seg - REMAP_LOG_BLOCKS;
+}
+
+static struct f2fs_remap_log_block *__remap_log_block(struct f2fs_sb_info *sbi,
+							unsigned int blk)
+{
+	return sbi->remap_log + (blk << F2FS_BLKSIZE_BITS);
+}
+
+static int __remap_log_io(struct f2fs_sb_info *sbi, int op, int op_flags,
+							unsigned int blk)
+{
+	struct bio *bio = f2fs_bio_alloc(sbi, 1, true);
+	int err;
+
+	bio_set_dev(bio, sbi->sb->s_bdev);
+	bio->bi_iter.bi_sector = SECTOR_FROM_BLOCK(
+			__remap_log_addr(sbi, sbi->remap_log_ver) + blk);
+	bio_set_op_attrs(bio, op, op_flags);
+	bio_add_page(bio, vmalloc_to_page(__remap_log_block(sbi, blk)),
+							F2FS_BLKSIZE, 0);
+	err = submit_bio_wait(bio);
+	bio_put(bio);
+	return err;
+}
+
+static int __remap_log_write(struct f2fs_sb_info *sbi, unsigned int blk)
+{
+	struct f2fs_remap_log_block *lb = __remap_log_block(sbi, blk);
+
+	lb->crc = 0;
+	lb->crc = cpu_to_le32(f2fs_crc32(sbi, lb, F2FS_BLKSIZE));
+	return __remap_log_io(sbi, REQ_OP_WRITE, REQ_SYNC | REQ_PREFLUSH |
+					REQ_FUA | REQ_META | REQ_PRIO, blk);
+}
+
+/*
+ * Log @entries as intended remaps before the device is told about them.
+ * The batch holds remap_rwsem until the dnodes are updated, so that no
+ * checkpoint can come in between.  The log only has room for the remaps
+ * of one checkpoint interval; -ENOSPC leaves the rest to host copies.
+ */
+static int __remap_log_intent(struct f2fs_sb_info *sbi,
+			struct remap_entry *entries, unsigned int nr)
+{
+	unsigned long long ver = cur_cp_version(F2FS_CKPT(sbi));
+	unsigned int i, blk, ofs;
+	int err = 0;
+
+	mutex_lock(&sbi->remap_log_lock);
+	if (sbi->remap_log_ver != ver) {
+		sbi->remap_log_ver = ver;
+		sbi->remap_log_pos = 0;
+	}
+
+	if (sbi->remap_log_pos + nr > REMAP_LOG_BLOCKS * REMAP_LOG_ENTRIES) {
+		err = -ENOSPC;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct f2fs_remap_log_block *lb;
+		struct f2fs_remap_log_entry *le;
+
+		blk = sbi->remap_log_pos / REMAP_LOG_ENTRIES;
+		ofs = sbi->remap_log_pos % REMAP_LOG_ENTRIES;
+		lb = __remap_log_block(sbi, blk);
+		if (!ofs) {
+			memset(lb, 0, F2FS_BLKSIZE);
+			lb->magic = cpu_to_le32(F2FS_REMAP_LOG_MAGIC);
+			lb->cp_ver = cpu_to_le64(ver);
+		}
+
+		le = &lb->entries[ofs];
+		le->old_blkaddr = cpu_to_le32(entries[i].old_blkaddr);
+		le->new_blkaddr = cpu_to_le32(entries[i].new_blkaddr);
+		le->nid = cpu_to_le32(entries[i].nid);
+		le->ofs_in_node = cpu_to_le16(entries[i].ofs_in_node);
+		lb->nr_entries = cpu_to_le32(ofs + 1);
+		entries[i].log_pos = sbi->remap_log_pos++;
+
+		/* write each block once it is full, and the last one */
+		if (ofs + 1 < REMAP_LOG_ENTRIES && i + 1 < nr)
+			continue;
+		err = __remap_log_write(sbi, blk);
+		if (err)
+			break;
+	}
+out:
+	mutex_unlock(&sbi->remap_log_lock);
+	return err;
+}
+
+/* mark the remaps of @entries the device completed as done in the log */
+static void __remap_log_done(struct f2fs_sb_info *sbi,
+			struct remap_entry *entries, unsigned int nr)
+{
+	unsigned int i, blk, last_blk = UINT_MAX;
+	int err = 0;
+
+	mutex_lock(&sbi->remap_log_lock);
+	for (i = 0; i < nr; i++) {
+		struct f2fs_remap_log_block *lb;
+
+		if (entries[i].err)
+			continue;
+
+		blk = entries[i].log_pos / REMAP_LOG_ENTRIES;
+		if (blk != last_blk && last_blk != UINT_MAX)
+			err |= __remap_log_write(sbi, last_blk);
+		last_blk = blk;
+
+		lb = __remap_log_block(sbi, blk);
+		lb->entries[entries[i].log_pos % REMAP_LOG_ENTRIES].flags |=
+					cpu_to_le16(REMAP_LOG_DONE);
+	}
+	if (last_blk != UINT_MAX)
+		err |= __remap_log_write(sbi, last_blk);
+	mutex_unlock(&sbi->remap_log_lock);
+
+	/* the blocks have moved already, the dnodes must follow */
+	if (err)
+		f2fs_msg(sbi->sb, KERN_WARNING,
+			"failed to log completed remaps, run fsck after a crash");
+}
+
+static void __apply_remap_entry(struct f2fs_sb_info *sbi,
+				struct remap_batch *rb, struct remap_entry *re)
+{
+	struct inode *inode = re->inode;
+	struct dnode_of_data dn;
+	bool moved = false;
+
+	if (re->err)
+		goto out;
+
+	set_new_dnode(&dn, inode, NULL, NULL, 0);
+	if (f2fs_get_dnode_of_data(&dn, re->index, LOOKUP_NODE))
+		goto out;
+
+	/* the block was rewritten or truncated while the device moved it */
+	if (dn.data_blkaddr == re->old_blkaddr) {
+		f2fs_wait_on_page_writeback(dn.node_page, NODE, true);
+		f2fs_update_data_blkaddr(&dn, re->new_blkaddr);
+		f2fs_invalidate_blocks(sbi, re->old_blkaddr);
+		set_inode_flag(inode, FI_APPEND_WRITE);
+		if (re->index == 0)
+			set_inode_flag(inode, FI_FIRST_BLOCK_WRITTEN);
+		moved = true;
+		if (rb->op == REMAP_OP_COPY) {
+			stat_inc_gc_move(sbi, GC_MOVE_DCOPY);
+			f2fs_trace_gc(sbi, inode->i_ino, re->index,
+				re->old_blkaddr, re->new_blkaddr,
+				GC_TRACE_DEVICE_COPY, rb->issue_time);
+		} else {
+			stat_inc_gc_move(sbi, GC_MOVE_REMAP);
+			f2fs_trace_gc(sbi, inode->i_ino, re->index,
+				re->old_blkaddr, re->new_blkaddr,
+				GC_TRACE_REMAP, rb->issue_time);
+		}
+	}
+	f2fs_put_dnode(&dn);
+out:
+	if (!moved)
+		f2fs_invalidate_blocks(sbi, re->new_blkaddr);
+	atomic_dec(&F2FS_I(inode)->i_remap_pending);
+}
+
+/* a device which doesn't know the command won't learn it later */
+static bool __remap_op_rejected(int err)
+{
+	if (err <= 0)
+		return false;
+	return (err & 0x7ff) == NVME_SC_INVALID_OPCODE ||
+			(err & 0x7ff) == NVME_SC_INVALID_FIELD;
+}
+
+/*
+ * Point the dnodes of a completed batch at the new addresses.  Only now the
+ * old blocks get invalidated, so the victim segment can't be reused before
+ * the device has moved all of its data away.  Blocks the device failed to
+ * move are copied by the host, and a command the device rejects is not
+ * used for later batches.
+ */
+static void __apply_remap_batch(struct f2fs_sb_info *sbi,
+				struct remap_batch *rb)
+{
+	struct remap_ctx *rc = rb->rc;
+	unsigned int i, segno, nr_failed = 0;
+	bool rejected = false, sec_freed = false;
+
+	/* pairs with atomic_dec_and_test() in f2fs_remap_end_io() */
+	smp_rmb();
+
+	/* copies leave the old blocks alone and need no log */
+	if (rb->op == REMAP_OP_REMAP)
+		__remap_log_done(sbi, rb->entries, rb->nr_entries);
+
+	f2fs_lock_op(sbi);
+	for (i = 0; i < rb->nr_entries; i++) {
+		if (rb->entries[i].err) {
+			nr_failed++;
+			if (__remap_op_rejected(rb->entries[i].err))
+				rejected = true;
+		}
+		__apply_remap_entry(sbi, rb, &rb->entries[i]);
+	}
+	f2fs_unlock_op(sbi);
+
+	for (i = 0; i < rb->nr_entries; i++)
+		f2fs_put_page(rb->entries[i].page, 1);
+	up_read(&sbi->remap_rwsem);
+
+	if (nr_failed)
+		f2fs_msg(sbi->sb, KERN_WARNING,
+			"%s of %u blocks in section %u failed, copying them",
+			rb->op == REMAP_OP_COPY ? "device copy" : "remap",
+			nr_failed, GET_SEC_FROM_SEG(sbi, rb->segno));
+	if (rejected && test_and_clear_bit(rb->op, &sbi->remap_caps))
+		f2fs_msg(sbi->sb, KERN_WARNING,
+			"device rejected %s, not using it any more",
+			rb->op == REMAP_OP_COPY ? "copy" : "remap");
+
+	/* takes page and inode locks, so not under f2fs_lock_op() */
+	for (i = 0; nr_failed && i < rb->nr_entries; i++)
+		if (rb->entries[i].err)
+			f2fs_gc_move_fallback(rb->entries[i].inode,
+					rb->entries[i].index,
+					rb->entries[i].old_blkaddr);
+
+	/*
+	 * Entries are sorted by old address, so each victim segment of the
+	 * batch shows up as one run.  The section GC is cleaning right now is
+	 * accounted by do_garbage_collect() itself.
+	 */
+	for (i = 0; i < rb->nr_entries; i++) {
+		segno = GET_SEGNO(sbi, rb->entries[i].old_blkaddr);
+		if (i && segno == GET_SEGNO(sbi, rb->entries[i - 1].old_blkaddr))
+			continue;
+		if (GET_SEC_FROM_SEG(sbi, segno) == rc->cur_secno)
+			continue;
+		if (get_valid_blocks(sbi, segno, false))
+			continue;
+		rc->seg_freed++;
+		if (!sec_freed && get_valid_blocks(sbi, segno, true) == 0)
+			sec_freed = true;
+	}
+	if (sec_freed)
+		rc->sec_freed++;
+
+	rb->nr_entries = 0;
+	rb->segno = NULL_SEGNO;
+	rb->state = REMAP_BATCH_FREE;
+}
+
+static bool __remap_batch_done(struct remap_batch *rb)
+{
+	return rb->state == REMAP_BATCH_INFLIGHT &&
+				!atomic_read(&rb->nr_inflight);
+}
+
+static bool __remap_has_done(struct remap_ctx *rc)
+{
+	int i;
+
+	for (i = 0; i < REMAP_MAX_BATCHES; i++)
+		if (__remap_batch_done(&rc->batches[i]))
+			return true;
+	return false;
+}
+
+static bool __remap_all_done(struct remap_ctx *rc)
+{
+	int i;
+
+	for (i = 0; i < REMAP_MAX_BATCHES; i++)
+		if (rc->batches[i].state == REMAP_BATCH_INFLIGHT &&
+				atomic_read(&rc->batches[i].nr_inflight))
+			return false;
+	return true;
+}
+
+static void __reap_remap_batches(struct f2fs_sb_info *sbi,
+				struct remap_ctx *rc)
+{
+	int i;
+
+	for (i = 0; i < REMAP_MAX_BATCHES; i++)
+		if (__remap_batch_done(&rc->batches[i]))
+			__apply_remap_batch(sbi, &rc->batches[i]);
+}
+
+/*
+ * Get an empty batch for the victim section starting at @segno.  Batches
+ * whose commands completed in the meantime are applied first; if all of them
+ * are still in flight, wait for the device.  Returns NULL once the device has
+ * rejected every way of relocating blocks, so that GC copies them itself.
+ *
+ * Each batch holds remap_rwsem for read until it is applied, which keeps
+ * checkpoints out: the reservations, the intent log and the dnode updates
+ * fall into one checkpoint interval, and no checkpoint blocks operations
+ * while GC holds pages locked.  A checkpoint waiting for the lock keeps new
+ * readers out, so the batches of this GC are applied before waiting for it.
+ */
+struct remap_batch *f2fs_remap_get_batch(struct f2fs_sb_info *sbi,
+				struct remap_ctx *rc, unsigned int segno)
+{
+	struct remap_batch *rb;
+	int i, op;
+
+	if (!down_read_trylock(&sbi->remap_rwsem)) {
+		f2fs_remap_wait(sbi, rc);
+		down_read(&sbi->remap_rwsem);
+	}
+
+	for (;;) {
+		__reap_remap_batches(sbi, rc);
+
+		op = __remap_pick_op(sbi);
+		if (op < 0) {
+			up_read(&sbi->remap_rwsem);
+			return NULL;
+		}
+
+		for (i = 0; i < REMAP_MAX_BATCHES; i++) {
+			rb = &rc->batches[i];
+			if (rb->state != REMAP_BATCH_FREE)
+				continue;
+			rb->state = REMAP_BATCH_FILLING;
+			rb->op = op;
+			rb->segno = segno;
+			return rb;
+		}
+
+		wait_event(rc->wait, __remap_has_done(rc));
+	}
+}
+
+/* send the remap requests of @rb to the device without waiting for them */
+void f2fs_remap_submit(struct f2fs_sb_info *sbi, struct remap_batch *rb)
+{
+	unsigned int i;
+	int err;
+
+	if (!rb->nr_entries) {
+		rb->segno = NULL_SEGNO;
+		rb->state = REMAP_BATCH_FREE;
+		up_read(&sbi->remap_rwsem);
+		return;
+	}
+
+	sort(rb->entries, rb->nr_entries, sizeof(struct remap_entry),
+					remap_entry_cmp, NULL);
+
+	rb->state = REMAP_BATCH_INFLIGHT;
+	rb->issue_time = f2fs_gc_trace_clock();
+	if (rb->op == REMAP_OP_COPY) {
+		__issue_copy_batch(sbi, rb);
+		return;
+	}
+
+	/* without a log entry, the host copies the blocks when applying */
+	err = __remap_log_intent(sbi, rb->entries, rb->nr_entries);
+	if (err) {
+		for (i = 0; i < rb->nr_entries; i++)
+			rb->entries[i].err = err;
+		return;
+	}
+	__issue_remap_batch(sbi, rb);
+}
+
+/* wait for all remap commands in flight and apply their results */
+void f2fs_remap_wait(struct f2fs_sb_info *sbi, struct remap_ctx *rc)
+{
+	wait_event(rc->wait, __remap_all_done(rc));
+	__reap_remap_batches(sbi, rc);
+}
+
+/*
+ * Victim selection must not pick a section again while the device is still
+ * moving blocks out of it; those blocks look valid until their batch is
+ * applied.
+ */
+bool f2fs_remap_sec_busy(struct f2fs_sb_info *sbi, unsigned int secno)
+{
+	struct remap_ctx *rc = sbi->remap_ctx;
+	int i;
+
+	if (!rc)
+		return false;
+
+	for (i = 0; i < REMAP_MAX_BATCHES; i++)
+		if (rc->batches[i].state == REMAP_BATCH_INFLIGHT &&
+			GET_SEC_FROM_SEG(sbi, rc->batches[i].segno) == secno)
+			return true;
+	return false;
+}
+
+/*
+ * Replay one logged remap.  Returns 1 if its dnode was pointed at the new
+ * address, -1 if the dnode still points at the old address but the remap
+ * can't be trusted to have happened, or 0 if there is nothing to do.
+ */
+static int __remap_replay_entry(struct f2fs_sb_info *sbi,
+				struct f2fs_remap_log_entry *le)
+{
+	block_t old_blkaddr = le32_to_cpu(le->old_blkaddr);
+	block_t new_blkaddr = le32_to_cpu(le->new_blkaddr);
+	nid_t nid = le32_to_cpu(le->nid);
+	unsigned int ofs_in_node = le16_to_cpu(le->ofs_in_node);
+	struct dnode_of_data dn;
+	struct node_info ni;
+	struct inode *inode;
+	struct page *page;
+	block_t blkaddr;
+	nid_t ino;
+	int ret = 0;
+
+	if (ofs_in_node >= ADDRS_PER_BLOCK)
+		return 0;
+
+	page = f2fs_get_node_page(sbi, nid);
+	if (IS_ERR(page))
+		return 0;
+	ino = ino_of_node(page);
+	blkaddr = datablock_addr(NULL, page, ofs_in_node);
+	f2fs_put_page(page, 1);
+
+	/* rewritten or truncated later, or applied before the crash */
+	if (blkaddr != old_blkaddr)
+		return 0;
+	if (!(le16_to_cpu(le->flags) & REMAP_LOG_DONE))
+		return -1;
+
+	/* f2fs_iget() may need the node page, so it is not held here */
+	inode = f2fs_iget(sbi->sb, ino);
+	if (IS_ERR(inode))
+		return -1;
+
+	page = f2fs_get_node_page(sbi, nid);
+	if (IS_ERR(page)) {
+		iput(inode);
+		return -1;
+	}
+
+	set_new_dnode(&dn, inode, IS_INODE(page) ? page : NULL, page, nid);
+	dn.ofs_in_node = ofs_in_node;
+	dn.data_blkaddr = datablock_addr(inode, page, ofs_in_node);
+	if (dn.data_blkaddr == old_blkaddr) {
+		ret = -1;
+		if (!f2fs_get_node_info(sbi, nid, &ni)) {
+			f2fs_replace_block(sbi, &dn, old_blkaddr, new_blkaddr,
+						ni.version, false, false);
+			ret = 1;
+		}
+	}
+	f2fs_put_dnode(&dn);
+	iput(inode);
+	return ret;
+}
+
+/*
+ * Walk the remap intent log of the checkpoint the volume was mounted from,
+ * once roll-forward has brought the dnodes up to date.  A remap the device
+ * completed, but whose dnode update did not reach the disk, is applied
+ * again.  A remap which was only logged may have reached the device or
+ * not, which can't be told apart here, so fsck is asked for if its dnode
+ * still points at the old address.
+ *
+ * The log sits in the checkpoint pack the next checkpoint overwrites, so
+ * this runs before any checkpoint is written.  Returns true if a log was
+ * found, which the caller retires with a new checkpoint, so that none of
+ * it is ever replayed twice.
+ */
+bool f2fs_remap_replay(struct f2fs_sb_info *sbi)
+{
+	unsigned int blk, i, nr, nr_found = 0;
+	unsigned int nr_replayed = 0, nr_unknown = 0;
+
+	if (!sbi->remap_log)
+		return false;
+
+	/* a checkpoint retired the log already */
+	if (sbi->remap_log_ver != cur_cp_version(F2FS_CKPT(sbi)))
+		return false;
+
+	for (blk = 0; blk < REMAP_LOG_BLOCKS; blk++) {
+		struct f2fs_remap_log_block *lb = __remap_log_block(sbi, blk);
+		__u32 crc;
+
+		if (__remap_log_io(sbi, REQ_OP_READ,
+				REQ_SYNC | REQ_META | REQ_PRIO, blk))
+			break;
+		if (le32_to_cpu(lb->magic) != F2FS_REMAP_LOG_MAGIC ||
+				le64_to_cpu(lb->cp_ver) != sbi->remap_log_ver)
+			break;
+		crc = le32_to_cpu(lb->crc);
+		lb->crc = 0;
+		if (!f2fs_crc_valid(sbi, crc, lb, F2FS_BLKSIZE))
+			break;
+		nr = le32_to_cpu(lb->nr_entries);
+		if (nr > REMAP_LOG_ENTRIES)
+			break;
+
+		for (i = 0; i < nr; i++) {
+			int ret = __remap_replay_entry(sbi, &lb->entries[i]);
+
+			if (ret > 0)
+				nr_replayed++;
+			else if (ret < 0)
+				nr_unknown++;
+		}
+		nr_found += nr;
+		if (nr < REMAP_LOG_ENTRIES)
+			break;
+	}
+	sbi->remap_log_pos = 0;
+
+	if (!nr_found)
+		return false;
+
+	f2fs_msg(sbi->sb, KERN_NOTICE,
+		"remap log: %u entries, %u replayed, %u unknown",
+		nr_found, nr_replayed, nr_unknown);
+	if (nr_unknown)
+		set_sbi_flag(sbi, SBI_NEED_FSCK);
+	return true;
+}
+
+/* replay the remap log, unless roll-forward recovery did already */
+int f2fs_remap_recover(struct f2fs_sb_info *sbi)
+{
+	struct cp_control cpc = {
+		.reason = CP_RECOVERY,
+	};
+
+	if (!f2fs_remap_replay(sbi))
+		return 0;
+	return f2fs_write_checkpoint(sbi, &cpc);
+}
@@ -0,0 +1,144 @@
+/*
+ * fs/f2fs/remap.h
+ *
+ * Device assisted relocation of data blocks for garbage collection
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/nvme_ioctl.h>
+
+/* vendor specific NVMe I/O commands understood by remap-capable SSDs */
+/* NVME_CMD_REMAP, cdw10/11: source, cdw12/13: destination, cdw14: len */
+#define NVME_CMD_REMAP		0x93
+#define NVME_CMD_REMAP_LIST	0x95	/* cdw10: nr_ranges - 1, data: ranges */
+/* NVMe Simple Copy, cdw10/11: destination, cdw12: nr_ranges - 1 */
+#define NVME_CMD_COPY		0x19
+
+/* one source/destination run in a NVME_CMD_REMAP_LIST payload */
+struct nvme_remap_range {
+	__le64 src_lba;
+	__le64 dst_lba;
+	__le32 len;
+	__le32 rsvd;
+} __packed;
+
+#define REMAP_RANGES_PER_CMD	(PAGE_SIZE / sizeof(struct nvme_remap_range))
+
+/* source range descriptor, format 0, of a NVME_CMD_COPY payload */
+struct nvme_copy_range {
+	__le64 rsvd0;
+	__le64 slba;
+	__le16 nlb;		/* 0's based */
+	__le16 rsvd18;
+	__le32 rsvd20;
+	__le32 eilbrt;
+	__le16 elbat;
+	__le16 elbatm;
+} __packed;
+
+#define COPY_RANGES_PER_CMD	(PAGE_SIZE / sizeof(struct nvme_copy_range))
+
+/* ways of the device to relocate blocks, bits of sbi->remap_caps */
+enum {
+	REMAP_OP_REMAP,		/* NVME_CMD_REMAP(_LIST), no data is moved */
+	REMAP_OP_COPY,		/* NVME_CMD_COPY */
+	NR_REMAP_OPS
+};
+
+/* translate a f2fs block address into a LBA of the remap namespace */
+static inline u64 remap_lba(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	return sbi->remap_start_lba + ((u64)blkaddr << sbi->remap_lba_shift);
+}
+
+/* remap batches which may be in flight at once */
+#define REMAP_MAX_BATCHES	4
+
+/* a data block waiting for the device to move it from old to new address */
+struct remap_entry {
+	struct inode *inode;	/* owner, pinned by gc_inode_list */
+	pgoff_t index;		/* page index in owner */
+	struct page *page;	/* held locked until the batch is applied */
+	block_t old_blkaddr;	/* address in victim segment */
+	block_t new_blkaddr;	/* address reserved in cold data log */
+	nid_t nid;		/* dnode holding the address */
+	unsigned int ofs_in_node;
+	unsigned int log_pos;	/* index in the remap intent log */
+	int err;		/* device status of the covering command */
+};
+
+enum {
+	REMAP_BATCH_FREE,	/* unused */
+	REMAP_BATCH_FILLING,	/* GC is queueing entries */
+	REMAP_BATCH_INFLIGHT,	/* commands issued, waiting for completion */
+};
+
+struct remap_batch;
+
+/* one command of a batch, covering entries [first, last) */
+struct remap_cmd {
+	struct remap_batch *rb;
+	unsigned int first;
+	unsigned int last;
+};
+
+/* remap requests of one victim section, which may need several batches */
+struct remap_batch {
+	struct remap_ctx *rc;
+	unsigned int segno;		/* first segment of victim section */
+	int state;			/* REMAP_BATCH_* */
+	int op;				/* REMAP_OP_* */
+	struct remap_entry *entries;
+	unsigned int nr_entries;
+	unsigned int max_entries;
+	union {				/* payload of all commands */
+		struct nvme_remap_range *ranges;
+		struct nvme_copy_range *copy_ranges;
+	};
+	struct remap_cmd *cmds;
+	atomic_t nr_inflight;		/* commands not completed yet */
+	u64 issue_time;			/* for the GC trace */
+};
+
+/* remap batches of one f2fs_gc() call */
+struct remap_ctx {
+	struct remap_batch batches[REMAP_MAX_BATCHES];
+	wait_queue_head_t wait;		/* woken when a batch completes */
+	unsigned int seg_freed;		/* segments freed by applied batches */
+	unsigned int sec_freed;		/* sections freed by applied batches */
+	unsigned int cur_secno;		/* section being cleaned, not counted */
+};
+
+/*
+ * On-disk remap intent log.  A remap changes the device mapping of a block
+ * before the dnode pointing at it is checkpointed, so each remap is logged
+ * in the checkpoint pack which the next checkpoint will overwrite, before
+ * the device sees it, and marked done once the device has completed it.
+ * Blocks are filled in order; the log ends at the first block which is not
+ * full, fails its crc or belongs to another checkpoint.
+ */
+#define F2FS_REMAP_LOG_MAGIC	0x4c4d5246	/* "FRML" */
+
+struct f2fs_remap_log_entry {
+	__le32 old_blkaddr;
+	__le32 new_blkaddr;
+	__le32 nid;
+	__le16 ofs_in_node;
+	__le16 flags;			/* REMAP_LOG_* */
+} __packed;
+
+#define REMAP_LOG_DONE		0x0001	/* the device completed the remap */
+
+#define REMAP_LOG_ENTRIES	((F2FS_BLKSIZE - 24) /			\
+				sizeof(struct f2fs_remap_log_entry))
+
+struct f2fs_remap_log_block {
+	__le32 magic;
+	__le32 crc;			/* of the block with crc set to 0 */
+	__le64 cp_ver;			/* checkpoint the remaps follow */
+	__le32 nr_entries;
+	__le32 rsvd;
+	struct f2fs_remap_log_entry entries[REMAP_LOG_ENTRIES];
+} __packed;
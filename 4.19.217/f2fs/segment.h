@@ -145,12 +145,14 @@ enum {
  * In the victim_sel_policy->gc_mode, there are two gc, aka cleaning, modes.
  * GC_CB is based on cost-benefit algorithm.
  * GC_GREEDY is based on greedy algorithm.
+ * GC_REMAP weighs blocks the device can remap against blocks to be copied.
  */
 enum {
 	GC_CB = 0,
 	GC_GREEDY,
 	ALLOC_NEXT,
 	FLUSH_DEVICE,
+	GC_REMAP,
 	MAX_GC_POLICY,
 };
 
@@ -168,7 +170,7 @@ enum {
 /* for a function parameter to select a victim segment */
 struct victim_sel_policy {
 	int alloc_mode;			/* LFS or SSR */
-	int gc_mode;			/* GC_CB or GC_GREEDY */
+	int gc_mode;			/* GC_CB, GC_GREEDY or GC_REMAP */
 	unsigned long *dirty_segmap;	/* dirty segment bitmap */
 	unsigned int max_search;	/* maximum # of segments to search */
 	unsigned int offset;		/* last scanned bitmap offset */
@@ -193,6 +195,8 @@ struct seg_entry {
 	unsigned char *ckpt_valid_map;	/* validity bitmap of blocks last cp */
 	unsigned char *discard_map;
 	unsigned long long mtime;	/* modification time of the segment */
+	unsigned char remap_copy;	/* sampled share GC_REMAP copies, of 255 */
+	bool remap_fresh;		/* no block invalidated since sampling */
 };
 
 struct sec_entry {
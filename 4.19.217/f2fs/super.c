@@ -33,6 +33,7 @@
 #include "xattr.h"
 #include "gc.h"
 #include "trace.h"
+#include "gctrace.h"
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/f2fs.h>
@@ -855,6 +856,7 @@ static struct inode *f2fs_alloc_inode(struct super_block *sb)
 	mutex_init(&fi->inmem_lock);
 	init_rwsem(&fi->i_gc_rwsem[READ]);
 	init_rwsem(&fi->i_gc_rwsem[WRITE]);
+	atomic_set(&fi->i_remap_pending, 0);
 	init_rwsem(&fi->i_mmap_sem);
 	init_rwsem(&fi->i_xattr_sem);
 
@@ -1065,6 +1067,7 @@ static void f2fs_put_super(struct super_block *sb)
 	f2fs_destroy_stats(sbi);
 
 	/* destroy f2fs internal modules */
+	f2fs_destroy_gc_manager(sbi);
 	f2fs_destroy_node_manager(sbi);
 	f2fs_destroy_segment_manager(sbi);
 
@@ -1075,6 +1078,7 @@ static void f2fs_put_super(struct super_block *sb)
 		crypto_free_shash(sbi->s_chksum_driver);
 	kfree(sbi->raw_super);
 
+	f2fs_remap_destroy_dev(sbi);
 	destroy_device_list(sbi);
 	mempool_destroy(sbi->write_io_dummy);
 #ifdef CONFIG_QUOTA
@@ -2952,6 +2956,7 @@ try_onemore:
 	}
 
 	init_rwsem(&sbi->cp_rwsem);
+	init_rwsem(&sbi->remap_rwsem);
 	init_waitqueue_head(&sbi->cp_wait);
 	init_sb_info(sbi);
 
@@ -3038,11 +3043,15 @@ try_onemore:
 		sbi->kbytes_written =
 			le64_to_cpu(seg_i->journal->info.kbytes_written);
 
-	f2fs_build_gc_manager(sbi);
+	err = f2fs_build_gc_manager(sbi);
+	if (err)
+		goto free_nm;
+
+	f2fs_remap_init_dev(sbi);
 
 	err = f2fs_build_stats(sbi);
 	if (err)
-		goto free_nm;
+		goto free_gc;
 
 	/* get an inode for node space */
 	sbi->node_inode = f2fs_iget(sb, F2FS_NODE_INO(sbi));
@@ -3131,6 +3140,13 @@ skip_recovery:
 	/* f2fs_recover_fsync_data() cleared this already */
 	clear_sbi_flag(sbi, SBI_POR_DOING);
 
+	/* remaps the device made after the last checkpoint */
+	if (!f2fs_readonly(sb)) {
+		err = f2fs_remap_recover(sbi);
+		if (err)
+			goto free_meta;
+	}
+
 	/*
 	 * If filesystem is not mounted as read-only then
 	 * do start the gc_thread.
@@ -3188,11 +3204,14 @@ free_node_inode:
 	sbi->node_inode = NULL;
 free_stats:
 	f2fs_destroy_stats(sbi);
+free_gc:
+	f2fs_destroy_gc_manager(sbi);
 free_nm:
 	f2fs_destroy_node_manager(sbi);
 free_sm:
 	f2fs_destroy_segment_manager(sbi);
 free_devices:
+	f2fs_remap_destroy_dev(sbi);
 	destroy_device_list(sbi);
 	kfree(sbi->ckpt);
 free_meta_inode:
@@ -3297,6 +3316,7 @@ static int __init init_f2fs_fs(void)
 	}
 
 	f2fs_build_trace_ios();
+	f2fs_build_gc_trace();
 
 	err = init_inodecache();
 	if (err)
@@ -3349,6 +3369,7 @@ free_node_manager_caches:
 free_inodecache:
 	destroy_inodecache();
 fail:
+	f2fs_destroy_gc_trace();
 	return err;
 }
 
@@ -3364,6 +3385,7 @@ static void __exit exit_f2fs_fs(void)
 	f2fs_destroy_segment_manager_caches();
 	f2fs_destroy_node_manager_caches();
 	destroy_inodecache();
+	f2fs_destroy_gc_trace();
 	f2fs_destroy_trace_ios();
 }
 
@@ -1102,7 +1102,7 @@ void write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 
 	if (!is_sbi_flag_set(sbi, SBI_IS_DIRTY) &&
 		(cpc->reason == CP_FASTBOOT || cpc->reason == CP_SYNC ||
-		(cpc->reason == CP_DISCARD && !sbi->discard_blks)))
+		(cpc->reason == CP_DISCARD && !discard_block_count(sbi))))
 		goto out;
 	if (unlikely(f2fs_cp_error(sbi)))
 		goto out;
@@ -1111,8 +1111,12 @@ void write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 
 	trace_f2fs_write_checkpoint(sbi->sb, cpc->reason, "start block_ops");
 
-	if (block_operations(sbi))
+	/* let GC finish the remap batches it holds pages of */
+	down_write(&sbi->remap_rwsem);
+	if (block_operations(sbi)) {
+		up_write(&sbi->remap_rwsem);
 		goto out;
+	}
 
 	trace_f2fs_write_checkpoint(sbi->sb, cpc->reason, "finish block_ops");
 
@@ -1136,6 +1140,7 @@ void write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	do_checkpoint(sbi, cpc);
 
 	unblock_operations(sbi);
+	up_write(&sbi->remap_rwsem);
 	stat_inc_cp_count(sbi->stat_info);
 
 	if (cpc->reason == CP_RECOVERY)
@@ -1163,8 +1168,8 @@ void init_ino_entry_info(struct f2fs_sb_info *sbi)
 	}
 
 	sbi->max_orphans = (sbi->blocks_per_seg - F2FS_CP_PACKS -
-			NR_CURSEG_TYPE - __cp_payload(sbi)) *
-				F2FS_ORPHANS_PER_BLOCK;
+			NR_CURSEG_TYPE - __cp_payload(sbi) -
+			REMAP_LOG_BLOCKS) * F2FS_ORPHANS_PER_BLOCK;
 }
 
 int __init create_checkpoint_caches(void)
@@ -112,7 +112,7 @@ static void __submit_merged_bio(struct f2fs_bio_info *io)
 	else
 		trace_f2fs_submit_write_bio(io->sbi->sb, fio, io->bio);
 
-	submit_bio(fio->rw, io->bio);
+	submit_bio(f2fs_io_rw(fio), io->bio);
 	io->bio = NULL;
 }
 
@@ -158,7 +158,7 @@ int f2fs_submit_page_bio(struct f2fs_io_info *fio)
 		return -EFAULT;
 	}
 
-	submit_bio(fio->rw, bio);
+	submit_bio(f2fs_io_rw(fio), bio);
 	return 0;
 }
 
@@ -180,7 +180,8 @@ void f2fs_submit_page_mbio(struct f2fs_io_info *fio)
 		inc_page_count(sbi, F2FS_WRITEBACK);
 
 	if (io->bio && (io->last_block_in_bio != fio->blk_addr - 1 ||
-						io->fio.rw != fio->rw))
+						io->fio.rw != fio->rw ||
+						io->fio.ctx != fio->ctx))
 		__submit_merged_bio(io);
 alloc_new:
 	if (io->bio == NULL) {
@@ -309,8 +310,11 @@ got_it:
 
 	return page;
 }
+/*
+ * @ctx is the F2FS_IO_* context of the read, e.g. GC moving the block.
+ */
 struct page *get_read_data_page(struct inode *inode, pgoff_t index,
-						int rw, bool for_write)
+				int rw, bool for_write, unsigned int ctx)
 {
 	struct address_space *mapping = inode->i_mapping;
 	struct dnode_of_data dn;
@@ -321,6 +325,7 @@ struct page *get_read_data_page(struct inode *inode, pgoff_t index,
 		.sbi = F2FS_I_SB(inode),
 		.type = DATA,
 		.rw = rw,
+		.ctx = ctx,
 		.encrypted_page = NULL,
 	};
 
@@ -374,77 +379,6 @@ got_it:
 	
 	return page;
 
-put_err:
-	f2fs_put_page(page, 1);
-	return ERR_PTR(err);
-}
-struct page *get_read_data_page_gc(struct inode *inode, pgoff_t index,
-						int rw, bool for_write, int off) // The last one means the original or the new block_t.
-{	// need to know wheather the page is in cache.
-	struct address_space *mapping = inode->i_mapping;
-	struct dnode_of_data dn;
-	struct page *page;
-	struct extent_info ei;
-	int err;
-	struct f2fs_io_info fio = {
-		.sbi = F2FS_I_SB(inode),
-		.type = DATA,
-		.rw = rw,
-		.encrypted_page = NULL,
-	};
-
-	if (f2fs_encrypted_inode(inode) && S_ISREG(inode->i_mode))
-		return read_mapping_page(mapping, index, NULL); // by index and mapping, read in the radix tree.
-
-	page = f2fs_grab_cache_page(mapping, index, for_write);
-	if (!page)
-		return ERR_PTR(-ENOMEM);
-
-	if (f2fs_lookup_extent_cache(inode, index, &ei)) { // if the page in the extent cache.
-		dn.data_blkaddr = ei.blk + index - ei.fofs;
-		goto got_it;
-	}
-
-	set_new_dnode(&dn, inode, NULL, NULL, 0);
-	err = get_dnode_of_data(&dn, index, LOOKUP_NODE); // get the dnode of the original block.
-	if (err)
-		goto put_err;
-	f2fs_put_dnode(&dn);
-
-	if (unlikely(dn.data_blkaddr == NULL_ADDR)) {
-		err = -ENOENT;
-		goto put_err;
-	}
-got_it:
-	if (PageUptodate(page)) { // 查看页是不是最新的，比如预读机制就可能不是最新的
-		unlock_page(page);
-//		printk(KERN_EMERG "4:%d\n",off); // block_t is type defined by u32.
-		return page;
-	}
-
-	/*
-	 * A new dentry page is allocated but not able to be written, since its
-	 * new inode page couldn't be allocated due to -ENOSPC.
-	 * In such the case, its blkaddr can be remained as NEW_ADDR.
-	 * see, f2fs_add_link -> get_new_data_page -> init_inode_metadata.
-	 */
-	if (dn.data_blkaddr == NEW_ADDR) { // Truncated.
-		printk(KERN_EMERG "%d NEW_ADDR\n",off); 
-		zero_user_segment(page, 0, PAGE_CACHE_SIZE);
-		SetPageUptodate(page);
-		unlock_page(page);
-		return page;
-	}
-
-	fio.blk_addr = dn.data_blkaddr;
-	fio.page = page;
-	err = f2fs_submit_page_bio(&fio); // What happend when submit page bio, when it return, will the page be filled with data?
-	if (err)
-		goto put_err;
-	// There will be, but don't know wheather is for GC.
-//	printk(KERN_EMERG "0:%d\n",off); // block_t is type defined by u32.
-	return page;
-
 put_err:
 	f2fs_put_page(page, 1);
 	return ERR_PTR(err);
@@ -459,7 +393,7 @@ struct page *find_data_page(struct inode *inode, pgoff_t index)
 		return page;
 	f2fs_put_page(page, 0);
 
-	page = get_read_data_page(inode, index, READ_SYNC, false);
+	page = get_read_data_page(inode, index, READ_SYNC, false, 0);
 	if (IS_ERR(page))
 		return page;
 
@@ -480,35 +414,12 @@ struct page *find_data_page(struct inode *inode, pgoff_t index)
  * whether this page exists or not.
  */
 struct page *get_lock_data_page(struct inode *inode, pgoff_t index,
-							bool for_write)
+					bool for_write, unsigned int ctx)
 {
 	struct address_space *mapping = inode->i_mapping;
 	struct page *page;
 repeat:
-	page = get_read_data_page(inode, index, READ_SYNC, for_write,0);
-	if (IS_ERR(page))
-		return page;
-
-	/* wait for read completion */
-	lock_page(page);
-	if (unlikely(!PageUptodate(page))) {
-		f2fs_put_page(page, 1);
-		return ERR_PTR(-EIO);
-	}
-	if (unlikely(page->mapping != mapping)) {
-		f2fs_put_page(page, 1);
-		goto repeat;
-	}
-	return page;
-}
-struct page *get_lock_data_page_gc(struct inode *inode, pgoff_t index,
-							bool for_write)
-{
-	struct address_space *mapping = inode->i_mapping;
-	struct page *page;
-repeat:
-	// page = get_read_data_page(inode, index, READ_SYNC, for_write,1);
-	page = get_read_data_page(inode, index, READ_SYNC, for_write);
+	page = get_read_data_page(inode, index, READ_SYNC, for_write, ctx);
 	if (IS_ERR(page))
 		return page;
 
@@ -569,7 +480,7 @@ repeat:
 	} else {
 		f2fs_put_page(page, 1);
 
-		page = get_read_data_page(inode, index, READ_SYNC, true);
+		page = get_read_data_page(inode, index, READ_SYNC, true, 0);
 		if (IS_ERR(page))
 			goto repeat;
 
@@ -1169,47 +1080,6 @@ static int f2fs_read_data_pages(struct file *file,
 
 	return f2fs_mpage_readpages(mapping, pages, NULL, nr_pages);
 }
-int do_remap_data_page(struct f2fs_io_info *fio) {
-	
-	struct page *page = fio->page;
-	struct inode *inode = page->mapping->host;
-	struct dnode_of_data dn;
-	int err = 0;
-
-	set_new_dnode(&dn, inode, NULL, NULL, 0);
-	err = get_dnode_of_data(&dn, page->index, LOOKUP_NODE);
-	if (err)
-		return err;
-
-	fio->blk_addr = dn.data_blkaddr;
-
-	/* This page is already truncated */
-	if (fio->blk_addr == NULL_ADDR) {
-		ClearPageUptodate(page);
-		goto out_writepage;
-	}
-
-	if (f2fs_encrypted_inode(inode) && S_ISREG(inode->i_mode)) {
-		printk("erro:f2fs_encrypted_inode in do_remap_data_page.\n");
-	}
-
-	if (unlikely(fio->blk_addr != NEW_ADDR &&
-			!is_cold_data(page) &&
-			need_inplace_update(inode))) { // 就地更新判断
-			printk("erro: need inplace update.\n");
-	} else {
-		remap_data_page(&dn, fio); // remap data page, but do nothing.
-		set_data_blkaddr(&dn);  // write the node page of the remaped date page.
-		f2fs_update_extent_cache(&dn); // if the data page in the extent cache?
-		//trace_f2fs_do_write_data_page(page, OPU); don't wait for the page write back.
-		set_inode_flag(F2FS_I(inode), FI_APPEND_WRITE);
-		if (page->index == 0)
-			set_inode_flag(F2FS_I(inode), FI_FIRST_BLOCK_WRITTEN);
-	}
-out_writepage:
-	f2fs_put_dnode(&dn);
-	return err;
-}
 int do_write_data_page(struct f2fs_io_info *fio)
 {
 	struct page *page = fio->page;
@@ -1223,6 +1093,7 @@ int do_write_data_page(struct f2fs_io_info *fio)
 		return err;
 
 	fio->blk_addr = dn.data_blkaddr;
+	fio->old_blk_addr = dn.data_blkaddr;
 
 	/* This page is already truncated */
 	if (fio->blk_addr == NULL_ADDR) {
@@ -1230,63 +1101,10 @@ int do_write_data_page(struct f2fs_io_info *fio)
 		goto out_writepage;
 	}
 
-	if (f2fs_encrypted_inode(inode) && S_ISREG(inode->i_mode)) {
-
-		/* wait for GCed encrypted page writeback */
-		f2fs_wait_on_encrypted_page_writeback(F2FS_I_SB(inode),
-							fio->blk_addr);
-
-		fio->encrypted_page = f2fs_encrypt(inode, fio->page);
-		if (IS_ERR(fio->encrypted_page)) {
-			err = PTR_ERR(fio->encrypted_page);
-			goto out_writepage;
-		}
-	}
-
-	set_page_writeback(page);
-
-	/*
-	 * If current allocation needs SSR,
-	 * it had better in-place writes for updated data.
-	 */
-	if (unlikely(fio->blk_addr != NEW_ADDR &&
-			!is_cold_data(page) &&
-			need_inplace_update(inode))) { // 就地更新判断
-		rewrite_data_page(fio);
-		set_inode_flag(F2FS_I(inode), FI_UPDATE_WRITE);
-		trace_f2fs_do_write_data_page(page, IPU);
-	} else {
-		write_data_page(&dn, fio);
-		set_data_blkaddr(&dn);
-		f2fs_update_extent_cache(&dn);
-		trace_f2fs_do_write_data_page(page, OPU);
-		set_inode_flag(F2FS_I(inode), FI_APPEND_WRITE);
-		if (page->index == 0)
-			set_inode_flag(F2FS_I(inode), FI_FIRST_BLOCK_WRITTEN);
-	}
-out_writepage:
-	f2fs_put_dnode(&dn);
-	return err;
-}
-int do_write_data_page_gc(struct f2fs_io_info *fio)
-{
-	struct page *page = fio->page;
-	struct inode *inode = page->mapping->host;
-	struct dnode_of_data dn;
-	int err = 0;
-
-	set_new_dnode(&dn, inode, NULL, NULL, 0);
-	err = get_dnode_of_data(&dn, page->index, LOOKUP_NODE); // Why don't allocate a new dnode?
-	if (err)
-		return err;
-
-	fio->blk_addr = dn.data_blkaddr;
-	block_t ori_addr = dn.data_blkaddr;
-	/* This page is already truncated */
-	if (fio->blk_addr == NULL_ADDR) {
-		ClearPageUptodate(page);
-		goto out_writepage;
-	}
+	/* GC moves are not updates */
+	if (fio->blk_addr != NEW_ADDR && !(fio->ctx & F2FS_IO_GC) &&
+					!is_cold_data(page))
+		update_data_lifetime(inode);
 
 	if (f2fs_encrypted_inode(inode) && S_ISREG(inode->i_mode)) {
 
@@ -1306,14 +1124,15 @@ int do_write_data_page_gc(struct f2fs_io_info *fio)
 	/*
 	 * If current allocation needs SSR,
 	 * it had better in-place writes for updated data.
+	 * GC has to move the block out of its victim, though.
 	 */
 	if (unlikely(fio->blk_addr != NEW_ADDR &&
+			!(fio->ctx & F2FS_IO_GC) &&
 			!is_cold_data(page) &&
-			need_inplace_update(inode))) {
+			need_inplace_update(inode))) { // 就地更新判断
 		rewrite_data_page(fio);
 		set_inode_flag(F2FS_I(inode), FI_UPDATE_WRITE);
 		trace_f2fs_do_write_data_page(page, IPU);
-//		printk(KERN_EMERG "3:%x %x\n",ori_addr,dn.data_blkaddr); // inplace update.
 	} else {
 		write_data_page(&dn, fio);
 		set_data_blkaddr(&dn);
@@ -1322,15 +1141,13 @@ int do_write_data_page_gc(struct f2fs_io_info *fio)
 		set_inode_flag(F2FS_I(inode), FI_APPEND_WRITE);
 		if (page->index == 0)
 			set_inode_flag(F2FS_I(inode), FI_FIRST_BLOCK_WRITTEN);
-		int is_original = 0;
-//		printk(KERN_EMERG "3:%x %x\n",ori_addr,dn.data_blkaddr); // outplace update.
 	}
 out_writepage:
 	f2fs_put_dnode(&dn);
 	return err;
 }
-static int f2fs_write_data_page(struct page *page,
-					struct writeback_control *wbc)
+static int __f2fs_write_data_page(struct page *page,
+			struct writeback_control *wbc, bool balance)
 {
 	struct inode *inode = page->mapping->host;
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
@@ -1386,7 +1203,7 @@ write:
 	}
 
 	if (!wbc->for_reclaim)
-		need_balance_fs = true;
+		need_balance_fs = balance;
 	else if (has_not_enough_free_secs(sbi, 0))
 		goto redirty_out;
 
@@ -1418,6 +1235,155 @@ redirty_out:
 	return AOP_WRITEPAGE_ACTIVATE;
 }
 
+static int f2fs_write_data_page(struct page *page,
+					struct writeback_control *wbc)
+{
+	return __f2fs_write_data_page(page, wbc, true);
+}
+
+/* whether dirty pages of @inode may be written back in block runs */
+static bool f2fs_may_write_runs(struct inode *inode,
+					struct writeback_control *wbc)
+{
+	/* f2fs_write_data_page() redirties pages during roll-forward */
+	if (unlikely(is_sbi_flag_set(F2FS_I_SB(inode), SBI_POR_DOING)))
+		return false;
+	if (wbc->for_reclaim || !S_ISREG(inode->i_mode))
+		return false;
+	if (f2fs_has_inline_data(inode) || f2fs_encrypted_inode(inode))
+		return false;
+	if (f2fs_is_atomic_file(inode) || f2fs_is_volatile_file(inode))
+		return false;
+	return !f2fs_is_drop_cache(inode);
+}
+
+/*
+ * Write the leading pages of @pages, which are locked, consecutive and
+ * cleaned for I/O, with one dnode lookup and as few block allocations as
+ * the logs allow.  Pages needing the full f2fs_write_data_page() treatment,
+ * such as in-place updates, truncated or partial blocks and blocks of
+ * another dnode, end the run, and so does a page which is cold while the
+ * first one is not or vice versa, since the log and the in-place update
+ * decision of the whole run follow the first page.  Returns the pages
+ * written and unlocked.
+ */
+static unsigned int f2fs_write_data_run(struct page **pages, unsigned int nr,
+					struct writeback_control *wbc)
+{
+	struct inode *inode = pages[0]->mapping->host;
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	const pgoff_t end_index = ((unsigned long long) i_size_read(inode))
+							>> PAGE_CACHE_SHIFT;
+	struct f2fs_io_info fio = {
+		.sbi = sbi,
+		.type = DATA,
+		.rw = (wbc->sync_mode == WB_SYNC_ALL) ? WRITE_SYNC : WRITE,
+		.encrypted_page = NULL,
+	};
+	block_t blkaddrs[F2FS_WRITE_RUN_MAX];
+	struct dnode_of_data dn;
+	unsigned int i, j, ofs, len = 0;
+	bool cold, ipu;
+
+	if (unlikely(f2fs_cp_error(sbi)))
+		return 0;
+
+	/* f2fs_may_write_runs() keeps runs out of roll-forward recovery */
+	f2fs_bug_on(sbi, is_sbi_flag_set(sbi, SBI_POR_DOING));
+
+	f2fs_lock_op(sbi);
+	set_new_dnode(&dn, inode, NULL, NULL, 0);
+	if (get_dnode_of_data(&dn, pages[0]->index, LOOKUP_NODE))
+		goto unlock_out;
+
+	ofs = dn.ofs_in_node;
+	nr = min_t(unsigned int, nr,
+			ADDRS_PER_PAGE(dn.node_page, F2FS_I(inode)) - ofs);
+	cold = is_cold_data(pages[0]);
+	ipu = !cold && need_inplace_update(inode);
+
+	for (len = 0; len < nr; len++) {
+		struct page *page = pages[len];
+
+		if (page->index >= end_index)
+			break;
+		if (!!is_cold_data(page) != cold)
+			break;
+		blkaddrs[len] = datablock_addr(dn.node_page, ofs + len);
+		if (blkaddrs[len] == NULL_ADDR)
+			break;
+		if (ipu && blkaddrs[len] != NEW_ADDR)
+			break;
+	}
+	if (len < 2) {
+		len = 0;
+		goto put_out;
+	}
+
+	for (i = 0; i < len; i++) {
+		trace_f2fs_writepage(pages[i], DATA);
+		/* GC moves are not updates */
+		if (blkaddrs[i] != NEW_ADDR && !is_cold_data(pages[i]))
+			update_data_lifetime(inode);
+		set_page_writeback(pages[i]);
+	}
+
+	write_data_pages(&dn, &fio, pages, blkaddrs, len);
+
+	for (i = 0; i < len; i++) {
+		dn.ofs_in_node = ofs + i;
+		dn.data_blkaddr = blkaddrs[i];
+		set_data_blkaddr(&dn);
+		trace_f2fs_do_write_data_page(pages[i], OPU);
+	}
+
+	/* one extent per block run */
+	for (i = 0; i < len; i = j) {
+		for (j = i + 1; j < len; j++)
+			if (blkaddrs[j] != blkaddrs[j - 1] + 1)
+				break;
+		f2fs_update_extent_cache_range(&dn, pages[i]->index,
+							blkaddrs[i], j - i);
+	}
+
+	set_inode_flag(F2FS_I(inode), FI_APPEND_WRITE);
+	if (pages[0]->index == 0)
+		set_inode_flag(F2FS_I(inode), FI_FIRST_BLOCK_WRITTEN);
+put_out:
+	f2fs_put_dnode(&dn);
+unlock_out:
+	f2fs_unlock_op(sbi);
+
+	for (i = 0; i < len; i++) {
+		clear_cold_data(pages[i]);
+		inode_dec_dirty_pages(inode);
+		unlock_page(pages[i]);
+	}
+	return len;
+}
+
+/*
+ * Write back the pages gathered by f2fs_write_cache_pages().  Nothing may
+ * wait for GC before all of them are unlocked, since GC may need to lock
+ * any of them, so the pages left over by the run skip f2fs_balance_fs().
+ */
+static void f2fs_write_run(struct page **pages, unsigned int nr,
+					struct writeback_control *wbc)
+{
+	struct inode *inode = pages[0]->mapping->host;
+	unsigned int i = 0;
+
+	if (nr > 1)
+		i = f2fs_write_data_run(pages, nr, wbc);
+
+	for (; i < nr; i++)
+		if (__f2fs_write_data_page(pages[i], wbc, false) ==
+						AOP_WRITEPAGE_ACTIVATE)
+			unlock_page(pages[i]);
+
+	f2fs_balance_fs(F2FS_I_SB(inode));
+}
+
 static int __f2fs_writepage(struct page *page, struct writeback_control *wbc,
 			void *data)
 {
@@ -1448,6 +1414,9 @@ static int f2fs_write_cache_pages(struct address_space *mapping,
 	int range_whole = 0;
 	int tag;
 	int step = 0;
+	struct page *run[F2FS_WRITE_RUN_MAX];
+	unsigned int nr_run = 0;
+	bool use_runs = f2fs_may_write_runs(mapping->host, wbc);
 
 	pagevec_init(&pvec, 0);
 next:
@@ -1492,6 +1461,13 @@ retry:
 
 			done_index = page->index;
 
+			/* a run holds consecutive pages, locked until written */
+			if (nr_run && (page->index != run[nr_run - 1]->index + 1 ||
+					nr_run == F2FS_WRITE_RUN_MAX)) {
+				f2fs_write_run(run, nr_run, wbc);
+				nr_run = 0;
+			}
+
 			lock_page(page);
 
 			if (unlikely(page->mapping != mapping)) {
@@ -1519,15 +1495,19 @@ continue_unlock:
 			if (!clear_page_dirty_for_io(page))
 				goto continue_unlock;
 
-			ret = (*writepage)(page, wbc, data);
-			if (unlikely(ret)) {
-				if (ret == AOP_WRITEPAGE_ACTIVATE) {
-					unlock_page(page);
-					ret = 0;
-				} else {
-					done_index = page->index + 1;
-					done = 1;
-					break;
+			if (use_runs) {
+				run[nr_run++] = page;
+			} else {
+				ret = (*writepage)(page, wbc, data);
+				if (unlikely(ret)) {
+					if (ret == AOP_WRITEPAGE_ACTIVATE) {
+						unlock_page(page);
+						ret = 0;
+					} else {
+						done_index = page->index + 1;
+						done = 1;
+						break;
+					}
 				}
 			}
 
@@ -1537,6 +1517,10 @@ continue_unlock:
 				break;
 			}
 		}
+		if (nr_run) {
+			f2fs_write_run(run, nr_run, wbc);
+			nr_run = 0;
+		}
 		pagevec_release(&pvec);
 		cond_resched();
 	}
@@ -1804,6 +1788,11 @@ static ssize_t f2fs_direct_IO(struct kiocb *iocb, struct iov_iter *iter,
 	if (f2fs_encrypted_inode(inode) && S_ISREG(inode->i_mode))
 		return 0;
 
+	/* overwriting in place would race with a pending device remap */
+	if (iov_iter_rw(iter) == WRITE &&
+			atomic_read(&F2FS_I(inode)->i_remap_pending))
+		return 0;
+
 	err = check_direct_IO(inode, iter, offset);
 	if (err)
 		return err;
@@ -66,7 +66,7 @@ static void update_general_status(struct f2fs_sb_info *sbi)
 	si->nats = NM_I(sbi)->nat_cnt;
 	si->dirty_nats = NM_I(sbi)->dirty_nat_cnt;
 	si->sits = MAIN_SEGS(sbi);
-	si->dirty_sits = SIT_I(sbi)->dirty_sentries;
+	si->dirty_sits = atomic_read(&SIT_I(sbi)->dirty_sentries);
 	si->fnids = NM_I(sbi)->fcnt;
 	si->bg_gc = sbi->bg_gc;
 	si->util_free = (int)(free_user_blocks(sbi) >> sbi->log_blocks_per_seg)
@@ -90,6 +90,14 @@ static void update_general_status(struct f2fs_sb_info *sbi)
 	}
 
 	si->inplace_count = atomic_read(&sbi->inplace_count);
+
+	if (SM_I(sbi)->dcc_info) {
+		struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+		si->undiscard_blks = dcc->undiscard_blks;
+		si->nr_discard_cmd = atomic_read(&dcc->discard_cmd_cnt);
+		si->nr_issing_discard = atomic_read(&dcc->issing_discard);
+	}
 }
 
 /*
@@ -183,6 +191,13 @@ get_cache:
 	if (SM_I(sbi)->cmd_control_info)
 		si->cache_mem += sizeof(struct flush_cmd_control);
 
+	/* build discard thread */
+	if (SM_I(sbi)->dcc_info) {
+		si->cache_mem += sizeof(struct discard_cmd_control);
+		si->cache_mem += sizeof(struct discard_cmd) *
+			atomic_read(&SM_I(sbi)->dcc_info->discard_cmd_cnt);
+	}
+
 	/* free nids */
 	si->cache_mem += NM_I(sbi)->fcnt * sizeof(struct free_nid);
 	si->cache_mem += NM_I(sbi)->nat_cnt * sizeof(struct nat_entry);
@@ -273,15 +288,30 @@ static int stat_show(struct seq_file *s, void *v)
 		seq_printf(s, "GC calls: %d (BG: %d)\n",
 			   si->call_count, si->bg_gc);
 		seq_printf(s, "  - data segments : %d (%d)\n",
-				si->data_segs, si->bg_data_segs);
+				atomic_read(&si->data_segs),
+				atomic_read(&si->bg_data_segs));
 		seq_printf(s, "  - node segments : %d (%d)\n",
-				si->node_segs, si->bg_node_segs);
-		seq_printf(s, "Try to move %d blocks (BG: %d)\n", si->tot_blks,
-				si->bg_data_blks + si->bg_node_blks);
-		seq_printf(s, "  - data blocks : %d (%d)\n", si->data_blks,
-				si->bg_data_blks);
-		seq_printf(s, "  - node blocks : %d (%d)\n", si->node_blks,
-				si->bg_node_blks);
+				atomic_read(&si->node_segs),
+				atomic_read(&si->bg_node_segs));
+		seq_printf(s, "Try to move %d blocks (BG: %d)\n",
+				atomic_read(&si->tot_blks),
+				atomic_read(&si->bg_data_blks) +
+				atomic_read(&si->bg_node_blks));
+		seq_printf(s, "  - data blocks : %d (%d)\n",
+				atomic_read(&si->data_blks),
+				atomic_read(&si->bg_data_blks));
+		seq_printf(s, "  - node blocks : %d (%d)\n",
+				atomic_read(&si->node_blks),
+				atomic_read(&si->bg_node_blks));
+		seq_printf(s, "Moved data blocks: host %d, remap %d, "
+				"device copy %d, fallback %d\n",
+				atomic_read(&si->gc_move[GC_MOVE_HOST]),
+				atomic_read(&si->gc_move[GC_MOVE_REMAP]),
+				atomic_read(&si->gc_move[GC_MOVE_DCOPY]),
+				atomic_read(&si->gc_move[GC_MOVE_FALLBACK]));
+		seq_printf(s, "GC hints: sent %d, acked %d\n",
+				atomic_read(&si->gc_hints),
+				atomic_read(&si->gc_hints_acked));
 		seq_puts(s, "\nExtent Cache:\n");
 		seq_printf(s, "  - Hit Count: L1-1:%llu L1-2:%llu L2:%llu\n",
 				si->hit_largest, si->hit_cached,
@@ -321,6 +351,9 @@ static int stat_show(struct seq_file *s, void *v)
 			seq_putc(s, '-');
 		seq_puts(s, "]\n\n");
 		seq_printf(s, "IPU: %u blocks\n", si->inplace_count);
+		seq_printf(s, "Discard: %u blocks in %d cmds, %d issuing\n",
+			   si->undiscard_blks, si->nr_discard_cmd,
+			   si->nr_issing_discard);
 		seq_printf(s, "SSR: %u blocks in %u segments\n",
 			   si->block_count[SSR], si->segment_count[SSR]);
 		seq_printf(s, "LFS: %u blocks in %u segments\n",
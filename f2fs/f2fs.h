@@ -54,6 +54,7 @@
 #define F2FS_MOUNT_FASTBOOT		0x00001000
 #define F2FS_MOUNT_EXTENT_CACHE		0x00002000
 #define F2FS_MOUNT_FORCE_FG_GC		0x00004000
+#define F2FS_MOUNT_GC_HINT		0x00008000
 
 #define clear_opt(sbi, option)	(sbi->mount_opt.opt &= ~F2FS_MOUNT_##option)
 #define set_opt(sbi, option)	(sbi->mount_opt.opt |= F2FS_MOUNT_##option)
@@ -125,6 +126,14 @@ enum {
 #define BATCHED_TRIM_BLOCKS(sbi)	\
 		(BATCHED_TRIM_SEGMENTS(sbi) << (sbi)->log_blocks_per_seg)
 #define DEF_CP_INTERVAL			60	/* 60 secs */
+#define DEF_HOT_DATA_LIFETIME		30	/* 30 secs */
+#define DEF_COLD_DATA_LIFETIME		3600	/* 1 hour */
+
+/* blocks at the tail of each checkpoint pack kept for the remap intent log */
+#define REMAP_LOG_BLOCKS		64
+
+/* dirty pages written back through one block run at most */
+#define F2FS_WRITE_RUN_MAX		16
 
 struct cp_control {
 	int reason;
@@ -430,6 +439,9 @@ struct f2fs_inode_info {
 	unsigned long flags;		/* use to pass per-file flags */
 	struct rw_semaphore i_sem;	/* protect fi info */
 	atomic_t dirty_pages;		/* # of dirty pages */
+	atomic_t i_remap_pending;	/* blocks queued for device remap */
+	unsigned int i_update_time;	/* get_mtime() of last data update */
+	unsigned int i_update_gap;	/* average secs between data updates */
 	f2fs_hash_t chash;		/* hash value of given file name */
 	unsigned int clevel;		/* maximum level of given file name */
 	nid_t i_xattr_nid;		/* node id that contains xattrs */
@@ -598,6 +610,44 @@ struct flush_cmd_control {
 	struct llist_node *dispatch_list;	/* list for command dispatch */
 };
 
+#define DEF_MIN_DISCARD_ISSUE_TIME	50	/* 50 ms, if exists */
+#define DEF_MID_DISCARD_ISSUE_TIME	500	/* 500 ms, if device busy */
+#define DEF_MAX_DISCARD_ISSUE_TIME	60000	/* 60 s, if no candidates */
+#define DEF_MAX_DISCARD_REQUEST		8	/* issue 8 discards per round */
+#define DEF_DISCARD_URGENT_UTIL		80	/* do not wait for idle above */
+
+enum {
+	D_PREP,			/* queued */
+	D_SUBMIT,		/* bios submitted */
+	D_DONE,			/* all bios finished */
+};
+
+/* a range of free blocks to be discarded, in discard_cmd_control */
+struct discard_cmd {
+	struct rb_node rb_node;		/* in the tree, sorted by lstart */
+	struct list_head list;		/* in wait_list once submitted */
+	block_t lstart;			/* start block address */
+	block_t len;			/* # of blocks */
+	struct completion wait;		/* completed when state is D_DONE */
+	atomic_t bio_ref;		/* bios in flight, plus one to submit */
+	unsigned short ref;		/* # of waiters */
+	unsigned char state;		/* D_* */
+	int error;			/* bio error */
+};
+
+struct discard_cmd_control {
+	struct task_struct *f2fs_issue_discard;	/* discard thread */
+	wait_queue_head_t discard_wait_queue;	/* waiting queue for wake-up */
+	unsigned int discard_wake;		/* to wake up discard thread */
+	struct mutex cmd_lock;			/* for the tree and wait_list */
+	struct rb_root root;			/* discard commands by address */
+	struct list_head wait_list;		/* submitted commands */
+	block_t next_pos;			/* where the next round starts */
+	unsigned int undiscard_blks;		/* # of blocks in the tree */
+	atomic_t discard_cmd_cnt;		/* # of commands in the tree */
+	atomic_t issing_discard;		/* # of commands in flight */
+};
+
 struct f2fs_sm_info {
 	struct sit_info *sit_info;		/* whole segment information */
 	struct free_segmap_info *free_info;	/* free segment information */
@@ -633,6 +683,9 @@ struct f2fs_sm_info {
 	/* for flush command control */
 	struct flush_cmd_control *cmd_control_info;
 
+	/* for discard command control */
+	struct discard_cmd_control *dcc_info;
+
 };
 
 /*
@@ -677,15 +730,34 @@ enum page_type {
 	OPU,
 };
 
+/*
+ * I/O context of a f2fs_io_info.  GC reads and writes pages through the same
+ * paths as everyone else, and only tells them apart by these flags.
+ */
+#define F2FS_IO_GC		0x01	/* block relocation by GC */
+#define F2FS_IO_FG_GC		0x02	/* by FG_GC, allocations wait for it */
+
 struct f2fs_io_info {
 	struct f2fs_sb_info *sbi;	/* f2fs_sb_info pointer */
 	enum page_type type;	/* contains DATA/NODE/META/META_FLUSH */
 	int rw;			/* contains R/RS/W/WS with REQ_META/REQ_PRIO */
+	unsigned int ctx;	/* F2FS_IO_* flags, 0 for regular I/O */
 	block_t blk_addr;	/* block address to be written */
+	block_t old_blk_addr;	/* address before an out-of-place update */
 	struct page *page;	/* page to be written */
 	struct page *encrypted_page;	/* encrypted page */
 };
 
+/* FG_GC stalls allocations, while BG_GC should not delay anybody */
+static inline int f2fs_io_rw(struct f2fs_io_info *fio)
+{
+	if (fio->ctx & F2FS_IO_FG_GC)
+		return fio->rw | REQ_PRIO;
+	if (fio->ctx & F2FS_IO_GC)
+		return fio->rw & ~REQ_SYNC;
+	return fio->rw;
+}
+
 #define is_read_io(rw)	(((rw) & 1) == READ)
 struct f2fs_bio_info {
 	struct f2fs_sb_info *sbi;	/* f2fs superblock */
@@ -787,11 +859,20 @@ struct f2fs_sb_info {
 	/* for cleaning operations */
 	struct mutex gc_mutex;			/* mutex for GC */
 	struct f2fs_gc_kthread	*gc_thread;	/* GC thread */
-	unsigned int cur_victim_sec;		/* current victim section num */
+	unsigned int gc_remap_budget;		/* BG remaps granted by gc thread */
+	unsigned int gc_threads;		/* FG_GC victims cleaned at once */
+	struct gc_worker *gc_workers;		/* per victim GC buffers */
+	unsigned int nr_gc_workers;		/* gc_threads at mount time */
+	struct workqueue_struct *gc_wq;		/* runs gc_workers[1..] */
+	wait_queue_head_t gc_free_wait;		/* f2fs_balance_fs() waiters */
 
 	/* maximum # of trials to find a victim segment for SSR and GC */
 	unsigned int max_victim_search;
 
+	/* data updated more/less often than this goes to hot/cold logs */
+	unsigned int hot_data_lifetime;		/* in secs, 0 to disable */
+	unsigned int cold_data_lifetime;	/* in secs, 0 to disable */
+
 	/*
 	 * for stat information.
 	 * one is for the LFS mode, and the other is for the SSR mode.
@@ -811,7 +892,7 @@ struct f2fs_sb_info {
 	int bg_gc;				/* background gc calls */
 	unsigned int n_dirty_dirs;		/* # of dir inodes */
 #endif
-	unsigned int last_victim[2];		/* last victim segment # */
+	unsigned int last_victim[3];		/* last victim segment # */
 	spinlock_t stat_lock;			/* lock for stat operations */
 
 	/* For sysfs suppport */
@@ -822,6 +903,21 @@ struct f2fs_sb_info {
 	struct list_head s_list;
 	struct mutex umount_mutex;
 	unsigned int shrinker_run_no;
+
+	/* for GC remap on NVMe */
+	struct block_device *remap_bdev;	/* NULL if remap is disabled */
+	unsigned int remap_nsid;		/* namespace of remap_bdev */
+	unsigned int remap_lba_shift;		/* log2 of LBAs per block */
+	sector_t remap_start_lba;		/* partition offset in LBAs */
+	unsigned long remap_caps;		/* REMAP_OP_* not rejected yet */
+	unsigned int copy_max_ranges;		/* source ranges per NVMe Copy */
+	unsigned int copy_max_range_blks;	/* blocks per source range */
+	unsigned int copy_max_blks;		/* blocks per NVMe Copy */
+	struct mutex remap_log_lock;		/* protects remap_log_* */
+	void *remap_log;			/* copy of the remap intent log */
+	unsigned int remap_log_pos;		/* entries used in it */
+	unsigned long long remap_log_ver;	/* checkpoint the log refers to */
+	struct rw_semaphore remap_rwsem;	/* remap batches vs. checkpoint */
 };
 
 /*
@@ -957,6 +1053,13 @@ static inline void f2fs_unlock_op(struct f2fs_sb_info *sbi)
 	up_read(&sbi->cp_rwsem);
 }
 
+static inline void f2fs_unlock_gc(struct f2fs_sb_info *sbi)
+{
+	mutex_unlock(&sbi->gc_mutex);
+	/* writers in f2fs_balance_fs() wait for this or free sections */
+	wake_up_all(&sbi->gc_free_wait);
+}
+
 static inline void f2fs_lock_all(struct f2fs_sb_info *sbi)
 {
 	f2fs_down_write(&sbi->cp_rwsem, &sbi->cp_mutex);
@@ -1743,13 +1846,11 @@ int remove_inode_page(struct inode *);
 struct page *new_inode_page(struct inode *);
 struct page *new_node_page(struct dnode_of_data *, unsigned int, struct page *);
 void ra_node_page(struct f2fs_sb_info *, nid_t);
-void ra_node_page_gc(struct f2fs_sb_info *, nid_t);
+void ra_node_pages(struct f2fs_sb_info *, struct node_info *, int);
 struct page *get_node_page(struct f2fs_sb_info *, pgoff_t);
-struct page *get_node_page_gc(struct f2fs_sb_info *, pgoff_t);
 struct page *get_node_page_ra(struct page *, int);
 void sync_inode_page(struct dnode_of_data *);
 int sync_node_pages(struct f2fs_sb_info *, nid_t, struct writeback_control *);
-int sync_node_pages_gc(struct f2fs_sb_info *, nid_t, struct writeback_control *);
 bool alloc_nid(struct f2fs_sb_info *, nid_t *);
 void alloc_nid_done(struct f2fs_sb_info *, nid_t);
 void alloc_nid_failed(struct f2fs_sb_info *, nid_t);
@@ -1776,10 +1877,14 @@ int f2fs_issue_flush(struct f2fs_sb_info *);
 int create_flush_cmd_control(struct f2fs_sb_info *);
 void destroy_flush_cmd_control(struct f2fs_sb_info *);
 void invalidate_blocks(struct f2fs_sb_info *, block_t);
+void mark_block_unmapped(struct f2fs_sb_info *, block_t);
+void revert_data_block(struct f2fs_sb_info *, block_t, block_t);
 bool is_checkpointed_data(struct f2fs_sb_info *, block_t);
 void refresh_sit_entry(struct f2fs_sb_info *, block_t, block_t);
+void update_data_lifetime(struct inode *);
 void clear_prefree_segments(struct f2fs_sb_info *, struct cp_control *);
 void release_discard_addrs(struct f2fs_sb_info *);
+void f2fs_wait_discard_bios(struct f2fs_sb_info *);
 bool discard_next_dnode(struct f2fs_sb_info *, block_t);
 int npages_for_summary_flush(struct f2fs_sb_info *, bool);
 void allocate_new_segments(struct f2fs_sb_info *);
@@ -1789,9 +1894,13 @@ void update_meta_page(struct f2fs_sb_info *, void *, block_t);
 void write_meta_page(struct f2fs_sb_info *, struct page *);
 void write_node_page(unsigned int, struct f2fs_io_info *);
 void write_data_page(struct dnode_of_data *, struct f2fs_io_info *);
+void write_data_pages(struct dnode_of_data *, struct f2fs_io_info *,
+			struct page **, block_t *, unsigned int);
 void rewrite_data_page(struct f2fs_io_info *);
 void f2fs_replace_block(struct f2fs_sb_info *, struct dnode_of_data *,
 				block_t, block_t, unsigned char, bool);
+unsigned int allocate_data_blocks(struct f2fs_sb_info *, block_t *,
+			struct f2fs_summary *, unsigned int, int);
 void allocate_data_block(struct f2fs_sb_info *, struct page *,
 		block_t, block_t *, struct f2fs_summary *, int);
 void f2fs_wait_on_page_writeback(struct page *, enum page_type);
@@ -1845,15 +1954,13 @@ void set_data_blkaddr(struct dnode_of_data *);
 int reserve_new_block(struct dnode_of_data *);
 int f2fs_get_block(struct dnode_of_data *, pgoff_t);
 int f2fs_reserve_block(struct dnode_of_data *, pgoff_t);
-struct page *get_read_data_page(struct inode *, pgoff_t, int, bool);
+struct page *get_read_data_page(struct inode *, pgoff_t, int, bool,
+							unsigned int);
 struct page *get_cached_data_page(struct inode *, pgoff_t, int, bool);
-struct page *get_read_data_page_gc(struct inode *, pgoff_t, int, bool, int);
 struct page *find_data_page(struct inode *, pgoff_t);
-struct page *get_lock_data_page(struct inode *, pgoff_t, bool);
-struct page *get_lock_data_page_gc(struct inode *, pgoff_t, bool);
+struct page *get_lock_data_page(struct inode *, pgoff_t, bool, unsigned int);
 struct page *get_new_data_page(struct inode *, struct page *, pgoff_t, bool);
 int do_write_data_page(struct f2fs_io_info *);
-int do_write_data_page_gc(struct f2fs_io_info *);
 int f2fs_fiemap(struct inode *inode, struct fiemap_extent_info *, u64, u64);
 void f2fs_invalidate_page(struct page *, unsigned int, unsigned int);
 int f2fs_release_page(struct page *, gfp_t);
@@ -1865,7 +1972,22 @@ int start_gc_thread(struct f2fs_sb_info *);
 void stop_gc_thread(struct f2fs_sb_info *);
 block_t start_bidx_of_node(unsigned int, struct f2fs_inode_info *);
 int f2fs_gc(struct f2fs_sb_info *, bool);
-void build_gc_manager(struct f2fs_sb_info *);
+void f2fs_gc_move_fallback(struct inode *, pgoff_t, block_t);
+int build_gc_manager(struct f2fs_sb_info *);
+void destroy_gc_manager(struct f2fs_sb_info *);
+
+/*
+ * remap.c
+ */
+struct remap_batch;
+void f2fs_remap_init_dev(struct f2fs_sb_info *);
+void f2fs_remap_destroy_dev(struct f2fs_sb_info *);
+bool f2fs_remap_replay(struct f2fs_sb_info *);
+void f2fs_remap_recover(struct f2fs_sb_info *);
+int f2fs_remap_init_batch(struct f2fs_sb_info *, struct remap_batch *);
+void f2fs_remap_destroy_batch(struct f2fs_sb_info *, struct remap_batch *);
+bool f2fs_remap_add(struct remap_batch *, struct page *, block_t);
+void f2fs_remap_commit(struct f2fs_sb_info *, struct remap_batch *);
 
 /*
  * recovery.c
@@ -1873,6 +1995,15 @@ void build_gc_manager(struct f2fs_sb_info *);
 int recover_fsync_data(struct f2fs_sb_info *);
 bool space_for_roll_forward(struct f2fs_sb_info *);
 
+/* how GC relocated a valid data block */
+enum {
+	GC_MOVE_HOST,		/* read and rewritten by the host */
+	GC_MOVE_REMAP,		/* remapped by the device */
+	GC_MOVE_DCOPY,		/* copied inside the device */
+	GC_MOVE_FALLBACK,	/* device failed, copied by the host instead */
+	NR_GC_MOVE
+};
+
 /*
  * debug.c
  */
@@ -1896,10 +2027,14 @@ struct f2fs_stat_info {
 	int rsvd_segs, overp_segs;
 	int dirty_count, node_pages, meta_pages;
 	int prefree_count, call_count, cp_count;
-	int tot_segs, node_segs, data_segs, free_segs, free_secs;
-	int bg_node_segs, bg_data_segs;
-	int tot_blks, data_blks, node_blks;
-	int bg_data_blks, bg_node_blks;
+	int free_segs, free_secs;
+	/* GC counters, bumped by the FG_GC workers in parallel */
+	atomic_t tot_segs, node_segs, data_segs;
+	atomic_t bg_node_segs, bg_data_segs;
+	atomic_t tot_blks, data_blks, node_blks;
+	atomic_t bg_data_blks, bg_node_blks;
+	atomic_t gc_move[NR_GC_MOVE];
+	atomic_t gc_hints, gc_hints_acked;
 	int curseg[NR_CURSEG_TYPE];
 	int cursec[NR_CURSEG_TYPE];
 	int curzone[NR_CURSEG_TYPE];
@@ -1907,6 +2042,8 @@ struct f2fs_stat_info {
 	unsigned int segment_count[2];
 	unsigned int block_count[2];
 	unsigned int inplace_count;
+	unsigned int undiscard_blks;
+	int nr_discard_cmd, nr_issing_discard;
 	unsigned long long base_mem, cache_mem, page_mem;
 };
 
@@ -1963,33 +2100,47 @@ static inline struct f2fs_stat_info *F2FS_STAT(struct f2fs_sb_info *sbi)
 #define stat_inc_seg_count(sbi, type, gc_type)				\
 	do {								\
 		struct f2fs_stat_info *si = F2FS_STAT(sbi);		\
-		(si)->tot_segs++;					\
+		atomic_inc(&si->tot_segs);				\
 		if (type == SUM_TYPE_DATA) {				\
-			si->data_segs++;				\
-			si->bg_data_segs += (gc_type == BG_GC) ? 1 : 0;	\
+			atomic_inc(&si->data_segs);			\
+			if (gc_type == BG_GC)				\
+				atomic_inc(&si->bg_data_segs);		\
 		} else {						\
-			si->node_segs++;				\
-			si->bg_node_segs += (gc_type == BG_GC) ? 1 : 0;	\
+			atomic_inc(&si->node_segs);			\
+			if (gc_type == BG_GC)				\
+				atomic_inc(&si->bg_node_segs);		\
 		}							\
 	} while (0)
 
 #define stat_inc_tot_blk_count(si, blks)				\
-	(si->tot_blks += (blks))
+	(atomic_add((blks), &(si)->tot_blks))
 
 #define stat_inc_data_blk_count(sbi, blks, gc_type)			\
 	do {								\
 		struct f2fs_stat_info *si = F2FS_STAT(sbi);		\
 		stat_inc_tot_blk_count(si, blks);			\
-		si->data_blks += (blks);				\
-		si->bg_data_blks += (gc_type == BG_GC) ? (blks) : 0;	\
+		atomic_add((blks), &si->data_blks);			\
+		if (gc_type == BG_GC)					\
+			atomic_add((blks), &si->bg_data_blks);		\
 	} while (0)
 
 #define stat_inc_node_blk_count(sbi, blks, gc_type)			\
 	do {								\
 		struct f2fs_stat_info *si = F2FS_STAT(sbi);		\
 		stat_inc_tot_blk_count(si, blks);			\
-		si->node_blks += (blks);				\
-		si->bg_node_blks += (gc_type == BG_GC) ? (blks) : 0;	\
+		atomic_add((blks), &si->node_blks);			\
+		if (gc_type == BG_GC)					\
+			atomic_add((blks), &si->bg_node_blks);		\
+	} while (0)
+
+#define stat_inc_gc_move(sbi, type)					\
+	(atomic_inc(&(F2FS_STAT(sbi))->gc_move[(type)]))
+#define stat_inc_gc_hint(sbi, acked)					\
+	do {								\
+		struct f2fs_stat_info *si = F2FS_STAT(sbi);		\
+		atomic_inc(&si->gc_hints);				\
+		if (acked)						\
+			atomic_inc(&si->gc_hints_acked);		\
 	} while (0)
 
 int f2fs_build_stats(struct f2fs_sb_info *);
@@ -2019,6 +2170,8 @@ void f2fs_destroy_root_stats(void);
 #define stat_inc_tot_blk_count(si, blks)
 #define stat_inc_data_blk_count(sbi, blks, gc_type)
 #define stat_inc_node_blk_count(sbi, blks, gc_type)
+#define stat_inc_gc_move(sbi, type)
+#define stat_inc_gc_hint(sbi, acked)
 
 static inline int f2fs_build_stats(struct f2fs_sb_info *sbi) { return 0; }
 static inline void f2fs_destroy_stats(struct f2fs_sb_info *sbi) { }
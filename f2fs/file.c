@@ -517,7 +517,7 @@ static int truncate_partial_data_page(struct inode *inode, u64 from,
 		return 0;
 	}
 
-	page = get_lock_data_page(inode, index, true);
+	page = get_lock_data_page(inode, index, true, 0);
 	if (IS_ERR(page))
 		return 0;
 truncate_out:
@@ -884,7 +884,7 @@ static int __exchange_data_block(struct inode *inode, pgoff_t src,
 	} else {
 		struct page *psrc, *pdst;
 
-		psrc = get_lock_data_page(inode, src, true);
+		psrc = get_lock_data_page(inode, src, true, 0);
 		if (IS_ERR(psrc))
 			return PTR_ERR(psrc);
 		pdst = get_new_data_page(inode, NULL, dst, false);
@@ -1641,7 +1641,7 @@ static int f2fs_ioc_write_checkpoint(struct file *filp, unsigned long arg)
 
 	mutex_lock(&sbi->gc_mutex);
 	write_checkpoint(sbi, &cpc);
-	mutex_unlock(&sbi->gc_mutex);
+	f2fs_unlock_gc(sbi);
 
 	return 0;
 }
@@ -17,13 +17,34 @@
 #include <linux/delay.h>
 #include <linux/freezer.h>
 #include <linux/blkdev.h>
+#include <linux/nvme.h>
 
 #include "f2fs.h"
 #include "node.h"
 #include "segment.h"
 #include "gc.h"
+#include "remap.h"
+#include "gctrace.h"
 #include <trace/events/f2fs.h>
 
+/*
+ * Blocks BG_GC may hand to the device on this wakeup.  A remap costs the
+ * device a mapping update instead of a block write, but it still competes
+ * with user I/O, so spend only what the writeback in flight leaves room for.
+ */
+static unsigned int bg_remap_budget(struct f2fs_sb_info *sbi,
+					struct f2fs_gc_kthread *gc_th)
+{
+	unsigned int budget = gc_th->max_remap_blocks;
+	unsigned int inflight;
+
+	if (!sbi->remap_caps)
+		return 0;
+
+	inflight = get_pages(sbi, F2FS_WRITEBACK);
+	return inflight < budget ? budget - inflight : 0;
+}
+
 static int gc_thread_func(void *data)
 {
 	struct f2fs_sb_info *sbi = data;
@@ -66,7 +87,7 @@ static int gc_thread_func(void *data)
 
 		if (!is_idle(sbi)) {
 			increase_sleep_time(gc_th, &wait_ms);
-			mutex_unlock(&sbi->gc_mutex);
+			f2fs_unlock_gc(sbi);
 			continue;
 		}
 
@@ -77,10 +98,15 @@ static int gc_thread_func(void *data)
 
 		stat_inc_bggc_count(sbi);
 
+		/* gc_mutex is held, so only this f2fs_gc() sees the budget */
+		sbi->gc_remap_budget = bg_remap_budget(sbi, gc_th);
+
 		/* if return value is not zero, no victim was selected */
 		if (f2fs_gc(sbi, test_opt(sbi, FORCE_FG_GC)))
 			wait_ms = gc_th->no_gc_sleep_time;
 
+		sbi->gc_remap_budget = 0;
+
 		trace_f2fs_background_gc(sbi->sb, wait_ms,
 				prefree_segments(sbi), free_segments(sbi));
 
@@ -107,6 +133,8 @@ int start_gc_thread(struct f2fs_sb_info *sbi)
 	gc_th->max_sleep_time = DEF_GC_THREAD_MAX_SLEEP_TIME;
 	gc_th->no_gc_sleep_time = DEF_GC_THREAD_NOGC_SLEEP_TIME;
 
+	gc_th->max_remap_blocks = DEF_GC_THREAD_REMAP_BLOCKS;
+
 	gc_th->gc_idle = 0;
 
 	sbi->gc_thread = gc_th;
@@ -132,8 +160,9 @@ void stop_gc_thread(struct f2fs_sb_info *sbi)
 	sbi->gc_thread = NULL;
 }
 
-static int select_gc_type(struct f2fs_gc_kthread *gc_th, int gc_type)
+static int select_gc_type(struct f2fs_sb_info *sbi, int gc_type)
 {
+	struct f2fs_gc_kthread *gc_th = sbi->gc_thread;
 	int gc_mode = (gc_type == BG_GC) ? GC_CB : GC_GREEDY;
 
 	if (gc_th && gc_th->gc_idle) {
@@ -141,6 +170,9 @@ static int select_gc_type(struct f2fs_gc_kthread *gc_th, int gc_type)
 			gc_mode = GC_CB;
 		else if (gc_th->gc_idle == 2)
 			gc_mode = GC_GREEDY;
+		/* without a remap device every block has to be copied */
+		else if (gc_th->gc_idle == 3)
+			gc_mode = sbi->remap_bdev ? GC_REMAP : GC_GREEDY;
 	}
 	return gc_mode;
 }
@@ -156,7 +188,7 @@ static void select_policy(struct f2fs_sb_info *sbi, int gc_type,
 		p->max_search = dirty_i->nr_dirty[type];
 		p->ofs_unit = 1;
 	} else {
-		p->gc_mode = select_gc_type(sbi->gc_thread, gc_type);
+		p->gc_mode = select_gc_type(sbi, gc_type);
 		p->dirty_segmap = dirty_i->dirty_segmap[DIRTY];
 		p->max_search = dirty_i->nr_dirty[DIRTY];
 		p->ofs_unit = sbi->segs_per_sec;
@@ -176,7 +208,7 @@ static unsigned int get_max_cost(struct f2fs_sb_info *sbi,
 		return 1 << sbi->log_blocks_per_seg;
 	if (p->gc_mode == GC_GREEDY)
 		return (1 << sbi->log_blocks_per_seg) * p->ofs_unit;
-	else if (p->gc_mode == GC_CB)
+	else if (p->gc_mode == GC_CB || p->gc_mode == GC_REMAP)
 		return UINT_MAX;
 	else /* No other gc_mode */
 		return 0;
@@ -201,22 +233,59 @@ static unsigned int check_bg_victims(struct f2fs_sb_info *sbi)
 	return NULL_SEGNO;
 }
 
+/*
+ * Invalidations per second in a segment, in 1/65536ths.  A segment which
+ * has been quiet for longer than its average gap is slowing down.
+ */
+static unsigned int get_inval_rate(struct seg_entry *se,
+						unsigned long long now)
+{
+	unsigned int gap;
+
+	if (!se->inval_time)
+		return 0;
+	gap = min_t(unsigned long long, now - se->inval_time,
+					SEG_LIFETIME_MAX_GAP) << 4;
+	gap = max3(gap, se->inval_gap, 1U);
+	return (1 << 20) / gap;
+}
+
 static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 {
 	struct sit_info *sit_i = SIT_I(sbi);
 	unsigned int secno = GET_SECNO(sbi, segno);
 	unsigned int start = secno * sbi->segs_per_sec;
-	unsigned long long mtime = 0;
+	unsigned long long now = get_mtime(sbi);
+	unsigned long long mtime = 0, rate = 0, life;
 	unsigned int vblocks;
 	unsigned char age = 0;
 	unsigned char u;
 	unsigned int i;
 
-	for (i = 0; i < sbi->segs_per_sec; i++)
-		mtime += get_seg_entry(sbi, start + i)->mtime;
+	for (i = 0; i < sbi->segs_per_sec; i++) {
+		struct seg_entry *se = get_seg_entry(sbi, start + i);
+
+		mtime += se->mtime;
+		rate += get_inval_rate(se, now);
+	}
 	vblocks = get_valid_blocks(sbi, segno, sbi->segs_per_sec);
 
 	mtime = div_u64(mtime, sbi->segs_per_sec);
+
+	/*
+	 * The age of a section stands for how long its valid blocks will
+	 * stay valid.  Once blocks die in it, predict that from the rate
+	 * they die at, so that sections whose remaining blocks are about to
+	 * be invalidated anyway are left for later, and long lived ones are
+	 * moved out first.
+	 */
+	if (rate) {
+		life = div64_u64((u64)vblocks << 16, rate);
+		mtime = now > life ? now - life : 0;
+		if (mtime < sit_i->min_mtime)
+			mtime = sit_i->min_mtime;
+	}
+
 	vblocks = div_u64(vblocks, sbi->segs_per_sec);
 
 	u = (vblocks * 100) >> sbi->log_blocks_per_seg;
@@ -233,6 +302,174 @@ static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 	return UINT_MAX - ((100 * (100 - u) * age) / (100 + u));
 }
 
+struct remap_sample {
+	unsigned int ofs_in_node;	/* in: block offset in the dnode */
+	unsigned int nofs;		/* in: offset of the dnode */
+	bool found;			/* out: owner is cached */
+	bool copy;			/* out: block must be copied by host */
+};
+
+static int remap_sample_match(struct inode *inode, unsigned long ino,
+								void *data)
+{
+	struct remap_sample *rs = data;
+	struct address_space *mapping = inode->i_mapping;
+	pgoff_t index;
+
+	if (inode->i_ino != ino)
+		return 0;
+
+	spin_lock(&inode->i_lock);
+	if (inode->i_state & (I_NEW | I_FREEING | I_WILL_FREE)) {
+		spin_unlock(&inode->i_lock);
+		return -1;
+	}
+	rs->found = true;
+
+	if (f2fs_encrypted_inode(inode) && S_ISREG(inode->i_mode)) {
+		rs->copy = true;
+	} else {
+		index = start_bidx_of_node(rs->nofs, F2FS_I(inode)) +
+							rs->ofs_in_node;
+		rcu_read_lock();
+		rs->copy = radix_tree_tag_get(&mapping->page_tree, index,
+						PAGECACHE_TAG_DIRTY) ||
+				radix_tree_tag_get(&mapping->page_tree, index,
+						PAGECACHE_TAG_WRITEBACK);
+		rcu_read_unlock();
+	}
+	spin_unlock(&inode->i_lock);
+	return -1;
+}
+
+/*
+ * Sample up to GC_REMAP_SAMPLES valid blocks of a data segment and cache
+ * the share of them that is dirty or under writeback in the page cache, so
+ * that remap_data_page() would fall back to copying them through the host.
+ * Only cached summary, node and inode objects are looked at, since victim
+ * selection must not issue I/O; a block whose owner is not cached can not
+ * have a dirty page and counts as remappable.
+ *
+ * This runs without sentry_lock, so the valid map is read racily; the
+ * result is only an estimate for get_remap_cost() anyway.
+ */
+static void sample_remap_segment(struct f2fs_sb_info *sbi, unsigned int segno)
+{
+	struct seg_entry *se = get_seg_entry(sbi, segno);
+	unsigned int blocks_per_seg = sbi->blocks_per_seg;
+	unsigned int step = max_t(unsigned int, 1,
+				blocks_per_seg / GC_REMAP_SAMPLES);
+	struct f2fs_summary_block *sum;
+	struct page *sum_page;
+	unsigned int off, sampled = 0, copied = 0;
+
+	if (READ_ONCE(se->remap_fresh) || !IS_DATASEG(se->type) ||
+						!se->valid_blocks)
+		return;
+
+	sum_page = find_get_page(META_MAPPING(sbi), GET_SUM_BLOCK(sbi, segno));
+	if (!sum_page)
+		return;
+	if (!PageUptodate(sum_page))
+		goto out;
+	sum = page_address(sum_page);
+
+	for (off = 0; off < blocks_per_seg; off += step) {
+		struct f2fs_summary *entry = &sum->entries[off];
+		struct remap_sample rs = { 0 };
+		struct page *node_page;
+		nid_t ino;
+
+		if (!test_bit(off, se->cur_valid_map))
+			continue;
+		sampled++;
+
+		node_page = find_get_page(NODE_MAPPING(sbi),
+						le32_to_cpu(entry->nid));
+		if (!node_page)
+			continue;
+		if (!PageUptodate(node_page)) {
+			f2fs_put_page(node_page, 0);
+			continue;
+		}
+		ino = ino_of_node(node_page);
+		rs.nofs = ofs_of_node(node_page);
+		rs.ofs_in_node = le16_to_cpu(entry->ofs_in_node);
+		f2fs_put_page(node_page, 0);
+
+		find_inode_nowait(sbi->sb, ino, remap_sample_match, &rs);
+		if (rs.found && rs.copy)
+			copied++;
+	}
+
+	/* nothing was learnt, try again on the next search */
+	if (sampled) {
+		WRITE_ONCE(se->remap_copy, copied * 255 / sampled);
+		WRITE_ONCE(se->remap_fresh, true);
+	}
+out:
+	f2fs_put_page(sum_page, 0);
+}
+
+/*
+ * get_remap_cost() runs under seglist_lock and sentry_lock, so it only
+ * reads the cached estimates.  Before a GC_REMAP search, resample the
+ * segments of the next max_victim_search dirty sections it will look at
+ * whose blocks were invalidated since their last sample.
+ */
+static void refresh_remap_estimates(struct f2fs_sb_info *sbi)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int segno = sbi->last_victim[GC_REMAP];
+	unsigned int nsearched = 0, i;
+
+	while (nsearched++ < sbi->max_victim_search) {
+		segno = find_next_bit(dirty_i->dirty_segmap[DIRTY],
+						MAIN_SEGS(sbi), segno);
+		if (segno >= MAIN_SEGS(sbi))
+			break;
+		segno -= segno % sbi->segs_per_sec;
+		for (i = 0; i < sbi->segs_per_sec; i++)
+			sample_remap_segment(sbi, segno + i);
+		segno += sbi->segs_per_sec;
+	}
+}
+
+static unsigned int get_remap_cost(struct f2fs_sb_info *sbi,
+						unsigned int segno)
+{
+	unsigned int secno = GET_SECNO(sbi, segno);
+	unsigned int start = secno * sbi->segs_per_sec;
+	unsigned int usable = sbi->blocks_per_seg * sbi->segs_per_sec;
+	unsigned int vblocks = 0, copied = 0;
+	unsigned long long cost;
+	unsigned int i;
+
+	for (i = 0; i < sbi->segs_per_sec; i++) {
+		unsigned int valid = get_valid_blocks(sbi, start + i, 0);
+		struct seg_entry *se = get_seg_entry(sbi, start + i);
+
+		if (!valid)
+			continue;
+		vblocks += valid;
+
+		/* node blocks are always moved through the page cache */
+		if (!IS_DATASEG(se->type)) {
+			copied += valid;
+			continue;
+		}
+
+		copied += valid * READ_ONCE(se->remap_copy) / 255;
+	}
+
+	if (vblocks >= usable)
+		return UINT_MAX - 1;
+
+	cost = (u64)(vblocks - copied) + (u64)copied * GC_REMAP_COPY_WEIGHT;
+	cost = div_u64(cost * 100, usable - vblocks);
+	return min_t(unsigned long long, cost, UINT_MAX - 1);
+}
+
 static inline unsigned int get_gc_cost(struct f2fs_sb_info *sbi,
 			unsigned int segno, struct victim_sel_policy *p)
 {
@@ -242,6 +479,8 @@ static inline unsigned int get_gc_cost(struct f2fs_sb_info *sbi,
 	/* alloc_mode == LFS */
 	if (p->gc_mode == GC_GREEDY)
 		return get_valid_blocks(sbi, segno, sbi->segs_per_sec);
+	else if (p->gc_mode == GC_REMAP)
+		return get_remap_cost(sbi, segno);
 	else
 		return get_cb_cost(sbi, segno);
 }
@@ -322,17 +561,21 @@ static int get_victim_by_default(struct f2fs_sb_info *sbi,
 	}
 	if (p.min_segno != NULL_SEGNO) {
 got_it:
+		secno = GET_SECNO(sbi, p.min_segno);
 		if (p.alloc_mode == LFS) {
-			secno = GET_SECNO(sbi, p.min_segno);
+			/*
+			 * The f2fs_gc() caller and each worker keep their own
+			 * FG_GC victim, which stays in fg_victim_secmap until
+			 * it is cleaned.
+			 */
 			if (gc_type == FG_GC)
-				sbi->cur_victim_sec = secno;
+				set_bit(secno, dirty_i->fg_victim_secmap);
 			else
 				set_bit(secno, dirty_i->victim_secmap);
 		}
 		*result = (p.min_segno / p.ofs_unit) * p.ofs_unit;
 
-		trace_f2fs_get_victim(sbi->sb, type, gc_type, &p,
-				sbi->cur_victim_sec,
+		trace_f2fs_get_victim(sbi->sb, type, gc_type, &p, secno,
 				prefree_segments(sbi), free_segments(sbi));
 	}
 out:
@@ -388,10 +631,10 @@ static int check_valid_map(struct f2fs_sb_info *sbi,
 	struct seg_entry *sentry;
 	int ret;
 
-	mutex_lock(&sit_i->sentry_lock);
+	down_read(&sit_i->sentry_lock);
 	sentry = get_seg_entry(sbi, segno);
-	ret = f2fs_test_bit(offset, sentry->cur_valid_map);
-	mutex_unlock(&sit_i->sentry_lock);
+	ret = test_bit(offset, sentry->cur_valid_map);
+	up_read(&sit_i->sentry_lock);
 	return ret;
 }
 
@@ -414,139 +657,141 @@ struct f2fs_summary { // a summary entry for a 4KB-sized block in a segment
 } __packed;
 */
 /*
- * @ Aim to know the situation of the SSD when trigger GC.
- * This function used to let the SSD known when to do clean.
- * The only thing need to do is to tell the start and then end address 
- * in this segment clean.
+ * GC hints tell the SSD which LBAs the host is cleaning, so that its own GC
+ * can keep away from them.  Both are set features commands with cdw11/12 the
+ * first LBA, cdw13 the number of LBAs and cdw14 the LBAs still valid: the
+ * start hint carries what the host expects to move, the end hint what was
+ * left behind.  Each victim section is announced as it is picked, and closed
+ * once it is cleaned; victims with consecutive section numbers share one
+ * hint of either kind.
  */
-#include <linux/types.h>
-//#include "/home/willow/fxl/linux-4.4.4/drivers/nvme/host/nvme.h"
-extern int nvme_set_features(struct nvme_dev *dev, unsigned fid, unsigned dword11,dma_addr_t dma_addr, u32 *result);
-int sendtoSSD(unsigned int lba, unsigned int s_e){ // s_e = 0,means start; s_e = 1,means end;
-
-    struct file *filp = NULL;
-    mm_segment_t oldfs;
-    int err = 0;
-
-    oldfs = get_fs();
-    set_fs(get_ds());
-    filp = filp_open("/dev/nvme0n1", O_RDONLY, 0);
-    set_fs(oldfs);
-    if (IS_ERR(filp)) {
-        err = PTR_ERR(filp);
-		printk("Unable to open stats file to write\n");
-        return -1;
-    }
-	struct nvme_ns *ns = filp->f_inode->i_bdev->bd_disk->private_data;
+#define NVME_FEAT_GC_START	0x12
+#define NVME_FEAT_GC_END	0x13
+
+extern int nvme_kernel_set_features(struct block_device *bdev, unsigned fid,
+			unsigned dword11, unsigned dword12, unsigned dword13,
+			unsigned dword14, u32 *result);
+
+/* LBAs of @nr_secs sections, which cdw13 has to hold in 32 bits */
+static u64 gc_hint_lbas(struct f2fs_sb_info *sbi, unsigned int nr_secs)
+{
+	return ((u64)nr_secs * sbi->segs_per_sec * sbi->blocks_per_seg) <<
+						sbi->remap_lba_shift;
+}
+
+static void send_gc_hint(struct f2fs_sb_info *sbi, unsigned int fid,
+					struct gc_hint_run *run)
+{
+	u64 start_lba = remap_lba(sbi,
+			START_BLOCK(sbi, run->start_secno * sbi->segs_per_sec));
 	u32 result;
-	int err2;
-	int count = 20;
-	int opcode;
-    if(s_e) // end
-		opcode = 0x13;
-	else
-        opcode = 0x12;
-	err2 = nvme_set_features(ns->dev, opcode, lba, 0, &result);
-    filp_close(filp, NULL);
-	printk("err2:%d\n",err2);
-	printk("result:%d\n",result);
-	int ret = min(result & 0xffff,result >> 16) + 1;
-	if(ret>=0){
-		printk("ioctl success!\n");	
-		return 0;
-	} else {
-		printk("ioctl failed!\n");
-		return -1;
+	int err;
+
+	err = nvme_kernel_set_features(sbi->remap_bdev, fid,
+				lower_32_bits(start_lba),
+				upper_32_bits(start_lba),
+				gc_hint_lbas(sbi, run->nr_secs),
+				(u64)run->valid << sbi->remap_lba_shift,
+				&result);
+	stat_inc_gc_hint(sbi, !err);
+
+	if (err > 0 && ((err & 0x7ff) == NVME_SC_INVALID_OPCODE ||
+			(err & 0x7ff) == NVME_SC_INVALID_FIELD)) {
+		clear_opt(sbi, GC_HINT);
+		f2fs_msg(sbi->sb, KERN_WARNING,
+			"device rejected GC hints, not sending them any more");
 	}
 }
-#define START_ADDR_GC 0
-#define END_ADDR_GC 1
-
-// static int gc_node_segment(struct f2fs_sb_info *sbi,
-// 		struct f2fs_summary *sum, unsigned int segno, int gc_type)
-// {
-// 	bool initial = true;
-// 	struct f2fs_summary *entry;
-// 	block_t start_addr;
-// 	int off;
-
-// 	start_addr = START_BLOCK(sbi, segno); // start logical block address.
-// 	printk(KERN_EMERG "gc_node::%x\n",start_addr);  // start_addr means block number.
-// next_step:
-// 	entry = sum;
-
-// 	for (off = 0; off < sbi->blocks_per_seg; off++, entry++) {
-// 		nid_t nid = le32_to_cpu(entry->nid); 
-// 		struct page *node_page;
-// 		struct node_info ni;
-
-// 		/* stop BG_GC if there is not enough free sections. */
-// 		if (gc_type == BG_GC && has_not_enough_free_secs(sbi, 0))
-// 			return 0;
-
-// 		if (check_valid_map(sbi, segno, off) == 0){ // check if the block is valid.
-// 			continue;
-// 		} 
-
-// 		if (initial) {
-// //			printk(KERN_EMERG "%d:",off); // Show how many nodes to read.
-// 			ra_node_page_gc(sbi, nid); // 将这个nid对应的node page读入到内存当中,因为有对应的逻辑地址。
-// 			continue;
-// 		}
-// 		node_page = get_node_page_gc(sbi, nid); // This function or the ra_node_page is used to read page.
-// 		if (IS_ERR(node_page))
-// 			continue;
-// /*		if(PageDirty(node_page)){
-// 			printk(KERN_EMERG "2:%d\n",off); 
-// 		}*/
-// 		/* block may become invalid during get_node_page */
-// 		if (check_valid_map(sbi, segno, off) == 0) { // Why block may become invalid?
-// 			f2fs_put_page(node_page, 1); // minus the used page count.
-// 			continue;
-// 		}
-
-// 		get_node_info(sbi, nid, &ni); 
-// 		if (ni.blk_addr != start_addr + off) {
-// 			f2fs_put_page(node_page, 1);
-// 			continue;
-// 		}
-// 		/* set page dirty and write it */
-// 		if (gc_type == FG_GC) {
-// 			f2fs_wait_on_page_writeback(node_page, NODE); // Why wait for write back? What kind of pages to write back?
-// 			set_page_dirty(node_page); // This page is dirty.
-// 		} else {
-// 			if (!PageWriteback(node_page))
-// 				set_page_dirty(node_page);
-// 		}
-// 		f2fs_put_page(node_page, 1);
-// 		stat_inc_node_blk_count(sbi, 1, gc_type); // Incress block count for what? For background.
-// 	}
-
-// 	if (initial) {
-// 		initial = false;
-// 		goto next_step;
-// 	}
-
-// 	if (gc_type == FG_GC) {
-// 		struct writeback_control wbc = {
-// 			.sync_mode = WB_SYNC_ALL,
-// 			.nr_to_write = LONG_MAX,
-// 			.for_reclaim = 0,
-// 		};
-// //		printk(KERN_EMERG "FG_GC\n",off); 
-// 		sync_node_pages_gc(sbi, 0, &wbc); // 难道是刷下去的时候才有逻辑地址吗？
-
-// 		/* return 1 only if FG_GC succefully reclaimed one */
-// 		if (get_valid_blocks(sbi, segno, 1) == 0) {
-// 			sendtoSSD(start_addr+sbi->blocks_per_seg, END_ADDR_GC); 
-// 			return 1;
-// 		}	
-// 	}
-// 	sendtoSSD(start_addr+sbi->blocks_per_seg, END_ADDR_GC); 
-// 	return 0;
-// }
+
+static void flush_gc_hint_run(struct f2fs_sb_info *sbi, unsigned int fid,
+					struct gc_hint_run *run)
+{
+	if (!run->nr_secs)
+		return;
+	send_gc_hint(sbi, fid, run);
+	run->nr_secs = 0;
+	run->valid = 0;
+}
+
+/*
+ * Add the victim section of @segno to @run.  A section which doesn't
+ * follow the run, or which would make it too long for one command, sends
+ * the run first and opens a new one.
+ */
+static void add_gc_hint_run(struct f2fs_sb_info *sbi, unsigned int fid,
+			struct gc_hint_run *run, unsigned int segno)
+{
+	unsigned int secno = GET_SECNO(sbi, segno);
+
+	if (run->nr_secs && (secno != run->start_secno + run->nr_secs ||
+			gc_hint_lbas(sbi, run->nr_secs + 1) > U32_MAX))
+		flush_gc_hint_run(sbi, fid, run);
+
+	if (!run->nr_secs)
+		run->start_secno = secno;
+	run->nr_secs++;
+	run->valid += get_valid_blocks(sbi, segno, sbi->segs_per_sec);
+}
+
+static void flush_gc_hint(struct f2fs_sb_info *sbi, struct gc_hint *hint)
+{
+	flush_gc_hint_run(sbi, NVME_FEAT_GC_END, &hint->end);
+}
+
+/*
+ * Announce the victim section of @segno and those just assigned to the
+ * first @nr_workers GC workers, before any of them is cleaned.  Every
+ * gc_more round calls this for the victims it picked.
+ */
+static void start_gc_hint(struct f2fs_sb_info *sbi, struct gc_hint *hint,
+				unsigned int segno, unsigned int nr_workers)
+{
+	unsigned int i;
+
+	if (!test_opt(sbi, GC_HINT) || !sbi->remap_bdev)
+		return;
+
+	add_gc_hint_run(sbi, NVME_FEAT_GC_START, &hint->start, segno);
+	for (i = 1; i <= nr_workers; i++)
+		add_gc_hint_run(sbi, NVME_FEAT_GC_START, &hint->start,
+					sbi->gc_workers[i].segno);
+	flush_gc_hint_run(sbi, NVME_FEAT_GC_START, &hint->start);
+}
+
+/*
+ * Close the victim section of @segno.  The end hint is held back while
+ * victims are adjacent, so that a run of them is closed by one command.
+ */
+static void end_gc_hint(struct f2fs_sb_info *sbi, struct gc_hint *hint,
+							unsigned int segno)
+{
+	if (!test_opt(sbi, GC_HINT) || !sbi->remap_bdev)
+		return;
+
+	add_gc_hint_run(sbi, NVME_FEAT_GC_END, &hint->end, segno);
+}
+
+/*
+ * Node and inode readahead of a victim is queued while its summaries are
+ * walked, and issued as one sorted batch at the end of the pass.
+ */
+static void queue_node_ra(struct gc_ctx *gc, nid_t nid)
+{
+	/* neighbouring data blocks mostly share their dnode */
+	if (gc->nr_ra && gc->ra_nis[gc->nr_ra - 1].nid == nid)
+		return;
+	gc->ra_nis[gc->nr_ra++].nid = nid;
+}
+
+static void submit_node_ra(struct f2fs_sb_info *sbi, struct gc_ctx *gc)
+{
+	ra_node_pages(sbi, gc->ra_nis, gc->nr_ra);
+	gc->nr_ra = 0;
+}
+
 static int gc_node_segment(struct f2fs_sb_info *sbi,
-		struct f2fs_summary *sum, unsigned int segno, int gc_type)
+		struct f2fs_summary *sum, unsigned int segno, int gc_type,
+		struct gc_ctx *gc)
 {
 	bool initial = true;
 	struct f2fs_summary *entry;
@@ -554,8 +799,7 @@ static int gc_node_segment(struct f2fs_sb_info *sbi,
 	int off;
 
 	start_addr = START_BLOCK(sbi, segno); // start logical block address.
-	printk(KERN_EMERG "gc_node::%x\n",start_addr);  // start_addr means block number.
-//	sendtoSSD(start_addr, START_ADDR_GC); 
+	gc->nr_ra = 0;
 next_step:
 	entry = sum;
 
@@ -563,6 +807,7 @@ next_step:
 		nid_t nid = le32_to_cpu(entry->nid); 
 		struct page *node_page;
 		struct node_info ni;
+		u64 start;
 
 		/* stop BG_GC if there is not enough free sections. */
 		if (gc_type == BG_GC && has_not_enough_free_secs(sbi, 0))
@@ -573,16 +818,13 @@ next_step:
 		} 
 
 		if (initial) {
-//			printk(KERN_EMERG "%d:",off); // Show how many nodes to read.
-			ra_node_page(sbi, nid); // 将这个nid对应的node page读入到内存当中,因为有对应的逻辑地址。
+			queue_node_ra(gc, nid);
 			continue;
 		}
+		start = f2fs_gc_trace_clock();
 		node_page = get_node_page(sbi, nid); // This function or the ra_node_page is used to read page.
 		if (IS_ERR(node_page))
 			continue;
-/*		if(PageDirty(node_page)){
-			printk(KERN_EMERG "2:%d\n",off); 
-		}*/
 		/* block may become invalid during get_node_page */
 		if (check_valid_map(sbi, segno, off) == 0) { // Why block may become invalid?
 			f2fs_put_page(node_page, 1);
@@ -603,10 +845,13 @@ next_step:
 				set_page_dirty(node_page);
 		}
 		f2fs_put_page(node_page, 1);
+		f2fs_trace_gc(sbi, ni.ino, nid, start_addr + off, NULL_ADDR,
+						GC_TRACE_NODE, start);
 		stat_inc_node_blk_count(sbi, 1, gc_type);
 	}
 
 	if (initial) {
+		submit_node_ra(sbi, gc);
 		initial = false;
 		goto next_step;
 	}
@@ -617,16 +862,13 @@ next_step:
 			.nr_to_write = LONG_MAX,
 			.for_reclaim = 0,
 		};
-//		printk(KERN_EMERG "FG_GC\n",off); 
 		sync_node_pages(sbi, 0, &wbc); // 难道是刷下去的时候才有逻辑地址吗？
 
 		/* return 1 only if FG_GC succefully reclaimed one */
 		if (get_valid_blocks(sbi, segno, 1) == 0) {
-//			sendtoSSD(start_addr+sbi->blocks_per_seg, END_ADDR_GC); 
 			return 1;
 		}	
 	}
-//	sendtoSSD(start_addr+sbi->blocks_per_seg, END_ADDR_GC); 
 	return 0;
 }
 /*
@@ -687,18 +929,22 @@ static bool is_alive(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
 	return true;
 }
 
-static void move_encrypted_block(struct inode *inode, block_t bidx)
+static void move_encrypted_block(struct inode *inode, block_t bidx,
+								int gc_type)
 {
 	struct f2fs_io_info fio = {
 		.sbi = F2FS_I_SB(inode),
 		.type = DATA,
 		.rw = READ_SYNC,
+		.ctx = gc_io_ctx(gc_type),
 		.encrypted_page = NULL,
 	};
 	struct dnode_of_data dn;
 	struct f2fs_summary sum;
 	struct node_info ni;
 	struct page *page;
+	block_t old_blkaddr;
+	u64 start = f2fs_gc_trace_clock();
 	int err;
 
 	/* do not read out */
@@ -757,6 +1003,7 @@ static void move_encrypted_block(struct inode *inode, block_t bidx)
 
 	/* allocate block address */
 	f2fs_wait_on_page_writeback(dn.node_page, NODE);
+	old_blkaddr = fio.blk_addr;
 	allocate_data_block(fio.sbi, NULL, fio.blk_addr,
 					&fio.blk_addr, &sum, CURSEG_COLD_DATA);
 	fio.rw = WRITE_SYNC;
@@ -768,6 +1015,9 @@ static void move_encrypted_block(struct inode *inode, block_t bidx)
 	set_inode_flag(F2FS_I(inode), FI_APPEND_WRITE);
 	if (page->index == 0)
 		set_inode_flag(F2FS_I(inode), FI_FIRST_BLOCK_WRITTEN);
+	stat_inc_gc_move(fio.sbi, GC_MOVE_HOST);
+	f2fs_trace_gc(fio.sbi, inode->i_ino, bidx, old_blkaddr, fio.blk_addr,
+					GC_TRACE_ENCRYPTED, start);
 put_page_out:
 	f2fs_put_page(fio.encrypted_page, 1);
 put_out:
@@ -775,55 +1025,35 @@ put_out:
 out:
 	f2fs_put_page(page, 1);
 }
-static void remap_data_page(struct inode *inode, block_t bidx, int gc_type) { // 主要是修改相关的东西。
-	// write something.
-	struct page *page = fio->page;
-	struct inode *inode = page->mapping->host;
-	struct dnode_of_data dn;
-	int err = 0;
-
-	set_new_dnode(&dn, inode, NULL, NULL, 0);
-	err = get_dnode_of_data(&dn, bidx, LOOKUP_NODE);
-	if (err)
-		return err;
-
-	/* This page is already truncated */
-	if (dn.data_blkaddr == NULL_ADDR) {
-		ClearPageUptodate(page);
-		goto out_writepage;
-	}
-
-	write_data_page(&dn, fio);
-	set_data_blkaddr(&dn);
-	f2fs_update_extent_cache(&dn);
-	trace_f2fs_do_write_data_page(page, OPU);
-	set_inode_flag(F2FS_I(inode), FI_APPEND_WRITE);
-	if (page->index == 0)
-		set_inode_flag(F2FS_I(inode), FI_FIRST_BLOCK_WRITTEN);
-
-out_writepage:
-	f2fs_put_dnode(&dn);
-	return err;
-
-}
-static void move_data_page(struct inode *inode, block_t bidx, int gc_type)
+static void move_data_page(struct inode *inode, block_t bidx, int gc_type,
+						unsigned int segno, int off)
 {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	u64 start = f2fs_gc_trace_clock();
 	struct page *page;
+	int path;
 
-	page = get_lock_data_page(inode, bidx, true); // This time to get the block_t of the index.
+	page = get_lock_data_page(inode, bidx, true, gc_io_ctx(gc_type));
 	if (IS_ERR(page))
 		return;
 
+	path = PageDirty(page) ? GC_TRACE_MOVE_DIRTY : GC_TRACE_MOVE_CLEAN;
+
 	if (gc_type == BG_GC) {
 		if (PageWriteback(page)) // 改页正在写回磁盘
 			goto out;
 		set_page_dirty(page);
 		set_cold_data(page); // Background GC will not write the page back immediately.
+		stat_inc_gc_move(sbi, GC_MOVE_HOST);
+		f2fs_trace_gc(sbi, inode->i_ino, bidx,
+				START_BLOCK(sbi, segno) + off, NULL_ADDR,
+				path, start);
 	} else {
 		struct f2fs_io_info fio = {
 			.sbi = F2FS_I_SB(inode),
 			.type = DATA,
 			.rw = WRITE_SYNC,
+			.ctx = gc_io_ctx(gc_type),
 			.page = page,
 			.encrypted_page = NULL,
 		};
@@ -832,7 +1062,12 @@ static void move_data_page(struct inode *inode, block_t bidx, int gc_type)
 		if (clear_page_dirty_for_io(page))
 			inode_dec_dirty_pages(inode);
 		set_cold_data(page);
-		do_write_data_page(&fio); // This time to write data page. Know the new logical address.
+		if (!do_write_data_page(&fio)) { // This time to write data page. Know the new logical address.
+			stat_inc_gc_move(sbi, GC_MOVE_HOST);
+			f2fs_trace_gc(sbi, inode->i_ino, bidx,
+					fio.old_blk_addr, fio.blk_addr,
+					path, start);
+		}
 		clear_cold_data(page);
 	}
 	// get the bloct_t of the inode and the bidx.
@@ -840,50 +1075,118 @@ static void move_data_page(struct inode *inode, block_t bidx, int gc_type)
 out:
 	f2fs_put_page(page, 1);
 }
-static void change_data_page(struct inode *inode, block_t bidx, int gc_type)
+/*
+ * Queue the move of the block of @bidx in @rb, so that the device relocates
+ * the data instead of the host copying it.  The new block is reserved when
+ * the batch is committed.  Returns false if the block has to be copied by
+ * move_data_page() instead, e.g. because the page cache holds newer data
+ * than the device.
+ */
+static bool remap_data_page(struct inode *inode, block_t bidx,
+			unsigned int segno, int off, struct remap_batch *rb)
 {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
 	struct page *page;
-	// change the code: get cached page.
-	page = get_cached_data_page(inode, 
-					start_bidx + ofs_in_node, READA, true,off);
-	/* wait for read completion */
-	lock_page(page);
-	if (unlikely(!PageUptodate(page))) {
+
+	if (rb->nr_entries >= rb->max_entries)
+		return false;
+	if (f2fs_is_atomic_file(inode))
+		return false;
+
+	page = f2fs_grab_cache_page(inode->i_mapping, bidx, false);
+	if (!page)
+		return false;
+
+	if (PageDirty(page) || PageWriteback(page)) {
 		f2fs_put_page(page, 1);
-		return;
+		return false;
 	}
-	if (unlikely(page->mapping != mapping)) {
+
+	/* the block is handled, even if it turns out not to need moving */
+	if (!check_valid_map(sbi, segno, off)) {
 		f2fs_put_page(page, 1);
-		return;
+		return true;
 	}
-	//page = get_lock_data_page(inode, bidx, true); // This time to get the block_t of the index. 
-	if (IS_ERR(page))
-		return;
 
-	if (gc_type == BG_GC) {
-		if (PageWriteback(page)) //该页正在写回磁盘
-			goto out;
-		set_page_dirty(page);
-		set_cold_data(page); // Background GC will not write the page back immediately.
-	} else {
-		struct f2fs_io_info fio = {
-			.sbi = F2FS_I_SB(inode),
-			.type = DATA,
-			.rw = WRITE_SYNC,
-			.page = page,
-			.encrypted_page = NULL,
-		};
-		if (clear_page_dirty_for_io(page)) // What is the aim? Because this page is ready to write, so it is not dirty anymore?
-			inode_dec_dirty_pages(inode);  // decrease dirty pages?
-		set_cold_data(page);
-		do_remap_data_page(&fio);
-		clear_cold_data(page);
-	}
-	// get the bloct_t of the inode and the bidx.
+	/* the batch keeps the page locked until it is committed */
+	atomic_inc(&F2FS_I(inode)->i_remap_pending);
+	f2fs_remap_add(rb, page, START_BLOCK(sbi, segno) + off);
+	return true;
+}
 
-out:
-	f2fs_put_page(page, 1);
+/*
+ * Snapshot the valid map of a victim, so that readahead phases don't take
+ * sentry_lock for every block.  Valid blocks start as uncached.  The map of
+ * segno starts at block @base, one segment per slot of the section.
+ */
+static void init_gc_blk_state(struct f2fs_sb_info *sbi, struct gc_ctx *gc,
+				unsigned int segno, unsigned int base)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct seg_entry *se;
+	unsigned int off;
+
+	memset(gc->blk_state + base / GC_BLK_PER_LONG, 0,
+						GC_BLK_STATE_SIZE(sbi));
+
+	down_read(&sit_i->sentry_lock);
+	se = get_seg_entry(sbi, segno);
+	for_each_set_bit(off, se->cur_valid_map, sbi->blocks_per_seg)
+		set_gc_blk_state(gc, base + off, GC_BLK_UNCACHED);
+	up_read(&sit_i->sentry_lock);
+}
+
+/* page cache state of a valid data block, without reading it */
+static int classify_data_block(struct inode *inode, pgoff_t index)
+{
+	struct page *page;
+	int state = GC_BLK_UNCACHED;
+
+	page = find_get_page(inode->i_mapping, index);
+	if (!page)
+		return state;
+
+	if (PageDirty(page) || PageWriteback(page))
+		state = GC_BLK_DIRTY;
+	else if (PageUptodate(page))
+		state = GC_BLK_CLEAN;
+	f2fs_put_page(page, 0);
+	return state;
 }
+
+/*
+ * Pick how a valid data block of a FG victim gets relocated.  The device can
+ * only move what it holds already, so blocks with newer data in the page
+ * cache are copied by the host.  So are blocks of encrypted files, whose
+ * ciphertext may be cached in META_MAPPING, and of atomic files, whose
+ * pages are staged in memory.  Otherwise the command the device still
+ * accepts is used.
+ */
+static int gc_data_mover(struct inode *inode, int blk_state,
+						struct remap_batch *rb)
+{
+	if (!rb || rb->op < 0 || blk_state == GC_BLK_DIRTY)
+		return GC_MOVE_HOST;
+	if (f2fs_encrypted_inode(inode) || f2fs_is_atomic_file(inode))
+		return GC_MOVE_HOST;
+	return rb->op == REMAP_OP_COPY ? GC_MOVE_DCOPY : GC_MOVE_REMAP;
+}
+
+/*
+ * Copy a block which the device failed to relocate.  Called from
+ * f2fs_remap_commit() with no page locked; @inode is pinned by the
+ * gc_inode_list of the running f2fs_gc().
+ */
+void f2fs_gc_move_fallback(struct inode *inode, pgoff_t index,
+						block_t old_blkaddr)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+
+	stat_inc_gc_move(sbi, GC_MOVE_FALLBACK);
+	move_data_page(inode, index, FG_GC, GET_SEGNO(sbi, old_blkaddr),
+				GET_BLKOFF_FROM_SEG0(sbi, old_blkaddr));
+}
+
 /*
  * This function tries to get parent node of victim data block, and identifies
  * data block validity. If the block is valid, copy that with cold status and
@@ -891,26 +1194,28 @@ out:
  * If the parent node is not valid or the data block address is different,
  * the victim data block is ignored.
  */
-#define EFFICIENT 1
 static int gc_data_segment(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
-		struct gc_inode_list *gc_list, unsigned int segno, int gc_type)
+		struct gc_inode_list *gc_list, unsigned int segno, int gc_type,
+		struct gc_ctx *gc)
 {
 	struct super_block *sb = sbi->sb;
 	struct f2fs_summary *entry;
+	struct remap_batch *rb = NULL;
+	unsigned int planned = 0;
 	block_t start_addr;
 	int off;
 	int phase = 0;
-	unsigned int ori_lba = 0;
-	unsigned int new_lba = 0;
-	unsigned int len = -1;
-
-	// get the bitmap of the segment. 512*32.
-	#ifdef EFFICIENT
-		int * array,i;
-        array = kzalloc(sizeof(int)*512,GFP_KERNEL);
-	#endif
+
 	start_addr = START_BLOCK(sbi, segno);
-	printk(KERN_EMERG "gc_data::%x\n",start_addr); 
+	init_gc_blk_state(sbi, gc, segno, 0);
+	gc->nr_ra = 0;
+
+	/*
+	 * Clean cached blocks are remapped instead of being rewritten at
+	 * writeback, uncached ones as far as the idle budget goes.
+	 */
+	if (gc_type == BG_GC)
+		rb = gc->rb;
 next_step:
 	entry = sum;
 
@@ -920,16 +1225,21 @@ next_step:
 		struct node_info dni; /* dnode info for the data */
 		unsigned int ofs_in_node, nofs;
 		block_t start_bidx;
+		bool skip_read;
+		int state;
 
 		/* stop BG_GC if there is not enough free sections. */
 		if (gc_type == BG_GC && has_not_enough_free_secs(sbi, 0))
-			return 0;
+			goto out;
 
-		if (check_valid_map(sbi, segno, off) == 0) // check if the block is valid.
+		if (gc_blk_state(gc, off) == GC_BLK_INVALID)
+			continue;
+		/* readahead may use the snapshot, moving must not */
+		if (phase > 1 && check_valid_map(sbi, segno, off) == 0)
 			continue;
 
 		if (phase == 0) {
-			ra_node_page(sbi, le32_to_cpu(entry->nid)); // read the node page of the moving block.
+			queue_node_ra(gc, le32_to_cpu(entry->nid));
 			continue;
 		}
 
@@ -938,7 +1248,7 @@ next_step:
 			continue;
 
 		if (phase == 1) {
-			ra_node_page(sbi, dni.ino); // read the inode of the moving block.
+			queue_node_ra(gc, dni.ino);
 			continue;
 		}
 
@@ -956,38 +1266,32 @@ next_step:
 				continue;
 			}
 			
-			start_bidx = start_bidx_of_node(nofs, F2FS_I(inode)); // 对应node block的start_bidx.
-			
-			
-			/*change : 1. judge the page in the page cache but clean or not in the cache. 2. judge the page is dirty.
-				1. just remap.
-				2. just move data.
-			*/
-			
-			data_page = get_cached_data_page(inode, 
-					start_bidx + ofs_in_node, READA, true,off); // read the block in data_page.
-			if (PageUptodate(data_page)) { // means data already in the page cache.
-				if(!PageDirty(data_page)){ // if page is not dirty.
-					printk("2\n");
-					array[off] = 2;
-				} else { // if page is dirty.
-					// 1. At first, I will remove the page. I think the overhead is the smallest.
-					// 2. Then, what need to do is syncing to the ssd. But I don't know how to sync.
-					#ifdef EFFICIENT
-						array[off] = 1;
-						// *** write the page back to the .
-					#endif
-					printk("1\n");
-				}
-			} else {
-				// page haven't read. add the remap table.
-				array[off] = 3;
+			/* cached blocks need no read */
+			start_bidx = start_bidx_of_node(nofs, F2FS_I(inode));
+			set_gc_blk_state(gc, off, classify_data_block(inode,
+						start_bidx + ofs_in_node));
+			skip_read = gc_blk_state(gc, off) != GC_BLK_UNCACHED;
+
+			/* nor do those the device will move */
+			if (!skip_read && planned < gc->remap_budget &&
+				gc_data_mover(inode, GC_BLK_UNCACHED, rb) !=
+							GC_MOVE_HOST) {
+				planned++;
+				skip_read = true;
 			}
-			if (IS_ERR(data_page)) { //#define IS_ERR_VALUE(x) unlikely((unsigned long)(void *)(x) >= (unsigned long)-MAX_ERRNO)
-				printk("erro:IS_ERR(data_page);\n");
-				iput(inode); // The function is used to reduce the usage count of inode.
+
+			if (skip_read) {
+				add_gc_inode(gc_list, inode);
 				continue;
-			} 
+			}
+
+			data_page = get_read_data_page(inode,
+					start_bidx + ofs_in_node, READA, true,
+					gc_io_ctx(gc_type));
+			if (IS_ERR(data_page)) {
+				iput(inode);
+				continue;
+			}
 
 			f2fs_put_page(data_page, 0); // 减少引用计数，前面函数grab_page_cache用到，所以这里手动释放。
 			add_gc_inode(gc_list, inode);
@@ -999,20 +1303,29 @@ next_step:
 		if (inode) {
 			start_bidx = start_bidx_of_node(nofs, F2FS_I(inode))
 								+ ofs_in_node;
-			if (f2fs_encrypted_inode(inode) && S_ISREG(inode->i_mode))
-				move_encrypted_block(inode, start_bidx);
-			else{
-				
-				if(array[off]==1 || gc_type == BG_GC) // if set bit , means dirty page.
-					move_data_page(inode, start_bidx, gc_type); // write data to ?
-				else	
-					change_data_page(inode, start_bidx, gc_type); // write data to ?
-			}
-				
+			if (rb && rb->nr_entries >= rb->max_entries)
+				f2fs_remap_commit(sbi, rb);
+
+			/* dirty pages are left to writeback as before */
+			state = gc_blk_state(gc, off);
+			if ((state == GC_BLK_CLEAN || gc->remap_budget) &&
+				gc_data_mover(inode, state, rb) != GC_MOVE_HOST &&
+				remap_data_page(inode, start_bidx, segno,
+								off, rb)) {
+				if (state != GC_BLK_CLEAN)
+					gc->remap_budget--;
+			} else if (f2fs_encrypted_inode(inode) &&
+						S_ISREG(inode->i_mode))
+				move_encrypted_block(inode, start_bidx, gc_type);
+			else
+				move_data_page(inode, start_bidx, gc_type,
+								segno, off);
 			stat_inc_data_blk_count(sbi, 1, gc_type);
 		}
 	}
 
+	if (phase < 2)
+		submit_node_ra(sbi, gc);
 	if (++phase < 4)
 		goto next_step;
 
@@ -1024,77 +1337,108 @@ next_step:
 			return 1;
 		}	
 	}
+out:
+	if (rb)
+		f2fs_remap_commit(sbi, rb);
 	return 0;
 }
-static int gc_data_segment_FG(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
-		struct gc_inode_list *gc_list, unsigned int segno, int gc_type)
+/*
+ * Same as gc_data_segment(), but valid blocks are handed to the device for
+ * remapping where possible, and the whole victim section is cleaned in one
+ * pass: every phase walks all segments picked by do_garbage_collect() before
+ * the next phase starts, so node and inode readahead of the section is in
+ * flight at once.  Remap requests are collected in a batch which may cross
+ * segment boundaries, and committed to the device whenever it fills up.
+ * Blocks found dirty in the page cache are copied without trying a remap.
+ */
+static int gc_data_section(struct f2fs_sb_info *sbi,
+		struct gc_inode_list *gc_list, unsigned int start_segno,
+		int gc_type, struct gc_ctx *gc)
 {
+	struct remap_batch *rb = gc->rb;
 	struct super_block *sb = sbi->sb;
-	struct f2fs_summary *entry;
-	block_t start_addr;
-	int off;
+	unsigned int blks_per_sec = sbi->segs_per_sec << sbi->log_blocks_per_seg;
+	unsigned int blk;
 	int phase = 0;
 
-	start_addr = START_BLOCK(sbi, segno);
-	printk(KERN_EMERG "gc_data::%x\n",start_addr); 
-//	sendtoSSD(start_addr, START_ADDR_GC); 
+	gc->nr_ra = 0;
 next_step:
-	entry = sum;
-
-	for (off = 0; off < sbi->blocks_per_seg; off++, entry++) {
+	for (blk = 0; blk < blks_per_sec; blk++) {
+		unsigned int i = blk >> sbi->log_blocks_per_seg;
+		unsigned int segno = start_segno + i;
+		int off = blk & (sbi->blocks_per_seg - 1);
+		struct f2fs_summary_block *sum;
+		struct f2fs_summary *entry;
 		struct page *data_page;
 		struct inode *inode;
 		struct node_info dni; /* dnode info for the data */
 		unsigned int ofs_in_node, nofs;
 		block_t start_bidx;
 
-		/* stop BG_GC if there is not enough free sections. */
-		if (gc_type == BG_GC && has_not_enough_free_secs(sbi, 0))
-			return 0;
+		/* segment was left out by do_garbage_collect() */
+		if (!gc->sum_pages[i]) {
+			blk += sbi->blocks_per_seg - 1;
+			continue;
+		}
 
-		if (check_valid_map(sbi, segno, off) == 0) // check if the block is valid.
+		if (gc_blk_state(gc, blk) == GC_BLK_INVALID)
 			continue;
+		/* readahead may use the snapshot, moving must not */
+		if (phase > 1 && check_valid_map(sbi, segno, off) == 0)
+			continue;
+
+		sum = page_address(gc->sum_pages[i]);
+		entry = &sum->entries[off];
 
 		if (phase == 0) {
-			ra_node_page(sbi, le32_to_cpu(entry->nid)); // read the node page of the moving block.
+			queue_node_ra(gc, le32_to_cpu(entry->nid));
 			continue;
 		}
 
 		/* Get an inode by ino with checking validity */
-		if (!is_alive(sbi, entry, &dni, start_addr + off, &nofs)) // get ino number by reading NAT.
+		if (!is_alive(sbi, entry, &dni, START_BLOCK(sbi, segno) + off,
+								&nofs))
 			continue;
 
 		if (phase == 1) {
-			ra_node_page(sbi, dni.ino); // read the inode of the moving block.
+			queue_node_ra(gc, dni.ino);
 			continue;
 		}
 
 		ofs_in_node = le16_to_cpu(entry->ofs_in_node); // the offset in the dnode.
 
 		if (phase == 2) {
-			inode = f2fs_iget(sb, dni.ino); // get the inode(already in page cache) , which is in the cache. ???
+			inode = f2fs_iget(sb, dni.ino);
 			if (IS_ERR(inode) || is_bad_inode(inode))
 				continue;
 
-			/* if encrypted（加密的） inode, let's go phase 3 */
+			/* if encrypted inode, let's go phase 3 */
 			if (f2fs_encrypted_inode(inode) &&
 						S_ISREG(inode->i_mode)) {
 				add_gc_inode(gc_list, inode);
 				continue;
 			}
-			
+
+			/* cached blocks and those the device moves need no read */
 			start_bidx = start_bidx_of_node(nofs, F2FS_I(inode));
-			// First, record the block number of the page.
-			data_page = get_read_data_page(inode, 
-					start_bidx + ofs_in_node, READA, true,off); // read the block in data_page.
+			set_gc_blk_state(gc, blk, classify_data_block(inode,
+						start_bidx + ofs_in_node));
+			if (gc_blk_state(gc, blk) != GC_BLK_UNCACHED ||
+				gc_data_mover(inode, GC_BLK_UNCACHED, rb) !=
+							GC_MOVE_HOST) {
+				add_gc_inode(gc_list, inode);
+				continue;
+			}
+
+			data_page = get_read_data_page(inode,
+					start_bidx + ofs_in_node, READA, true,
+					gc_io_ctx(gc_type));
 			if (IS_ERR(data_page)) {
-				iput(inode); // The function is used to reduce the usage count of inode.
+				iput(inode);
 				continue;
-			} 
-		/*	if(PageDirty(data_page))
-				printk(KERN_EMERG "2:%d\n",off); */// print wheater the page cached is dirty.
+			}
 
-			f2fs_put_page(data_page, 0); // What is the meaning of page cache release?
+			f2fs_put_page(data_page, 0);
 			add_gc_inode(gc_list, inode);
 			continue;
 		}
@@ -1102,98 +1446,222 @@ next_step:
 		/* phase 3 */
 		inode = find_gc_inode(gc_list, dni.ino);
 		if (inode) {
+			/* a full batch goes to the device before queueing more */
+			if (rb && rb->nr_entries >= rb->max_entries)
+				f2fs_remap_commit(sbi, rb);
+
 			start_bidx = start_bidx_of_node(nofs, F2FS_I(inode))
 								+ ofs_in_node;
-			if (f2fs_encrypted_inode(inode) && S_ISREG(inode->i_mode))
-				move_encrypted_block(inode, start_bidx);
-			else
-				move_data_page(inode, start_bidx, gc_type); // write data to ?
+			switch (gc_data_mover(inode, gc_blk_state(gc, blk), rb)) {
+			case GC_MOVE_REMAP:
+			case GC_MOVE_DCOPY:
+				if (remap_data_page(inode, start_bidx,
+							segno, off, rb))
+					break;
+				/* fall through */
+			default:
+				if (f2fs_encrypted_inode(inode) &&
+						S_ISREG(inode->i_mode))
+					move_encrypted_block(inode, start_bidx,
+								gc_type);
+				else
+					move_data_page(inode, start_bidx,
+							gc_type, segno, off);
+				break;
+			}
 			stat_inc_data_blk_count(sbi, 1, gc_type);
 		}
 	}
 
+	if (phase < 2)
+		submit_node_ra(sbi, gc);
 	if (++phase < 4)
 		goto next_step;
 
-	if (gc_type == FG_GC) {
-		f2fs_submit_merged_bio(sbi, DATA, WRITE);
+	if (rb)
+		f2fs_remap_commit(sbi, rb);
 
-		/* return 1 only if FG_GC succefully reclaimed one */
-		if (get_valid_blocks(sbi, segno, 1) == 0){
-//			sendtoSSD(start_addr+sbi->blocks_per_seg, END_ADDR_GC); 
-			return 1;
-		}	
-	}
-//	sendtoSSD(start_addr+sbi->blocks_per_seg, END_ADDR_GC); 
-	return 0;
+	f2fs_submit_merged_bio(sbi, DATA, WRITE);
+
+	/* return 1 only if FG_GC succefully reclaimed the section */
+	return get_valid_blocks(sbi, start_segno, sbi->segs_per_sec) == 0;
 }
+
 static int __get_victim(struct f2fs_sb_info *sbi, unsigned int *victim,
 			int gc_type)
 {
 	struct sit_info *sit_i = SIT_I(sbi);
 	int ret;
 
-	mutex_lock(&sit_i->sentry_lock);
+	if (select_gc_type(sbi, gc_type) == GC_REMAP)
+		refresh_remap_estimates(sbi);
+
+	down_write(&sit_i->sentry_lock);
 	ret = DIRTY_I(sbi)->v_ops->get_victim(sbi, victim, gc_type,
 					      NO_CHECK_TYPE, LFS);
-	mutex_unlock(&sit_i->sentry_lock);
+	up_write(&sit_i->sentry_lock);
 	return ret;
 }
 
-static int do_garbage_collect(struct f2fs_sb_info *sbi, unsigned int segno,
-				struct gc_inode_list *gc_list, int gc_type)
+static int do_garbage_collect(struct f2fs_sb_info *sbi,
+				unsigned int start_segno,
+				struct gc_inode_list *gc_list, int gc_type,
+				struct gc_ctx *gc)
 {
-	if(gc_type==FG_GC) {
-		printk("FG_GC:--------\n");
-	} else {
-		printk("BG_GC:--------\n");
-	}
 	struct page *sum_page;
 	struct f2fs_summary_block *sum;
 	struct blk_plug plug;
+	unsigned int segno, end_segno = start_segno + sbi->segs_per_sec;
+	unsigned int i, nr_planned = 0;
 	int nfree = 0;
 
-	/* read segment summary of victim */
-	sum_page = get_sum_page(sbi, segno);
+	/* readahead multi ssa blocks those have contiguous address */
+	if (sbi->segs_per_sec > 1)
+		ra_meta_pages(sbi, GET_SUM_BLOCK(sbi, start_segno),
+					sbi->segs_per_sec, META_SSA, true);
 
 	blk_start_plug(&plug);
 
-	sum = page_address(sum_page);
+	for (segno = start_segno; segno < end_segno; segno++) {
+		/* read segment summary of victim */
+		sum_page = get_sum_page(sbi, segno);
+		sum = page_address(sum_page);
 
-	/*
-	 * this is to avoid deadlock:
-	 * - lock_page(sum_page)         - f2fs_replace_block
-	 *  - check_valid_map()            - mutex_lock(sentry_lock)
-	 *   - mutex_lock(sentry_lock)     - change_curseg()
-	 *                                  - lock_page(sum_page)
-	 */
-	unlock_page(sum_page);
-
-	switch (GET_SUM_TYPE((&sum->footer))) {
-	case SUM_TYPE_NODE:
-		nfree = gc_node_segment(sbi, sum->entries, segno, gc_type);
-		break;
-	case SUM_TYPE_DATA:
-		if(gc_type==FG_GC)
-			nfree = gc_data_segment_FG(sbi, sum->entries, gc_list,
-							segno, gc_type);
-		else
+		/*
+		 * this is to avoid deadlock:
+		 * - lock_page(sum_page)         - f2fs_replace_block
+		 *  - check_valid_map()            - down_write(sentry_lock)
+		 *   - down_read(sentry_lock)      - change_curseg()
+		 *                                  - lock_page(sum_page)
+		 */
+		unlock_page(sum_page);
+
+		switch (GET_SUM_TYPE((&sum->footer))) {
+		case SUM_TYPE_NODE:
+			nfree = gc_node_segment(sbi, sum->entries, segno,
+								gc_type, gc);
+			break;
+		case SUM_TYPE_DATA:
+			if (gc_type == FG_GC) {
+				/* keep it referenced for gc_data_section() */
+				i = segno - start_segno;
+				init_gc_blk_state(sbi, gc, segno,
+						i << sbi->log_blocks_per_seg);
+				gc->sum_pages[i] = sum_page;
+				nr_planned++;
+				continue;
+			}
 			nfree = gc_data_segment(sbi, sum->entries, gc_list,
-							segno, gc_type);
-		break;
+							segno, gc_type, gc);
+			break;
+		}
+
+		stat_inc_seg_count(sbi, GET_SUM_TYPE((&sum->footer)), gc_type);
+		f2fs_put_page(sum_page, 0);
+
+		/*
+		 * for FG_GC case, halt gcing left segments once failed one
+		 * of segments in selected section to avoid long latency.
+		 */
+		if (!nfree && gc_type == FG_GC)
+			break;
+	}
+
+	/* data segments of a FG_GC victim are cleaned all together */
+	if (nr_planned) {
+		nfree = gc_data_section(sbi, gc_list, start_segno, gc_type, gc);
+
+		for (i = 0; i < sbi->segs_per_sec; i++) {
+			if (!gc->sum_pages[i])
+				continue;
+			stat_inc_seg_count(sbi, SUM_TYPE_DATA, gc_type);
+			f2fs_put_page(gc->sum_pages[i], 0);
+			gc->sum_pages[i] = NULL;
+		}
 	}
 	blk_finish_plug(&plug);
 
-	stat_inc_seg_count(sbi, GET_SUM_TYPE((&sum->footer)), gc_type);
 	stat_inc_call_count(sbi->stat_info);
 
-	f2fs_put_page(sum_page, 0);
 	return nfree;
 }
 
+static void gc_worker_func(struct work_struct *work)
+{
+	struct gc_worker *w = container_of(work, struct gc_worker, work);
+	struct f2fs_sb_info *sbi = w->sbi;
+	struct gc_inode_list gc_list = {
+		.ilist = LIST_HEAD_INIT(gc_list.ilist),
+		.iroot = RADIX_TREE_INIT(GFP_NOFS),
+	};
+	struct remap_batch remap_batch;
+	struct gc_ctx gc = {
+		.blk_state = w->blk_state,
+		.sum_pages = w->sum_pages,
+		.ra_nis = w->ra_nis,
+		.rb = &remap_batch,
+	};
+
+	if (f2fs_remap_init_batch(sbi, gc.rb))
+		gc.rb = NULL;
+
+	w->freed = do_garbage_collect(sbi, w->segno, &gc_list, FG_GC, &gc);
+
+	clear_bit(GET_SECNO(sbi, w->segno), DIRTY_I(sbi)->fg_victim_secmap);
+
+	if (gc.rb)
+		f2fs_remap_destroy_batch(sbi, gc.rb);
+	put_gc_inode(&gc_list);
+}
+
+/*
+ * Pick further FG_GC victims for the workers, as long as the victim the
+ * caller is about to clean and those picked so far are not enough.  The
+ * victims are disjoint, since sec_usage_check() skips the sections which
+ * are in fg_victim_secmap.
+ */
+static unsigned int assign_gc_workers(struct f2fs_sb_info *sbi, int sec_freed)
+{
+	unsigned int nr = min(sbi->gc_threads, sbi->nr_gc_workers);
+	unsigned int i;
+
+	for (i = 1; i < nr; i++) {
+		struct gc_worker *w = &sbi->gc_workers[i];
+
+		if (!has_not_enough_free_secs(sbi, sec_freed + i))
+			break;
+		if (!__get_victim(sbi, &w->segno, FG_GC))
+			break;
+	}
+	return i - 1;
+}
+
+static void queue_gc_workers(struct f2fs_sb_info *sbi, unsigned int nr_queued)
+{
+	unsigned int i;
+
+	for (i = 1; i <= nr_queued; i++)
+		queue_work(sbi->gc_wq, &sbi->gc_workers[i].work);
+}
+
+static int wait_gc_workers(struct f2fs_sb_info *sbi, unsigned int nr_queued,
+						struct gc_hint *hint)
+{
+	unsigned int i;
+	int sec_freed = 0;
+
+	for (i = 1; i <= nr_queued; i++) {
+		flush_work(&sbi->gc_workers[i].work);
+		if (sbi->gc_workers[i].freed)
+			sec_freed++;
+		end_gc_hint(sbi, hint, sbi->gc_workers[i].segno);
+	}
+	return sec_freed;
+}
+
 int f2fs_gc(struct f2fs_sb_info *sbi, bool sync)
-{	
-	unsigned int segno, i;
+{
+	unsigned int segno, nr_queued = 0;
 	int gc_type = sync ? FG_GC : BG_GC;
 	int sec_freed = 0;
 	int ret = -EINVAL;
@@ -1202,8 +1670,20 @@ int f2fs_gc(struct f2fs_sb_info *sbi, bool sync)
 		.ilist = LIST_HEAD_INIT(gc_list.ilist),
 		.iroot = RADIX_TREE_INIT(GFP_NOFS),
 	};
+	struct remap_batch remap_batch;
+	struct gc_ctx gc = {
+		.blk_state = sbi->gc_workers[0].blk_state,
+		.sum_pages = sbi->gc_workers[0].sum_pages,
+		.ra_nis = sbi->gc_workers[0].ra_nis,
+		.rb = &remap_batch,
+		.remap_budget = sbi->gc_remap_budget,
+	};
 
 	cpc.reason = __get_cp_reason(sbi);
+
+	/* without a batch buffer, fall back to copying every block */
+	if (f2fs_remap_init_batch(sbi, gc.rb))
+		gc.rb = NULL;
 gc_more:
 	segno = NULL_SEGNO;
 
@@ -1222,26 +1702,26 @@ gc_more:
 		goto stop;
 	ret = 0;
 
-	/* readahead multi ssa blocks those have contiguous address */
-	if (sbi->segs_per_sec > 1)
-		ra_meta_pages(sbi, GET_SUM_BLOCK(sbi, segno), sbi->segs_per_sec,
-							META_SSA, true);
+	/* writers are stalled in f2fs_balance_fs(), clean in parallel */
+	if (gc_type == FG_GC && !sync)
+		nr_queued = assign_gc_workers(sbi, sec_freed);
 
-	for (i = 0; i < sbi->segs_per_sec; i++) {
-		/*
-		 * for FG_GC case, halt gcing left segments once failed one
-		 * of segments in selected section to avoid long latency.
-		 */
-		if (!do_garbage_collect(sbi, segno + i, &gc_list, gc_type) &&
-				gc_type == FG_GC)
-			break;
-	}
+	start_gc_hint(sbi, &gc.hint, segno, nr_queued);
+	queue_gc_workers(sbi, nr_queued);
 
-	if (i == sbi->segs_per_sec && gc_type == FG_GC)
+	if (do_garbage_collect(sbi, segno, &gc_list, gc_type, &gc) &&
+						gc_type == FG_GC)
 		sec_freed++;
+	end_gc_hint(sbi, &gc.hint, segno);
 
 	if (gc_type == FG_GC)
-		sbi->cur_victim_sec = NULL_SEGNO;
+		clear_bit(GET_SECNO(sbi, segno),
+				DIRTY_I(sbi)->fg_victim_secmap);
+
+	if (nr_queued) {
+		sec_freed += wait_gc_workers(sbi, nr_queued, &gc.hint);
+		nr_queued = 0;
+	}
 
 	if (!sync) {
 		if (has_not_enough_free_secs(sbi, sec_freed))
@@ -1251,8 +1731,11 @@ gc_more:
 			write_checkpoint(sbi, &cpc);
 	}
 stop:
-	mutex_unlock(&sbi->gc_mutex);
+	flush_gc_hint(sbi, &gc.hint);
+	f2fs_unlock_gc(sbi);
 
+	if (gc.rb)
+		f2fs_remap_destroy_batch(sbi, gc.rb);
 	put_gc_inode(&gc_list);
 
 	if (sync)
@@ -1260,7 +1743,77 @@ stop:
 	return ret;
 }
 
-void build_gc_manager(struct f2fs_sb_info *sbi)
+static int init_gc_worker(struct f2fs_sb_info *sbi, struct gc_worker *w)
 {
+	INIT_WORK(&w->work, gc_worker_func);
+	w->sbi = sbi;
+
+	w->blk_state = f2fs_kvzalloc(GC_BLK_STATE_SIZE(sbi) *
+					sbi->segs_per_sec, GFP_KERNEL);
+	if (!w->blk_state)
+		return -ENOMEM;
+
+	w->sum_pages = kcalloc(sbi->segs_per_sec, sizeof(struct page *),
+								GFP_KERNEL);
+	if (!w->sum_pages)
+		return -ENOMEM;
+
+	/* a victim section has at most one node to read per block */
+	w->ra_nis = f2fs_kvzalloc(sizeof(struct node_info) *
+			(sbi->segs_per_sec << sbi->log_blocks_per_seg),
+			GFP_KERNEL);
+	if (!w->ra_nis)
+		return -ENOMEM;
+	return 0;
+}
+
+int build_gc_manager(struct f2fs_sb_info *sbi)
+{
+	unsigned int i;
+
 	DIRTY_I(sbi)->v_ops = &default_v_ops;
+
+	/* gc_threads may only be lowered by remount */
+	sbi->gc_workers = kcalloc(sbi->gc_threads, sizeof(struct gc_worker),
+								GFP_KERNEL);
+	if (!sbi->gc_workers)
+		return -ENOMEM;
+	sbi->nr_gc_workers = sbi->gc_threads;
+
+	for (i = 0; i < sbi->nr_gc_workers; i++)
+		if (init_gc_worker(sbi, &sbi->gc_workers[i]))
+			goto fail;
+
+	if (sbi->nr_gc_workers > 1) {
+		/* FG_GC runs on behalf of writeback and reclaim */
+		sbi->gc_wq = alloc_workqueue("f2fs_gc", WQ_UNBOUND |
+				WQ_MEM_RECLAIM, sbi->nr_gc_workers - 1);
+		if (!sbi->gc_wq)
+			goto fail;
+	}
+	return 0;
+fail:
+	destroy_gc_manager(sbi);
+	return -ENOMEM;
+}
+
+void destroy_gc_manager(struct f2fs_sb_info *sbi)
+{
+	unsigned int i;
+
+	if (sbi->gc_wq) {
+		destroy_workqueue(sbi->gc_wq);
+		sbi->gc_wq = NULL;
+	}
+
+	for (i = 0; sbi->gc_workers && i < sbi->nr_gc_workers; i++) {
+		struct gc_worker *w = &sbi->gc_workers[i];
+
+		kvfree(w->ra_nis);
+		kfree(w->sum_pages);
+		kvfree(w->blk_state);
+	}
+	kfree(sbi->gc_workers);
+	sbi->gc_workers = NULL;
+	sbi->nr_gc_workers = 0;
 }
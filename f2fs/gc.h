@@ -16,12 +16,20 @@
 #define DEF_GC_THREAD_MIN_SLEEP_TIME	30000	/* milliseconds */
 #define DEF_GC_THREAD_MAX_SLEEP_TIME	60000
 #define DEF_GC_THREAD_NOGC_SLEEP_TIME	300000	/* wait 5 min */
+#define DEF_GC_THREAD_REMAP_BLOCKS	1024	/* BG remaps per wakeup */
 #define LIMIT_INVALID_BLOCK	40 /* percentage over total user space */
 #define LIMIT_FREE_BLOCK	40 /* percentage over invalid + free space */
 
+/* FG_GC victims cleaned in parallel, see the gc_threads mount option */
+#define GC_MAX_THREADS		8
+
 /* Search max. number of dirty segments to select a victim segment */
 #define DEF_MAX_VICTIM_SEARCH 4096 /* covers 8GB */
 
+/* for GC_REMAP victim selection */
+#define GC_REMAP_SAMPLES	32	/* valid blocks sampled per segment */
+#define GC_REMAP_COPY_WEIGHT	16	/* cost of a host copy over a remap */
+
 struct f2fs_gc_kthread {
 	struct task_struct *f2fs_gc_task;
 	wait_queue_head_t gc_wait_queue_head;
@@ -33,6 +41,9 @@ struct f2fs_gc_kthread {
 
 	/* for changing gc mode */
 	unsigned int gc_idle;
+
+	/* for remapping in BG_GC, 0 disables it */
+	unsigned int max_remap_blocks;
 };
 
 struct gc_inode_list {
@@ -40,9 +51,85 @@ struct gc_inode_list {
 	struct radix_tree_root iroot;
 };
 
+/* state of a block in the victim section */
+enum {
+	GC_BLK_INVALID,		/* not valid when the segment was scanned */
+	GC_BLK_UNCACHED,	/* valid, no uptodate page cached */
+	GC_BLK_CLEAN,		/* valid, clean uptodate page cached */
+	GC_BLK_DIRTY,		/* valid, page dirty or under writeback */
+};
+
+#define GC_BLK_STATE_BITS	2
+#define GC_BLK_STATE_MASK	((1UL << GC_BLK_STATE_BITS) - 1)
+#define GC_BLK_PER_LONG		(BITS_PER_LONG / GC_BLK_STATE_BITS)
+#define GC_BLK_STATE_SIZE(sbi)						\
+	(DIV_ROUND_UP((sbi)->blocks_per_seg, GC_BLK_PER_LONG) *		\
+						sizeof(unsigned long))
+
+/* a run of adjacent victim sections, announced by one GC hint */
+struct gc_hint_run {
+	unsigned int start_secno;	/* first section of the run */
+	unsigned int nr_secs;		/* 0 if no run is open */
+	unsigned int valid;		/* valid blocks in the run */
+};
+
+/* GC hint state of one f2fs_gc() pass */
+struct gc_hint {
+	struct gc_hint_run start;	/* victims about to be cleaned */
+	struct gc_hint_run end;		/* victims cleaned, not closed yet */
+};
+
+/* state shared by all victims of one f2fs_gc() call */
+struct gc_ctx {
+	unsigned long *blk_state;	/* GC_BLK_STATE_BITS per block */
+	struct page **sum_pages;	/* planned SSA pages of FG data victim */
+	struct node_info *ra_nis;	/* nodes queued for readahead */
+	int nr_ra;			/* # of entries in ra_nis */
+	struct remap_batch *rb;		/* NULL if blocks are only copied */
+	unsigned int remap_budget;	/* blocks BG_GC may still remap */
+	struct gc_hint hint;		/* pending GC hints */
+};
+
+/*
+ * Buffers to clean one victim section.  gc_workers[0] serves the caller of
+ * f2fs_gc(), the others clean further FG_GC victims from sbi->gc_wq.
+ */
+struct gc_worker {
+	struct work_struct work;
+	struct f2fs_sb_info *sbi;
+	unsigned long *blk_state;
+	struct page **sum_pages;
+	struct node_info *ra_nis;
+	unsigned int segno;		/* victim section to clean */
+	bool freed;			/* the victim section was freed */
+};
+
 /*
  * inline functions
  */
+static inline int gc_blk_state(struct gc_ctx *gc, unsigned int off)
+{
+	return (gc->blk_state[off / GC_BLK_PER_LONG] >>
+		((off % GC_BLK_PER_LONG) * GC_BLK_STATE_BITS)) &
+							GC_BLK_STATE_MASK;
+}
+
+static inline void set_gc_blk_state(struct gc_ctx *gc, unsigned int off,
+								int state)
+{
+	unsigned long *word = &gc->blk_state[off / GC_BLK_PER_LONG];
+	unsigned int shift = (off % GC_BLK_PER_LONG) * GC_BLK_STATE_BITS;
+
+	*word = (*word & ~(GC_BLK_STATE_MASK << shift)) |
+					((unsigned long)state << shift);
+}
+
+/* F2FS_IO_* context of the block moves of a @gc_type pass */
+static inline unsigned int gc_io_ctx(int gc_type)
+{
+	return F2FS_IO_GC | (gc_type == FG_GC ? F2FS_IO_FG_GC : 0);
+}
+
 static inline block_t free_user_blocks(struct f2fs_sb_info *sbi)
 {
 	if (free_segments(sbi) < overprovision_segments(sbi))
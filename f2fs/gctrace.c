@@ -0,0 +1,187 @@
+/*
+ * fs/f2fs/gctrace.c
+ *
+ * Tracer of the blocks garbage collection relocates
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/fs.h>
+#include <linux/f2fs_fs.h>
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+
+#include "f2fs.h"
+#include "segment.h"
+#include "gctrace.h"
+
+#define GC_TRACE_ENTRIES	1024	/* records per cpu, power of 2 */
+
+/*
+ * Each cpu owns a ring written with preemption disabled, so writers never
+ * contend.  A slot is rewritten under its seqcount and remembers the ring
+ * position it was written for, so the reader retries torn copies and drops
+ * records the writer has wrapped onto.
+ */
+struct gc_trace_slot {
+	seqcount_t seq;
+	unsigned long pos;		/* value of head when written */
+	struct f2fs_gc_trace_rec rec;
+};
+
+struct gc_trace_ring {
+	struct gc_trace_slot *slots;
+	unsigned long head;		/* next record to write */
+	unsigned long tail;		/* next record to read */
+};
+
+static struct gc_trace_ring __percpu *gc_trace_rings;
+static DEFINE_MUTEX(gc_trace_mutex);	/* serializes readers */
+static struct dentry *gc_trace_file;
+
+void f2fs_trace_gc(struct f2fs_sb_info *sbi, nid_t ino, pgoff_t bidx,
+		block_t old_blkaddr, block_t new_blkaddr, int path, u64 start)
+{
+	struct gc_trace_ring *ring;
+	struct gc_trace_slot *slot;
+	struct f2fs_gc_trace_rec *rec;
+	u64 now;
+
+	if (!gc_trace_rings)
+		return;
+
+	now = local_clock();
+
+	ring = get_cpu_ptr(gc_trace_rings);
+	slot = &ring->slots[ring->head & (GC_TRACE_ENTRIES - 1)];
+	rec = &slot->rec;
+
+	write_seqcount_begin(&slot->seq);
+	slot->pos = ring->head;
+	rec->time = now;
+	rec->dev = new_encode_dev(sbi->sb->s_dev);
+	rec->segno = GET_SEGNO(sbi, old_blkaddr);
+	rec->offset = GET_BLKOFF_FROM_SEG0(sbi, old_blkaddr);
+	rec->ino = ino;
+	rec->bidx = bidx;
+	rec->old_blkaddr = old_blkaddr;
+	rec->new_blkaddr = new_blkaddr;
+	rec->latency = min_t(u64, now - start, U32_MAX);
+	rec->path = path;
+	rec->rsvd = 0;
+	write_seqcount_end(&slot->seq);
+
+	/* publish the record before the reader can see the new head */
+	smp_store_release(&ring->head, ring->head + 1);
+	put_cpu_ptr(gc_trace_rings);
+}
+
+static ssize_t gc_trace_read(struct file *file, char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	struct f2fs_gc_trace_rec rec;
+	size_t copied = 0;
+	int cpu, err = 0;
+
+	mutex_lock(&gc_trace_mutex);
+	for_each_possible_cpu(cpu) {
+		struct gc_trace_ring *ring = per_cpu_ptr(gc_trace_rings, cpu);
+
+		while (count - copied >= sizeof(rec)) {
+			unsigned long head = smp_load_acquire(&ring->head);
+			struct gc_trace_slot *slot;
+			unsigned long pos;
+			unsigned int seq;
+
+			if (ring->tail == head)
+				break;
+			if (head - ring->tail > GC_TRACE_ENTRIES)
+				ring->tail = head - GC_TRACE_ENTRIES;
+
+			slot = &ring->slots[ring->tail & (GC_TRACE_ENTRIES - 1)];
+			do {
+				seq = read_seqcount_begin(&slot->seq);
+				pos = slot->pos;
+				rec = slot->rec;
+			} while (read_seqcount_retry(&slot->seq, seq));
+
+			/* the writer has wrapped onto it meanwhile */
+			if (pos != ring->tail++)
+				continue;
+
+			if (copy_to_user(buf + copied, &rec, sizeof(rec))) {
+				err = -EFAULT;
+				goto out;
+			}
+			copied += sizeof(rec);
+		}
+	}
+out:
+	mutex_unlock(&gc_trace_mutex);
+	return copied ? copied : err;
+}
+
+static const struct file_operations gc_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = nonseekable_open,
+	.read = gc_trace_read,
+	.llseek = no_llseek,
+};
+
+static void __destroy_gc_trace_rings(struct gc_trace_ring __percpu *rings)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		vfree(per_cpu_ptr(rings, cpu)->slots);
+	free_percpu(rings);
+}
+
+/* tracing is left disabled if the rings can not be allocated */
+void f2fs_build_gc_trace(void)
+{
+	struct gc_trace_ring __percpu *rings;
+	int cpu, i;
+
+	rings = alloc_percpu(struct gc_trace_ring);
+	if (!rings)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct gc_trace_ring *ring = per_cpu_ptr(rings, cpu);
+
+		ring->slots = vzalloc_node(GC_TRACE_ENTRIES *
+				sizeof(*ring->slots), cpu_to_node(cpu));
+		if (!ring->slots) {
+			__destroy_gc_trace_rings(rings);
+			return;
+		}
+		for (i = 0; i < GC_TRACE_ENTRIES; i++)
+			seqcount_init(&ring->slots[i].seq);
+	}
+
+	/* no GC runs at module init, so nobody traces yet */
+	gc_trace_rings = rings;
+
+	gc_trace_file = debugfs_create_file("f2fs_gc_trace", S_IRUSR, NULL,
+						NULL, &gc_trace_fops);
+	if (IS_ERR_OR_NULL(gc_trace_file)) {
+		gc_trace_rings = NULL;
+		__destroy_gc_trace_rings(rings);
+	}
+}
+
+void f2fs_destroy_gc_trace(void)
+{
+	if (!gc_trace_rings)
+		return;
+
+	debugfs_remove(gc_trace_file);
+	gc_trace_file = NULL;
+	__destroy_gc_trace_rings(gc_trace_rings);
+	gc_trace_rings = NULL;
+}
@@ -15,6 +15,7 @@
 #include <linux/blkdev.h>
 #include <linux/pagevec.h>
 #include <linux/swap.h>
+#include <linux/sort.h>
 
 #include "f2fs.h"
 #include "node.h"
@@ -1027,35 +1028,6 @@ static int read_node_page(struct page *page, int rw)
 	fio.blk_addr = ni.blk_addr;
 	return f2fs_submit_page_bio(&fio); // read node page.
 }
-static int read_node_page_gc(struct page *page, int rw)
-{
-	struct f2fs_sb_info *sbi = F2FS_P_SB(page);
-	struct node_info ni;
-	struct f2fs_io_info fio = {
-		.sbi = sbi,
-		.type = NODE,
-		.rw = rw,
-		.page = page,
-		.encrypted_page = NULL,
-	};
-
-	get_node_info(sbi, page->index, &ni); // what is the relation ship between them?
-
-	if (unlikely(ni.blk_addr == NULL_ADDR)) {
-		ClearPageUptodate(page); // The page is dirty!
-		return -ENOENT;
-	}
-
-	if (PageUptodate(page)){
-		return LOCKED_PAGE;
-	} // The page is locked, which is possible.
-		
-
-	fio.blk_addr = ni.blk_addr;
-	int is_original = 1;
-//	printk(KERN_EMERG "0.\n"); 
-	return f2fs_submit_page_bio(&fio);
-}
 /*
  * Readahead a node page
  */
@@ -1078,71 +1050,122 @@ void ra_node_page(struct f2fs_sb_info *sbi, nid_t nid)
 	err = read_node_page(apage, READA);
 	f2fs_put_page(apage, err ? 1 : 0);
 }
-void ra_node_page_gc(struct f2fs_sb_info *sbi, nid_t nid)
+
+static int cmp_node_info_nid(const void *a, const void *b)
 {
-	struct page *apage;
-	int err;
+	nid_t na = ((const struct node_info *)a)->nid;
+	nid_t nb = ((const struct node_info *)b)->nid;
 
-	apage = find_get_page(NODE_MAPPING(sbi), nid);
-	if (apage && PageUptodate(apage)) { // The page uptodate means in the cache. Because original data in ?
-		f2fs_put_page(apage, 0);
-//		printk(KERN_EMERG "4.\n"); // Test shows that the node page is almost cached.
-		return;
-	}
-	f2fs_put_page(apage, 0);
+	return na < nb ? -1 : na > nb;
+}
 
-	apage = grab_cache_page(NODE_MAPPING(sbi), nid);
-	if (!apage)
-		return;
+static int cmp_node_info_blkaddr(const void *a, const void *b)
+{
+	block_t ba = ((const struct node_info *)a)->blk_addr;
+	block_t bb = ((const struct node_info *)b)->blk_addr;
 
-	err = read_node_page_gc(apage, READA);
-	f2fs_put_page(apage, err ? 1 : 0);
+	return ba < bb ? -1 : ba > bb;
 }
-struct page *get_node_page(struct f2fs_sb_info *sbi, pgoff_t nid)
+
+/*
+ * Readahead the node pages of @nr nids at once.  Only the nid of each entry
+ * in @nis needs to be set; duplicated and cached nids are dropped, missing
+ * NAT blocks are read ahead first, and node blocks are submitted in on-disk
+ * order so that neighbours are merged into large bios.  @nis is overwritten.
+ */
+void ra_node_pages(struct f2fs_sb_info *sbi, struct node_info *nis, int nr)
 {
-	struct page *page;
-	int err;
-repeat:
-	// This function will make page->index = nid.
-	page = grab_cache_page(NODE_MAPPING(sbi), nid); // root inode 对应的？
-	if (!page)
-		return ERR_PTR(-ENOMEM);
+	struct f2fs_nm_info *nm_i = NM_I(sbi);
+	struct f2fs_io_info fio = {
+		.sbi = sbi,
+		.type = NODE,
+		.rw = READA,
+		.encrypted_page = NULL,
+	};
+	struct blk_plug plug;
+	pgoff_t nat_ofs = ULONG_MAX;
+	nid_t prev = 0;
+	int i, n = 0;
 
-	err = read_node_page(page, READ_SYNC); // This function read node page.
-	if (err < 0) {
-		f2fs_put_page(page, 1);
-		return ERR_PTR(err);
-	} else if (err != LOCKED_PAGE) {
-		lock_page(page);
-	}
+	if (!nr)
+		return;
 
-	if (unlikely(!PageUptodate(page) || nid != nid_of_node(page))) {
-		ClearPageUptodate(page);
-		f2fs_put_page(page, 1);
-		return ERR_PTR(-EIO);
+	sort(nis, nr, sizeof(struct node_info), cmp_node_info_nid, NULL);
+
+	blk_start_plug(&plug);
+
+	for (i = 0; i < nr; i++) {
+		nid_t nid = nis[i].nid;
+		struct page *page;
+		bool cached;
+
+		if (i && nid == prev)
+			continue;
+		prev = nid;
+
+		page = find_get_page(NODE_MAPPING(sbi), nid);
+		cached = page && PageUptodate(page);
+		f2fs_put_page(page, 0);
+		if (cached)
+			continue;
+
+		down_read(&nm_i->nat_tree_lock);
+		cached = __lookup_nat_cache(nm_i, nid) != NULL;
+		up_read(&nm_i->nat_tree_lock);
+
+		/* nids are sorted, so each NAT block is read once */
+		if (!cached && NAT_BLOCK_OFFSET(nid) != nat_ofs) {
+			nat_ofs = NAT_BLOCK_OFFSET(nid);
+			ra_meta_pages(sbi, nat_ofs, 1, META_NAT, true);
+		}
+		nis[n++].nid = nid;
 	}
-	if (unlikely(page->mapping != NODE_MAPPING(sbi))) {
-		f2fs_put_page(page, 1);
-		goto repeat;
+
+	for (i = 0; i < n; i++)
+		get_node_info(sbi, nis[i].nid, &nis[i]);
+
+	sort(nis, n, sizeof(struct node_info), cmp_node_info_blkaddr, NULL);
+
+	for (i = 0; i < n; i++) {
+		struct page *page;
+
+		if (nis[i].blk_addr == NULL_ADDR ||
+					nis[i].blk_addr == NEW_ADDR)
+			continue;
+
+		page = grab_cache_page(NODE_MAPPING(sbi), nis[i].nid);
+		if (!page)
+			continue;
+		if (PageUptodate(page)) {
+			f2fs_put_page(page, 1);
+			continue;
+		}
+
+		fio.page = page;
+		fio.blk_addr = nis[i].blk_addr;
+		f2fs_submit_page_mbio(&fio);
+		f2fs_put_page(page, 0);
 	}
-	return page;
+	f2fs_submit_merged_bio(sbi, NODE, READ);
+
+	blk_finish_plug(&plug);
 }
-struct page *get_node_page_gc(struct f2fs_sb_info *sbi, pgoff_t nid)
+
+struct page *get_node_page(struct f2fs_sb_info *sbi, pgoff_t nid)
 {
 	struct page *page;
 	int err;
 repeat:
+	// This function will make page->index = nid.
 	page = grab_cache_page(NODE_MAPPING(sbi), nid); // root inode 对应的？
 	if (!page)
 		return ERR_PTR(-ENOMEM);
 
-	err = read_node_page_gc(page, READ_SYNC); // This function read node page.
+	err = read_node_page(page, READ_SYNC); // This function read node page.
 	if (err < 0) {
-//		printk(KERN_EMERG "err < 0\n"); 
 		f2fs_put_page(page, 1);
 		return ERR_PTR(err);
 	} else if (err != LOCKED_PAGE) {
-//		printk(KERN_EMERG "err != LOCKED_PAGE\n"); 
 		lock_page(page);
 	}
 
@@ -1227,176 +1250,6 @@ void sync_inode_page(struct dnode_of_data *dn)
 		update_inode_page(dn->inode);
 	}
 }
-static int f2fs_write_node_page_gc(struct page *page,
-				struct writeback_control *wbc)
-{
-	struct f2fs_sb_info *sbi = F2FS_P_SB(page);
-	nid_t nid;
-	struct node_info ni;
-	struct f2fs_io_info fio = {
-		.sbi = sbi,
-		.type = NODE,
-		.rw = (wbc->sync_mode == WB_SYNC_ALL) ? WRITE_SYNC : WRITE,
-		.page = page,
-		.encrypted_page = NULL,
-	};
-
-	trace_f2fs_writepage(page, NODE);
-
-	if (unlikely(is_sbi_flag_set(sbi, SBI_POR_DOING)))
-		goto redirty_out;
-	if (unlikely(f2fs_cp_error(sbi)))
-		goto redirty_out;
-
-	f2fs_wait_on_page_writeback(page, NODE);
-
-	/* get old block addr of this node page */
-	nid = nid_of_node(page);
-	f2fs_bug_on(sbi, page->index != nid);
-
-	if (wbc->for_reclaim) {
-		if (!down_read_trylock(&sbi->node_write))
-			goto redirty_out;
-	} else {
-		down_read(&sbi->node_write);
-	}
-
-	get_node_info(sbi, nid, &ni);
-
-	/* This page is already truncated */
-	if (unlikely(ni.blk_addr == NULL_ADDR)) {
-		ClearPageUptodate(page);
-		dec_page_count(sbi, F2FS_DIRTY_NODES);
-		up_read(&sbi->node_write);
-		unlock_page(page);
-		return 0;
-	}
-
-	set_page_writeback(page);
-	fio.blk_addr = ni.blk_addr;
-	block_t ori_addr = ni.blk_addr;
-	write_node_page(nid, &fio);
-	set_node_addr(sbi, &ni, fio.blk_addr, is_fsync_dnode(page));
-//	printk(KERN_EMERG "3:%x %x\n",ori_addr,fio.blk_addr); 
-	dec_page_count(sbi, F2FS_DIRTY_NODES);
-	up_read(&sbi->node_write);
-	unlock_page(page);
-
-	if (wbc->for_reclaim)
-		f2fs_submit_merged_bio(sbi, NODE, WRITE);
-
-	return 0;
-
-redirty_out:
-	redirty_page_for_writepage(wbc, page);
-	return AOP_WRITEPAGE_ACTIVATE;
-}
-int sync_node_pages_gc(struct f2fs_sb_info *sbi, nid_t ino,
-					struct writeback_control *wbc)
-{
-	pgoff_t index, end;
-	struct pagevec pvec;
-	int step = ino ? 2 : 0;
-	int nwritten = 0, wrote = 0;
-
-	pagevec_init(&pvec, 0);
-
-next_step:
-	index = 0;
-	end = LONG_MAX;
-
-	while (index <= end) {
-		int i, nr_pages;
-		nr_pages = pagevec_lookup_tag(&pvec, NODE_MAPPING(sbi), &index,
-				PAGECACHE_TAG_DIRTY,
-				min(end - index, (pgoff_t)PAGEVEC_SIZE-1) + 1);
-		if (nr_pages == 0)
-			break;
-
-		for (i = 0; i < nr_pages; i++) {
-			struct page *page = pvec.pages[i];
-
-			/*
-			 * flushing sequence with step:
-			 * 0. indirect nodes
-			 * 1. dentry dnodes
-			 * 2. file dnodes
-			 */
-			if (step == 0 && IS_DNODE(page))
-				continue;
-			if (step == 1 && (!IS_DNODE(page) ||
-						is_cold_node(page)))
-				continue;
-			if (step == 2 && (!IS_DNODE(page) ||
-						!is_cold_node(page)))
-				continue;
-
-			/*
-			 * If an fsync mode,
-			 * we should not skip writing node pages.
-			 */
-			if (ino && ino_of_node(page) == ino)
-				lock_page(page);
-			else if (!trylock_page(page))
-				continue;
-
-			if (unlikely(page->mapping != NODE_MAPPING(sbi))) {
-continue_unlock:
-				unlock_page(page);
-				continue;
-			}
-			if (ino && ino_of_node(page) != ino)
-				goto continue_unlock;
-
-			if (!PageDirty(page)) {
-				/* someone wrote it for us */
-				goto continue_unlock;
-			}
-
-			if (!clear_page_dirty_for_io(page))
-				goto continue_unlock;
-
-			/* called by fsync() */
-			if (ino && IS_DNODE(page)) {
-				set_fsync_mark(page, 1);
-				if (IS_INODE(page))
-					set_dentry_mark(page,
-						need_dentry_mark(sbi, ino));
-				nwritten++;
-			} else {
-				set_fsync_mark(page, 0);
-				set_dentry_mark(page, 0);
-			}
-			// I guess it point to the function: f2fs_write_node_pages;
-			// So I just need to change to use the function.
-			//if (f2fs_write_node_pages_gc(page, wbc)) 
-			//if (NODE_MAPPING(sbi)->a_ops->writepage(page, wbc)) // This is the function to write node page back. I have to rewrite the function.
-			if (f2fs_write_node_page_gc(page, wbc)) 
-				unlock_page(page);
-			else
-				wrote++;
-
-			if (--wbc->nr_to_write == 0)
-				break;
-		}
-		pagevec_release(&pvec);
-		cond_resched();
-
-		if (wbc->nr_to_write == 0) {
-			step = 2;
-			break;
-		}
-	}
-
-	if (step < 2) {
-		step++;
-		goto next_step;
-	}
-
-	if (wrote)
-		f2fs_submit_merged_bio(sbi, NODE, WRITE);
-	return nwritten;
-}
 int sync_node_pages(struct f2fs_sb_info *sbi, nid_t ino,
 					struct writeback_control *wbc)
 {
@@ -272,7 +272,7 @@ static int check_index_in_prev_nodes(struct f2fs_sb_info *sbi,
 	int i;
 
 	sentry = get_seg_entry(sbi, segno);
-	if (!f2fs_test_bit(blkoff, sentry->cur_valid_map))
+	if (!test_bit(blkoff, sentry->cur_valid_map))
 		return 0;
 
 	/* Get the previous summary */
@@ -595,6 +595,8 @@ out:
 			.reason = CP_RECOVERY,
 		};
 		mutex_unlock(&sbi->cp_mutex);
+		/* the checkpoint overwrites the remap log */
+		f2fs_remap_replay(sbi);
 		write_checkpoint(sbi, &cpc);
 	} else {
 		mutex_unlock(&sbi->cp_mutex);
@@ -0,0 +1,790 @@
+/*
+ * fs/f2fs/remap.c
+ *
+ * Device assisted relocation of data blocks for garbage collection
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/fs.h>
+#include <linux/f2fs_fs.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/vmalloc.h>
+#include <linux/nvme.h>
+#include <linux/sort.h>
+
+#include "f2fs.h"
+#include "segment.h"
+#include "node.h"
+#include "remap.h"
+#include "gctrace.h"
+
+extern int nvme_kernel_iocmd(struct block_device *bdev,
+			struct nvme_passthru_cmd *cmd,
+			void *buffer, unsigned int bufflen);
+extern int nvme_kernel_copy_limits(struct block_device *bdev,
+			u32 *max_ranges, u32 *max_range_lbas, u32 *max_lbas);
+
+/*
+ * NVMe Copy is only used if the controller reports it in its identify data,
+ * and within the limits of the namespace, kept in blocks.  A device which
+ * can't copy one block with a single range is not worth it.
+ */
+static bool __remap_init_copy(struct f2fs_sb_info *sbi)
+{
+	u32 ranges, range_lbas, lbas;
+
+	if (nvme_kernel_copy_limits(sbi->remap_bdev, &ranges,
+						&range_lbas, &lbas))
+		return false;
+
+	/* unset limits are only bound by the 16 bit length of a range */
+	if (!range_lbas || range_lbas > 65536)
+		range_lbas = 65536;
+	if (!lbas)
+		lbas = UINT_MAX;
+
+	sbi->copy_max_ranges = min_t(u32, ranges, COPY_RANGES_PER_CMD);
+	sbi->copy_max_range_blks = range_lbas >> sbi->remap_lba_shift;
+	sbi->copy_max_blks = lbas >> sbi->remap_lba_shift;
+	return sbi->copy_max_ranges && sbi->copy_max_range_blks &&
+						sbi->copy_max_blks;
+}
+
+/*
+ * Look up the NVMe namespace behind the mounted block device once, so that
+ * GC can talk to it directly for the lifetime of the superblock.  Remap is
+ * left disabled if the volume does not sit on a NVMe namespace.
+ */
+void f2fs_remap_init_dev(struct f2fs_sb_info *sbi)
+{
+	struct block_device *bdev = sbi->sb->s_bdev;
+	unsigned int lba_bits;
+	int nsid;
+
+	nsid = ioctl_by_bdev(bdev, NVME_IOCTL_ID, 0);
+	if (nsid <= 0)
+		return;
+
+	lba_bits = ilog2(bdev_logical_block_size(bdev));
+	if (lba_bits > F2FS_BLKSIZE_BITS)
+		return;
+
+	sbi->remap_log = vzalloc(REMAP_LOG_BLOCKS << F2FS_BLKSIZE_BITS);
+	if (!sbi->remap_log)
+		return;
+	mutex_init(&sbi->remap_log_lock);
+	sbi->remap_log_pos = 0;
+	sbi->remap_log_ver = cur_cp_version(F2FS_CKPT(sbi));
+
+	sbi->remap_bdev = bdgrab(bdev);
+	sbi->remap_nsid = nsid;
+	sbi->remap_lba_shift = F2FS_BLKSIZE_BITS - lba_bits;
+	sbi->remap_start_lba = get_start_sect(bdev) >> (lba_bits - 9);
+
+	/* the vendor remap is assumed to work until the device rejects it */
+	sbi->remap_caps = BIT(REMAP_OP_REMAP);
+	if (__remap_init_copy(sbi))
+		sbi->remap_caps |= BIT(REMAP_OP_COPY);
+
+	f2fs_msg(sbi->sb, KERN_INFO, "GC remap enabled on nsid %d, copy %s",
+		nsid, test_bit(REMAP_OP_COPY, &sbi->remap_caps) ?
+		"supported" : "unsupported");
+}
+
+void f2fs_remap_destroy_dev(struct f2fs_sb_info *sbi)
+{
+	if (!sbi->remap_bdev)
+		return;
+	bdput(sbi->remap_bdev);
+	sbi->remap_bdev = NULL;
+	sbi->remap_caps = 0;
+	vfree(sbi->remap_log);
+	sbi->remap_log = NULL;
+}
+
+/* device relocation to use for the next commit, -1 if there is none left */
+static int __remap_pick_op(struct f2fs_sb_info *sbi)
+{
+	if (test_bit(REMAP_OP_REMAP, &sbi->remap_caps))
+		return REMAP_OP_REMAP;
+	if (test_bit(REMAP_OP_COPY, &sbi->remap_caps))
+		return REMAP_OP_COPY;
+	return -1;
+}
+
+int f2fs_remap_init_batch(struct f2fs_sb_info *sbi, struct remap_batch *rb)
+{
+	if (!sbi->remap_bdev || !sbi->remap_caps)
+		return -EOPNOTSUPP;
+
+	rb->op = __remap_pick_op(sbi);
+	rb->nr_entries = 0;
+	rb->max_entries = sbi->blocks_per_seg;
+	rb->entries = f2fs_kvmalloc(rb->max_entries *
+				sizeof(struct remap_entry), GFP_NOFS);
+	if (!rb->entries)
+		goto fail;
+	rb->ranges = kmalloc(PAGE_SIZE, GFP_NOFS);
+	if (!rb->ranges)
+		goto fail;
+	return 0;
+fail:
+	kvfree(rb->entries);
+	rb->entries = NULL;
+	rb->max_entries = 0;
+	return -ENOMEM;
+}
+
+void f2fs_remap_destroy_batch(struct f2fs_sb_info *sbi, struct remap_batch *rb)
+{
+	f2fs_bug_on(sbi, rb->nr_entries);
+	kvfree(rb->entries);
+	kfree(rb->ranges);
+	rb->entries = NULL;
+	rb->ranges = NULL;
+	rb->max_entries = 0;
+}
+
+/*
+ * Record that the block at @old_blkaddr, which backs the locked @page, should
+ * be moved by the device.  The page stays locked until f2fs_remap_commit(),
+ * so that nothing rewrites or truncates the block meanwhile, and a reader of
+ * an uncached page waits for the dnode to point at the new address instead
+ * of reading an address the device has remapped away.
+ *
+ * The first entry of a batch takes remap_rwsem, which keeps checkpoints out
+ * until the batch is applied: the reservations, the intent log and the
+ * dnode updates fall into one checkpoint interval, and no checkpoint blocks
+ * operations while GC holds pages locked.
+ */
+bool f2fs_remap_add(struct remap_batch *rb, struct page *page,
+						block_t old_blkaddr)
+{
+	struct remap_entry *re;
+
+	if (rb->nr_entries >= rb->max_entries)
+		return false;
+	if (!rb->nr_entries)
+		down_read(&F2FS_P_SB(page)->remap_rwsem);
+
+	re = &rb->entries[rb->nr_entries++];
+	re->inode = page->mapping->host;
+	re->index = page->index;
+	re->page = page;
+	re->old_blkaddr = old_blkaddr;
+	re->new_blkaddr = NULL_ADDR;
+	re->err = 0;
+	return true;
+}
+
+static int remap_entry_cmp(const void *a, const void *b)
+{
+	const struct remap_entry *ra = a, *rb = b;
+
+	if (ra->old_blkaddr < rb->old_blkaddr)
+		return -1;
+	return ra->old_blkaddr > rb->old_blkaddr;
+}
+
+static int __submit_remap_cmd(struct f2fs_sb_info *sbi,
+				struct remap_batch *rb, unsigned int nr_ranges)
+{
+	struct nvme_passthru_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.nsid = sbi->remap_nsid;
+
+	/* a single run fits in the command itself, no payload to DMA */
+	if (nr_ranges == 1) {
+		u64 src = le64_to_cpu(rb->ranges[0].src_lba);
+		u64 dst = le64_to_cpu(rb->ranges[0].dst_lba);
+
+		cmd.opcode = NVME_CMD_REMAP;
+		cmd.cdw10 = lower_32_bits(src);
+		cmd.cdw11 = upper_32_bits(src);
+		cmd.cdw12 = lower_32_bits(dst);
+		cmd.cdw13 = upper_32_bits(dst);
+		cmd.cdw14 = le32_to_cpu(rb->ranges[0].len);
+		return nvme_kernel_iocmd(sbi->remap_bdev, &cmd, NULL, 0);
+	}
+
+	cmd.opcode = NVME_CMD_REMAP_LIST;
+	cmd.cdw10 = nr_ranges - 1;
+	return nvme_kernel_iocmd(sbi->remap_bdev, &cmd, rb->ranges,
+			nr_ranges * sizeof(struct nvme_remap_range));
+}
+
+/*
+ * Merge sorted entries into runs which are contiguous on both the source and
+ * the destination side, and send them with as few commands as possible.
+ * Every entry ends up with the status of the command that covered it.
+ */
+static void __issue_remap_batch(struct f2fs_sb_info *sbi,
+				struct remap_batch *rb)
+{
+	unsigned int first = 0, start = 0, nr_ranges = 0;
+	unsigned int i;
+	int err;
+
+	for (i = 1; i <= rb->nr_entries; i++) {
+		struct remap_entry *prev = &rb->entries[i - 1];
+		struct nvme_remap_range *range;
+
+		if (i < rb->nr_entries &&
+			rb->entries[i].old_blkaddr == prev->old_blkaddr + 1 &&
+			rb->entries[i].new_blkaddr == prev->new_blkaddr + 1)
+			continue;
+
+		/* close the run [start, i) */
+		range = &rb->ranges[nr_ranges++];
+		range->src_lba = cpu_to_le64(remap_lba(sbi,
+					rb->entries[start].old_blkaddr));
+		range->dst_lba = cpu_to_le64(remap_lba(sbi,
+					rb->entries[start].new_blkaddr));
+		range->len = cpu_to_le32((i - start) << sbi->remap_lba_shift);
+		range->rsvd = 0;
+		start = i;
+
+		if (nr_ranges < REMAP_RANGES_PER_CMD && i < rb->nr_entries)
+			continue;
+
+		err = __submit_remap_cmd(sbi, rb, nr_ranges);
+		if (err)
+			f2fs_msg(sbi->sb, KERN_WARNING,
+				"remap of %u ranges failed: %d", nr_ranges, err);
+		for (; first < i; first++)
+			rb->entries[first].err = err;
+		nr_ranges = 0;
+	}
+}
+
+static int __submit_copy_cmd(struct f2fs_sb_info *sbi,
+				struct remap_batch *rb, block_t dst_blkaddr,
+				unsigned int nr_ranges)
+{
+	struct nvme_passthru_cmd cmd;
+	u64 sdlba = remap_lba(sbi, dst_blkaddr);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = NVME_CMD_COPY;
+	cmd.nsid = sbi->remap_nsid;
+	cmd.cdw10 = lower_32_bits(sdlba);
+	cmd.cdw11 = upper_32_bits(sdlba);
+	cmd.cdw12 = nr_ranges - 1;	/* descriptor format 0 */
+	return nvme_kernel_iocmd(sbi->remap_bdev, &cmd, rb->copy_ranges,
+			nr_ranges * sizeof(struct nvme_copy_range));
+}
+
+/*
+ * Same as __issue_remap_batch() for devices which copy instead of remap.
+ * A copy command writes one contiguous destination, so a command is closed
+ * whenever the new addresses of the sorted entries have a gap; within it,
+ * each contiguous source run becomes one range.  Ranges and commands are
+ * also closed where they would exceed the limits of the device.
+ */
+static void __issue_copy_batch(struct f2fs_sb_info *sbi,
+				struct remap_batch *rb)
+{
+	unsigned int first = 0, start = 0, nr_ranges = 0;
+	unsigned int i;
+	int err;
+
+	for (i = 1; i <= rb->nr_entries; i++) {
+		struct remap_entry *prev = &rb->entries[i - 1];
+		struct nvme_copy_range *range;
+		bool dst_contig = i < rb->nr_entries &&
+			rb->entries[i].new_blkaddr == prev->new_blkaddr + 1;
+
+		if (dst_contig &&
+			rb->entries[i].old_blkaddr == prev->old_blkaddr + 1 &&
+			i - start < sbi->copy_max_range_blks &&
+			i - first < sbi->copy_max_blks)
+			continue;
+
+		/* close the source range [start, i) */
+		range = &rb->copy_ranges[nr_ranges++];
+		memset(range, 0, sizeof(*range));
+		range->slba = cpu_to_le64(remap_lba(sbi,
+					rb->entries[start].old_blkaddr));
+		range->nlb = cpu_to_le16(((i - start) <<
+					sbi->remap_lba_shift) - 1);
+		start = i;
+
+		if (dst_contig && nr_ranges < sbi->copy_max_ranges &&
+				i - first < sbi->copy_max_blks)
+			continue;
+
+		err = __submit_copy_cmd(sbi, rb,
+				rb->entries[first].new_blkaddr, nr_ranges);
+		if (err)
+			f2fs_msg(sbi->sb, KERN_WARNING,
+				"copy of %u ranges failed: %d", nr_ranges, err);
+		for (; first < i; first++)
+			rb->entries[first].err = err;
+		nr_ranges = 0;
+	}
+}
+
+/*
+ * Reserve the destination of @re in the cold data log.  The old block is
+ * invalidated in the same SIT update, so the victim loses it right away and
+ * the block is never counted twice.  Returns false if the dnode no longer
+ * points at the old block, in which case there is nothing to move.
+ */
+static bool __reserve_remap_entry(struct f2fs_sb_info *sbi,
+						struct remap_entry *re)
+{
+	struct dnode_of_data dn;
+	struct f2fs_summary sum;
+	struct node_info ni;
+	bool reserved = false;
+
+	set_new_dnode(&dn, re->inode, NULL, NULL, 0);
+	if (get_dnode_of_data(&dn, re->index, LOOKUP_NODE))
+		return false;
+
+	if (dn.data_blkaddr == re->old_blkaddr) {
+		get_node_info(sbi, dn.nid, &ni);
+		set_summary(&sum, dn.nid, dn.ofs_in_node, ni.version);
+		allocate_data_block(sbi, NULL, re->old_blkaddr,
+				&re->new_blkaddr, &sum, CURSEG_COLD_DATA);
+		re->nid = dn.nid;
+		re->ofs_in_node = dn.ofs_in_node;
+		reserved = true;
+	}
+	f2fs_put_dnode(&dn);
+	return reserved;
+}
+
+/* reserve all entries of @rb, dropping those with nothing left to move */
+static void __reserve_remap_batch(struct f2fs_sb_info *sbi,
+						struct remap_batch *rb)
+{
+	unsigned int i, nr = 0;
+
+	for (i = 0; i < rb->nr_entries; i++) {
+		struct remap_entry *re = &rb->entries[i];
+
+		if (__reserve_remap_entry(sbi, re)) {
+			rb->entries[nr++] = *re;
+			continue;
+		}
+		atomic_dec(&F2FS_I(re->inode)->i_remap_pending);
+		f2fs_put_page(re->page, 1);
+	}
+	rb->nr_entries = nr;
+}
+
+static void __apply_remap_entry(struct f2fs_sb_info *sbi,
+				struct remap_batch *rb, struct remap_entry *re,
+				u64 issue_time)
+{
+	struct inode *inode = re->inode;
+	struct dnode_of_data dn;
+
+	/* the data is still at the old block, which is given back */
+	if (re->err) {
+		revert_data_block(sbi, re->old_blkaddr, re->new_blkaddr);
+		goto out;
+	}
+
+	set_new_dnode(&dn, inode, NULL, NULL, 0);
+	if (get_dnode_of_data(&dn, re->index, LOOKUP_NODE)) {
+		/* the data has moved, only the remap log knows where */
+		set_sbi_flag(sbi, SBI_NEED_FSCK);
+		goto out;
+	}
+
+	/* the locked page kept the block from being rewritten or truncated */
+	if (unlikely(dn.data_blkaddr != re->old_blkaddr)) {
+		f2fs_bug_on(sbi, 1);
+		f2fs_put_dnode(&dn);
+		goto out;
+	}
+
+	dn.data_blkaddr = re->new_blkaddr;
+	set_data_blkaddr(&dn);
+	f2fs_update_extent_cache(&dn);
+	f2fs_put_dnode(&dn);
+
+	set_inode_flag(F2FS_I(inode), FI_APPEND_WRITE);
+	if (re->index == 0)
+		set_inode_flag(F2FS_I(inode), FI_FIRST_BLOCK_WRITTEN);
+
+	/* a copy leaves the data behind, a remap does not */
+	if (rb->op == REMAP_OP_COPY) {
+		stat_inc_gc_move(sbi, GC_MOVE_DCOPY);
+		f2fs_trace_gc(sbi, inode->i_ino, re->index,
+				re->old_blkaddr, re->new_blkaddr,
+				GC_TRACE_DEVICE_COPY, issue_time);
+	} else {
+		mark_block_unmapped(sbi, re->old_blkaddr);
+		stat_inc_gc_move(sbi, GC_MOVE_REMAP);
+		f2fs_trace_gc(sbi, inode->i_ino, re->index,
+				re->old_blkaddr, re->new_blkaddr,
+				GC_TRACE_REMAP, issue_time);
+	}
+out:
+	atomic_dec(&F2FS_I(inode)->i_remap_pending);
+}
+
+/* a device which doesn't know the command won't learn it later */
+static bool __remap_op_rejected(int err)
+{
+	if (err <= 0)
+		return false;
+	return (err & 0x7ff) == NVME_SC_INVALID_OPCODE ||
+			(err & 0x7ff) == NVME_SC_INVALID_FIELD;
+}
+
+/* the log goes to the tail of the pack checkpoint @ver + 1 is written to */
+static block_t __remap_log_addr(struct f2fs_sb_info *sbi,
+						unsigned long long ver)
+{
+	block_t start_addr = le32_to_cpu(F2FS_RAW_SUPER(sbi)->cp_blkaddr);
+
+	if (!((ver + 1) & 1))
+		start_addr += sbi->blocks_per_seg;
+	return start_addr + sbi->blocks_per_seg - REMAP_LOG_BLOCKS;
+}
+
+static struct f2fs_remap_log_block *__remap_log_block(struct f2fs_sb_info *sbi,
+							unsigned int blk)
+{
+	return sbi->remap_log + (blk << F2FS_BLKSIZE_BITS);
+}
+
+static int __remap_log_io(struct f2fs_sb_info *sbi, int rw, unsigned int blk)
+{
+	struct bio *bio = f2fs_bio_alloc(1);
+	int err;
+
+	bio->bi_bdev = sbi->sb->s_bdev;
+	bio->bi_iter.bi_sector = SECTOR_FROM_BLOCK(
+			__remap_log_addr(sbi, sbi->remap_log_ver) + blk);
+	bio_add_page(bio, vmalloc_to_page(__remap_log_block(sbi, blk)),
+							F2FS_BLKSIZE, 0);
+	err = submit_bio_wait(rw, bio);
+	bio_put(bio);
+	return err;
+}
+
+static int __remap_log_write(struct f2fs_sb_info *sbi, unsigned int blk)
+{
+	struct f2fs_remap_log_block *lb = __remap_log_block(sbi, blk);
+
+	lb->crc = 0;
+	lb->crc = cpu_to_le32(f2fs_crc32(lb, F2FS_BLKSIZE));
+	return __remap_log_io(sbi, WRITE_FLUSH_FUA | REQ_META | REQ_PRIO, blk);
+}
+
+/*
+ * Log @entries as intended remaps before the device is told about them.
+ * The caller holds remap_rwsem until the dnodes are updated, so that no
+ * checkpoint can come in between.  The log only has room for the remaps
+ * of one checkpoint interval; -ENOSPC leaves the rest to host copies.
+ */
+static int __remap_log_intent(struct f2fs_sb_info *sbi,
+			struct remap_entry *entries, unsigned int nr)
+{
+	unsigned long long ver = cur_cp_version(F2FS_CKPT(sbi));
+	unsigned int i, blk, ofs;
+	int err = 0;
+
+	mutex_lock(&sbi->remap_log_lock);
+	if (sbi->remap_log_ver != ver) {
+		sbi->remap_log_ver = ver;
+		sbi->remap_log_pos = 0;
+	}
+
+	if (sbi->remap_log_pos + nr > REMAP_LOG_BLOCKS * REMAP_LOG_ENTRIES) {
+		err = -ENOSPC;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct f2fs_remap_log_block *lb;
+		struct f2fs_remap_log_entry *le;
+
+		blk = sbi->remap_log_pos / REMAP_LOG_ENTRIES;
+		ofs = sbi->remap_log_pos % REMAP_LOG_ENTRIES;
+		lb = __remap_log_block(sbi, blk);
+		if (!ofs) {
+			memset(lb, 0, F2FS_BLKSIZE);
+			lb->magic = cpu_to_le32(F2FS_REMAP_LOG_MAGIC);
+			lb->cp_ver = cpu_to_le64(ver);
+		}
+
+		le = &lb->entries[ofs];
+		le->old_blkaddr = cpu_to_le32(entries[i].old_blkaddr);
+		le->new_blkaddr = cpu_to_le32(entries[i].new_blkaddr);
+		le->nid = cpu_to_le32(entries[i].nid);
+		le->ofs_in_node = cpu_to_le16(entries[i].ofs_in_node);
+		lb->nr_entries = cpu_to_le32(ofs + 1);
+		entries[i].log_pos = sbi->remap_log_pos++;
+
+		/* write each block once it is full, and the last one */
+		if (ofs + 1 < REMAP_LOG_ENTRIES && i + 1 < nr)
+			continue;
+		err = __remap_log_write(sbi, blk);
+		if (err)
+			break;
+	}
+out:
+	mutex_unlock(&sbi->remap_log_lock);
+	return err;
+}
+
+/* mark the remaps of @entries the device completed as done in the log */
+static void __remap_log_done(struct f2fs_sb_info *sbi,
+			struct remap_entry *entries, unsigned int nr)
+{
+	unsigned int i, blk, last_blk = UINT_MAX;
+	int err = 0;
+
+	mutex_lock(&sbi->remap_log_lock);
+	for (i = 0; i < nr; i++) {
+		struct f2fs_remap_log_block *lb;
+
+		if (entries[i].err)
+			continue;
+
+		blk = entries[i].log_pos / REMAP_LOG_ENTRIES;
+		if (blk != last_blk && last_blk != UINT_MAX)
+			err |= __remap_log_write(sbi, last_blk);
+		last_blk = blk;
+
+		lb = __remap_log_block(sbi, blk);
+		lb->entries[entries[i].log_pos % REMAP_LOG_ENTRIES].flags |=
+					cpu_to_le16(REMAP_LOG_DONE);
+	}
+	if (last_blk != UINT_MAX)
+		err |= __remap_log_write(sbi, last_blk);
+	mutex_unlock(&sbi->remap_log_lock);
+
+	/* the blocks have moved already, the dnodes must follow */
+	if (err)
+		f2fs_msg(sbi->sb, KERN_WARNING,
+			"failed to log completed remaps, run fsck after a crash");
+}
+
+/*
+ * Send all requests collected for a victim to the device, then point the
+ * dnodes at the new addresses.  Blocks the device failed to move are copied
+ * by the host, and a command the device rejects is not used for later
+ * commits.
+ */
+void f2fs_remap_commit(struct f2fs_sb_info *sbi, struct remap_batch *rb)
+{
+	u64 issue_time = f2fs_gc_trace_clock();
+	unsigned int i, nr_failed = 0;
+	bool rejected = false;
+
+	if (!rb->nr_entries)
+		return;
+
+	/* destinations are reserved in source order, so runs line up */
+	sort(rb->entries, rb->nr_entries, sizeof(struct remap_entry),
+					remap_entry_cmp, NULL);
+
+	/*
+	 * The device commands are not issued under f2fs_lock_op(), which
+	 * would hold up all operations; remap_rwsem, taken by
+	 * f2fs_remap_add(), keeps checkpoints out instead.
+	 */
+	f2fs_lock_op(sbi);
+	__reserve_remap_batch(sbi, rb);
+	f2fs_unlock_op(sbi);
+	if (!rb->nr_entries) {
+		up_read(&sbi->remap_rwsem);
+		goto out;
+	}
+
+	/* copies leave the old blocks alone and need no log */
+	if (rb->op == REMAP_OP_COPY) {
+		__issue_copy_batch(sbi, rb);
+	} else {
+		int err = __remap_log_intent(sbi, rb->entries,
+						rb->nr_entries);
+
+		if (err) {
+			for (i = 0; i < rb->nr_entries; i++)
+				rb->entries[i].err = err;
+		} else {
+			__issue_remap_batch(sbi, rb);
+			__remap_log_done(sbi, rb->entries, rb->nr_entries);
+		}
+	}
+
+	f2fs_lock_op(sbi);
+	for (i = 0; i < rb->nr_entries; i++) {
+		if (rb->entries[i].err) {
+			nr_failed++;
+			if (__remap_op_rejected(rb->entries[i].err))
+				rejected = true;
+		}
+		__apply_remap_entry(sbi, rb, &rb->entries[i], issue_time);
+	}
+	f2fs_unlock_op(sbi);
+
+	for (i = 0; i < rb->nr_entries; i++)
+		f2fs_put_page(rb->entries[i].page, 1);
+	up_read(&sbi->remap_rwsem);
+
+	if (rejected && test_and_clear_bit(rb->op, &sbi->remap_caps))
+		f2fs_msg(sbi->sb, KERN_WARNING,
+			"device rejected %s, not using it any more",
+			rb->op == REMAP_OP_COPY ? "copy" : "remap");
+
+	/* takes page locks, so not under f2fs_lock_op() */
+	for (i = 0; nr_failed && i < rb->nr_entries; i++)
+		if (rb->entries[i].err)
+			f2fs_gc_move_fallback(rb->entries[i].inode,
+					rb->entries[i].index,
+					rb->entries[i].old_blkaddr);
+out:
+	rb->nr_entries = 0;
+	rb->op = __remap_pick_op(sbi);
+}
+
+/*
+ * Replay one logged remap.  Returns 1 if its dnode was pointed at the new
+ * address, -1 if the dnode still points at the old address but the remap
+ * can't be trusted to have happened, or 0 if there is nothing to do.
+ */
+static int __remap_replay_entry(struct f2fs_sb_info *sbi,
+				struct f2fs_remap_log_entry *le)
+{
+	block_t old_blkaddr = le32_to_cpu(le->old_blkaddr);
+	block_t new_blkaddr = le32_to_cpu(le->new_blkaddr);
+	nid_t nid = le32_to_cpu(le->nid);
+	unsigned int ofs_in_node = le16_to_cpu(le->ofs_in_node);
+	struct dnode_of_data dn;
+	struct node_info ni;
+	struct inode *inode;
+	struct page *page;
+	block_t blkaddr;
+	nid_t ino;
+	int ret = 0;
+
+	if (ofs_in_node >= ADDRS_PER_BLOCK)
+		return 0;
+
+	page = get_node_page(sbi, nid);
+	if (IS_ERR(page))
+		return 0;
+	ino = ino_of_node(page);
+	blkaddr = datablock_addr(page, ofs_in_node);
+	f2fs_put_page(page, 1);
+
+	/* rewritten or truncated later, or applied before the crash */
+	if (blkaddr != old_blkaddr)
+		return 0;
+	if (!(le16_to_cpu(le->flags) & REMAP_LOG_DONE))
+		return -1;
+
+	/* f2fs_iget() may need the node page, so it is not held here */
+	inode = f2fs_iget(sbi->sb, ino);
+	if (IS_ERR(inode))
+		return -1;
+
+	page = get_node_page(sbi, nid);
+	if (IS_ERR(page)) {
+		iput(inode);
+		return -1;
+	}
+
+	set_new_dnode(&dn, inode, IS_INODE(page) ? page : NULL, page, nid);
+	dn.ofs_in_node = ofs_in_node;
+	dn.data_blkaddr = datablock_addr(page, ofs_in_node);
+	if (dn.data_blkaddr == old_blkaddr) {
+		get_node_info(sbi, nid, &ni);
+		f2fs_replace_block(sbi, &dn, old_blkaddr, new_blkaddr,
+							ni.version, false);
+		ret = 1;
+	}
+	f2fs_put_dnode(&dn);
+	iput(inode);
+	return ret;
+}
+
+/*
+ * Walk the remap intent log of the checkpoint the volume was mounted from,
+ * once roll-forward has brought the dnodes up to date.  A remap the device
+ * completed, but whose dnode update did not reach the disk, is applied
+ * again.  A remap which was only logged may have reached the device or
+ * not, which can't be told apart here, so fsck is asked for if its dnode
+ * still points at the old address.
+ *
+ * The log sits in the checkpoint pack the next checkpoint overwrites, so
+ * this runs before any checkpoint is written.  Returns true if a log was
+ * found, which the caller retires with a new checkpoint, so that none of
+ * it is ever replayed twice.
+ */
+bool f2fs_remap_replay(struct f2fs_sb_info *sbi)
+{
+	unsigned int blk, i, nr, nr_found = 0;
+	unsigned int nr_replayed = 0, nr_unknown = 0;
+
+	if (!sbi->remap_log)
+		return false;
+
+	/* a checkpoint retired the log already */
+	if (sbi->remap_log_ver != cur_cp_version(F2FS_CKPT(sbi)))
+		return false;
+
+	for (blk = 0; blk < REMAP_LOG_BLOCKS; blk++) {
+		struct f2fs_remap_log_block *lb = __remap_log_block(sbi, blk);
+		__u32 crc;
+
+		if (__remap_log_io(sbi, READ_SYNC | REQ_META | REQ_PRIO, blk))
+			break;
+		if (le32_to_cpu(lb->magic) != F2FS_REMAP_LOG_MAGIC ||
+				le64_to_cpu(lb->cp_ver) != sbi->remap_log_ver)
+			break;
+		crc = le32_to_cpu(lb->crc);
+		lb->crc = 0;
+		if (!f2fs_crc_valid(crc, lb, F2FS_BLKSIZE))
+			break;
+		nr = le32_to_cpu(lb->nr_entries);
+		if (nr > REMAP_LOG_ENTRIES)
+			break;
+
+		for (i = 0; i < nr; i++) {
+			int ret = __remap_replay_entry(sbi, &lb->entries[i]);
+
+			if (ret > 0)
+				nr_replayed++;
+			else if (ret < 0)
+				nr_unknown++;
+		}
+		nr_found += nr;
+		if (nr < REMAP_LOG_ENTRIES)
+			break;
+	}
+	sbi->remap_log_pos = 0;
+
+	if (!nr_found)
+		return false;
+
+	f2fs_msg(sbi->sb, KERN_NOTICE,
+		"remap log: %u entries, %u replayed, %u unknown",
+		nr_found, nr_replayed, nr_unknown);
+	if (nr_unknown)
+		set_sbi_flag(sbi, SBI_NEED_FSCK);
+	return true;
+}
+
+/* replay the remap log, unless roll-forward recovery did already */
+void f2fs_remap_recover(struct f2fs_sb_info *sbi)
+{
+	struct cp_control cpc = {
+		.reason = CP_RECOVERY,
+	};
+
+	if (f2fs_remap_replay(sbi))
+		write_checkpoint(sbi, &cpc);
+}
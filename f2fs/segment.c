@@ -16,175 +16,20 @@
 #include <linux/kthread.h>
 #include <linux/swap.h>
 #include <linux/timer.h>
+#include <linux/freezer.h>
 
 #include "f2fs.h"
 #include "segment.h"
 #include "node.h"
+#include "gc.h"
 #include "trace.h"
 #include <trace/events/f2fs.h>
 
-#define __reverse_ffz(x) __reverse_ffs(~(x))
-
 static struct kmem_cache *discard_entry_slab;
+static struct kmem_cache *discard_cmd_slab;
 static struct kmem_cache *sit_entry_set_slab;
 static struct kmem_cache *inmem_entry_slab;
 
-static unsigned long __reverse_ulong(unsigned char *str)
-{
-	unsigned long tmp = 0;
-	int shift = 24, idx = 0;
-
-#if BITS_PER_LONG == 64
-	shift = 56;
-#endif
-	while (shift >= 0) {
-		tmp |= (unsigned long)str[idx++] << shift;
-		shift -= BITS_PER_BYTE;
-	}
-	return tmp;
-}
-
-/*
- * __reverse_ffs is copied from include/asm-generic/bitops/__ffs.h since
- * MSB and LSB are reversed in a byte by f2fs_set_bit.
- */
-static inline unsigned long __reverse_ffs(unsigned long word)
-{
-	int num = 0;
-
-#if BITS_PER_LONG == 64
-	if ((word & 0xffffffff00000000UL) == 0)
-		num += 32;
-	else
-		word >>= 32;
-#endif
-	if ((word & 0xffff0000) == 0)
-		num += 16;
-	else
-		word >>= 16;
-
-	if ((word & 0xff00) == 0)
-		num += 8;
-	else
-		word >>= 8;
-
-	if ((word & 0xf0) == 0)
-		num += 4;
-	else
-		word >>= 4;
-
-	if ((word & 0xc) == 0)
-		num += 2;
-	else
-		word >>= 2;
-
-	if ((word & 0x2) == 0)
-		num += 1;
-	return num;
-}
-
-/*
- * __find_rev_next(_zero)_bit is copied from lib/find_next_bit.c because
- * f2fs_set_bit makes MSB and LSB reversed in a byte.
- * Example:
- *                             MSB <--> LSB
- *   f2fs_set_bit(0, bitmap) => 1000 0000
- *   f2fs_set_bit(7, bitmap) => 0000 0001
- */
-static unsigned long __find_rev_next_bit(const unsigned long *addr,
-			unsigned long size, unsigned long offset)
-{
-	const unsigned long *p = addr + BIT_WORD(offset);
-	unsigned long result = offset & ~(BITS_PER_LONG - 1);
-	unsigned long tmp;
-
-	if (offset >= size)
-		return size;
-
-	size -= result;
-	offset %= BITS_PER_LONG;
-	if (!offset)
-		goto aligned;
-
-	tmp = __reverse_ulong((unsigned char *)p);
-	tmp &= ~0UL >> offset;
-
-	if (size < BITS_PER_LONG)
-		goto found_first;
-	if (tmp)
-		goto found_middle;
-
-	size -= BITS_PER_LONG;
-	result += BITS_PER_LONG;
-	p++;
-aligned:
-	while (size & ~(BITS_PER_LONG-1)) {
-		tmp = __reverse_ulong((unsigned char *)p);
-		if (tmp)
-			goto found_middle;
-		result += BITS_PER_LONG;
-		size -= BITS_PER_LONG;
-		p++;
-	}
-	if (!size)
-		return result;
-
-	tmp = __reverse_ulong((unsigned char *)p);
-found_first:
-	tmp &= (~0UL << (BITS_PER_LONG - size));
-	if (!tmp)		/* Are any bits set? */
-		return result + size;   /* Nope. */
-found_middle:
-	return result + __reverse_ffs(tmp);
-}
-
-static unsigned long __find_rev_next_zero_bit(const unsigned long *addr,
-			unsigned long size, unsigned long offset)
-{
-	const unsigned long *p = addr + BIT_WORD(offset);
-	unsigned long result = offset & ~(BITS_PER_LONG - 1);
-	unsigned long tmp;
-
-	if (offset >= size)
-		return size;
-
-	size -= result;
-	offset %= BITS_PER_LONG;
-	if (!offset)
-		goto aligned;
-
-	tmp = __reverse_ulong((unsigned char *)p);
-	tmp |= ~((~0UL << offset) >> offset);
-
-	if (size < BITS_PER_LONG)
-		goto found_first;
-	if (tmp != ~0UL)
-		goto found_middle;
-
-	size -= BITS_PER_LONG;
-	result += BITS_PER_LONG;
-	p++;
-aligned:
-	while (size & ~(BITS_PER_LONG - 1)) {
-		tmp = __reverse_ulong((unsigned char *)p);
-		if (tmp != ~0UL)
-			goto found_middle;
-		result += BITS_PER_LONG;
-		size -= BITS_PER_LONG;
-		p++;
-	}
-	if (!size)
-		return result;
-
-	tmp = __reverse_ulong((unsigned char *)p);
-found_first:
-	tmp |= ~(~0UL << (BITS_PER_LONG - size));
-	if (tmp == ~0UL)	/* Are any bits zero? */
-		return result + size;   /* Nope. */
-found_middle:
-	return result + __reverse_ffz(tmp);
-}
-
 void register_inmem_page(struct inode *inode, struct page *page)
 {
 	struct f2fs_inode_info *fi = F2FS_I(inode);
@@ -285,11 +130,18 @@ void f2fs_balance_fs(struct f2fs_sb_info *sbi)
 {
 	/*
 	 * We should do GC or end up with checkpoint, if there are so many dirty
-	 * dir/node pages without enough free segments.
+	 * dir/node pages without enough free segments.  Only one writer runs
+	 * GC, the others wait for it to free sections rather than queueing up
+	 * on gc_mutex to clean one more section each.
 	 */
-	if (has_not_enough_free_secs(sbi, 0)) {
-		mutex_lock(&sbi->gc_mutex);
-		f2fs_gc(sbi, false);
+	while (has_not_enough_free_secs(sbi, 0)) {
+		if (mutex_trylock(&sbi->gc_mutex)) {
+			f2fs_gc(sbi, false);
+			return;
+		}
+		wait_event(sbi->gc_free_wait,
+				!has_not_enough_free_secs(sbi, 0) ||
+				!mutex_is_locked(&sbi->gc_mutex));
 	}
 }
 
@@ -493,11 +345,9 @@ static void locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno)
 	mutex_unlock(&dirty_i->seglist_lock);
 }
 
-static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
+static void __set_discard_map(struct f2fs_sb_info *sbi,
 				block_t blkstart, block_t blklen)
 {
-	sector_t start = SECTOR_FROM_BLOCK(blkstart);
-	sector_t len = SECTOR_FROM_BLOCK(blklen);
 	struct seg_entry *se;
 	unsigned int offset;
 	block_t i;
@@ -506,13 +356,491 @@ static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
 		se = get_seg_entry(sbi, GET_SEGNO(sbi, i));
 		offset = GET_BLKOFF_FROM_SEG0(sbi, i);
 
-		if (!f2fs_test_and_set_bit(offset, se->discard_map))
+		if (!__test_and_set_bit(offset, se->discard_map))
 			sbi->discard_blks--;
 	}
+}
+
+static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	sector_t start = SECTOR_FROM_BLOCK(blkstart);
+	sector_t len = SECTOR_FROM_BLOCK(blklen);
+
+	__set_discard_map(sbi, blkstart, blklen);
 	trace_f2fs_issue_discard(sbi->sb, blkstart, blklen);
 	return blkdev_issue_discard(sbi->sb->s_bdev, start, len, GFP_NOFS, 0);
 }
 
+/*
+ * Discards of free blocks are queued in a tree at checkpoint time and issued
+ * by issue_discard_thread while the device is idle, so checkpoints never
+ * wait for them.  Blocks taken by the allocator before their discard went
+ * out are punched out of the queued command, or waited for if it was issued.
+ */
+
+/*
+ * Find the command covering @blkaddr.  Otherwise @prev and @next are the
+ * commands before and after it.
+ */
+static struct discard_cmd *__lookup_discard_cmd(struct discard_cmd_control *dcc,
+		block_t blkaddr, struct discard_cmd **prev,
+		struct discard_cmd **next)
+{
+	struct rb_node *node = dcc->root.rb_node;
+	struct discard_cmd *dc;
+
+	*prev = *next = NULL;
+	while (node) {
+		dc = rb_entry(node, struct discard_cmd, rb_node);
+		if (blkaddr < dc->lstart) {
+			*next = dc;
+			node = node->rb_left;
+		} else if (blkaddr >= dc->lstart + dc->len) {
+			*prev = dc;
+			node = node->rb_right;
+		} else {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+static void __insert_discard_cmd(struct f2fs_sb_info *sbi,
+				block_t lstart, block_t len)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct rb_node **p = &dcc->root.rb_node;
+	struct rb_node *parent = NULL;
+	struct discard_cmd *dc;
+
+	while (*p) {
+		parent = *p;
+		dc = rb_entry(parent, struct discard_cmd, rb_node);
+		if (lstart < dc->lstart)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	dc = f2fs_kmem_cache_alloc(discard_cmd_slab, GFP_NOFS);
+	INIT_LIST_HEAD(&dc->list);
+	dc->lstart = lstart;
+	dc->len = len;
+	init_completion(&dc->wait);
+	atomic_set(&dc->bio_ref, 0);
+	dc->ref = 0;
+	dc->state = D_PREP;
+	dc->error = 0;
+
+	rb_link_node(&dc->rb_node, parent, p);
+	rb_insert_color(&dc->rb_node, &dcc->root);
+	dcc->undiscard_blks += len;
+	atomic_inc(&dcc->discard_cmd_cnt);
+}
+
+static void __remove_discard_cmd(struct f2fs_sb_info *sbi,
+						struct discard_cmd *dc)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+	f2fs_bug_on(sbi, dc->ref);
+
+	if (dc->state == D_DONE)
+		atomic_dec(&dcc->issing_discard);
+	if (dc->error && dc->error != -EOPNOTSUPP)
+		f2fs_msg(sbi->sb, KERN_INFO,
+			"Issue discard(%u, %u) failed, ret: %d",
+			dc->lstart, dc->len, dc->error);
+
+	list_del(&dc->list);
+	rb_erase(&dc->rb_node, &dcc->root);
+	dcc->undiscard_blks -= dc->len;
+	atomic_dec(&dcc->discard_cmd_cnt);
+	kmem_cache_free(discard_cmd_slab, dc);
+}
+
+/* queue [lstart, lstart + len), merging with queued neighbours */
+static void __update_discard_tree_range(struct f2fs_sb_info *sbi,
+				block_t lstart, block_t len)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct discard_cmd *dc, *prev_dc, *next_dc;
+	block_t end = lstart + len;
+	block_t pos = lstart;
+
+	while (pos < end) {
+		block_t gap_end;
+
+		dc = __lookup_discard_cmd(dcc, pos, &prev_dc, &next_dc);
+		if (dc) {
+			/* already queued or in flight */
+			pos = dc->lstart + dc->len;
+			continue;
+		}
+
+		gap_end = next_dc ? min(end, next_dc->lstart) : end;
+
+		if (prev_dc && prev_dc->state == D_PREP &&
+				prev_dc->lstart + prev_dc->len == pos) {
+			prev_dc->len += gap_end - pos;
+			dcc->undiscard_blks += gap_end - pos;
+			dc = prev_dc;
+		} else if (next_dc && next_dc->state == D_PREP &&
+				next_dc->lstart == gap_end) {
+			dcc->undiscard_blks += gap_end - pos;
+			next_dc->len += gap_end - pos;
+			next_dc->lstart = pos;
+		} else {
+			__insert_discard_cmd(sbi, pos, gap_end - pos);
+		}
+
+		/* the gap may have joined two commands */
+		if (dc && next_dc && next_dc->state == D_PREP &&
+				next_dc->lstart == gap_end) {
+			block_t next_len = next_dc->len;
+
+			__remove_discard_cmd(sbi, next_dc);
+			dc->len += next_len;
+			dcc->undiscard_blks += next_len;
+		}
+		pos = gap_end;
+	}
+}
+
+static void f2fs_queue_discard(struct f2fs_sb_info *sbi,
+				block_t blkstart, block_t blklen)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+	__set_discard_map(sbi, blkstart, blklen);
+
+	mutex_lock(&dcc->cmd_lock);
+	__update_discard_tree_range(sbi, blkstart, blklen);
+	mutex_unlock(&dcc->cmd_lock);
+}
+
+static void wake_up_discard_thread(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+	dcc->discard_wake = 1;
+	wake_up_interruptible_all(&dcc->discard_wait_queue);
+}
+
+static void __put_discard_bio_ref(struct discard_cmd *dc)
+{
+	if (atomic_dec_and_test(&dc->bio_ref)) {
+		dc->state = D_DONE;
+		complete_all(&dc->wait);
+	}
+}
+
+static void f2fs_submit_discard_endio(struct bio *bio)
+{
+	struct discard_cmd *dc = (struct discard_cmd *)bio->bi_private;
+
+	if (bio->bi_error)
+		dc->error = bio->bi_error;
+	__put_discard_bio_ref(dc);
+	bio_put(bio);
+}
+
+/* split @dc into bios the queue accepts, as blkdev_issue_discard does */
+static void __submit_discard_cmd(struct f2fs_sb_info *sbi,
+						struct discard_cmd *dc)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct block_device *bdev = sbi->sb->s_bdev;
+	struct request_queue *q = bdev_get_queue(bdev);
+	block_t max_blocks = SECTOR_TO_BLOCK(min_t(sector_t,
+			q->limits.max_discard_sectors, UINT_MAX >> 9));
+	block_t start = dc->lstart;
+	block_t left = dc->len;
+
+	trace_f2fs_issue_discard(sbi->sb, dc->lstart, dc->len);
+
+	dc->state = D_SUBMIT;
+	atomic_set(&dc->bio_ref, 1);
+	list_add_tail(&dc->list, &dcc->wait_list);
+	atomic_inc(&dcc->issing_discard);
+
+	while (left && max_blocks) {
+		block_t len = min(left, max_blocks);
+		struct bio *bio = f2fs_bio_alloc(1);
+
+		bio->bi_bdev = bdev;
+		bio->bi_iter.bi_sector = SECTOR_FROM_BLOCK(start);
+		bio->bi_iter.bi_size = len << F2FS_BLKSIZE_BITS;
+		bio->bi_private = dc;
+		bio->bi_end_io = f2fs_submit_discard_endio;
+
+		atomic_inc(&dc->bio_ref);
+		submit_bio(REQ_WRITE | REQ_DISCARD, bio);
+
+		start += len;
+		left -= len;
+	}
+
+	__put_discard_bio_ref(dc);
+}
+
+/*
+ * Issue up to @max_requests queued commands in address order, from where the
+ * last round stopped.  Returns the number issued, or -1 if none was because
+ * the device was busy.
+ */
+static int __issue_discard_cmd(struct f2fs_sb_info *sbi,
+			unsigned int max_requests, bool io_aware)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct discard_cmd *dc, *prev_dc, *next_dc;
+	struct blk_plug plug;
+	unsigned int issued = 0;
+	bool io_interrupted = false;
+
+	mutex_lock(&dcc->cmd_lock);
+	dc = __lookup_discard_cmd(dcc, dcc->next_pos, &prev_dc, &next_dc);
+	if (!dc)
+		dc = next_dc;
+
+	blk_start_plug(&plug);
+	while (dc && issued < max_requests) {
+		if (dc->state == D_PREP) {
+			if (io_aware && !is_idle(sbi)) {
+				io_interrupted = true;
+				break;
+			}
+			dcc->next_pos = dc->lstart + dc->len;
+			__submit_discard_cmd(sbi, dc);
+			issued++;
+		}
+		dc = rb_entry_safe(rb_next(&dc->rb_node),
+					struct discard_cmd, rb_node);
+	}
+	blk_finish_plug(&plug);
+
+	if (!dc)
+		dcc->next_pos = 0;
+	mutex_unlock(&dcc->cmd_lock);
+
+	if (!issued && io_interrupted)
+		return -1;
+	return issued;
+}
+
+/* wait for one submitted command, with a reference taken under cmd_lock */
+static void __wait_one_discard_cmd(struct f2fs_sb_info *sbi,
+						struct discard_cmd *dc)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+	wait_for_completion_io(&dc->wait);
+	mutex_lock(&dcc->cmd_lock);
+	f2fs_bug_on(sbi, dc->state != D_DONE);
+	if (!--dc->ref)
+		__remove_discard_cmd(sbi, dc);
+	mutex_unlock(&dcc->cmd_lock);
+}
+
+/* reap all submitted commands */
+static void __wait_discard_cmds(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct discard_cmd *dc, *tmp;
+	bool need_wait;
+
+next:
+	need_wait = false;
+	mutex_lock(&dcc->cmd_lock);
+	list_for_each_entry_safe(dc, tmp, &dcc->wait_list, list) {
+		if (dc->state == D_DONE && !dc->ref) {
+			__remove_discard_cmd(sbi, dc);
+		} else {
+			dc->ref++;
+			need_wait = true;
+			break;
+		}
+	}
+	mutex_unlock(&dcc->cmd_lock);
+
+	if (need_wait) {
+		__wait_one_discard_cmd(sbi, dc);
+		goto next;
+	}
+}
+
+/* drop [start, end) out of the queued @dc which covers it */
+static void __punch_discard_cmd(struct f2fs_sb_info *sbi,
+			struct discard_cmd *dc, block_t start, block_t end)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	block_t dc_end = dc->lstart + dc->len;
+
+	if (start == dc->lstart && end == dc_end) {
+		__remove_discard_cmd(sbi, dc);
+		return;
+	}
+
+	dcc->undiscard_blks -= end - start;
+
+	if (start > dc->lstart) {
+		dc->len = start - dc->lstart;
+		if (end < dc_end) {
+			dcc->undiscard_blks -= dc_end - end;
+			__insert_discard_cmd(sbi, end, dc_end - end);
+		}
+	} else {
+		dc->lstart = end;
+		dc->len = dc_end - end;
+	}
+}
+
+/*
+ * Blocks [start, start + len) are about to be written, so keep their pending
+ * discards off them.  The caller holds curseg_mutex of the log.
+ */
+static void f2fs_wait_discard_range(struct f2fs_sb_info *sbi,
+					block_t start, block_t len)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	struct discard_cmd *dc, *prev_dc, *next_dc;
+	block_t end = start + len, stop;
+
+	/* commands are only queued while checkpoint blocks allocations */
+	if (!atomic_read(&dcc->discard_cmd_cnt))
+		return;
+
+	mutex_lock(&dcc->cmd_lock);
+	while (start < end) {
+		dc = __lookup_discard_cmd(dcc, start, &prev_dc, &next_dc);
+		if (!dc) {
+			if (!next_dc)
+				break;
+			start = next_dc->lstart;
+			continue;
+		}
+
+		if (dc->state == D_SUBMIT) {
+			dc->ref++;
+			mutex_unlock(&dcc->cmd_lock);
+			__wait_one_discard_cmd(sbi, dc);
+			mutex_lock(&dcc->cmd_lock);
+			continue;
+		}
+
+		stop = min(end, dc->lstart + dc->len);
+		if (dc->state == D_PREP)
+			__punch_discard_cmd(sbi, dc, start, stop);
+		start = stop;
+	}
+	mutex_unlock(&dcc->cmd_lock);
+}
+
+/* This comes from f2fs_put_super and f2fs_trim_fs */
+void f2fs_wait_discard_bios(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+	if (!dcc)
+		return;
+
+	dcc->next_pos = 0;
+	while (__issue_discard_cmd(sbi, UINT_MAX, false) > 0)
+		;
+	__wait_discard_cmds(sbi);
+}
+
+static int issue_discard_thread(void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+	wait_queue_head_t *q = &dcc->discard_wait_queue;
+	unsigned int wait_ms = DEF_MIN_DISCARD_ISSUE_TIME;
+	int issued;
+
+	set_freezable();
+
+	do {
+		wait_event_interruptible_timeout(*q,
+				kthread_should_stop() || freezing(current) ||
+				dcc->discard_wake,
+				msecs_to_jiffies(wait_ms));
+
+		if (dcc->discard_wake)
+			dcc->discard_wake = 0;
+
+		if (try_to_freeze())
+			continue;
+		if (kthread_should_stop())
+			return 0;
+		if (f2fs_readonly(sbi->sb)) {
+			wait_ms = DEF_MAX_DISCARD_ISSUE_TIME;
+			continue;
+		}
+
+		sb_start_intwrite(sbi->sb);
+
+		/* a nearly full device needs its free blocks trimmed now */
+		issued = __issue_discard_cmd(sbi, DEF_MAX_DISCARD_REQUEST,
+				utilization(sbi) < DEF_DISCARD_URGENT_UTIL);
+		if (issued > 0) {
+			__wait_discard_cmds(sbi);
+			wait_ms = DEF_MIN_DISCARD_ISSUE_TIME;
+		} else if (issued == -1) {
+			wait_ms = DEF_MID_DISCARD_ISSUE_TIME;
+		} else {
+			wait_ms = DEF_MAX_DISCARD_ISSUE_TIME;
+		}
+
+		sb_end_intwrite(sbi->sb);
+	} while (!kthread_should_stop());
+	return 0;
+}
+
+static int create_discard_cmd_control(struct f2fs_sb_info *sbi)
+{
+	dev_t dev = sbi->sb->s_bdev->bd_dev;
+	struct discard_cmd_control *dcc;
+	int err;
+
+	dcc = kzalloc(sizeof(struct discard_cmd_control), GFP_KERNEL);
+	if (!dcc)
+		return -ENOMEM;
+
+	init_waitqueue_head(&dcc->discard_wait_queue);
+	mutex_init(&dcc->cmd_lock);
+	dcc->root = RB_ROOT;
+	INIT_LIST_HEAD(&dcc->wait_list);
+	atomic_set(&dcc->discard_cmd_cnt, 0);
+	atomic_set(&dcc->issing_discard, 0);
+	SM_I(sbi)->dcc_info = dcc;
+
+	dcc->f2fs_issue_discard = kthread_run(issue_discard_thread, sbi,
+				"f2fs_discard-%u:%u", MAJOR(dev), MINOR(dev));
+	if (IS_ERR(dcc->f2fs_issue_discard)) {
+		err = PTR_ERR(dcc->f2fs_issue_discard);
+		kfree(dcc);
+		SM_I(sbi)->dcc_info = NULL;
+		return err;
+	}
+	return 0;
+}
+
+static void destroy_discard_cmd_control(struct f2fs_sb_info *sbi)
+{
+	struct discard_cmd_control *dcc = SM_I(sbi)->dcc_info;
+
+	if (!dcc)
+		return;
+
+	kthread_stop(dcc->f2fs_issue_discard);
+	f2fs_wait_discard_bios(sbi);
+	f2fs_bug_on(sbi, atomic_read(&dcc->discard_cmd_cnt));
+	kfree(dcc);
+	SM_I(sbi)->dcc_info = NULL;
+}
+
 bool discard_next_dnode(struct f2fs_sb_info *sbi, block_t blkaddr)
 {
 	int err = -ENOTSUPP;
@@ -522,7 +850,7 @@ bool discard_next_dnode(struct f2fs_sb_info *sbi, block_t blkaddr)
 				GET_SEGNO(sbi, blkaddr));
 		unsigned int offset = GET_BLKOFF_FROM_SEG0(sbi, blkaddr);
 
-		if (f2fs_test_bit(offset, se->discard_map))
+		if (test_bit(offset, se->discard_map))
 			return false;
 
 		err = f2fs_issue_discard(sbi, blkaddr, 1);
@@ -562,14 +890,13 @@ done:
 
 static void add_discard_addrs(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 {
-	int entries = SIT_VBLOCK_MAP_SIZE / sizeof(unsigned long);
 	int max_blocks = sbi->blocks_per_seg;
 	struct seg_entry *se = get_seg_entry(sbi, cpc->trim_start);
-	unsigned long *cur_map = (unsigned long *)se->cur_valid_map;
-	unsigned long *ckpt_map = (unsigned long *)se->ckpt_valid_map;
-	unsigned long *discard_map = (unsigned long *)se->discard_map;
+	unsigned long *cur_map = se->cur_valid_map;
+	unsigned long *ckpt_map = se->ckpt_valid_map;
+	unsigned long *discard_map = se->discard_map;
 	unsigned long *dmap = SIT_I(sbi)->tmp_map;
-	unsigned int start = 0, end = -1;
+	unsigned int start, end;
 	bool force = (cpc->reason == CP_DISCARD);
 	int i;
 
@@ -582,17 +909,15 @@ static void add_discard_addrs(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 			return;
 	}
 
-	/* SIT_VBLOCK_MAP_SIZE should be multiple of sizeof(unsigned long) */
-	for (i = 0; i < entries; i++)
+	for (i = 0; i < SIT_MAP_LONGS; i++)
 		dmap[i] = force ? ~ckpt_map[i] & ~discard_map[i] :
-				(cur_map[i] ^ ckpt_map[i]) & ckpt_map[i];
+			(cur_map[i] ^ ckpt_map[i]) & ckpt_map[i] &
+							~discard_map[i];
 
-	while (force || SM_I(sbi)->nr_discards <= SM_I(sbi)->max_discards) {
-		start = __find_rev_next_bit(dmap, max_blocks, end + 1);
-		if (start >= max_blocks)
+	for_each_sit_map_run(start, end, dmap, max_blocks) {
+		if (!force &&
+			SM_I(sbi)->nr_discards > SM_I(sbi)->max_discards)
 			break;
-
-		end = __find_rev_next_zero_bit(dmap, max_blocks, start + 1);
 		__add_discard_entry(sbi, cpc, se, start, end);
 	}
 }
@@ -609,6 +934,23 @@ void release_discard_addrs(struct f2fs_sb_info *sbi)
 	}
 }
 
+/*
+ * Queue the blocks of a prefree segment whose data the device may still hold.
+ * Blocks remapped away by the device are marked in the discard map already,
+ * so a section cleaned by remapping alone costs no discard at all.
+ */
+static void __queue_prefree_discard(struct f2fs_sb_info *sbi,
+						unsigned int segno)
+{
+	struct seg_entry *se = get_seg_entry(sbi, segno);
+	int max_blocks = sbi->blocks_per_seg;
+	unsigned int start, end;
+
+	for_each_sit_map_zero_run(start, end, se->discard_map, max_blocks)
+		f2fs_queue_discard(sbi, START_BLOCK(sbi, segno) + start,
+							end - start);
+}
+
 /*
  * Should call clear_prefree_segments after checkpoint is done.
  */
@@ -649,8 +991,8 @@ void clear_prefree_segments(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 		if (!test_opt(sbi, DISCARD))
 			continue;
 
-		f2fs_issue_discard(sbi, START_BLOCK(sbi, start),
-				(end - start) << sbi->log_blocks_per_seg);
+		for (i = start; i < end; i++)
+			__queue_prefree_discard(sbi, i);
 	}
 	mutex_unlock(&dirty_i->seglist_lock);
 
@@ -658,25 +1000,28 @@ void clear_prefree_segments(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	list_for_each_entry_safe(entry, this, head, list) {
 		if (cpc->reason == CP_DISCARD && entry->len < cpc->trim_minlen)
 			goto skip;
-		f2fs_issue_discard(sbi, entry->blkaddr, entry->len);
+		f2fs_queue_discard(sbi, entry->blkaddr, entry->len);
 		cpc->trimmed += entry->len;
 skip:
 		list_del(&entry->list);
 		SM_I(sbi)->nr_discards -= entry->len;
 		kmem_cache_free(discard_entry_slab, entry);
 	}
+
+	wake_up_discard_thread(sbi);
 }
 
 static bool __mark_sit_entry_dirty(struct f2fs_sb_info *sbi, unsigned int segno)
 {
 	struct sit_info *sit_i = SIT_I(sbi);
 
-	if (!__test_and_set_bit(segno, sit_i->dirty_sentries_bitmap)) {
-		sit_i->dirty_sentries++;
-		return false;
-	}
+	/* segments of other shards may share the word */
+	if (test_bit(segno, sit_i->dirty_sentries_bitmap) ||
+			test_and_set_bit(segno, sit_i->dirty_sentries_bitmap))
+		return true;
 
-	return true;
+	atomic_inc(&sit_i->dirty_sentries);
+	return false;
 }
 
 static void __set_sit_entry_type(struct f2fs_sb_info *sbi, int type,
@@ -688,14 +1033,38 @@ static void __set_sit_entry_type(struct f2fs_sb_info *sbi, int type,
 		__mark_sit_entry_dirty(sbi, segno);
 }
 
+/*
+ * Keep a moving average of the time between two invalidations in a
+ * segment, from which GC predicts how long its valid blocks will live.
+ */
+static void update_seg_lifetime(struct seg_entry *se)
+{
+	unsigned int now = se->mtime;
+	unsigned int gap;
+
+	if (se->inval_time) {
+		gap = min_t(unsigned int, now - se->inval_time,
+					SEG_LIFETIME_MAX_GAP) << 4;
+		se->inval_gap = se->inval_gap ?
+				(se->inval_gap * 7 + gap) >> 3 : gap;
+	}
+	se->inval_time = now;
+}
+
+/*
+ * The caller holds sentry_lock for write, or for read along with the lock of
+ * the shard of @blkaddr.
+ */
 static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del)
 {
+	struct sit_shard *shard;
 	struct seg_entry *se;
 	unsigned int segno, offset;
 	long int new_vblocks;
 
 	segno = GET_SEGNO(sbi, blkaddr);
 
+	shard = get_sit_shard(sbi, segno);
 	se = get_seg_entry(sbi, segno);
 	new_vblocks = se->valid_blocks + del;
 	offset = GET_BLKOFF_FROM_SEG0(sbi, blkaddr);
@@ -706,36 +1075,51 @@ static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del)
 	se->valid_blocks = new_vblocks;
 	se->mtime = get_mtime(sbi);
 	SIT_I(sbi)->max_mtime = se->mtime;
+	if (del < 0) {
+		update_seg_lifetime(se);
+		WRITE_ONCE(se->remap_fresh, false);
+	}
 
 	/* Update valid block bitmap */
 	if (del > 0) {
-		if (f2fs_test_and_set_bit(offset, se->cur_valid_map))
+		if (__test_and_set_bit(offset, se->cur_valid_map))
 			f2fs_bug_on(sbi, 1);
-		if (!f2fs_test_and_set_bit(offset, se->discard_map))
-			sbi->discard_blks--;
+		if (!__test_and_set_bit(offset, se->discard_map))
+			shard->discard_delta--;
 	} else {
-		if (!f2fs_test_and_clear_bit(offset, se->cur_valid_map))
+		if (!__test_and_clear_bit(offset, se->cur_valid_map))
 			f2fs_bug_on(sbi, 1);
-		if (f2fs_test_and_clear_bit(offset, se->discard_map))
-			sbi->discard_blks++;
+		if (__test_and_clear_bit(offset, se->discard_map))
+			shard->discard_delta++;
 	}
-	if (!f2fs_test_bit(offset, se->ckpt_valid_map))
+	if (!test_bit(offset, se->ckpt_valid_map))
 		se->ckpt_valid_blocks += del;
 
 	__mark_sit_entry_dirty(sbi, segno);
 
 	/* update total number of valid blocks to be written in ckpt area */
-	SIT_I(sbi)->written_valid_blocks += del;
+	shard->written_delta += del;
 
 	if (sbi->segs_per_sec > 1)
 		get_sec_entry(sbi, segno)->valid_blocks += del;
 }
 
+static void update_sit_entry_shared(struct f2fs_sb_info *sbi,
+						block_t blkaddr, int del)
+{
+	struct sit_shard *shard = get_sit_shard(sbi, GET_SEGNO(sbi, blkaddr));
+
+	spin_lock(&shard->lock);
+	update_sit_entry(sbi, blkaddr, del);
+	spin_unlock(&shard->lock);
+}
+
+/* the caller holds sentry_lock for read */
 void refresh_sit_entry(struct f2fs_sb_info *sbi, block_t old, block_t new)
 {
-	update_sit_entry(sbi, new, 1);
+	update_sit_entry_shared(sbi, new, 1);
 	if (GET_SEGNO(sbi, old) != NULL_SEGNO)
-		update_sit_entry(sbi, old, -1);
+		update_sit_entry_shared(sbi, old, -1);
 
 	locate_dirty_segment(sbi, GET_SEGNO(sbi, old));
 	locate_dirty_segment(sbi, GET_SEGNO(sbi, new));
@@ -745,20 +1129,69 @@ void invalidate_blocks(struct f2fs_sb_info *sbi, block_t addr)
 {
 	unsigned int segno = GET_SEGNO(sbi, addr);
 	struct sit_info *sit_i = SIT_I(sbi);
+	struct sit_shard *shard;
 
 	f2fs_bug_on(sbi, addr == NULL_ADDR);
 	if (addr == NEW_ADDR)
 		return;
 
 	/* add it into sit main buffer */
-	mutex_lock(&sit_i->sentry_lock);
+	down_read(&sit_i->sentry_lock);
 
+	shard = get_sit_shard(sbi, segno);
+	spin_lock(&shard->lock);
 	update_sit_entry(sbi, addr, -1);
+	spin_unlock(&shard->lock);
 
 	/* add it into dirty seglist */
 	locate_dirty_segment(sbi, segno);
 
-	mutex_unlock(&sit_i->sentry_lock);
+	up_read(&sit_i->sentry_lock);
+}
+
+/*
+ * The device remapped the data of @addr to another block and holds nothing
+ * at @addr any more, so the block, which allocate_data_block() invalidated
+ * when the remap destination was reserved, needs no discard.
+ */
+void mark_block_unmapped(struct f2fs_sb_info *sbi, block_t addr)
+{
+	unsigned int segno = GET_SEGNO(sbi, addr);
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct sit_shard *shard;
+	struct seg_entry *se;
+
+	down_read(&sit_i->sentry_lock);
+	shard = get_sit_shard(sbi, segno);
+	se = get_seg_entry(sbi, segno);
+	spin_lock(&shard->lock);
+	if (!__test_and_set_bit(GET_BLKOFF_FROM_SEG0(sbi, addr),
+						se->discard_map))
+		shard->discard_delta--;
+	spin_unlock(&shard->lock);
+	up_read(&sit_i->sentry_lock);
+}
+
+/*
+ * Undo allocate_data_block() for a block which was never written: @new is
+ * invalid again and @old, which it replaced, is valid once more.  @old may
+ * have left its segment without valid blocks meanwhile, so the segment is
+ * taken off the prefree list before a checkpoint can free it.
+ */
+void revert_data_block(struct f2fs_sb_info *sbi, block_t old, block_t new)
+{
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	struct sit_info *sit_i = SIT_I(sbi);
+	unsigned int segno = GET_SEGNO(sbi, old);
+
+	down_read(&sit_i->sentry_lock);
+	refresh_sit_entry(sbi, new, old);
+
+	mutex_lock(&dirty_i->seglist_lock);
+	if (test_and_clear_bit(segno, dirty_i->dirty_segmap[PRE]))
+		dirty_i->nr_dirty[PRE]--;
+	mutex_unlock(&dirty_i->seglist_lock);
+	up_read(&sit_i->sentry_lock);
 }
 
 bool is_checkpointed_data(struct f2fs_sb_info *sbi, block_t blkaddr)
@@ -771,16 +1204,17 @@ bool is_checkpointed_data(struct f2fs_sb_info *sbi, block_t blkaddr)
 	if (blkaddr == NEW_ADDR || blkaddr == NULL_ADDR)
 		return true;
 
-	mutex_lock(&sit_i->sentry_lock);
+	/* ckpt_valid_map only changes under sentry_lock for write */
+	down_read(&sit_i->sentry_lock);
 
 	segno = GET_SEGNO(sbi, blkaddr);
 	se = get_seg_entry(sbi, segno);
 	offset = GET_BLKOFF_FROM_SEG0(sbi, blkaddr);
 
-	if (f2fs_test_bit(offset, se->ckpt_valid_map))
+	if (test_bit(offset, se->ckpt_valid_map))
 		is_cp = true;
 
-	mutex_unlock(&sit_i->sentry_lock);
+	up_read(&sit_i->sentry_lock);
 
 	return is_cp;
 }
@@ -962,12 +1396,18 @@ static void reset_curseg(struct f2fs_sb_info *sbi, int type, int modified)
 {
 	struct curseg_info *curseg = CURSEG_I(sbi, type);
 	struct summary_footer *sum_footer;
+	struct seg_entry *se;
 
 	curseg->segno = curseg->next_segno;
 	curseg->zone = GET_ZONENO_FROM_SEGNO(sbi, curseg->segno);
 	curseg->next_blkoff = 0;
 	curseg->next_segno = NULL_SEGNO;
 
+	/* blocks written from now on don't share the lifetime of older ones */
+	se = get_seg_entry(sbi, curseg->segno);
+	se->inval_time = 0;
+	se->inval_gap = 0;
+
 	sum_footer = &(curseg->sum_blk->footer);
 	memset(sum_footer, 0, sizeof(struct summary_footer));
 	if (IS_DATASEG(type))
@@ -1005,18 +1445,12 @@ static void __next_free_blkoff(struct f2fs_sb_info *sbi,
 			struct curseg_info *seg, block_t start)
 {
 	struct seg_entry *se = get_seg_entry(sbi, seg->segno);
-	int entries = SIT_VBLOCK_MAP_SIZE / sizeof(unsigned long);
-	unsigned long *target_map = SIT_I(sbi)->tmp_map;
-	unsigned long *ckpt_map = (unsigned long *)se->ckpt_valid_map;
-	unsigned long *cur_map = (unsigned long *)se->cur_valid_map;
-	int i, pos;
+	unsigned long target_map[SIT_MAP_LONGS];
 
-	for (i = 0; i < entries; i++)
-		target_map[i] = ckpt_map[i] | cur_map[i];
-
-	pos = __find_rev_next_zero_bit(target_map, sbi->blocks_per_seg, start);
-
-	seg->next_blkoff = pos;
+	bitmap_or(target_map, se->ckpt_valid_map, se->cur_valid_map,
+							SIT_MAP_BITS);
+	seg->next_blkoff = find_next_zero_bit(target_map, sbi->blocks_per_seg,
+								start);
 }
 
 /*
@@ -1027,10 +1461,16 @@ static void __next_free_blkoff(struct f2fs_sb_info *sbi,
 static void __refresh_next_blkoff(struct f2fs_sb_info *sbi,
 				struct curseg_info *seg)
 {
-	if (seg->alloc_type == SSR)
+	if (seg->alloc_type == SSR) {
+		struct sit_shard *shard = get_sit_shard(sbi, seg->segno);
+
+		/* others may invalidate blocks of the segment meanwhile */
+		spin_lock(&shard->lock);
 		__next_free_blkoff(sbi, seg, seg->next_blkoff + 1); // get the obsolete block because of lack of space.
-	else
+		spin_unlock(&shard->lock);
+	} else {
 		seg->next_blkoff++;
+	}
 }
 
 /*
@@ -1153,9 +1593,9 @@ int f2fs_trim_fs(struct f2fs_sb_info *sbi, struct fstrim_range *range)
 	for (; start_segno <= end_segno; start_segno = cpc.trim_end + 1) {
 		cpc.trim_start = start_segno;
 
-		if (sbi->discard_blks == 0)
+		if (discard_block_count(sbi) == 0)
 			break;
-		else if (sbi->discard_blks < BATCHED_TRIM_BLOCKS(sbi))
+		else if (discard_block_count(sbi) < BATCHED_TRIM_BLOCKS(sbi))
 			cpc.trim_end = end_segno;
 		else
 			cpc.trim_end = min_t(unsigned int,
@@ -1165,8 +1605,11 @@ int f2fs_trim_fs(struct f2fs_sb_info *sbi, struct fstrim_range *range)
 
 		mutex_lock(&sbi->gc_mutex);
 		write_checkpoint(sbi, &cpc);
-		mutex_unlock(&sbi->gc_mutex);
+		f2fs_unlock_gc(sbi);
 	}
+
+	/* FITRIM returns once the device has seen the discards */
+	f2fs_wait_discard_bios(sbi);
 out:
 	range->len = F2FS_BLK_TO_BYTES(cpc.trimmed);
 	return 0;
@@ -1205,6 +1648,42 @@ static int __get_segment_type_4(struct page *page, enum page_type p_type)
 	}
 }
 
+/*
+ * Remember how often @inode rewrites its data, counting all blocks written
+ * back within the same second as one update.
+ */
+void update_data_lifetime(struct inode *inode)
+{
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	unsigned int now = get_mtime(F2FS_I_SB(inode));
+	unsigned int gap;
+
+	if (now == fi->i_update_time)
+		return;
+	if (fi->i_update_time) {
+		gap = now - fi->i_update_time;
+		fi->i_update_gap = fi->i_update_gap ?
+				(fi->i_update_gap * 3 + gap) >> 2 : gap;
+	}
+	fi->i_update_time = now;
+}
+
+/* place data by the predicted lifetime of its blocks */
+static int __get_data_lifetime_type(struct inode *inode)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	unsigned int gap = F2FS_I(inode)->i_update_gap;
+
+	/* not rewritten yet */
+	if (!gap)
+		return CURSEG_WARM_DATA;
+	if (gap < sbi->hot_data_lifetime)
+		return CURSEG_HOT_DATA;
+	if (sbi->cold_data_lifetime && gap > sbi->cold_data_lifetime)
+		return CURSEG_COLD_DATA;
+	return CURSEG_WARM_DATA;
+}
+
 static int __get_segment_type_6(struct page *page, enum page_type p_type)
 {
 	if (p_type == DATA) {
@@ -1215,7 +1694,7 @@ static int __get_segment_type_6(struct page *page, enum page_type p_type)
 		else if (is_cold_data(page) || file_is_cold(inode))
 			return CURSEG_COLD_DATA;
 		else
-			return CURSEG_WARM_DATA;
+			return __get_data_lifetime_type(inode);
 	} else {
 		if (IS_DNODE(page))
 			return is_cold_node(page) ? CURSEG_WARM_NODE :
@@ -1239,6 +1718,69 @@ static int __get_segment_type(struct page *page, enum page_type p_type)
 	return __get_segment_type_6(page, p_type);
 }
 
+/*
+ * Take up to @nr blocks from the current segment of @type, as long as they
+ * are contiguous.  @blkaddrs carries the old addresses in and the new ones
+ * out, @sums the summary entries of the blocks.  Returns the blocks taken,
+ * at least one.  The caller holds curseg_mutex.
+ */
+static unsigned int __allocate_blocks(struct f2fs_sb_info *sbi, int type,
+		block_t *blkaddrs, struct f2fs_summary *sums, unsigned int nr)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct curseg_info *curseg = CURSEG_I(sbi, type);
+	block_t start = NEXT_FREE_BLKADDR(sbi, curseg);
+	unsigned int i;
+
+	/*
+	 * curseg_mutex keeps the current segment of this log, so only the
+	 * SIT entries are shared with other logs, through their shard locks.
+	 */
+	down_read(&sit_i->sentry_lock);
+
+	for (i = 0; i < nr; i++) {
+		block_t new_blkaddr = NEXT_FREE_BLKADDR(sbi, curseg); // get the BLKADDR.
+
+		/* SSR skips the blocks still in use */
+		if (new_blkaddr != start + i)
+			break;
+
+		/*
+		 * __add_sum_entry should be resided under the curseg_mutex
+		 * because, this function updates a summary entry in the
+		 * current summary block.
+		 */
+		__add_sum_entry(sbi, type, &sums[i]); // fill the summary entry of the new block address.
+
+		__refresh_next_blkoff(sbi, curseg); // update next_blkoff, just add 1.
+
+		stat_inc_block_count(sbi, curseg);
+
+		/*
+		 * SIT information should be updated before segment allocation,
+		 * since SSR needs latest valid block information.
+		 */
+		refresh_sit_entry(sbi, blkaddrs[i], new_blkaddr); // set invalid of the old_blkaddr and ?
+		blkaddrs[i] = new_blkaddr;
+
+		if (!__has_curseg_space(sbi, type)) {
+			i++;
+			break;
+		}
+	}
+
+	up_read(&sit_i->sentry_lock);
+
+	f2fs_wait_discard_range(sbi, start, i);
+
+	if (!__has_curseg_space(sbi, type)) {
+		down_write(&sit_i->sentry_lock);
+		sit_i->s_ops->allocate_segment(sbi, type, false); // need allocate new segment.
+		up_write(&sit_i->sentry_lock);
+	}
+	return i;
+}
+
 void allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
 		block_t old_blkaddr, block_t *new_blkaddr,
 		struct f2fs_summary *sum, int type)
@@ -1252,40 +1794,42 @@ void allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
 	curseg = CURSEG_I(sbi, type);
 
 	mutex_lock(&curseg->curseg_mutex);
-	mutex_lock(&sit_i->sentry_lock);
 
 	/* direct_io'ed data is aligned to the segment for better performance */
 	if (direct_io && curseg->next_blkoff &&
-				!has_not_enough_free_secs(sbi, 0))
+				!has_not_enough_free_secs(sbi, 0)) {
+		down_write(&sit_i->sentry_lock);
 		__allocate_new_segments(sbi, type);
+		up_write(&sit_i->sentry_lock);
+	}
 
-	*new_blkaddr = NEXT_FREE_BLKADDR(sbi, curseg); // get the BLKADDR.
-
-	/*
-	 * __add_sum_entry should be resided under the curseg_mutex
-	 * because, this function updates a summary entry in the
-	 * current summary block.
-	 */
-	__add_sum_entry(sbi, type, sum); // fill the summary entry of the new block address.
-
-	__refresh_next_blkoff(sbi, curseg); // update next_blkoff, just add 1.
+	*new_blkaddr = old_blkaddr;
+	__allocate_blocks(sbi, type, new_blkaddr, sum, 1);
 
-	stat_inc_block_count(sbi, curseg);
+	if (page && IS_NODESEG(type)) // If is node block, write the footer. Interesting.
+		fill_node_footer_blkaddr(page, NEXT_FREE_BLKADDR(sbi, curseg));
 
-	if (!__has_curseg_space(sbi, type))
-		sit_i->s_ops->allocate_segment(sbi, type, false); // need allocate new segment.
-	/*
-	 * SIT information should be updated before segment allocation,
-	 * since SSR needs latest valid block information.
-	 */
-	refresh_sit_entry(sbi, old_blkaddr, *new_blkaddr); // set invalid of the old_blkaddr and ?
+	mutex_unlock(&curseg->curseg_mutex);
+}
 
-	mutex_unlock(&sit_i->sentry_lock);
+/*
+ * Reserve a run of contiguous blocks for the data blocks in @blkaddrs, whose
+ * summary entries are in @sums.  Node blocks carry their own address in the
+ * footer, so only data logs hand out runs.  Returns the length of the run,
+ * which ends early at the end of a segment or, under SSR, at a used block.
+ */
+unsigned int allocate_data_blocks(struct f2fs_sb_info *sbi, block_t *blkaddrs,
+			struct f2fs_summary *sums, unsigned int nr, int type)
+{
+	struct curseg_info *curseg = CURSEG_I(sbi, type);
+	unsigned int len;
 
-	if (page && IS_NODESEG(type)) // If is node block, write the footer. Interesting.
-		fill_node_footer_blkaddr(page, NEXT_FREE_BLKADDR(sbi, curseg));
+	f2fs_bug_on(sbi, !IS_DATASEG(type));
 
+	mutex_lock(&curseg->curseg_mutex);
+	len = __allocate_blocks(sbi, type, blkaddrs, sums, nr);
 	mutex_unlock(&curseg->curseg_mutex);
+	return len;
 }
 
 static void do_write_page(struct f2fs_summary *sum, struct f2fs_io_info *fio) // This time is really to write page back.
@@ -1337,92 +1881,48 @@ void write_data_page(struct dnode_of_data *dn, struct f2fs_io_info *fio)
 	do_write_page(&sum, fio);
 	dn->data_blkaddr = fio->blk_addr;
 }
-// I don't think I should define the cmd there. 
-struct nvme_passthru_cmd {
-	__u8	opcode;
-	__u8	flags;
-	__u16	rsvd1;
-	__u32	nsid;
-	__u32	cdw2;
-	__u32	cdw3;
-	__u64	metadata;
-	__u64	addr;
-	__u32	metadata_len;
-	__u32	data_len;
-	__u32	cdw10;
-	__u32	cdw11;
-	__u32	cdw12;
-	__u32	cdw13;
-	__u32	cdw14;
-	__u32	cdw15;
-	__u32	timeout_ms;
-	__u32	result;
-};
-extern static int nvme_kernel_iocmd(struct block_dev *dev, struct nvme_passthru_cmd *ucmd);
-#define REMAP 0x93
-int remapSSD(unsigned int ori_lba,unsigned int new_lba,int len) {
-	
-	struct file *filp = NULL;
-    mm_segment_t oldfs;
-    int err = 0;
-
-    oldfs = get_fs();
-    set_fs(get_ds());
-    filp = filp_open("/dev/nvme0n1", O_RDONLY, 0);
-    set_fs(oldfs);
-    if (IS_ERR(filp)) {
-        err = PTR_ERR(filp);
-		printk("Unable to open stats file to write\n");
-        return -1;
-    }
-
-	struct block_device *b_dev = filp->f_inode->i_bdev;
-	u32 result;
-	int err2;
-	int count = 20;
-	int opcode;
-	struct nvme_passthru_cmd cmd;
-
-	cmd.opcode = REMAP;
-	cmd.nsid = 1;
-	cmd.cdw10 = ori_lba;
-	cmd.cdw11 = new_lba;
-	cmd.cdw12 = len;
-	cmd.flags = 0; 
-
-	err2 = nvme_kernel_iocmd(b_dev,&cmd);
-    filp_close(filp, NULL);
-	result = cmd.result;
-	printk("err2:%d\n",err2);
-	printk("result:%d\n",result);
-	int ret = min(result & 0xffff,result >> 16) + 1;
-	if(ret>=0){
-		printk("remap success!\n");	
-		return 0;
-	} else {
-		printk("remap failed!\n"); 
-		return -1;
-	}
-}
-void remap_data_page(struct dnode_of_data *dn, struct f2fs_io_info *fio)
+
+/*
+ * Write @nr pages of consecutive indices, whose addresses are the slots from
+ * dn->ofs_in_node on, through as few block runs as the logs allow.  The old
+ * addresses are passed in @blkaddrs and the new ones returned there; the
+ * caller updates the dnode.
+ */
+void write_data_pages(struct dnode_of_data *dn, struct f2fs_io_info *fio,
+		struct page **pages, block_t *blkaddrs, unsigned int nr)
 {
 	struct f2fs_sb_info *sbi = fio->sbi;
-	struct f2fs_summary sum;
+	struct f2fs_summary sums[F2FS_WRITE_RUN_MAX];
 	struct node_info ni;
+	unsigned int i, len;
 	int type;
 
-	f2fs_bug_on(sbi, dn->data_blkaddr == NULL_ADDR);
-	get_node_info(sbi, dn->nid, &ni); // get node information in struct ni.
-	set_summary(&sum, dn->nid, dn->ofs_in_node, ni.version);
+	f2fs_bug_on(sbi, nr > F2FS_WRITE_RUN_MAX);
 
+	get_node_info(sbi, dn->nid, &ni);
+	for (i = 0; i < nr; i++) {
+		f2fs_bug_on(sbi, blkaddrs[i] == NULL_ADDR);
+		/* the caller ends a run where the temperature changes */
+		f2fs_bug_on(sbi, !is_cold_data(pages[i]) !=
+						!is_cold_data(pages[0]));
+		set_summary(&sums[i], dn->nid, dn->ofs_in_node + i, ni.version);
+	}
 
-	type = __get_segment_type(fio->page, fio->type); // get type of hot/warm/cold and data/node.
-	allocate_data_block(fio->sbi, fio->page, fio->blk_addr,
-					&fio->blk_addr, sum, type);
-	remapSSD(dn->data_blkaddr,fio->blk_addr,1);
-	dn->data_blkaddr = fio->blk_addr;
-}
+	/* pages of a run share their inode and temperature */
+	type = __get_segment_type(pages[0], fio->type);
 
+	for (i = 0; i < nr; i += len) {
+		unsigned int j;
+
+		len = allocate_data_blocks(sbi, blkaddrs + i, sums + i,
+							nr - i, type);
+		for (j = i; j < i + len; j++) {
+			fio->page = pages[j];
+			fio->blk_addr = blkaddrs[j];
+			f2fs_submit_page_mbio(fio);
+		}
+	}
+}
 
 void rewrite_data_page(struct f2fs_io_info *fio)
 {
@@ -1462,7 +1962,7 @@ static void __f2fs_replace_block(struct f2fs_sb_info *sbi,
 	curseg = CURSEG_I(sbi, type);
 
 	mutex_lock(&curseg->curseg_mutex);
-	mutex_lock(&sit_i->sentry_lock);
+	down_write(&sit_i->sentry_lock);
 
 	old_cursegno = curseg->segno;
 	old_blkoff = curseg->next_blkoff;
@@ -1494,7 +1994,7 @@ static void __f2fs_replace_block(struct f2fs_sb_info *sbi,
 		curseg->next_blkoff = old_blkoff;
 	}
 
-	mutex_unlock(&sit_i->sentry_lock);
+	up_write(&sit_i->sentry_lock);
 	mutex_unlock(&curseg->curseg_mutex);
 }
 
@@ -1978,9 +2478,9 @@ void flush_sit_entries(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	struct seg_entry *se;
 
 	mutex_lock(&curseg->curseg_mutex);
-	mutex_lock(&sit_i->sentry_lock);
+	down_write(&sit_i->sentry_lock);
 
-	if (!sit_i->dirty_sentries)
+	if (!atomic_read(&sit_i->dirty_sentries))
 		goto out;
 
 	/*
@@ -1994,7 +2494,8 @@ void flush_sit_entries(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	 * entries, remove all entries from journal and add and account
 	 * them in sit entry set.
 	 */
-	if (!__has_cursum_space(sum, sit_i->dirty_sentries, SIT_JOURNAL))
+	if (!__has_cursum_space(sum, atomic_read(&sit_i->dirty_sentries),
+								SIT_JOURNAL))
 		remove_sits_in_journal(sbi);
 
 	/*
@@ -2046,7 +2547,7 @@ void flush_sit_entries(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 			}
 
 			__clear_bit(segno, bitmap);
-			sit_i->dirty_sentries--;
+			atomic_dec(&sit_i->dirty_sentries);
 			ses->entry_cnt--;
 		}
 
@@ -2058,13 +2559,13 @@ void flush_sit_entries(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	}
 
 	f2fs_bug_on(sbi, !list_empty(head));
-	f2fs_bug_on(sbi, sit_i->dirty_sentries);
+	f2fs_bug_on(sbi, atomic_read(&sit_i->dirty_sentries));
 out:
 	if (cpc->reason == CP_DISCARD) {
 		for (; cpc->trim_start <= cpc->trim_end; cpc->trim_start++)
 			add_discard_addrs(sbi, cpc);
 	}
-	mutex_unlock(&sit_i->sentry_lock);
+	up_write(&sit_i->sentry_lock);
 	mutex_unlock(&curseg->curseg_mutex);
 
 	set_prefree_as_free_segments(sbi);
@@ -2139,11 +2640,13 @@ static int build_sit_info(struct f2fs_sb_info *sbi)
 	sit_i->written_valid_blocks = le64_to_cpu(ckpt->valid_block_count);
 	sit_i->sit_bitmap = dst_bitmap;
 	sit_i->bitmap_size = bitmap_size;
-	sit_i->dirty_sentries = 0;
+	atomic_set(&sit_i->dirty_sentries, 0);
 	sit_i->sents_per_block = SIT_ENTRY_PER_BLOCK;
 	sit_i->elapsed_time = le64_to_cpu(sbi->ckpt->elapsed_time);
 	sit_i->mounted_time = CURRENT_TIME_SEC.tv_sec;
-	mutex_init(&sit_i->sentry_lock);
+	init_rwsem(&sit_i->sentry_lock);
+	for (start = 0; start < NR_SIT_SHARDS; start++)
+		spin_lock_init(&sit_i->shards[start].lock);
 	return 0;
 }
 
@@ -2245,7 +2748,8 @@ got_it:
 			seg_info_from_raw_sit(se, &sit);
 
 			/* build discard map only one time */
-			memcpy(se->discard_map, se->cur_valid_map, SIT_VBLOCK_MAP_SIZE);
+			bitmap_copy(se->discard_map, se->cur_valid_map,
+							SIT_MAP_BITS);
 			sbi->discard_blks += sbi->blocks_per_seg - se->valid_blocks;
 
 			if (sbi->segs_per_sec > 1) {
@@ -2309,6 +2813,10 @@ static int init_victim_secmap(struct f2fs_sb_info *sbi)
 	dirty_i->victim_secmap = f2fs_kvzalloc(bitmap_size, GFP_KERNEL);
 	if (!dirty_i->victim_secmap)
 		return -ENOMEM;
+
+	dirty_i->fg_victim_secmap = f2fs_kvzalloc(bitmap_size, GFP_KERNEL);
+	if (!dirty_i->fg_victim_secmap)
+		return -ENOMEM;
 	return 0;
 }
 
@@ -2345,7 +2853,7 @@ static void init_min_max_mtime(struct f2fs_sb_info *sbi)
 	struct sit_info *sit_i = SIT_I(sbi);
 	unsigned int segno;
 
-	mutex_lock(&sit_i->sentry_lock);
+	down_write(&sit_i->sentry_lock);
 
 	sit_i->min_mtime = LLONG_MAX;
 
@@ -2362,7 +2870,7 @@ static void init_min_max_mtime(struct f2fs_sb_info *sbi)
 			sit_i->min_mtime = mtime;
 	}
 	sit_i->max_mtime = get_mtime(sbi);
-	mutex_unlock(&sit_i->sentry_lock);
+	up_write(&sit_i->sentry_lock);
 }
 
 int build_segment_manager(struct f2fs_sb_info *sbi)
@@ -2405,6 +2913,10 @@ int build_segment_manager(struct f2fs_sb_info *sbi)
 			return err;
 	}
 
+	err = create_discard_cmd_control(sbi);
+	if (err)
+		return err;
+
 	err = build_sit_info(sbi);
 	if (err)
 		return err;
@@ -2442,6 +2954,7 @@ static void destroy_victim_secmap(struct f2fs_sb_info *sbi)
 {
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	kvfree(dirty_i->victim_secmap);
+	kvfree(dirty_i->fg_victim_secmap);
 }
 
 static void destroy_dirty_segmap(struct f2fs_sb_info *sbi)
@@ -2518,6 +3031,7 @@ void destroy_segment_manager(struct f2fs_sb_info *sbi)
 	if (!sm_info)
 		return;
 	destroy_flush_cmd_control(sbi);
+	destroy_discard_cmd_control(sbi);
 	destroy_dirty_segmap(sbi);
 	destroy_curseg(sbi);
 	destroy_free_segmap(sbi);
@@ -2533,10 +3047,15 @@ int __init create_segment_manager_caches(void)
 	if (!discard_entry_slab)
 		goto fail;
 
+	discard_cmd_slab = f2fs_kmem_cache_create("discard_cmd",
+			sizeof(struct discard_cmd));
+	if (!discard_cmd_slab)
+		goto destory_discard_entry;
+
 	sit_entry_set_slab = f2fs_kmem_cache_create("sit_entry_set",
 			sizeof(struct sit_entry_set));
 	if (!sit_entry_set_slab)
-		goto destory_discard_entry;
+		goto destroy_discard_cmd;
 
 	inmem_entry_slab = f2fs_kmem_cache_create("inmem_page_entry",
 			sizeof(struct inmem_pages));
@@ -2546,6 +3065,8 @@ int __init create_segment_manager_caches(void)
 
 destroy_sit_entry_set:
 	kmem_cache_destroy(sit_entry_set_slab);
+destroy_discard_cmd:
+	kmem_cache_destroy(discard_cmd_slab);
 destory_discard_entry:
 	kmem_cache_destroy(discard_entry_slab);
 fail:
@@ -2555,6 +3076,7 @@ fail:
 void destroy_segment_manager_caches(void)
 {
 	kmem_cache_destroy(sit_entry_set_slab);
+	kmem_cache_destroy(discard_cmd_slab);
 	kmem_cache_destroy(discard_entry_slab);
 	kmem_cache_destroy(inmem_entry_slab);
 }
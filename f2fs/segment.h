@@ -11,6 +11,8 @@
 #include <linux/blkdev.h>
 #include <linux/backing-dev.h>
 
+#include "sitmap.h"
+
 /* constant macro */
 #define NULL_SEGNO			((unsigned int)(~0))
 #define NULL_SECNO			((unsigned int)(~0))
@@ -128,10 +130,12 @@ enum {
  * In the victim_sel_policy->gc_mode, there are two gc, aka cleaning, modes.
  * GC_CB is based on cost-benefit algorithm.
  * GC_GREEDY is based on greedy algorithm.
+ * GC_REMAP weighs blocks the device can remap against blocks to be copied.
  */
 enum {
 	GC_CB = 0,
-	GC_GREEDY
+	GC_GREEDY,
+	GC_REMAP
 };
 
 /*
@@ -148,7 +152,7 @@ enum {
 /* for a function parameter to select a victim segment */
 struct victim_sel_policy {
 	int alloc_mode;			/* LFS or SSR */
-	int gc_mode;			/* GC_CB or GC_GREEDY */
+	int gc_mode;			/* GC_CB, GC_GREEDY or GC_REMAP */
 	unsigned long *dirty_segmap;	/* dirty segment bitmap */
 	unsigned int max_search;	/* maximum # of segments to search */
 	unsigned int offset;		/* last scanned bitmap offset */
@@ -159,18 +163,25 @@ struct victim_sel_policy {
 
 struct seg_entry {
 	unsigned short valid_blocks;	/* # of valid blocks */
-	unsigned char *cur_valid_map;	/* validity bitmap of blocks */
+	unsigned long *cur_valid_map;	/* validity bitmap of blocks */
 	/*
 	 * # of valid blocks and the validity bitmap stored in the the last
 	 * checkpoint pack. This information is used by the SSR mode.
 	 */
 	unsigned short ckpt_valid_blocks;
-	unsigned char *ckpt_valid_map;
-	unsigned char *discard_map;
+	unsigned long *ckpt_valid_map;
+	unsigned long *discard_map;
 	unsigned char type;		/* segment type like CURSEG_XXX_TYPE */
 	unsigned long long mtime;	/* modification time of the segment */
+	unsigned int inval_time;	/* get_mtime() of last invalidation */
+	unsigned int inval_gap;		/* average 1/16 secs between them */
+	unsigned char remap_copy;	/* sampled share GC_REMAP copies, of 255 */
+	bool remap_fresh;		/* no block invalidated since sampling */
 };
 
+/* caps seg_entry->inval_gap, so that its moving average can't overflow */
+#define SEG_LIFETIME_MAX_GAP	(1 << 24)
+
 struct sec_entry {
 	unsigned int valid_blocks;	/* # of valid blocks in a section */
 };
@@ -193,6 +204,20 @@ struct inmem_pages {
 	struct page *page;
 };
 
+/*
+ * Per-block SIT updates take sentry_lock for read and the lock of the shard
+ * holding the section, so that logs writing to different sections don't
+ * contend.  Anything which changes the current segments or walks the whole
+ * SIT takes sentry_lock for write.
+ */
+#define NR_SIT_SHARDS		16
+
+struct sit_shard {
+	spinlock_t lock;		/* protects seg/sec entries of shard */
+	long written_delta;		/* change of written_valid_blocks */
+	long discard_delta;		/* change of sbi->discard_blks */
+} ____cacheline_aligned_in_smp;
+
 struct sit_info {
 	const struct segment_allocation *s_ops;
 
@@ -204,9 +229,10 @@ struct sit_info {
 
 	unsigned long *tmp_map;			/* bitmap for temporal use */
 	unsigned long *dirty_sentries_bitmap;	/* bitmap for dirty sentries */
-	unsigned int dirty_sentries;		/* # of dirty sentries */
+	atomic_t dirty_sentries;		/* # of dirty sentries */
 	unsigned int sents_per_block;		/* # of SIT entries per block */
-	struct mutex sentry_lock;		/* to protect SIT cache */
+	struct rw_semaphore sentry_lock;	/* to protect SIT cache */
+	struct sit_shard shards[NR_SIT_SHARDS];	/* see NR_SIT_SHARDS */
 	struct seg_entry *sentries;		/* SIT segment-level cache */
 	struct sec_entry *sec_entries;		/* SIT section-level cache */
 
@@ -245,6 +271,7 @@ struct dirty_seglist_info {
 	struct mutex seglist_lock;		/* lock for segment bitmaps */
 	int nr_dirty[NR_DIRTY_TYPE];		/* # of dirty segments */
 	unsigned long *victim_secmap;		/* background GC victims */
+	unsigned long *fg_victim_secmap;	/* sections FG_GC is cleaning */
 };
 
 /* victim selection function for cleaning and SSR */
@@ -310,8 +337,8 @@ static inline void seg_info_from_raw_sit(struct seg_entry *se,
 {
 	se->valid_blocks = GET_SIT_VBLOCKS(rs);
 	se->ckpt_valid_blocks = GET_SIT_VBLOCKS(rs);
-	memcpy(se->cur_valid_map, rs->valid_map, SIT_VBLOCK_MAP_SIZE);
-	memcpy(se->ckpt_valid_map, rs->valid_map, SIT_VBLOCK_MAP_SIZE);
+	sit_map_from_raw(se->cur_valid_map, rs->valid_map);
+	bitmap_copy(se->ckpt_valid_map, se->cur_valid_map, SIT_MAP_BITS);
 	se->type = GET_SIT_TYPE(rs);
 	se->mtime = le64_to_cpu(rs->mtime);
 }
@@ -322,8 +349,8 @@ static inline void seg_info_to_raw_sit(struct seg_entry *se,
 	unsigned short raw_vblocks = (se->type << SIT_VBLOCKS_SHIFT) |
 					se->valid_blocks;
 	rs->vblocks = cpu_to_le16(raw_vblocks);
-	memcpy(rs->valid_map, se->cur_valid_map, SIT_VBLOCK_MAP_SIZE);
-	memcpy(se->ckpt_valid_map, rs->valid_map, SIT_VBLOCK_MAP_SIZE);
+	sit_map_to_raw(rs->valid_map, se->cur_valid_map);
+	bitmap_copy(se->ckpt_valid_map, se->cur_valid_map, SIT_MAP_BITS);
 	se->ckpt_valid_blocks = se->valid_blocks;
 	rs->mtime = cpu_to_le64(se->mtime);
 }
@@ -412,9 +439,32 @@ static inline void get_sit_bitmap(struct f2fs_sb_info *sbi,
 	memcpy(dst_addr, sit_i->sit_bitmap, sit_i->bitmap_size);
 }
 
+static inline struct sit_shard *get_sit_shard(struct f2fs_sb_info *sbi,
+						unsigned int segno)
+{
+	return &SIT_I(sbi)->shards[GET_SECNO(sbi, segno) % NR_SIT_SHARDS];
+}
+
 static inline block_t written_block_count(struct f2fs_sb_info *sbi)
 {
-	return SIT_I(sbi)->written_valid_blocks;
+	struct sit_info *sit_i = SIT_I(sbi);
+	long count = sit_i->written_valid_blocks;
+	int i;
+
+	for (i = 0; i < NR_SIT_SHARDS; i++)
+		count += READ_ONCE(sit_i->shards[i].written_delta);
+	return count;
+}
+
+static inline block_t discard_block_count(struct f2fs_sb_info *sbi)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	long count = sbi->discard_blks;
+	int i;
+
+	for (i = 0; i < NR_SIT_SHARDS; i++)
+		count += READ_ONCE(sit_i->shards[i].discard_delta);
+	return count;
 }
 
 static inline unsigned int free_segments(struct f2fs_sb_info *sbi)
@@ -527,6 +577,10 @@ static inline bool need_inplace_update(struct inode *inode)
 	if (S_ISDIR(inode->i_mode) || f2fs_is_atomic_file(inode))
 		return false;
 
+	/* the device may be moving the old block away under us */
+	if (atomic_read(&F2FS_I(inode)->i_remap_pending))
+		return false;
+
 	if (policy & (0x1 << F2FS_IPU_FORCE))
 		return true;
 	if (policy & (0x1 << F2FS_IPU_SSR) && need_SSR(sbi))
@@ -584,25 +638,12 @@ static inline void check_block_count(struct f2fs_sb_info *sbi,
 		int segno, struct f2fs_sit_entry *raw_sit)
 {
 #ifdef CONFIG_F2FS_CHECK_FS
-	bool is_valid  = test_bit_le(0, raw_sit->valid_map) ? true : false;
-	int valid_blocks = 0;
-	int cur_pos = 0, next_pos;
+	unsigned long map[SIT_MAP_LONGS];
 
 	/* check bitmap with valid block count */
-	do {
-		if (is_valid) {
-			next_pos = find_next_zero_bit_le(&raw_sit->valid_map,
-					sbi->blocks_per_seg,
-					cur_pos);
-			valid_blocks += next_pos - cur_pos;
-		} else
-			next_pos = find_next_bit_le(&raw_sit->valid_map,
-					sbi->blocks_per_seg,
-					cur_pos);
-		cur_pos = next_pos;
-		is_valid = !is_valid;
-	} while (cur_pos < sbi->blocks_per_seg);
-	BUG_ON(GET_SIT_VBLOCKS(raw_sit) != valid_blocks);
+	sit_map_from_raw(map, raw_sit->valid_map);
+	BUG_ON(GET_SIT_VBLOCKS(raw_sit) !=
+				sit_map_weight(map, sbi->blocks_per_seg));
 #endif
 	/* check segment usage, and check boundary of a given segment number */
 	f2fs_bug_on(sbi, GET_SIT_VBLOCKS(raw_sit) > sbi->blocks_per_seg
@@ -675,7 +716,9 @@ static inline block_t sum_blk_addr(struct f2fs_sb_info *sbi, int base, int type)
 
 static inline bool sec_usage_check(struct f2fs_sb_info *sbi, unsigned int secno)
 {
-	if (IS_CURSEC(sbi, secno) || (sbi->cur_victim_sec == secno))
+	/* sections being written, or being cleaned by any FG_GC */
+	if (IS_CURSEC(sbi, secno) ||
+			test_bit(secno, DIRTY_I(sbi)->fg_victim_secmap))
 		return true;
 	return false;
 }
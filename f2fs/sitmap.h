@@ -0,0 +1,92 @@
+/*
+ * fs/f2fs/sitmap.h
+ *
+ * Conversion of segment block maps between disk and memory bit order
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef __F2FS_SITMAP_H__
+#define __F2FS_SITMAP_H__
+
+#include <linux/bitmap.h>
+#include <linux/bitrev.h>
+
+/*
+ * Block maps of a segment (cur_valid_map, ckpt_valid_map, discard_map).
+ *
+ * On disk, SIT entries keep block 0 in the MSB of the first byte, the order
+ * of f2fs_set_bit().  In memory the maps are plain kernel bitmaps instead,
+ * so that find_next_bit(), bitmap_weight() and friends work a word at a
+ * time.  Only sit_map_from_raw() and sit_map_to_raw() deal with the disk
+ * order, when SIT entries are loaded and flushed.
+ */
+#define SIT_MAP_BITS		(SIT_VBLOCK_MAP_SIZE * BITS_PER_BYTE)
+#define SIT_MAP_LONGS		BITS_TO_LONGS(SIT_MAP_BITS)
+
+static inline void sit_map_from_raw(unsigned long *map, const __u8 *raw)
+{
+	int i, j;
+
+	for (i = 0; i < SIT_MAP_LONGS; i++) {
+		unsigned long word = 0;
+
+		for (j = 0; j < sizeof(unsigned long); j++, raw++)
+			word |= (unsigned long)bitrev8(*raw) <<
+							(j * BITS_PER_BYTE);
+		map[i] = word;
+	}
+}
+
+static inline void sit_map_to_raw(__u8 *raw, const unsigned long *map)
+{
+	int i, j;
+
+	for (i = 0; i < SIT_MAP_LONGS; i++)
+		for (j = 0; j < sizeof(unsigned long); j++, raw++)
+			*raw = bitrev8(map[i] >> (j * BITS_PER_BYTE));
+}
+
+/* # of blocks set among the first @nbits */
+static inline unsigned int sit_map_weight(const unsigned long *map,
+							unsigned int nbits)
+{
+	return bitmap_weight(map, nbits);
+}
+
+/*
+ * Find the next run of set bits at or after @start.  Returns the start of
+ * the run, with its end in @end, or @nbits if there is none.
+ */
+static inline unsigned int sit_map_next_run(const unsigned long *map,
+		unsigned int nbits, unsigned int start, unsigned int *end)
+{
+	start = find_next_bit(map, nbits, start);
+	if (start < nbits)
+		*end = find_next_zero_bit(map, nbits, start + 1);
+	return start;
+}
+
+/* the same for a run of clear bits */
+static inline unsigned int sit_map_next_zero_run(const unsigned long *map,
+		unsigned int nbits, unsigned int start, unsigned int *end)
+{
+	start = find_next_zero_bit(map, nbits, start);
+	if (start < nbits)
+		*end = find_next_bit(map, nbits, start + 1);
+	return start;
+}
+
+/* iterate the runs [start, end) of set or clear bits of a map */
+#define for_each_sit_map_run(start, end, map, nbits)			\
+	for ((start) = sit_map_next_run(map, nbits, 0, &(end));		\
+		(start) < (nbits);					\
+		(start) = sit_map_next_run(map, nbits, end, &(end)))
+
+#define for_each_sit_map_zero_run(start, end, map, nbits)		\
+	for ((start) = sit_map_next_zero_run(map, nbits, 0, &(end));	\
+		(start) < (nbits);					\
+		(start) = sit_map_next_zero_run(map, nbits, end, &(end)))
+
+#endif /* __F2FS_SITMAP_H__ */
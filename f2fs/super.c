@@ -31,6 +31,7 @@
 #include "xattr.h"
 #include "gc.h"
 #include "trace.h"
+#include "gctrace.h"
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/f2fs.h>
@@ -67,6 +68,8 @@ enum {
 	Opt_extent_cache,
 	Opt_noextent_cache,
 	Opt_noinline_data,
+	Opt_gc_hint,
+	Opt_gc_threads,
 	Opt_err,
 };
 
@@ -91,6 +94,8 @@ static match_table_t f2fs_tokens = {
 	{Opt_extent_cache, "extent_cache"},
 	{Opt_noextent_cache, "noextent_cache"},
 	{Opt_noinline_data, "noinline_data"},
+	{Opt_gc_hint, "gc_hint"},
+	{Opt_gc_threads, "gc_threads=%u"},
 	{Opt_err, NULL},
 };
 
@@ -206,6 +211,7 @@ F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_min_sleep_time, min_sleep_time);
 F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_max_sleep_time, max_sleep_time);
 F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_no_gc_sleep_time, no_gc_sleep_time);
 F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_idle, gc_idle);
+F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_remap_blocks, max_remap_blocks);
 F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, reclaim_segments, rec_prefree_segments);
 F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, max_small_discards, max_discards);
 F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, batched_trim_sections, trim_sections);
@@ -217,6 +223,8 @@ F2FS_RW_ATTR(NM_INFO, f2fs_nm_info, ra_nid_pages, ra_nid_pages);
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, max_victim_search, max_victim_search);
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, dir_level, dir_level);
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, cp_interval, cp_interval);
+F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, hot_data_lifetime, hot_data_lifetime);
+F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, cold_data_lifetime, cold_data_lifetime);
 
 #define ATTR_LIST(name) (&f2fs_attr_##name.attr)
 static struct attribute *f2fs_attrs[] = {
@@ -224,6 +232,7 @@ static struct attribute *f2fs_attrs[] = {
 	ATTR_LIST(gc_max_sleep_time),
 	ATTR_LIST(gc_no_gc_sleep_time),
 	ATTR_LIST(gc_idle),
+	ATTR_LIST(gc_remap_blocks),
 	ATTR_LIST(reclaim_segments),
 	ATTR_LIST(max_small_discards),
 	ATTR_LIST(batched_trim_sections),
@@ -235,6 +244,8 @@ static struct attribute *f2fs_attrs[] = {
 	ATTR_LIST(ram_thresh),
 	ATTR_LIST(ra_nid_pages),
 	ATTR_LIST(cp_interval),
+	ATTR_LIST(hot_data_lifetime),
+	ATTR_LIST(cold_data_lifetime),
 	NULL,
 };
 
@@ -406,6 +417,16 @@ static int parse_options(struct super_block *sb, char *options)
 		case Opt_noinline_data:
 			clear_opt(sbi, INLINE_DATA);
 			break;
+		case Opt_gc_hint:
+			set_opt(sbi, GC_HINT);
+			break;
+		case Opt_gc_threads:
+			if (args->from && match_int(args, &arg))
+				return -EINVAL;
+			if (arg < 1 || arg > GC_MAX_THREADS)
+				return -EINVAL;
+			sbi->gc_threads = arg;
+			break;
 		default:
 			f2fs_msg(sb, KERN_ERR,
 				"Unrecognized mount option \"%s\" or missing value",
@@ -429,8 +450,11 @@ static struct inode *f2fs_alloc_inode(struct super_block *sb)
 	/* Initialize f2fs-specific inode info */
 	fi->vfs_inode.i_version = 1;
 	atomic_set(&fi->dirty_pages, 0);
+	atomic_set(&fi->i_remap_pending, 0);
 	fi->i_current_depth = 1;
 	fi->i_advise = 0;
+	fi->i_update_time = 0;
+	fi->i_update_gap = 0;
 	init_rwsem(&fi->i_sem);
 	INIT_LIST_HEAD(&fi->inmem_pages);
 	mutex_init(&fi->inmem_lock);
@@ -541,6 +565,9 @@ static void f2fs_put_super(struct super_block *sb)
 		write_checkpoint(sbi, &cpc);
 	}
 
+	/* the last checkpoint may have queued discards */
+	f2fs_wait_discard_bios(sbi);
+
 	/* write_checkpoint can update stat informaion */
 	f2fs_destroy_stats(sbi);
 
@@ -558,6 +585,8 @@ static void f2fs_put_super(struct super_block *sb)
 	iput(sbi->meta_inode);
 
 	/* destroy f2fs internal modules */
+	f2fs_remap_destroy_dev(sbi);
+	destroy_gc_manager(sbi);
 	destroy_node_manager(sbi);
 	destroy_segment_manager(sbi);
 
@@ -583,7 +612,7 @@ int f2fs_sync_fs(struct super_block *sb, int sync)
 
 		mutex_lock(&sbi->gc_mutex);
 		write_checkpoint(sbi, &cpc);
-		mutex_unlock(&sbi->gc_mutex);
+		f2fs_unlock_gc(sbi);
 	} else {
 		f2fs_balance_fs(sbi);
 	}
@@ -686,7 +715,11 @@ static int f2fs_show_options(struct seq_file *seq, struct dentry *root)
 		seq_puts(seq, ",extent_cache");
 	else
 		seq_puts(seq, ",noextent_cache");
+	if (test_opt(sbi, GC_HINT))
+		seq_puts(seq, ",gc_hint");
 	seq_printf(seq, ",active_logs=%u", sbi->active_logs);
+	if (sbi->gc_threads > 1)
+		seq_printf(seq, ",gc_threads=%u", sbi->gc_threads);
 
 	return 0;
 }
@@ -735,6 +768,7 @@ static void default_options(struct f2fs_sb_info *sbi)
 {
 	/* init some FS parameters */
 	sbi->active_logs = NR_CURSEG_TYPE;
+	sbi->gc_threads = 1;
 
 	set_opt(sbi, BG_GC);
 	set_opt(sbi, INLINE_DATA);
@@ -753,6 +787,7 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 	struct f2fs_sb_info *sbi = F2FS_SB(sb);
 	struct f2fs_mount_info org_mount_opt;
 	int err, active_logs;
+	unsigned int gc_threads;
 	bool need_restart_gc = false;
 	bool need_stop_gc = false;
 	bool no_extent_cache = !test_opt(sbi, EXTENT_CACHE);
@@ -765,6 +800,7 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 	 */
 	org_mount_opt = sbi->mount_opt;
 	active_logs = sbi->active_logs;
+	gc_threads = sbi->gc_threads;
 
 	sbi->mount_opt.opt = 0;
 	default_options(sbi);
@@ -774,6 +810,15 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 	if (err)
 		goto restore_opts;
 
+	/* the GC worker buffers are sized at mount time */
+	if (sbi->gc_threads > sbi->nr_gc_workers) {
+		err = -EINVAL;
+		f2fs_msg(sbi->sb, KERN_WARNING,
+			"gc_threads can't be raised above %u by remount",
+			sbi->nr_gc_workers);
+		goto restore_opts;
+	}
+
 	/*
 	 * Previous and new state of filesystem is RO,
 	 * so skip checking GC and FLUSH_MERGE conditions.
@@ -834,6 +879,7 @@ restore_gc:
 restore_opts:
 	sbi->mount_opt = org_mount_opt;
 	sbi->active_logs = active_logs;
+	sbi->gc_threads = gc_threads;
 	return err;
 }
 
@@ -1011,7 +1057,6 @@ static void init_sb_info(struct f2fs_sb_info *sbi)
 	sbi->root_ino_num = le32_to_cpu(raw_super->root_ino);
 	sbi->node_ino_num = le32_to_cpu(raw_super->node_ino);
 	sbi->meta_ino_num = le32_to_cpu(raw_super->meta_ino);
-	sbi->cur_victim_sec = NULL_SECNO;
 	sbi->max_victim_search = DEF_MAX_VICTIM_SEARCH;
 
 	for (i = 0; i < NR_COUNT_TYPE; i++)
@@ -1019,6 +1064,8 @@ static void init_sb_info(struct f2fs_sb_info *sbi)
 
 	sbi->dir_level = DEF_DIR_LEVEL;
 	sbi->cp_interval = DEF_CP_INTERVAL;
+	sbi->hot_data_lifetime = DEF_HOT_DATA_LIFETIME;
+	sbi->cold_data_lifetime = DEF_COLD_DATA_LIFETIME;
 	clear_sbi_flag(sbi, SBI_NEED_FSCK);
 
 	INIT_LIST_HEAD(&sbi->s_list);
@@ -1185,6 +1232,7 @@ try_onemore:
 	sbi->raw_super = raw_super;
 	sbi->raw_super_buf = raw_super_buf;
 	mutex_init(&sbi->gc_mutex);
+	init_waitqueue_head(&sbi->gc_free_wait);
 	mutex_init(&sbi->writepages);
 	mutex_init(&sbi->cp_mutex);
 	init_rwsem(&sbi->node_write);
@@ -1203,6 +1251,7 @@ try_onemore:
 	}
 
 	init_rwsem(&sbi->cp_rwsem);
+	init_rwsem(&sbi->remap_rwsem);
 	init_waitqueue_head(&sbi->cp_wait);
 	init_sb_info(sbi);
 
@@ -1257,7 +1306,14 @@ try_onemore:
 		goto free_nm;
 	}
 
-	build_gc_manager(sbi);
+	err = build_gc_manager(sbi);
+	if (err)
+		goto free_nm;
+
+	f2fs_remap_init_dev(sbi);
+	if (test_opt(sbi, GC_HINT) && !sbi->remap_bdev)
+		f2fs_msg(sb, KERN_WARNING,
+			"gc_hint needs a NVMe device, no hints are sent");
 
 	/* get an inode for node space */
 	sbi->node_inode = f2fs_iget(sb, F2FS_NODE_INO(sbi));
@@ -1337,6 +1393,10 @@ try_onemore:
 	/* recover_fsync_data() cleared this already */
 	clear_sbi_flag(sbi, SBI_POR_DOING);
 
+	/* remaps the device made after the last checkpoint */
+	if (!bdev_read_only(sb->s_bdev))
+		f2fs_remap_recover(sbi);
+
 	/*
 	 * If filesystem is not mounted as read-only then
 	 * do start the gc_thread.
@@ -1376,6 +1436,8 @@ free_node_inode:
 	iput(sbi->node_inode);
 	mutex_unlock(&sbi->umount_mutex);
 free_nm:
+	f2fs_remap_destroy_dev(sbi);
+	destroy_gc_manager(sbi);
 	destroy_node_manager(sbi);
 free_sm:
 	destroy_segment_manager(sbi);
@@ -1446,6 +1508,7 @@ static int __init init_f2fs_fs(void)
 	int err;
 
 	f2fs_build_trace_ios();
+	f2fs_build_gc_trace();
 
 	err = init_inodecache();
 	if (err)
@@ -1499,6 +1562,7 @@ free_node_manager_caches:
 free_inodecache:
 	destroy_inodecache();
 fail:
+	f2fs_destroy_gc_trace();
 	return err;
 }
 
@@ -1515,6 +1579,7 @@ static void __exit exit_f2fs_fs(void)
 	destroy_node_manager_caches();
 	destroy_inodecache();
 	kset_unregister(f2fs_kset);
+	f2fs_destroy_gc_trace();
 	f2fs_destroy_trace_ios();
 }
 
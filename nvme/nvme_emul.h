@@ -0,0 +1,41 @@
+/*
+ * NVM Express device driver
+ * In-kernel passthrough for disks which emulate a NVMe namespace
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#ifndef _NVME_EMUL_H
+#define _NVME_EMUL_H
+
+#include <linux/blkdev.h>
+#include <linux/nvme_ioctl.h>
+
+/*
+ * Served instead of the nvme_kernel_*() passthrough for disks with @fops.
+ * All return 0, a negative errno or a positive NVMe status code, and may
+ * sleep.  Without @copy_limits the disk is reported not to support Copy.
+ */
+struct nvme_kernel_emul_ops {
+	const struct block_device_operations *fops;
+	int (*iocmd)(struct block_device *bdev, struct nvme_passthru_cmd *cmd,
+				void *buffer, unsigned bufflen);
+	int (*set_features)(struct block_device *bdev, unsigned fid,
+				unsigned dword11, unsigned dword12,
+				unsigned dword13, unsigned dword14,
+				u32 *result);
+	int (*copy_limits)(struct block_device *bdev, u32 *max_ranges,
+				u32 *max_range_lbas, u32 *max_lbas);
+};
+
+int nvme_kernel_register_emul(const struct nvme_kernel_emul_ops *ops);
+void nvme_kernel_unregister_emul(const struct nvme_kernel_emul_ops *ops);
+
+#endif /* _NVME_EMUL_H */
@@ -21,6 +21,7 @@
 #include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/hdreg.h>
+#include <linux/hrtimer.h>
 #include <linux/idr.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
@@ -46,6 +47,7 @@
 
 #include <uapi/linux/nvme_ioctl.h>
 #include "nvme.h"
+#include "nvme_emul.h"
 
 #define NVME_MINORS		(1U << MINORBITS)
 #define NVME_Q_DEPTH		1024
@@ -80,6 +82,32 @@ static bool use_cmb_sqes = true;
 module_param(use_cmb_sqes, bool, 0644);
 MODULE_PARM_DESC(use_cmb_sqes, "use controller's memory buffer for I/O SQes");
 
+static bool use_maint_queue = true;
+module_param(use_maint_queue, bool, 0444);
+MODULE_PARM_DESC(use_maint_queue,
+	"reserve a low priority I/O queue for filesystem maintenance commands");
+
+static unsigned int maint_coalesce_us = 100;
+module_param(maint_coalesce_us, uint, 0644);
+MODULE_PARM_DESC(maint_coalesce_us,
+	"time completions of the maintenance queue are gathered, in usecs");
+
+static unsigned int maint_poll_us = 20;
+module_param(maint_poll_us, uint, 0644);
+MODULE_PARM_DESC(maint_poll_us,
+	"time synchronous kernel commands spin for completion, in usecs");
+
+/* WRR: Arbitration Mechanism Supported bit in CAP */
+#define NVME_CAP_AMS_WRRU(cap)	(((cap) >> 17) & 0x1)
+/* arbitration burst 8, low priority weight 1, medium and high weight 16 */
+#define NVME_MAINT_ARBITRATION	(3 | (0 << 8) | (15 << 16) | (15 << 24))
+
+/* Copy command support in ONCS, and its limits in struct nvme_id_ns */
+#define NVME_CTRL_ONCS_COPY	(1 << 8)
+#define NVME_ID_NS_MSSRL	74	/* le16: LBAs per source range */
+#define NVME_ID_NS_MCL		76	/* le32: LBAs per command */
+#define NVME_ID_NS_MSRC		80	/* u8: source ranges per command - 1 */
+
 static DEFINE_SPINLOCK(dev_list_lock);
 static LIST_HEAD(dev_list);
 static struct task_struct *nvme_thread;
@@ -92,6 +120,10 @@ static int __nvme_reset(struct nvme_dev *dev);
 static int nvme_reset(struct nvme_dev *dev);
 static void nvme_process_cq(struct nvme_queue *nvmeq);
 static void nvme_dead_ctrl(struct nvme_dev *dev);
+static void nvme_maint_complete(struct nvme_queue *nvmeq,
+					struct nvme_completion *cqe);
+
+typedef void (nvme_kernel_end_io_t)(void *private, int status, u32 result);
 
 struct async_cmd_info {
 	struct kthread_work work;
@@ -127,6 +159,24 @@ struct nvme_queue {
 	u8 cq_phase;
 	u8 cqe_seen;
 	struct async_cmd_info cmdinfo;
+	struct nvme_maint *maint;	/* only for the maintenance queue */
+};
+
+/* a command on the maintenance queue, indexed by command id */
+struct nvme_maint_cmd {
+	nvme_kernel_end_io_t *end_io;
+	void *private;
+	dma_addr_t dma_addr;
+	unsigned len;
+	enum dma_data_direction dir;
+};
+
+struct nvme_maint {
+	struct nvme_queue *nvmeq;
+	struct hrtimer timer;		/* reaps coalesced completions */
+	unsigned nr_inflight;
+	unsigned long *cmdids;		/* command ids in use */
+	struct nvme_maint_cmd cmds[];	/* q_depth entries */
 };
 
 /*
@@ -962,6 +1012,10 @@ static void __nvme_process_cq(struct nvme_queue *nvmeq, unsigned int *tag)
 			head = 0;
 			phase = !phase;
 		}
+		if (nvmeq->maint) {
+			nvme_maint_complete(nvmeq, &cqe);
+			continue;
+		}
 		if (tag && *tag == cqe.command_id)
 			*tag = -1;
 		ctx = nvme_finish_cmd(nvmeq, cqe.command_id, &fn);
@@ -1028,6 +1082,123 @@ static int nvme_poll(struct blk_mq_hw_ctx *hctx, unsigned int tag)
 	return 0;
 }
 
+/*
+ * The maintenance queue is an I/O queue pair outside of blk-mq for commands
+ * a filesystem issues on its own behalf, such as f2fs GC remaps, so that
+ * they neither take tags from nor complete on the queues of foreground I/O.
+ * Its SQ has the lowest priority if the controller arbitrates by WRR, and
+ * its CQ raises no interrupt: completions are reaped all together by a
+ * timer, maint_coalesce_us after the first command went out.
+ */
+static struct nvme_queue *nvme_maint_queue(struct nvme_dev *dev)
+{
+	struct nvme_queue *nvmeq;
+
+	if (dev->queue_count < 3)
+		return NULL;
+	nvmeq = dev->queues[dev->queue_count - 1];
+	return nvmeq && nvmeq->maint ? nvmeq : NULL;
+}
+
+static ktime_t nvme_maint_delay(void)
+{
+	return ns_to_ktime((u64)max(maint_coalesce_us, 1U) * NSEC_PER_USEC);
+}
+
+static enum hrtimer_restart nvme_maint_timer(struct hrtimer *timer)
+{
+	struct nvme_maint *maint = container_of(timer, struct nvme_maint,
+									timer);
+	struct nvme_queue *nvmeq = maint->nvmeq;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	spin_lock_irqsave(&nvmeq->q_lock, flags);
+	nvme_process_cq(nvmeq);
+	if (maint->nr_inflight) {
+		hrtimer_forward_now(timer, nvme_maint_delay());
+		ret = HRTIMER_RESTART;
+	}
+	spin_unlock_irqrestore(&nvmeq->q_lock, flags);
+	return ret;
+}
+
+/* called with q_lock held, so @end_io must not submit to this queue */
+static void nvme_maint_complete(struct nvme_queue *nvmeq,
+					struct nvme_completion *cqe)
+{
+	struct nvme_maint *maint = nvmeq->maint;
+	u16 cmdid = cqe->command_id;
+	struct nvme_maint_cmd *mc;
+	nvme_kernel_end_io_t *end_io;
+	void *private;
+
+	if (cmdid >= nvmeq->q_depth || !test_bit(cmdid, maint->cmdids)) {
+		dev_warn(nvmeq->q_dmadev,
+			"invalid id %d completed on maintenance queue %d\n",
+			cmdid, nvmeq->qid);
+		return;
+	}
+
+	mc = &maint->cmds[cmdid];
+	if (mc->len)
+		dma_unmap_single(nvmeq->q_dmadev, mc->dma_addr, mc->len,
+								mc->dir);
+	end_io = mc->end_io;
+	private = mc->private;
+	clear_bit(cmdid, maint->cmdids);
+	maint->nr_inflight--;
+
+	end_io(private, le16_to_cpu(cqe->status) >> 1,
+					le32_to_cpu(cqe->result));
+}
+
+/* fail what the controller will not complete any more, under q_lock */
+static void nvme_maint_cancel(struct nvme_queue *nvmeq)
+{
+	struct nvme_completion cqe;
+	int cmdid;
+
+	memset(&cqe, 0, sizeof(cqe));
+	cqe.status = cpu_to_le16(NVME_SC_ABORT_REQ << 1);
+	for_each_set_bit(cmdid, nvmeq->maint->cmdids, nvmeq->q_depth) {
+		cqe.command_id = cmdid;
+		nvme_maint_complete(nvmeq, &cqe);
+	}
+}
+
+static int nvme_alloc_maint(struct nvme_queue *nvmeq)
+{
+	struct nvme_maint *maint;
+
+	maint = kzalloc(sizeof(*maint) + nvmeq->q_depth *
+				sizeof(struct nvme_maint_cmd), GFP_KERNEL);
+	if (!maint)
+		return -ENOMEM;
+	maint->cmdids = kcalloc(BITS_TO_LONGS(nvmeq->q_depth),
+					sizeof(unsigned long), GFP_KERNEL);
+	if (!maint->cmdids) {
+		kfree(maint);
+		return -ENOMEM;
+	}
+
+	maint->nvmeq = nvmeq;
+	hrtimer_init(&maint->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	maint->timer.function = nvme_maint_timer;
+	nvmeq->maint = maint;
+	return 0;
+}
+
+static void nvme_free_maint(struct nvme_queue *nvmeq)
+{
+	struct nvme_maint *maint = nvmeq->maint;
+
+	hrtimer_cancel(&maint->timer);
+	kfree(maint->cmdids);
+	kfree(maint);
+	nvmeq->maint = NULL;
+}
+
 /*
  * Returns 0 on success.  If the result is negative, it's a Linux error code;
  * if the result is positive, it's an NVM Express status code
@@ -1152,6 +1323,10 @@ static int adapter_alloc_cq(struct nvme_dev *dev, u16 qid,
 	struct nvme_command c;
 	int flags = NVME_QUEUE_PHYS_CONTIG | NVME_CQ_IRQ_ENABLED;
 
+	/* the maintenance queue is reaped by its timer */
+	if (nvmeq->maint)
+		flags &= ~NVME_CQ_IRQ_ENABLED;
+
 	/*
 	 * Note: we (ab)use the fact the the prp fields survive if no data
 	 * is attached to the request.
@@ -1171,7 +1346,9 @@ static int adapter_alloc_sq(struct nvme_dev *dev, u16 qid,
 						struct nvme_queue *nvmeq)
 {
 	struct nvme_command c;
-	int flags = NVME_QUEUE_PHYS_CONTIG | NVME_SQ_PRIO_MEDIUM;
+	int flags = NVME_QUEUE_PHYS_CONTIG;
+
+	flags |= nvmeq->maint ? NVME_SQ_PRIO_LOW : NVME_SQ_PRIO_MEDIUM;
 
 	/*
 	 * Note: we (ab)use the fact the the prp fields survive if no data
@@ -1391,6 +1568,8 @@ static enum blk_eh_timer_return nvme_timeout(struct request *req, bool reserved)
 
 static void nvme_free_queue(struct nvme_queue *nvmeq)
 {
+	if (nvmeq->maint)
+		nvme_free_maint(nvmeq);
 	dma_free_coherent(nvmeq->q_dmadev, CQ_SIZE(nvmeq->q_depth),
 				(void *)nvmeq->cqes, nvmeq->cq_dma_addr);
 	if (nvmeq->sq_cmds)
@@ -1432,6 +1611,9 @@ static int nvme_suspend_queue(struct nvme_queue *nvmeq)
 	if (!nvmeq->qid && nvmeq->dev->admin_q)
 		blk_mq_freeze_queue_start(nvmeq->dev->admin_q);
 
+	if (nvmeq->maint)
+		return 0;
+
 	irq_set_affinity_hint(vector, NULL);
 	free_irq(vector, nvmeq);
 
@@ -1443,6 +1625,8 @@ static void nvme_clear_queue(struct nvme_queue *nvmeq)
 	spin_lock_irq(&nvmeq->q_lock);
 	if (nvmeq->tags && *nvmeq->tags)
 		blk_mq_all_tag_busy_iter(*nvmeq->tags, nvme_cancel_queue_ios, nvmeq);
+	if (nvmeq->maint)
+		nvme_maint_cancel(nvmeq);
 	spin_unlock_irq(&nvmeq->q_lock);
 }
 
@@ -1580,7 +1764,8 @@ static int nvme_create_queue(struct nvme_queue *nvmeq, int qid)
 	struct nvme_dev *dev = nvmeq->dev;
 	int result;
 
-	nvmeq->cq_vector = qid - 1;
+	/* no interrupt for the maintenance queue, only a valid vector */
+	nvmeq->cq_vector = nvmeq->maint ? 0 : qid - 1;
 	result = adapter_alloc_cq(dev, qid, nvmeq);
 	if (result < 0)
 		return result;
@@ -1589,9 +1774,11 @@ static int nvme_create_queue(struct nvme_queue *nvmeq, int qid)
 	if (result < 0)
 		goto release_cq;
 
-	result = queue_request_irq(dev, nvmeq, nvmeq->irqname);
-	if (result < 0)
-		goto release_sq;
+	if (!nvmeq->maint) {
+		result = queue_request_irq(dev, nvmeq, nvmeq->irqname);
+		if (result < 0)
+			goto release_sq;
+	}
 
 	nvme_init_queue(nvmeq, qid);
 	return result;
@@ -1777,7 +1964,12 @@ static int nvme_configure_admin_queue(struct nvme_dev *dev)
 
 	dev->ctrl_config = NVME_CC_CSS_NVM;
 	dev->ctrl_config |= (page_shift - 12) << NVME_CC_MPS_SHIFT;
-	dev->ctrl_config |= NVME_CC_ARB_RR | NVME_CC_SHN_NONE;
+	/* WRR lets the maintenance queue yield to all other I/O */
+	if (use_maint_queue && NVME_CAP_AMS_WRRU(cap))
+		dev->ctrl_config |= NVME_CC_ARB_WRRU;
+	else
+		dev->ctrl_config |= NVME_CC_ARB_RR;
+	dev->ctrl_config |= NVME_CC_SHN_NONE;
 	dev->ctrl_config |= NVME_CC_IOSQES | NVME_CC_IOCQES;
 
 	writel(aqa, &dev->bar->aqa);
@@ -1918,100 +2110,466 @@ static int nvme_user_cmd(struct nvme_dev *dev, struct nvme_ns *ns,
 
 	return status;
 }
-static int nvme_kernel_iocmd(struct nvme_ns *ns, struct nvme_passthru_cmd  *ucmd) {
 
-	struct nvme_passthru_cmd cmd;
+static const struct block_device_operations nvme_fops;
+static const struct nvme_kernel_emul_ops *nvme_kernel_emul;
+
+/*
+ * Let a block driver which emulates a NVMe namespace, e.g. remap_emu, serve
+ * the in-kernel passthrough below for its disks.  Only one may register.
+ */
+int nvme_kernel_register_emul(const struct nvme_kernel_emul_ops *ops)
+{
+	if (cmpxchg(&nvme_kernel_emul, NULL, ops))
+		return -EBUSY;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(nvme_kernel_register_emul);
+
+void nvme_kernel_unregister_emul(const struct nvme_kernel_emul_ops *ops)
+{
+	cmpxchg(&nvme_kernel_emul, ops, NULL);
+}
+EXPORT_SYMBOL_GPL(nvme_kernel_unregister_emul);
+
+/*
+ * The emulator can not go away under a caller: its disk is held open, which
+ * pins the module.  Returns NULL for disks it does not drive.
+ */
+static const struct nvme_kernel_emul_ops *nvme_kernel_emul_of(
+					struct block_device *bdev)
+{
+	const struct nvme_kernel_emul_ops *emul = READ_ONCE(nvme_kernel_emul);
+
+	if (emul && bdev->bd_disk->fops == emul->fops)
+		return emul;
+	return NULL;
+}
+
+static void nvme_kernel_setup_cmd(struct nvme_command *c,
+					struct nvme_passthru_cmd *cmd)
+{
+	memset(c, 0, sizeof(*c));
+	c->common.opcode = cmd->opcode;
+	c->common.flags = cmd->flags;
+	c->common.nsid = cpu_to_le32(cmd->nsid);
+	c->common.cdw2[0] = cpu_to_le32(cmd->cdw2);
+	c->common.cdw2[1] = cpu_to_le32(cmd->cdw3);
+	c->common.cdw10[0] = cpu_to_le32(cmd->cdw10);
+	c->common.cdw10[1] = cpu_to_le32(cmd->cdw11);
+	c->common.cdw10[2] = cpu_to_le32(cmd->cdw12);
+	c->common.cdw10[3] = cpu_to_le32(cmd->cdw13);
+	c->common.cdw10[4] = cpu_to_le32(cmd->cdw14);
+	c->common.cdw10[5] = cpu_to_le32(cmd->cdw15);
+}
+
+static int __nvme_kernel_maint_cmd(struct block_device *bdev,
+			struct nvme_passthru_cmd *cmd,
+			void *buffer, unsigned bufflen,
+			nvme_kernel_end_io_t *end_io, void *private,
+			u16 *command_id)
+{
+	struct nvme_ns *ns = bdev->bd_disk->private_data;
+	enum dma_data_direction dir = cmd->opcode & 1 ? DMA_TO_DEVICE :
+							DMA_FROM_DEVICE;
+	struct nvme_queue *nvmeq;
+	struct nvme_dev *dev;
+	struct nvme_maint *maint;
+	struct nvme_maint_cmd *mc;
 	struct nvme_command c;
-	unsigned timeout = 0;
+	dma_addr_t dma_addr = 0;
+	unsigned long flags;
+	unsigned offset;
+	int cmdid, ret = 0;
+
+	if (bdev->bd_disk->fops != &nvme_fops)
+		return -ENOTTY;
+	dev = ns->dev;
+	nvmeq = nvme_maint_queue(dev);
+	if (!nvmeq)
+		return -ENODEV;
+
+	offset = (unsigned long)buffer & (dev->page_size - 1);
+	if (bufflen) {
+		if (!virt_addr_valid(buffer) ||
+				offset + bufflen > 2 * dev->page_size)
+			return -EINVAL;
+		dma_addr = dma_map_single(dev->dev, buffer, bufflen, dir);
+		if (dma_mapping_error(dev->dev, dma_addr))
+			return -ENOMEM;
+	}
+
+	nvme_kernel_setup_cmd(&c, cmd);
+	c.common.prp1 = cpu_to_le64(dma_addr);
+	if (bufflen && offset + bufflen > dev->page_size)
+		c.common.prp2 = cpu_to_le64((dma_addr + dev->page_size) &
+						~(u64)(dev->page_size - 1));
+
+	spin_lock_irqsave(&nvmeq->q_lock, flags);
+	maint = nvmeq->maint;
+
+	/* the SQ holds one command less than its depth */
+	cmdid = find_first_zero_bit(maint->cmdids, nvmeq->q_depth - 1);
+	if (nvmeq->cq_vector < 0 || cmdid >= nvmeq->q_depth - 1) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	set_bit(cmdid, maint->cmdids);
+	mc = &maint->cmds[cmdid];
+	mc->end_io = end_io;
+	mc->private = private;
+	mc->dma_addr = dma_addr;
+	mc->len = bufflen;
+	mc->dir = dir;
+
+	c.common.command_id = cmdid;
+	if (command_id)
+		*command_id = cmdid;
+	__nvme_submit_cmd(nvmeq, &c);
+
+	if (!maint->nr_inflight++)
+		hrtimer_start(&maint->timer, nvme_maint_delay(),
+						HRTIMER_MODE_REL);
+ unlock:
+	spin_unlock_irqrestore(&nvmeq->q_lock, flags);
+	if (ret && bufflen)
+		dma_unmap_single(dev->dev, dma_addr, bufflen, dir);
+	return ret;
+}
+
+/*
+ * Queue @cmd on the maintenance queue of the controller behind @bdev.  The
+ * command gets no timeout and is only aborted by a controller reset.
+ * @buffer must be physically contiguous and span at most two controller
+ * pages, which is what PRP1 and PRP2 address without a list.
+ *
+ * Returns 0 if the command was queued, in which case @end_io is always
+ * called, possibly from interrupt context, or a negative errno if the
+ * caller has to take another path.
+ */
+int nvme_kernel_maint_cmd(struct block_device *bdev,
+			struct nvme_passthru_cmd *cmd,
+			void *buffer, unsigned bufflen,
+			nvme_kernel_end_io_t *end_io, void *private)
+{
+	return __nvme_kernel_maint_cmd(bdev, cmd, buffer, bufflen,
+						end_io, private, NULL);
+}
+EXPORT_SYMBOL_GPL(nvme_kernel_maint_cmd);
+
+struct nvme_kernel_sync_cmd {
+	struct completion done;
+	u16 command_id;		/* on the maintenance queue */
 	int status;
+	u32 result;
+};
 
-	if (!capable(CAP_SYS_ADMIN))
-		return -EACCES;
-	memcpy(&cmd,ucmd,sizeof(cmd));
-	memset(&c, 0, sizeof(c));
-	c.common.opcode = cmd.opcode;
-	c.common.flags = cmd.flags;
-	c.common.nsid = cpu_to_le32(cmd.nsid); // this com
-	c.common.cdw2[0] = cpu_to_le32(cmd.cdw2);
-	c.common.cdw2[1] = cpu_to_le32(cmd.cdw3);
-	c.common.cdw10[0] = cpu_to_le32(cmd.cdw10);
-	c.common.cdw10[1] = cpu_to_le32(cmd.cdw11);
-	c.common.cdw10[2] = cpu_to_le32(cmd.cdw12);
-	c.common.cdw10[3] = cpu_to_le32(cmd.cdw13);
-	c.common.cdw10[4] = cpu_to_le32(cmd.cdw14);
-	c.common.cdw10[5] = cpu_to_le32(cmd.cdw15);
+static void nvme_kernel_sync_endio(void *private, int status, u32 result)
+{
+	struct nvme_kernel_sync_cmd *sc = private;
 
-	if (cmd.timeout_ms)
-		timeout = msecs_to_jiffies(cmd.timeout_ms);
+	sc->status = status;
+	sc->result = result;
+	complete(&sc->done);
+}
 
-	status = __nvme_submit_sync_cmd(ns->queue, &c,NULL, (void __user *)(uintptr_t)cmd.addr, cmd.data_len,&cmd.result, timeout);
-	if (status >= 0) {
-		if (put_user(cmd.result, &ucmd->result))
-			return -EFAULT;
+/*
+ * Send an Abort for the maintenance command of @sc, as nvme_abort_req()
+ * does for timed out requests.  Returns false if none could be sent.
+ */
+static bool nvme_kernel_maint_abort(struct nvme_dev *dev,
+			struct nvme_queue *nvmeq, struct nvme_kernel_sync_cmd *sc)
+{
+	struct request *abort_req;
+	struct nvme_cmd_info *abort_cmd;
+	struct nvme_command cmd;
+
+	abort_req = blk_mq_alloc_request(dev->admin_q, WRITE, GFP_KERNEL,
+									false);
+	if (IS_ERR(abort_req))
+		return false;
+
+	/* don't abort whatever took over the command id meanwhile */
+	spin_lock_irq(&nvmeq->q_lock);
+	if (completion_done(&sc->done) || !dev->abort_limit) {
+		spin_unlock_irq(&nvmeq->q_lock);
+		blk_mq_free_request(abort_req);
+		return completion_done(&sc->done);
 	}
+	--dev->abort_limit;
+	spin_unlock_irq(&nvmeq->q_lock);
 
-	return status;
+	abort_cmd = blk_mq_rq_to_pdu(abort_req);
+	nvme_set_info(abort_cmd, abort_req, abort_completion);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.abort.opcode = nvme_admin_abort_cmd;
+	cmd.abort.cid = sc->command_id;
+	cmd.abort.sqid = cpu_to_le16(nvmeq->qid);
+	cmd.abort.command_id = abort_req->tag;
+
+	dev_warn(nvmeq->q_dmadev, "Aborting maintenance command %d QID %d\n",
+						sc->command_id, nvmeq->qid);
+	nvme_submit_cmd(dev->queues[0], &cmd);
+	return true;
 }
+
 /*
- kernel: 4.17.129
-*/
-static int nvme_kernel_iocmd(struct block_device *bdev,struct nvme_passthru_cmd *cmd) {
-
-		struct nvme_ctrl *ctrl;
-		struct nvme_ns *ns;
-		int srcu_idx, ret;
-		struct nvme_ns_head *head = NULL;
-
-		struct nvme_command c;
-        unsigned timeout = 0;
-        u32 effects;
-        int status;
-
-		ns = nvme_get_ns_from_disk(bdev->bd_disk, &head, &srcu_idx);
-		if (unlikely(!ns)) {
-			printk("erro: no ns.\n");
-			return -EWOULDBLOCK;
+ * Remaps and copies complete within a few usecs, much less than the
+ * coalescing timer and a wakeup would add, so spin on the CQ of the
+ * maintenance queue for up to maint_poll_us before going to sleep.
+ *
+ * A command still outstanding after @timeout is aborted, and once more
+ * @timeout later the controller is reset, which fails everything left on
+ * the maintenance queue.  Only then the command is waited for unbounded.
+ */
+static void nvme_kernel_sync_wait(struct nvme_dev *dev,
+			struct nvme_kernel_sync_cmd *sc, unsigned long timeout)
+{
+	struct nvme_queue *nvmeq = nvme_maint_queue(dev);
+	u64 end = local_clock() + (u64)maint_poll_us * NSEC_PER_USEC;
+
+	while (nvmeq && maint_poll_us && !completion_done(&sc->done)) {
+		if ((le16_to_cpu(nvmeq->cqes[nvmeq->cq_head].status) & 1) ==
+							nvmeq->cq_phase) {
+			spin_lock_irq(&nvmeq->q_lock);
+			nvme_process_cq(nvmeq);
+			spin_unlock_irq(&nvmeq->q_lock);
+			continue;
 		}
-		ctrl = ns->ctrl;
-			
-        if (!capable(CAP_SYS_ADMIN))
-                return -EACCES;
-        if (cmd.flags)
-                return -EINVAL;
-
-        memset(&c, 0, sizeof(c));
-        c.common.opcode = cmd.opcode;
-        c.common.flags = cmd.flags;
-        c.common.nsid = cpu_to_le32(cmd.nsid);
-        c.common.cdw2[0] = cpu_to_le32(cmd.cdw2);
-        c.common.cdw2[1] = cpu_to_le32(cmd.cdw3);
-        c.common.cdw10[0] = cpu_to_le32(cmd.cdw10);
-        c.common.cdw10[1] = cpu_to_le32(cmd.cdw11);
-        c.common.cdw10[2] = cpu_to_le32(cmd.cdw12);
-        c.common.cdw10[3] = cpu_to_le32(cmd.cdw13);
-        c.common.cdw10[4] = cpu_to_le32(cmd.cdw14);
-        c.common.cdw10[5] = cpu_to_le32(cmd.cdw15);
-
-		// for safe.
-		cmd.addr = 0;
-		cmd.metadata = 0;
-		cmd.data_len = 0;
-		cmd.metadata_len =0;
-
-        if (cmd.timeout_ms)
-                timeout = msecs_to_jiffies(cmd.timeout_ms);
-
-        effects = nvme_passthru_start(ctrl, ns, cmd.opcode);
-        status = nvme_submit_user_cmd(ns ? ns->queue : ctrl->admin_q, &c,
-                        (void __user *)(uintptr_t)cmd.addr, cmd.data_len,
-                        (void __user *)(uintptr_t)cmd.metadata, cmd.metadata_len,
-                        0, &cmd.result, timeout);
-        nvme_passthru_end(ctrl, effects);
-
-		nvme_put_ns_from_disk(head, srcu_idx);
-		return status;
+		if (need_resched() || local_clock() > end)
+			break;
+		cpu_relax();
+	}
+	if (wait_for_completion_timeout(&sc->done, timeout))
+		return;
+
+	dev_warn(dev->dev, "Timeout maintenance command %d\n",
+							sc->command_id);
+	if (nvmeq && nvme_kernel_maint_abort(dev, nvmeq, sc) &&
+			wait_for_completion_timeout(&sc->done, timeout))
+		return;
+
+	spin_lock(&dev_list_lock);
+	if (!__nvme_reset(dev))
+		dev_warn(dev->dev,
+			"maintenance command %d timeout, reset controller\n",
+			sc->command_id);
+	spin_unlock(&dev_list_lock);
+
+	wait_for_completion(&sc->done);
+}
+
+/*
+ * Passthrough for in-kernel users (f2fs remap) which already hold a reference
+ * to the block device.  Commands go to the maintenance queue if there is
+ * one, where their completion is polled for a while, and to the I/O queue
+ * of the calling cpu otherwise.  @buffer, if any, is a kernel buffer of
+ * @bufflen bytes that is transferred in the direction given by the opcode.
+ * Either way the command is aborted after cmd->timeout_ms, or the default
+ * I/O timeout if that is 0.
+ *
+ * Returns 0 on success, a negative errno, or a positive NVMe status code.
+ */
+int nvme_kernel_iocmd(struct block_device *bdev,
+			struct nvme_passthru_cmd *cmd,
+			void *buffer, unsigned bufflen)
+{
+	const struct nvme_kernel_emul_ops *emul = nvme_kernel_emul_of(bdev);
+	struct nvme_ns *ns = bdev->bd_disk->private_data;
+	struct nvme_kernel_sync_cmd sc;
+	struct nvme_command c;
+	unsigned long timeout = NVME_IO_TIMEOUT;
+
+	if (emul)
+		return emul->iocmd(bdev, cmd, buffer, bufflen);
+	if (bdev->bd_disk->fops != &nvme_fops)
+		return -ENOTTY;
+
+	if (cmd->timeout_ms)
+		timeout = msecs_to_jiffies(cmd->timeout_ms);
+
+	init_completion(&sc.done);
+	if (!__nvme_kernel_maint_cmd(bdev, cmd, buffer, bufflen,
+			nvme_kernel_sync_endio, &sc, &sc.command_id)) {
+		nvme_kernel_sync_wait(ns->dev, &sc, timeout);
+		cmd->result = sc.result;
+		return sc.status;
+	}
+
+	nvme_kernel_setup_cmd(&c, cmd);
+
+	return __nvme_submit_sync_cmd(ns->queue, &c, buffer, NULL, bufflen,
+					&cmd->result, timeout);
+}
+EXPORT_SYMBOL_GPL(nvme_kernel_iocmd);
+
+struct nvme_kernel_async_cmd {
+	struct nvme_command c;		/* must live until the request is issued */
+	nvme_kernel_end_io_t *end_io;
+	void *private;
+};
+
+static void nvme_kernel_async_endio(struct request *req, int error)
+{
+	struct nvme_kernel_async_cmd *kc = req->end_io_data;
+	u32 result = (u32)(uintptr_t)req->special;
+	int status = req->errors;
+
+	blk_mq_free_request(req);
+	kc->end_io(kc->private, status, result);
+	kfree(kc);
+}
+
+/*
+ * Same as nvme_kernel_iocmd(), but don't wait for the command.  @end_io is
+ * called with the status and result of the command once it completes,
+ * possibly from interrupt context.  @buffer must stay valid until then.
+ *
+ * Returns 0 if the command was queued, in which case @end_io is always
+ * called, or a negative errno.
+ */
+int nvme_kernel_iocmd_async(struct block_device *bdev,
+			struct nvme_passthru_cmd *cmd,
+			void *buffer, unsigned bufflen,
+			nvme_kernel_end_io_t *end_io, void *private)
+{
+	const struct nvme_kernel_emul_ops *emul = nvme_kernel_emul_of(bdev);
+	struct nvme_ns *ns = bdev->bd_disk->private_data;
+	struct nvme_kernel_async_cmd *kc;
+	struct request *req;
+	int ret;
+
+	/* emulated commands complete before they return */
+	if (emul) {
+		ret = emul->iocmd(bdev, cmd, buffer, bufflen);
+		end_io(private, ret, cmd->result);
+		return 0;
+	}
+	if (bdev->bd_disk->fops != &nvme_fops)
+		return -ENOTTY;
+
+	if (!nvme_kernel_maint_cmd(bdev, cmd, buffer, bufflen, end_io, private))
+		return 0;
+
+	kc = kmalloc(sizeof(*kc), GFP_NOIO);
+	if (!kc)
+		return -ENOMEM;
+
+	nvme_kernel_setup_cmd(&kc->c, cmd);
+	kc->end_io = end_io;
+	kc->private = private;
+
+	req = blk_mq_alloc_request(ns->queue, cmd->opcode & 1, GFP_NOIO, false);
+	if (IS_ERR(req)) {
+		ret = PTR_ERR(req);
+		goto free_cmd;
+	}
+
+	req->cmd_type = REQ_TYPE_DRV_PRIV;
+	req->cmd_flags |= REQ_FAILFAST_DRIVER;
+	req->__data_len = 0;
+	req->__sector = (sector_t) -1;
+	req->bio = req->biotail = NULL;
+
+	req->timeout = cmd->timeout_ms ? msecs_to_jiffies(cmd->timeout_ms) :
+								ADMIN_TIMEOUT;
+
+	req->cmd = (unsigned char *)&kc->c;
+	req->cmd_len = sizeof(struct nvme_command);
+	req->special = (void *)0;
+	req->end_io_data = kc;
+
+	if (buffer && bufflen) {
+		ret = blk_rq_map_kern(ns->queue, req, buffer, bufflen, GFP_NOIO);
+		if (ret)
+			goto free_req;
+	}
+
+	blk_execute_rq_nowait(req->q, NULL, req, 0, nvme_kernel_async_endio);
+	return 0;
+
+ free_req:
+	blk_mq_free_request(req);
+ free_cmd:
+	kfree(kc);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(nvme_kernel_iocmd_async);
+
+/*
+ * Set a (vendor specific) feature on the controller behind @bdev on behalf
+ * of an in-kernel user, e.g. the f2fs GC start/end hints.  Dwords 12 to 14
+ * are passed through for features which need more than dword 11.
+ *
+ * Returns 0 on success, a negative errno, or a positive NVMe status code.
+ */
+int nvme_kernel_set_features(struct block_device *bdev, unsigned fid,
+			unsigned dword11, unsigned dword12, unsigned dword13,
+			unsigned dword14, u32 *result)
+{
+	const struct nvme_kernel_emul_ops *emul = nvme_kernel_emul_of(bdev);
+	struct nvme_ns *ns = bdev->bd_disk->private_data;
+	struct nvme_command c;
+
+	if (emul)
+		return emul->set_features(bdev, fid, dword11, dword12,
+						dword13, dword14, result);
+	if (bdev->bd_disk->fops != &nvme_fops)
+		return -ENOTTY;
+
+	memset(&c, 0, sizeof(c));
+	c.common.opcode = nvme_admin_set_features;
+	c.common.nsid = cpu_to_le32(ns->ns_id);
+	c.common.cdw10[0] = cpu_to_le32(fid);
+	c.common.cdw10[1] = cpu_to_le32(dword11);
+	c.common.cdw10[2] = cpu_to_le32(dword12);
+	c.common.cdw10[3] = cpu_to_le32(dword13);
+	c.common.cdw10[4] = cpu_to_le32(dword14);
+
+	return __nvme_submit_sync_cmd(ns->dev->admin_q, &c, NULL, NULL, 0,
+			result, 0);
+}
+EXPORT_SYMBOL_GPL(nvme_kernel_set_features);
+
+/*
+ * Tell an in-kernel user whether the namespace behind @bdev takes NVMe Copy
+ * commands, and up to which size: @max_ranges source ranges per command,
+ * @max_range_lbas LBAs per range and @max_lbas LBAs per command.  A limit
+ * the device leaves at 0 is reported as 0.
+ *
+ * Returns 0 if Copy is supported, -EOPNOTSUPP if it isn't, or an error.
+ */
+int nvme_kernel_copy_limits(struct block_device *bdev, u32 *max_ranges,
+				u32 *max_range_lbas, u32 *max_lbas)
+{
+	const struct nvme_kernel_emul_ops *emul = nvme_kernel_emul_of(bdev);
+	struct nvme_ns *ns = bdev->bd_disk->private_data;
+	struct nvme_id_ns *id;
+	u8 *raw;
+	int err;
+
+	if (emul)
+		return emul->copy_limits ? emul->copy_limits(bdev, max_ranges,
+				max_range_lbas, max_lbas) : -EOPNOTSUPP;
+	if (bdev->bd_disk->fops != &nvme_fops)
+		return -ENOTTY;
+	if (!(ns->dev->oncs & NVME_CTRL_ONCS_COPY))
+		return -EOPNOTSUPP;
+
+	err = nvme_identify_ns(ns->dev, ns->ns_id, &id);
+	if (err)
+		return err < 0 ? err : -EIO;
+
+	raw = (u8 *)id;
+	*max_ranges = raw[NVME_ID_NS_MSRC] + 1;
+	*max_range_lbas = le16_to_cpup((__le16 *)(raw + NVME_ID_NS_MSSRL));
+	*max_lbas = le32_to_cpup((__le32 *)(raw + NVME_ID_NS_MCL));
+	kfree(id);
+	return 0;
 }
-EXPORT_SYMBOL(nvme_user_cmd);
+EXPORT_SYMBOL_GPL(nvme_kernel_copy_limits);
 
 
 static int nvme_subsys_reset(struct nvme_dev *dev)
@@ -2429,13 +2987,20 @@ static void nvme_alloc_ns(struct nvme_dev *dev, unsigned nsid)
  * admin commands.  This might be useful to upgrade a buggy firmware
  * for example.
  */
-static void nvme_create_io_queues(struct nvme_dev *dev)
+static void nvme_create_io_queues(struct nvme_dev *dev, unsigned maint_qid)
 {
+	struct nvme_queue *nvmeq;
 	unsigned i;
 
-	for (i = dev->queue_count; i <= dev->max_qid; i++)
-		if (!nvme_alloc_queue(dev, i, dev->q_depth))
+	for (i = dev->queue_count; i <= dev->max_qid; i++) {
+		nvmeq = nvme_alloc_queue(dev, i, dev->q_depth);
+		if (!nvmeq)
 			break;
+		if (i == maint_qid && nvme_alloc_maint(nvmeq)) {
+			nvme_free_queues(dev, i);
+			break;
+		}
+	}
 
 	for (i = dev->online_queues; i <= dev->queue_count - 1; i++)
 		if (nvme_create_queue(dev->queues[i], i)) {
@@ -2523,16 +3088,21 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	struct nvme_queue *adminq = dev->queues[0];
 	struct pci_dev *pdev = to_pci_dev(dev->dev);
 	int result, i, vecs, nr_io_queues, size;
+	unsigned maint_qid = 0;
+	bool maint;
 
 	nr_io_queues = num_possible_cpus();
-	result = set_queue_count(dev, nr_io_queues);
+	result = set_queue_count(dev, nr_io_queues + use_maint_queue);
 	if (result <= 0)
 		return result;
-	if (result < nr_io_queues)
-		nr_io_queues = result;
+
+	/* the maintenance queue goes first if the controller is short */
+	maint = use_maint_queue && result > 1;
+	if (result - maint < nr_io_queues)
+		nr_io_queues = result - maint;
 
 	if (dev->cmb && NVME_CMB_SQS(dev->cmbsz)) {
-		result = nvme_cmb_qdepth(dev, nr_io_queues,
+		result = nvme_cmb_qdepth(dev, nr_io_queues + maint,
 				sizeof(struct nvme_command));
 		if (result > 0)
 			dev->q_depth = result;
@@ -2540,7 +3110,7 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 			nvme_release_cmb(dev);
 	}
 
-	size = db_bar_size(dev, nr_io_queues);
+	size = db_bar_size(dev, nr_io_queues + maint);
 	if (size > 8192) {
 		iounmap(dev->bar);
 		do {
@@ -2549,7 +3119,7 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 				break;
 			if (!--nr_io_queues)
 				return -ENOMEM;
-			size = db_bar_size(dev, nr_io_queues);
+			size = db_bar_size(dev, nr_io_queues + maint);
 		} while (1);
 		dev->dbs = ((void __iomem *)dev->bar) + 4096;
 		adminq->q_db = dev->dbs;
@@ -2585,7 +3155,9 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	 * number of interrupts.
 	 */
 	nr_io_queues = vecs;
-	dev->max_qid = nr_io_queues;
+	if (maint)
+		maint_qid = nr_io_queues + 1;
+	dev->max_qid = nr_io_queues + maint;
 
 	result = queue_request_irq(dev, adminq, adminq->irqname);
 	if (result) {
@@ -2593,9 +3165,19 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 		goto free_queues;
 	}
 
-	/* Free previously allocated queues that are no longer usable */
-	nvme_free_queues(dev, nr_io_queues + 1);
-	nvme_create_io_queues(dev);
+	/*
+	 * Free previously allocated queues that are no longer usable, which
+	 * includes a maintenance queue that is not the last one any more.
+	 */
+	for (i = 1; i < dev->queue_count && i <= dev->max_qid; i++)
+		if (!!dev->queues[i]->maint != (i == maint_qid))
+			break;
+	nvme_free_queues(dev, i);
+	nvme_create_io_queues(dev, maint_qid);
+
+	if (nvme_maint_queue(dev) && (dev->ctrl_config & NVME_CC_ARB_WRRU))
+		nvme_set_features(dev, NVME_FEAT_ARBITRATION,
+					NVME_MAINT_ARBITRATION, 0, NULL);
 
 	return 0;
 
@@ -2751,7 +3333,8 @@ static int nvme_dev_add(struct nvme_dev *dev)
 
 	if (!dev->tagset.tags) {
 		dev->tagset.ops = &nvme_mq_ops;
-		dev->tagset.nr_hw_queues = dev->online_queues - 1;
+		dev->tagset.nr_hw_queues = dev->online_queues - 1 -
+						!!nvme_maint_queue(dev);
 		dev->tagset.timeout = NVME_IO_TIMEOUT;
 		dev->tagset.numa_node = dev_to_node(dev->dev);
 		dev->tagset.queue_depth =
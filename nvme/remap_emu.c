@@ -0,0 +1,599 @@
+/*
+ * RAM backed block device emulating a remap-capable NVMe namespace
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * Every LBA points to a page through an indirection table, so that the
+ * vendor remap commands used by f2fs GC are pointer swaps and Simple Copy is
+ * a memcpy per LBA.  The commands reach the disk through the nvme_kernel_*()
+ * passthrough of the NVMe driver, which forwards them here.  Counters under
+ * /sys/block/remapemu0/remap_emu/ tell what the host wrote and what the
+ * "device" moved by itself, to compare the write amplification of GC modes.
+ */
+
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/genhd.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/nvme.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
+#include "nvme_emul.h"
+
+#define EMU_BLOCK_SHIFT		PAGE_SHIFT	/* one page per LBA */
+#define EMU_BLOCK_SIZE		(1UL << EMU_BLOCK_SHIFT)
+#define EMU_SECT_SHIFT		(EMU_BLOCK_SHIFT - 9)
+#define EMU_NSID		1
+
+/* vendor and NVMe commands as sent by fs/f2fs/remap.c */
+/* EMU_CMD_REMAP, cdw10/11: source, cdw12/13: destination, cdw14: len */
+#define EMU_CMD_REMAP		0x93
+#define EMU_CMD_REMAP_LIST	0x95	/* cdw10: nr_ranges - 1, data: ranges */
+#define EMU_CMD_COPY		0x19	/* NVMe Simple Copy, format 0 */
+#define EMU_FEAT_GC_START	0x12
+#define EMU_FEAT_GC_END		0x13
+#define EMU_SC_CMD_SIZE_LIMIT	0x183	/* copy beyond the limits below */
+
+struct emu_remap_range {
+	__le64 src_lba;
+	__le64 dst_lba;
+	__le32 len;
+	__le32 rsvd;
+} __packed;
+
+struct emu_copy_range {
+	__le64 rsvd0;
+	__le64 slba;
+	__le16 nlb;		/* 0's based */
+	__le16 rsvd18;
+	__le32 rsvd20;
+	__le32 eilbrt;
+	__le16 elbat;
+	__le16 elbatm;
+} __packed;
+
+static unsigned int size_mb = 1024;
+module_param(size_mb, uint, 0444);
+MODULE_PARM_DESC(size_mb, "capacity in MiB, allocated as it is written");
+
+static unsigned int remap_latency_us = 10;
+module_param(remap_latency_us, uint, 0644);
+MODULE_PARM_DESC(remap_latency_us, "latency charged per remap command");
+
+static unsigned int copy_latency_us = 100;
+module_param(copy_latency_us, uint, 0644);
+MODULE_PARM_DESC(copy_latency_us, "latency charged per copy command");
+
+static unsigned int copy_max_ranges = 128;
+module_param(copy_max_ranges, uint, 0444);
+MODULE_PARM_DESC(copy_max_ranges, "source ranges per copy command (MSRC + 1)");
+
+static unsigned int copy_max_range_lbas = 256;
+module_param(copy_max_range_lbas, uint, 0444);
+MODULE_PARM_DESC(copy_max_range_lbas, "LBAs per copy source range (MSSRL)");
+
+static unsigned int copy_max_lbas = 1024;
+module_param(copy_max_lbas, uint, 0444);
+MODULE_PARM_DESC(copy_max_lbas, "LBAs per copy command (MCL)");
+
+static unsigned int hint_latency_us;
+module_param(hint_latency_us, uint, 0644);
+MODULE_PARM_DESC(hint_latency_us, "latency charged per GC hint");
+
+struct remap_emu {
+	struct gendisk *disk;
+	struct request_queue *queue;
+	spinlock_t lock;		/* protects map */
+	struct page **map;		/* LBA -> data, NULL reads as zeroes */
+	sector_t nr_blocks;
+
+	atomic64_t host_read_bytes;
+	atomic64_t host_written_bytes;
+	atomic64_t remap_cmds;
+	atomic64_t remapped_blocks;
+	atomic64_t copy_cmds;
+	atomic64_t copied_blocks;
+	atomic64_t gc_hints;
+};
+
+static int remap_emu_major;
+static struct remap_emu *remap_emu_dev;
+
+static struct page *emu_lookup_page(struct remap_emu *emu, sector_t blk,
+								bool alloc)
+{
+	struct page *page, *new;
+
+	spin_lock(&emu->lock);
+	page = emu->map[blk];
+	spin_unlock(&emu->lock);
+	if (page || !alloc)
+		return page;
+
+	new = alloc_page(GFP_NOIO | __GFP_ZERO | __GFP_HIGHMEM);
+	if (!new)
+		return NULL;
+
+	spin_lock(&emu->lock);
+	page = emu->map[blk];
+	if (!page) {
+		emu->map[blk] = new;
+		page = new;
+		new = NULL;
+	}
+	spin_unlock(&emu->lock);
+
+	if (new)
+		__free_page(new);
+	return page;
+}
+
+/* copy @len bytes of @page at @off from or to the device at @sector */
+static int emu_do_bvec(struct remap_emu *emu, struct page *page,
+		unsigned int len, unsigned int off, int rw, sector_t sector)
+{
+	while (len) {
+		sector_t blk = sector >> EMU_SECT_SHIFT;
+		unsigned int boff = (sector & ((1 << EMU_SECT_SHIFT) - 1)) << 9;
+		unsigned int n = min_t(unsigned int, len, EMU_BLOCK_SIZE - boff);
+		struct page *dpage;
+		void *mem, *dmem;
+
+		/* may allocate, so look up before mapping anything */
+		dpage = emu_lookup_page(emu, blk, rw == WRITE);
+		if (rw == WRITE && !dpage)
+			return -ENOMEM;
+
+		mem = kmap_atomic(page);
+		if (rw == WRITE) {
+			dmem = kmap_atomic(dpage);
+			memcpy(dmem + boff, mem + off, n);
+			kunmap_atomic(dmem);
+		} else if (dpage) {
+			dmem = kmap_atomic(dpage);
+			memcpy(mem + off, dmem + boff, n);
+			kunmap_atomic(dmem);
+		} else {
+			memset(mem + off, 0, n);
+		}
+		kunmap_atomic(mem);
+
+		len -= n;
+		off += n;
+		sector += n >> 9;
+	}
+	return 0;
+}
+
+static blk_qc_t remap_emu_make_request(struct request_queue *q,
+							struct bio *bio)
+{
+	struct block_device *bdev = bio->bi_bdev;
+	struct remap_emu *emu = bdev->bd_disk->private_data;
+	unsigned int size = bio->bi_iter.bi_size;
+	int rw = bio_data_dir(bio);
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	sector_t sector;
+
+	sector = bio->bi_iter.bi_sector;
+	if (bio_end_sector(bio) > get_capacity(bdev->bd_disk))
+		goto io_error;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		if (emu_do_bvec(emu, bvec.bv_page, bvec.bv_len,
+					bvec.bv_offset, rw, sector))
+			goto io_error;
+		sector += bvec.bv_len >> 9;
+	}
+
+	if (rw == WRITE)
+		atomic64_add(size, &emu->host_written_bytes);
+	else
+		atomic64_add(size, &emu->host_read_bytes);
+
+	bio_endio(bio);
+	return BLK_QC_T_NONE;
+io_error:
+	bio_io_error(bio);
+	return BLK_QC_T_NONE;
+}
+
+static bool emu_valid_range(struct remap_emu *emu, u64 lba, u64 len)
+{
+	return lba < emu->nr_blocks && len <= emu->nr_blocks - lba;
+}
+
+/*
+ * The blocks of @dst take over the data of @src by trading pages, so @src
+ * is left with what @dst held before instead of sharing the pages; a later
+ * write to either side can not leak into the other.
+ */
+static int emu_remap(struct remap_emu *emu, u64 src, u64 dst, u32 len)
+{
+	u32 i;
+
+	if (!emu_valid_range(emu, src, len) || !emu_valid_range(emu, dst, len))
+		return NVME_SC_LBA_RANGE;
+
+	spin_lock(&emu->lock);
+	for (i = 0; i < len; i++)
+		swap(emu->map[src + i], emu->map[dst + i]);
+	spin_unlock(&emu->lock);
+
+	atomic64_add(len, &emu->remapped_blocks);
+	return 0;
+}
+
+static int emu_copy_block(struct remap_emu *emu, sector_t src, sector_t dst)
+{
+	struct page *spage = emu_lookup_page(emu, src, false);
+	struct page *dpage = emu_lookup_page(emu, dst, true);
+
+	if (!dpage)
+		return -ENOMEM;
+
+	if (spage)
+		copy_highpage(dpage, spage);
+	else
+		clear_highpage(dpage);
+	return 0;
+}
+
+static int emu_do_remap_list(struct remap_emu *emu,
+		struct nvme_passthru_cmd *cmd, void *buffer, unsigned bufflen)
+{
+	struct emu_remap_range *ranges = buffer;
+	unsigned int nr_ranges = cmd->cdw10 + 1;
+	unsigned int i;
+	int status;
+
+	if (!buffer || bufflen < nr_ranges * sizeof(*ranges))
+		return NVME_SC_INVALID_FIELD;
+
+	/* nothing is remapped unless every range is within the namespace */
+	for (i = 0; i < nr_ranges; i++) {
+		u32 len = le32_to_cpu(ranges[i].len);
+
+		if (!emu_valid_range(emu, le64_to_cpu(ranges[i].src_lba), len) ||
+		    !emu_valid_range(emu, le64_to_cpu(ranges[i].dst_lba), len))
+			return NVME_SC_LBA_RANGE;
+	}
+
+	for (i = 0; i < nr_ranges; i++) {
+		status = emu_remap(emu, le64_to_cpu(ranges[i].src_lba),
+				le64_to_cpu(ranges[i].dst_lba),
+				le32_to_cpu(ranges[i].len));
+		if (status)
+			return status;
+	}
+	return 0;
+}
+
+/* the source ranges are written one after the other from cdw10/11 on */
+static int emu_do_copy(struct remap_emu *emu,
+		struct nvme_passthru_cmd *cmd, void *buffer, unsigned bufflen)
+{
+	struct emu_copy_range *ranges = buffer;
+	unsigned int nr_ranges = (cmd->cdw12 & 0xff) + 1;
+	u64 dst = ((u64)cmd->cdw11 << 32) | cmd->cdw10;
+	unsigned int i;
+	u64 j;
+	int err;
+
+	if ((cmd->cdw12 >> 8) & 0xf)
+		return NVME_SC_INVALID_FIELD;	/* only format 0 */
+	if (!buffer || bufflen < nr_ranges * sizeof(*ranges))
+		return NVME_SC_INVALID_FIELD;
+	if (nr_ranges > copy_max_ranges)
+		return EMU_SC_CMD_SIZE_LIMIT;
+
+	/* nothing is copied unless the whole command is within the limits */
+	for (i = 0, j = 0; i < nr_ranges; i++) {
+		u64 len = le16_to_cpu(ranges[i].nlb) + 1;
+
+		if (len > copy_max_range_lbas)
+			return EMU_SC_CMD_SIZE_LIMIT;
+		j += len;
+	}
+	if (j > copy_max_lbas)
+		return EMU_SC_CMD_SIZE_LIMIT;
+
+	for (i = 0; i < nr_ranges; i++) {
+		u64 src = le64_to_cpu(ranges[i].slba);
+		u64 len = le16_to_cpu(ranges[i].nlb) + 1;
+
+		if (!emu_valid_range(emu, src, len) ||
+				!emu_valid_range(emu, dst, len))
+			return NVME_SC_LBA_RANGE;
+
+		for (j = 0; j < len; j++) {
+			err = emu_copy_block(emu, src + j, dst + j);
+			if (err)
+				return err;
+		}
+		atomic64_add(len, &emu->copied_blocks);
+		dst += len;
+	}
+	return 0;
+}
+
+static void emu_charge(unsigned int us)
+{
+	if (us)
+		usleep_range(us, us + us / 8 + 1);
+}
+
+static int remap_emu_iocmd(struct block_device *bdev,
+		struct nvme_passthru_cmd *cmd, void *buffer, unsigned bufflen)
+{
+	struct remap_emu *emu = bdev->bd_disk->private_data;
+
+	cmd->result = 0;
+
+	switch (cmd->opcode) {
+	case EMU_CMD_REMAP:
+		emu_charge(remap_latency_us);
+		atomic64_inc(&emu->remap_cmds);
+		return emu_remap(emu, ((u64)cmd->cdw11 << 32) | cmd->cdw10,
+				((u64)cmd->cdw13 << 32) | cmd->cdw12,
+				cmd->cdw14);
+	case EMU_CMD_REMAP_LIST:
+		emu_charge(remap_latency_us);
+		atomic64_inc(&emu->remap_cmds);
+		return emu_do_remap_list(emu, cmd, buffer, bufflen);
+	case EMU_CMD_COPY:
+		emu_charge(copy_latency_us);
+		atomic64_inc(&emu->copy_cmds);
+		return emu_do_copy(emu, cmd, buffer, bufflen);
+	default:
+		return NVME_SC_INVALID_OPCODE;
+	}
+}
+
+static int remap_emu_set_features(struct block_device *bdev, unsigned fid,
+			unsigned dword11, unsigned dword12, unsigned dword13,
+			unsigned dword14, u32 *result)
+{
+	struct remap_emu *emu = bdev->bd_disk->private_data;
+
+	if (fid != EMU_FEAT_GC_START && fid != EMU_FEAT_GC_END)
+		return NVME_SC_INVALID_FIELD;
+
+	emu_charge(hint_latency_us);
+	atomic64_inc(&emu->gc_hints);
+	*result = 0;
+	return 0;
+}
+
+static int remap_emu_copy_limits(struct block_device *bdev, u32 *max_ranges,
+				u32 *max_range_lbas, u32 *max_lbas)
+{
+	*max_ranges = copy_max_ranges;
+	*max_range_lbas = copy_max_range_lbas;
+	*max_lbas = copy_max_lbas;
+	return 0;
+}
+
+static int remap_emu_ioctl(struct block_device *bdev, fmode_t mode,
+					unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case NVME_IOCTL_ID:
+		return EMU_NSID;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct block_device_operations remap_emu_fops = {
+	.owner		= THIS_MODULE,
+	.ioctl		= remap_emu_ioctl,
+};
+
+static const struct nvme_kernel_emul_ops remap_emu_ops = {
+	.fops		= &remap_emu_fops,
+	.iocmd		= remap_emu_iocmd,
+	.set_features	= remap_emu_set_features,
+	.copy_limits	= remap_emu_copy_limits,
+};
+
+#define EMU_STAT_ATTR(name)						\
+static ssize_t name##_show(struct device *dev,				\
+			struct device_attribute *attr, char *buf)	\
+{									\
+	struct remap_emu *emu = dev_to_disk(dev)->private_data;		\
+									\
+	return sprintf(buf, "%lld\n",					\
+			(long long)atomic64_read(&emu->name));		\
+}									\
+static DEVICE_ATTR_RO(name)
+
+EMU_STAT_ATTR(host_read_bytes);
+EMU_STAT_ATTR(host_written_bytes);
+EMU_STAT_ATTR(remap_cmds);
+EMU_STAT_ATTR(remapped_blocks);
+EMU_STAT_ATTR(copy_cmds);
+EMU_STAT_ATTR(copied_blocks);
+EMU_STAT_ATTR(gc_hints);
+
+/* what the media would have to program: host writes plus device copies */
+static ssize_t media_written_bytes_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	struct remap_emu *emu = dev_to_disk(dev)->private_data;
+
+	return sprintf(buf, "%lld\n",
+		(long long)(atomic64_read(&emu->host_written_bytes) +
+		(atomic64_read(&emu->copied_blocks) << EMU_BLOCK_SHIFT)));
+}
+static DEVICE_ATTR_RO(media_written_bytes);
+
+static ssize_t reset_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct remap_emu *emu = dev_to_disk(dev)->private_data;
+
+	atomic64_set(&emu->host_read_bytes, 0);
+	atomic64_set(&emu->host_written_bytes, 0);
+	atomic64_set(&emu->remap_cmds, 0);
+	atomic64_set(&emu->remapped_blocks, 0);
+	atomic64_set(&emu->copy_cmds, 0);
+	atomic64_set(&emu->copied_blocks, 0);
+	atomic64_set(&emu->gc_hints, 0);
+	return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *remap_emu_attrs[] = {
+	&dev_attr_host_read_bytes.attr,
+	&dev_attr_host_written_bytes.attr,
+	&dev_attr_remap_cmds.attr,
+	&dev_attr_remapped_blocks.attr,
+	&dev_attr_copy_cmds.attr,
+	&dev_attr_copied_blocks.attr,
+	&dev_attr_gc_hints.attr,
+	&dev_attr_media_written_bytes.attr,
+	&dev_attr_reset.attr,
+	NULL,
+};
+
+static const struct attribute_group remap_emu_attr_group = {
+	.name	= "remap_emu",
+	.attrs	= remap_emu_attrs,
+};
+
+static void remap_emu_free(struct remap_emu *emu)
+{
+	sector_t i;
+
+	if (emu->queue)
+		blk_cleanup_queue(emu->queue);
+	if (emu->disk)
+		put_disk(emu->disk);
+	if (emu->map) {
+		for (i = 0; i < emu->nr_blocks; i++)
+			if (emu->map[i])
+				__free_page(emu->map[i]);
+		vfree(emu->map);
+	}
+	kfree(emu);
+}
+
+static struct remap_emu *remap_emu_alloc(void)
+{
+	struct remap_emu *emu;
+	struct gendisk *disk;
+
+	emu = kzalloc(sizeof(*emu), GFP_KERNEL);
+	if (!emu)
+		return NULL;
+
+	spin_lock_init(&emu->lock);
+	emu->nr_blocks = (sector_t)size_mb << (20 - EMU_BLOCK_SHIFT);
+	emu->map = vzalloc(emu->nr_blocks * sizeof(struct page *));
+	if (!emu->map)
+		goto out_free;
+
+	emu->queue = blk_alloc_queue(GFP_KERNEL);
+	if (!emu->queue)
+		goto out_free;
+	blk_queue_make_request(emu->queue, remap_emu_make_request);
+	blk_queue_logical_block_size(emu->queue, EMU_BLOCK_SIZE);
+	blk_queue_physical_block_size(emu->queue, EMU_BLOCK_SIZE);
+	blk_queue_max_hw_sectors(emu->queue, 1024);
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, emu->queue);
+
+	disk = emu->disk = alloc_disk(1 << 4);
+	if (!disk)
+		goto out_free;
+	disk->major = remap_emu_major;
+	disk->first_minor = 0;
+	disk->fops = &remap_emu_fops;
+	disk->private_data = emu;
+	disk->queue = emu->queue;
+	strcpy(disk->disk_name, "remapemu0");
+	set_capacity(disk, emu->nr_blocks << EMU_SECT_SHIFT);
+	return emu;
+
+out_free:
+	remap_emu_free(emu);
+	return NULL;
+}
+
+static int __init remap_emu_init(void)
+{
+	struct remap_emu *emu;
+	int err;
+
+	/* as far as MSRC, MSSRL and the nlb field of a range can tell */
+	if (!copy_max_ranges || copy_max_ranges > 256 ||
+			!copy_max_range_lbas || copy_max_range_lbas > 65536 ||
+			!copy_max_lbas)
+		return -EINVAL;
+
+	remap_emu_major = register_blkdev(0, "remapemu");
+	if (remap_emu_major < 0)
+		return remap_emu_major;
+
+	err = -ENOMEM;
+	emu = remap_emu_alloc();
+	if (!emu)
+		goto out_unregister;
+
+	err = nvme_kernel_register_emul(&remap_emu_ops);
+	if (err)
+		goto out_free;
+
+	add_disk(emu->disk);
+	err = sysfs_create_group(&disk_to_dev(emu->disk)->kobj,
+						&remap_emu_attr_group);
+	if (err) {
+		del_gendisk(emu->disk);
+		nvme_kernel_unregister_emul(&remap_emu_ops);
+		goto out_free;
+	}
+
+	remap_emu_dev = emu;
+	pr_info("remap_emu: %u MiB, remap %uus, copy %uus per command\n",
+				size_mb, remap_latency_us, copy_latency_us);
+	return 0;
+
+out_free:
+	remap_emu_free(emu);
+out_unregister:
+	unregister_blkdev(remap_emu_major, "remapemu");
+	return err;
+}
+
+static void __exit remap_emu_exit(void)
+{
+	struct remap_emu *emu = remap_emu_dev;
+
+	sysfs_remove_group(&disk_to_dev(emu->disk)->kobj,
+						&remap_emu_attr_group);
+	del_gendisk(emu->disk);
+	nvme_kernel_unregister_emul(&remap_emu_ops);
+	remap_emu_free(emu);
+	unregister_blkdev(remap_emu_major, "remapemu");
+}
+
+MODULE_DESCRIPTION("RAM disk emulating a remap-capable NVMe namespace");
+MODULE_LICENSE("GPL");
+module_init(remap_emu_init);
+module_exit(remap_emu_exit);